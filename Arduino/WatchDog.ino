@@ -11,6 +11,9 @@ Description:
    of msgMode (displays warning message and flashing lights to intruders), in and
    out of standby (stops transmitting current temperature and displays 'OFF' until
    reengaged), changes display on 7-Seg between celsius and fareignheit. 
+   When the middleware sends 'b' the Arduino stops printing lines and instead sends
+   binary frames of FRAME_SAMPLES raw readings a second, with a sequence number, the
+   motion sensor state and a CRC (see Server/serial_frame.h for the layout).
 
 Citation: The majority of this code come from I2C_7SEG_Temperature.pde, Copyright 2008, Gravitech.
           Original file modified to contain all functionality mentioned in description except 
@@ -32,6 +35,9 @@ Citation: The majority of this code come from I2C_7SEG_Temperature.pde, Copyrigh
 #define COLD (23)      /* Cold temperature, drive blue LED (23c) */
 #define HOT (26)       /* Hot temperature, drive red LED (27c) */
 
+#define FRAME_SAMPLES (4)         /* Readings per binary frame, taken evenly over a second */
+#define FRAME_NO_READING (-32768) /* Raw reading sent in standby */
+
 const byte NumberLookup[16] =   {0x3F,0x06,0x5B,0x4F,0x66,
                                  0x6D,0x7D,0x07,0x7F,0x6F, 
                                  0x77,0x7C,0x39,0x5E,0x79,0x71};
@@ -46,12 +52,23 @@ const int inputPin = 2; /*Reading from motion sensor*/
 int celsius = 1;        /*Indicates whether display should be in celsius*/
 int standby = 0;        /*Indicates whether the Arduino is in standby*/
 int msgMode = 0;        /*Indicates whether the Arduino is in message mode*/
+int binary = 0;         /*Indicates whether readings are sent as binary frames*/
+
+unsigned int frameSeq = 0;        /*Sequence number of the next frame*/
+int frameRaw[FRAME_SAMPLES];      /*Readings waiting to be sent*/
+byte frameCount = 0;
+byte frameFlags = 0;              /*Bit 0: the motion sensor was tripped*/
+unsigned long frameStart;         /*millis() at the first waiting reading*/
 
 /* Function prototypes */
 void Cal_temp (int&, byte&, byte&, bool&);
 void Dis_7SEG (int, byte, byte, bool);
 void Send7SEG (byte, byte);
 void SerialMonitorPrint (byte, int, bool);
+int Read_raw (void);
+void QueueSample (int, bool);
+void SendFrame (void);
+unsigned int Crc16 (unsigned int, byte);
 
 /***************************************************************************
  Function Name: setup
@@ -137,7 +154,13 @@ void loop()
       Send7SEG (3,0b00111111);
       Send7SEG (2,0b1110001);
       Send7SEG (1,0b1110001);
-      Serial.print("-274.0\n");
+      if (binary){
+        QueueSample(FRAME_NO_READING, false);
+        SendFrame();
+      }
+      else {
+        Serial.print("-274.0\n");
+      }
       int message = Serial.read();
       if (message == 115){
         standby = !standby;
@@ -153,7 +176,7 @@ void loop()
      *to the middleware if it has been.
      */
     int value= digitalRead(inputPin);
-    if (value == HIGH)
+    if (value == HIGH && !binary)
     {
       Serial.print("tripped\n");
     }
@@ -168,6 +191,7 @@ void loop()
      *'s' - asks the arduino to toggle standby mode
      *'m' - tells the arduino to engage msgMode when updating display
      *'r' - takes the arduino display out of msgMode if it was engaged
+     *'b' - switches the serial output to binary frames
      */
     int message = Serial.read();
     if(message == 102){ //'c'
@@ -183,17 +207,28 @@ void loop()
       if (msgMode)
         msgMode = 0;
     }
+    else if (message == 98){ //'b'
+      binary = 1;
+    }
     
     /*Get temp reading*/
     Wire.requestFrom(THERM, 2);
     Temperature_H = Wire.read();
     Temperature_L = Wire.read();
     
+    /* The raw 12-bit reading goes into binary frames as is */
+    int Raw = (int)(((unsigned int)Temperature_H << 8) | Temperature_L) >> 4;
+    
     /* Calculate temperature */
     Cal_temp (Decimal, Temperature_H, Temperature_L, IsPositive);
     
-    /* Display temperature on the serial monitor.*/
-    SerialMonitorPrint (Temperature_H, Decimal, IsPositive);
+    /* Display temperature on the serial monitor, or queue it for the next frame.*/
+    if (binary){
+      QueueSample(Raw, value == HIGH);
+    }
+    else {
+      SerialMonitorPrint (Temperature_H, Decimal, IsPositive);
+    }
     
     /*Chooses what should be displayed on the 7-Seg based on whether or not the device is in msgMode.
      * If in message mode, police message and lights will be displayed, otherwise temp and green light.
@@ -223,8 +258,19 @@ void loop()
         delay(1000);
       }
     }
-    /* Delay makes this loop, temperature reading and display repeat once per second. */
-    delay (1000);  
+    /* Delay makes this loop, temperature reading and display repeat once per second.
+       In binary mode the rest of the frame's readings are taken during that second. */
+    if (binary){
+      for (int i = 1; i < FRAME_SAMPLES; i++){
+        delay (1000 / FRAME_SAMPLES);
+        QueueSample(Read_raw(), digitalRead(inputPin) == HIGH);
+      }
+      delay (1000 / FRAME_SAMPLES);
+      SendFrame();
+    }
+    else {
+      delay (1000);  
+    }
   }
 } 
 
@@ -356,4 +402,106 @@ void SerialMonitorPrint (byte Temperature_H, int Decimal, bool IsPositive)
     Serial.print(".");
     Serial.print(Decimal, DEC);
     Serial.print("\n");
-}
\ No newline at end of file
+}
+
+/***************************************************************************
+ Function Name: Read_raw
+
+ Purpose: 
+   Read the thermometer's raw 12-bit temperature in 1/16 degrees.
+****************************************************************************/
+int Read_raw (void)
+{
+  Wire.requestFrom(THERM, 2);
+  byte High = Wire.read();
+  byte Low = Wire.read();
+  return (int)(((unsigned int)High << 8) | Low) >> 4;
+}
+
+/***************************************************************************
+ Function Name: QueueSample
+
+ Purpose: 
+   Add a raw reading to the frame being built, sending the frame first if it is full.
+****************************************************************************/
+void QueueSample (int Raw, bool Motion)
+{
+  if (frameCount == FRAME_SAMPLES)
+  {
+    SendFrame();
+  }
+  if (frameCount == 0)
+  {
+    frameStart = millis();
+  }
+  frameRaw[frameCount++] = Raw;
+  if (Motion)
+  {
+    frameFlags |= 1;
+  }
+}
+
+/***************************************************************************
+ Function Name: Crc16
+
+ Purpose: 
+   Add one byte to a CRC-16/CCITT (polynomial 0x1021, start with 0xFFFF).
+****************************************************************************/
+unsigned int Crc16 (unsigned int Crc, byte Data)
+{
+  Crc ^= (unsigned int)Data << 8;
+  for (byte bit = 0; bit < 8; bit++)
+  {
+    if (Crc & 0x8000)
+      Crc = (Crc << 1) ^ 0x1021;
+    else
+      Crc = Crc << 1;
+  }
+  return Crc;
+}
+
+/***************************************************************************
+ Function Name: SendFrame
+
+ Purpose: 
+   Send the waiting readings as one binary frame: sync bytes 0xA5 0x5A, flags,
+   count, sequence number, millis() at the first reading, the interval between
+   readings, the readings, and a CRC of everything after the sync bytes. All
+   multi-byte fields are sent low byte first.
+****************************************************************************/
+void SendFrame (void)
+{
+  if (frameCount == 0)
+    return;
+  byte Frame[12 + 2 * FRAME_SAMPLES + 2];
+  byte Len = 0;
+  unsigned int Interval = 1000 / FRAME_SAMPLES;
+  Frame[Len++] = 0xA5;
+  Frame[Len++] = 0x5A;
+  Frame[Len++] = frameFlags;
+  Frame[Len++] = frameCount;
+  Frame[Len++] = frameSeq & 0xFF;
+  Frame[Len++] = frameSeq >> 8;
+  for (byte i = 0; i < 4; i++)
+  {
+    Frame[Len++] = (frameStart >> (8 * i)) & 0xFF;
+  }
+  Frame[Len++] = Interval & 0xFF;
+  Frame[Len++] = Interval >> 8;
+  for (byte i = 0; i < frameCount; i++)
+  {
+    Frame[Len++] = (unsigned int)frameRaw[i] & 0xFF;
+    Frame[Len++] = (unsigned int)frameRaw[i] >> 8;
+  }
+  unsigned int Crc = 0xFFFF;
+  for (byte i = 2; i < Len; i++)
+  {
+    Crc = Crc16(Crc, Frame[i]);
+  }
+  Frame[Len++] = Crc & 0xFF;
+  Frame[Len++] = Crc >> 8;
+  Serial.write(Frame, Len);
+  frameSeq++;
+  frameCount = 0;
+  frameFlags = 0;
+}
@@ -6,9 +6,42 @@
  */
 Pebble.addEventListener("appmessage",
   function(e) {
-    sendToServer(e.payload.hello_msg);}
+    if (e.payload.hello_msg == "n") requestSnapshot();
+    else sendToServer(e.payload.hello_msg);}
 );
 
+var snapshotGeneration = -1; // version of the last status snapshot passed to the watch
+
+/* Asks the server for a status snapshot. The server answers 304 with no body while
+ * nothing changed since the snapshot the watch already has, and the watch is left alone.
+ */
+function requestSnapshot() {
+
+	var req = new XMLHttpRequest();
+	var ipAddress = "10.0.0.4"; // Hard coded IP address
+	var port = "3002"; // Same port specified as argument to server
+	var url = "http://" + ipAddress + ":" + port + "/n?since=" + snapshotGeneration;
+
+	req.onload = function(e) {
+                if (req.status == 304) return;
+                var response = JSON.parse(req.responseText);
+                if (!response) return;
+                snapshotGeneration = response.gen;
+                // trip state, standby state and the text to display
+                Pebble.sendAppMessage({ "1": response.tripped ? 1 : 0,
+                                        "2": response.standby ? 1 : 0,
+                                        "3": response.name });
+	};
+
+  req.onerror = function(e) {
+    var msg = "Server Error!!!";
+    Pebble.sendAppMessage({ "0": msg });
+  };
+
+        req.open("GET", url, true);
+        req.send(null);
+}
+
 function sendToServer(requestMessage) {
 
 	var req = new XMLHttpRequest();
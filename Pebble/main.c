@@ -33,11 +33,29 @@ void out_sent_handler(DictionaryIterator *sent, void *context) {
 
 /* 
  * Receives a message returned from the JavaScript following a request to the server. 
- * If the message is "tripped" - sets var tripped to 1.
+ * A status snapshot (key #3, with the trip state in key #1 and standby state in key #2)
+ * updates tripped and standbyEngaged, and its temperature is displayed if wanted.
+ * Otherwise, if the message is "tripped" - sets var tripped to 1.
  * If message is "nottripped" - it is ignored.
  * Otherwise - the returned message is displayed on the Pebble watchface.
  */
  void in_received_handler(DictionaryIterator *received, void *context) {
+   Tuple *snapshot_tuple = dict_find(received, 3);
+   if (snapshot_tuple) {
+     Tuple *tripped_tuple = dict_find(received, 1);
+     Tuple *standby_tuple = dict_find(received, 2);
+     if (tripped_tuple && tripped_tuple->value->int32) {
+       tripped = 1;
+     }
+     if (standby_tuple) {
+       standbyEngaged = standby_tuple->value->int32;
+     }
+     if (wantAverage && !standbyEngaged && !tripped) {
+       strcpy(msg, snapshot_tuple->value->cstring);
+       text_layer_set_text(hello_layer, msg);
+     }
+     return;
+   }
     // looks for key #0 in the incoming message
    int key = 0;
    Tuple *text_tuple = dict_find(received, key);
@@ -162,35 +180,26 @@ void up_double_click_handler(ClickRecognizerRef recognizer, void *context) {
 
 /*
  * Tick-Handler - executes once every second using watch's internal clock.
- * Switched every other second between getting most recent temp (if desired) and checking for tripped alarm.
+ * Switched every other second between asking for a status snapshot, which carries both the most
+ * recent temp and the tripped alarm, and sounding the alarm once it has been tripped.
  */
 static void tick_handler(struct tm *tick_time, TimeUnits units_changed) {
   if (tickTimerMod % 2 == 0){
-      if (wantAverage && !standbyEngaged && !tripped){
+      if (!tripped){
         DictionaryIterator *iter;
         app_message_outbox_begin(&iter);
         int key = 0;
-        // send the message "b" to the phone, using key #0
-        Tuplet value = TupletCString(key, "b");
+        // send the message "n" to the phone, using key #0
+        Tuplet value = TupletCString(key, "n");
         dict_write_tuplet(iter, &value);
         app_message_outbox_send();
       }
   }
   else{
-      //checks if alarm has been tripped, checks to see every 10 seconds if not
       if (tripped){
           text_layer_set_text(hello_layer, "INTRUDER ALERT!!!");
           vibes_double_pulse();
       }
-      else { 
-          DictionaryIterator *iter;
-          app_message_outbox_begin(&iter);
-          int key = 0;
-          // send the message "t" to the phone, using key #0
-          Tuplet value = TupletCString(key, "t");
-          dict_write_tuplet(iter, &value);
-          app_message_outbox_send();
-      }
   }
   tickTimerMod += 1;
 }
@@ -243,7 +252,7 @@ static void init(void) {
   app_message_register_inbox_dropped(in_dropped_handler);
   app_message_register_outbox_sent(out_sent_handler);
   app_message_register_outbox_failed(out_failed_handler);
-  const uint32_t inbound_size = 64;
+  const uint32_t inbound_size = 128;
   const uint32_t outbound_size = 64;
   app_message_open(inbound_size, outbound_size);
   const bool animated = true;
@@ -6,15 +6,32 @@
  * Fundamental server operations were borrowed from the following 2 sources:
  * 1 - http://www.prasannatech.net/2008/07/socket-programming-tutorial.html
  * 2 - http://www.binarii.com/files/papers/c_sockets.txt
- * This is mostly found in function server_thread between lines 320-355
- * and in function main between lines 498-503
+ * This is mostly found in function server_thread
+ * and in function main
  */
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "server_info.h"
+#include "connection.h"
+#include "temp_stats.h"
+#include "temp_ring.h"
+#include "rollup.h"
+#include "series.h"
+#include "line_framer.h"
+#include "sensor.h"
+#include "notify.h"
+#include "http_request.h"
+#include "simulator.h"
+#include "metrics.h"
+#include "command_queue.h"
+#include "executor.h"
+#include "uring.h"
+#include "replica.h"
+#include "journal.h"
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -24,448 +41,2423 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <termios.h>
+#include <atomic>
 
 
-char tempBuilder[1000];
-double temps[3600];
-int nextTempPointer;
-int fd;
 int quit_signal = 0;
 int standby = 0;
-pthread_mutex_t lock;
-char cOrF = 'c';
-char celciusCount = 0;
-char standbyCount = 0;
-bool standbyActive = false;
-bool arduinoError = false;
-bool tripped = false;
+notify_queue notifications;       //trip events from the ingest thread to the event loop
+command_queue commands;           //commands for the Arduinos, written out by the ingest thread
+simulator simulators[MAX_SENSORS]; //simulated Arduinos started with -s or -p
+int simulator_count = 0;
+long long capture_start;          //captures are stamped relative to this
+executor pool;                    //runs slow request handlers and archive compaction off the event loop
+int worker_count = 0;             //executor workers, one per core unless -j says otherwise
+bool binary_frames = true;        //ask boards to switch to binary frames; -b 0 keeps them on lines
+bool use_uring = false;           //run both event loops on io_uring (-u 1) where the kernel supports it
+char sensor_reads[MAX_SENSORS][SENSOR_READ_SIZE]; //where the ingest ring reads each sensor's device into
+const char* history_dir = ".";    //ring_dir, for the remote sensors registered while running
+bool replicating = false;         //stream readings and trips to an aggregator (-R host:port)
+replica_uplink uplink;            //that stream, owned by the ingest thread
+int replica_listen = -1;          //listening socket for edge servers (-A port), -1 if not an aggregator
+replica_site sites[REPLICA_MAX_SITES]; //edges connected to this aggregator, owned by the ingest thread
+std::atomic<int> replica_sites(0); //how many of them have said hello
+
+typedef struct RequestJob request_job;
+
+//a request handed to the executor, and the reply its handler builds there
+struct RequestJob {
+  connection* conn;                 // only the server thread touches this
+  http_request req;
+  char target[REQUEST_BUFFER_SIZE];
+  int route;
+  int body_start;
+  long long started;
+  connection reply;
+  request_job* next;
+};
+
+request_job* finished_jobs = NULL;      //handled jobs waiting for the event loop to send their replies
+pthread_mutex_t finished_lock = PTHREAD_MUTEX_INITIALIZER;
+int finished_fd = -1;                   //readable whenever finished_jobs is not empty
+
+/*
+ * Renders a JSON containing max, min and average temperatures from a stats snapshot into out and returns its length.
+ * Renders "No data available." when temperature array is empty of there has been a problem receiving data.
+ * Renders "Arudino Error!!!" if the Arudino is currently in an error state (such as when it is disconnected after starting).
+ */
+int packageAvgJSON(sensor* s, const temp_summary* summary, char* out, int size){
+      if (s->arduinoError){
+            return snprintf(out, size, "{\n\"name\":\"Arudino Error!!!\"\n}\n");
+      }
+      if (summary->latest == NO_READING || summary->count == 0){
+            return snprintf(out, size, "{\n\"name\":\"No data available.\"\n}\n");
+      }
+      double max = summary->max;
+      double min = summary->min;
+      double average = summary->average;
+      if (s->cOrF == 'F') {
+            max = max * 9 / 5 + 32;
+            min = min * 9 / 5 + 32;
+            average = average * 9 / 5 + 32;
+      }
+      return snprintf(out, size, "{\n\"name\":\"H: %.1f L: %.1f AVG: %.1f\"\n}\n", max, min, average);
+}
+
+/*
+ * Renders a JSON containing the most recent temperature reading from a stats snapshot into out and returns its length.
+ * Renders "No data available." when temperature array is empty of there has been a problem receiving it.
+ * Renders "Arudino Error!!!" if the Arudino is currently in an error state (such as when it is disconnected after starting).
+ */
+int packageTempJSON(sensor* s, const temp_summary* summary, char* out, int size){
+      if (s->arduinoError){
+            return snprintf(out, size, "{\n\"name\":\"Arudino Error!!!\"\n}\n");
+      }
+      double latest = summary->latest;
+      if (latest == NO_READING){
+            return snprintf(out, size, "{\n\"name\":\"No data available.\"\n}\n");
+      }
+      double convert = latest;
+      if (s->cOrF == 'F') {
+            convert = latest * 9 / 5 + 32;
+      }
+      return snprintf(out, size, "{\n\"name\":\"%.1f %c\"\n}\n", convert, s->cOrF.load());
+}
+
+/*
+ * Queues a sensor's cached reply, first rendering it with package if the sensor changed since it was last rendered.
+ */
+void sendCached(int fd2, sensor* s, cached_response* reply, int (*package)(sensor*, const temp_summary*, char*, int)){
+      if (!cacheFresh(reply, &s->generation)){
+            //read the generation before the snapshot so a sample published meanwhile forces another render
+            unsigned generation = s->generation.load(std::memory_order_acquire);
+            temp_summary summary;
+            statsRead(&s->published, &summary);
+            cacheStore(reply, generation, package(s, &summary, reply->body, sizeof(reply->body)));
+      }
+      sendBytes(fd2, reply->body, reply->len);
+}
+
+/*
+ * Sends the most recent temperature reading to the Pebble in JSON format.
+ */
+void mostRecentTemp(int fd2, sensor* s){
+      sendCached(fd2, s, &s->temp_reply, packageTempJSON);
+}
+
+/*
+ * Writes the address of the client on fd2 into origin, for the journal.
+ */
+void clientOrigin(int fd2, char* origin, int size){
+      struct sockaddr_in peer;
+      socklen_t len = sizeof(peer);
+      if (getpeername(fd2, (struct sockaddr*) &peer, &len) == -1 || peer.sin_family != AF_INET) snprintf(origin, size, "unknown");
+      else inet_ntop(AF_INET, &peer.sin_addr, origin, size);
+}
+
+/*
+ * Journals a change a client asked for.
+ */
+void journalRequest(int fd2, sensor* s, int type, int state){
+      char origin[JOURNAL_ORIGIN_LENGTH];
+      clientOrigin(fd2, origin, sizeof(origin));
+      journalPost(&event_journal, type, s->id, state, origin, wallMillis());
+}
+
+/*
+ * Queues a command for the sensor's Arduino. Returns false if the same command was
+ * accepted moments ago (the Pebble sends every press three times) or the queue is full.
+ */
+bool submitCommand(sensor* s, char code){
+      if (commandSubmit(&commands, s - sensors, code, nowMillis())) return true;
+      counterAdd(&metrics_local->commands_coalesced, 1);
+      return false;
+}
+
+/*
+ * Tells the Arduino to change the display from c to F or vice versa. 
+ * Sends the most recent temperature reading in the new style to the Pebble in JSON format.
+ * (Does not change the format of temperatures being transmitted Arduino->Server, just processes differently for display on both sides.)
+ */
+void changeSign(int fd2, sensor* s){
+      //repeats of the same press only get the current reading back
+      if (submitCommand(s, 'f')){
+            if (s->cOrF == 'c')
+                  s->cOrF = 'F';
+            else 
+                  s->cOrF = 'c';
+            cacheBump(&s->generation);
+            journalRequest(fd2, s, JOURNAL_UNIT, s->cOrF);
+      }
+      //send temp in new format
+      sendCached(fd2, s, &s->temp_reply, packageTempJSON);
+}
+
+/*
+ *Tells the Arduino to go into or come out of standby mode.
+ */
+void toggleStandby(int fd2, sensor* s){
+      //*Note - UP button on Pebble sends request 3 times - the command queue keeps only the first
+      if (submitCommand(s, 's')){
+            s->standbyActive = !s->standbyActive;
+            cacheBump(&s->generation);
+            journalRequest(fd2, s, JOURNAL_STANDBY, s->standbyActive ? 1 : 0);
+      }
+      //report the standby state the Arduino was last told to be in
+      if (s->standbyActive){
+            sendMessage(fd2, "{\n\"name\":\"Standby engaged.\"\n}\n");
+      }
+      else {
+            sendMessage(fd2, "{\n\"name\":\"Standby disengaged.\"\n}\n");
+      } 
+}
+
+/*
+ * Sends the max, min and average temperature readings to the Pebble in JSON format.
+ */
+void highLowAverage(int fd2, sensor* s){
+      sendCached(fd2, s, &s->avg_reply, packageAvgJSON);
+}
+
+/*
+ * Copies the value of query parameter `name` from the request line into value.
+ * Returns false if the parameter is not present.
+ */
+bool findQueryParam(const char* request, const char* name, char* value, int size){
+      const char* end = strchr(request, ' ') ? strchr(strchr(request, ' ') + 1, ' ') : NULL;
+      const char* query = strchr(request, '?');
+      if (query == NULL || (end != NULL && query > end)) return false;
+      int name_len = strlen(name);
+      const char* p = query + 1;
+      while (p != NULL && (end == NULL || p < end)){
+            if (strncmp(p, name, name_len) == 0 && p[name_len] == '='){
+                  p += name_len + 1;
+                  int n = 0;
+                  while (n < size - 1 && p[n] != '&' && p[n] != ' ' && p[n] != '\r' && p[n] != '\n' && p[n] != '\0'){
+                        value[n] = p[n];
+                        n++;
+                  }
+                  value[n] = '\0';
+                  return true;
+            }
+            p = strchr(p, '&');
+            if (p != NULL) p++;
+      }
+      return false;
+}
+
+/*
+ * Parses a duration such as "90s", "30m", "24h" or "7d" into seconds (hours if no unit).
+ * Returns 0 for anything unparseable.
+ */
+int64_t parseDuration(const char* text){
+      char* unit;
+      long long amount = strtoll(text, &unit, 10);
+      if (unit == text || amount <= 0) return 0;
+      switch (*unit){
+            case 's': return amount;
+            case 'm': return amount * 60;
+            case 'd': return amount * 86400;
+            case 'h':
+            case '\0': return amount * 3600;
+      }
+      return 0;
+}
+
+/*
+ * Sends the max, min and average temperatures over the last N seconds/minutes/hours/days
+ * (GET /h?last=7d). Ranges the ring still covers are scanned exactly out of it, longer
+ * ones are answered from the rollup buckets.
+ */
+void rangeHighLowAverage(int fd2, sensor* s, const char* request){
+      char message[1000];
+      char last[32];
+      int64_t seconds = 3600;
+      if (findQueryParam(request, "last", last, sizeof(last))) seconds = parseDuration(last);
+      if (seconds <= 0){
+            sendMessage(fd2, "{\n\"name\":\"Bad range.\"\n}\n");
+            return;
+      }
+      int64_t to = wallMillis() / 1000 + 1;
+      rollup_result result;
+      int64_t ring_start = seriesRingStart(&s->ring);
+      bool complete = __atomic_load_n(&s->ring.header->inserted, __ATOMIC_RELAXED) < TEMP_HISTORY;
+      if (ring_start > 0 && ((to - seconds) * 1000 >= ring_start || complete)){
+            column_aggregate agg;
+            ringAggregate(&s->ring, (to - seconds) * 1000, &agg);
+            result.count = agg.count;
+            result.buckets = 0;
+            result.min = agg.count > 0 ? agg.min / (double) SAMPLE_SCALE : NO_READING;
+            result.max = agg.count > 0 ? agg.max / (double) SAMPLE_SCALE : NO_READING;
+            result.average = agg.count > 0 ? agg.sum / (double) SAMPLE_SCALE / agg.count : NO_READING;
+      }
+      else rollupQuery(&s->rollups, to - seconds, to, &result);
+      if (result.count == 0){
+            sendMessage(fd2, "{\n\"name\":\"No data available.\"\n}\n");
+            return;
+      }
+      double max = result.max;
+      double min = result.min;
+      double average = result.average;
+      if (s->cOrF == 'F') {
+            max = max * 9 / 5 + 32;
+            min = min * 9 / 5 + 32;
+            average = average * 9 / 5 + 32;
+      }
+      sprintf(message, "{\n\"name\":\"H: %.1f L: %.1f AVG: %.1f\",\n\"high\":%.2f,\"low\":%.2f,\"avg\":%.2f,\"count\":%lld,\"seconds\":%lld\n}\n",
+              max, min, average, max, min, average, result.count, (long long) seconds);
+      sendMessage(fd2, message);
+}
+
+/*
+ * Sends the median, 95th and 99th percentile temperatures over the last N seconds/minutes/hours/days
+ * (GET /p?last=1d), merged from the rollup buckets' sketches. all=1 combines every sensor's readings.
+ */
+void rangePercentiles(int fd2, sensor* s, const char* request){
+      char message[1000];
+      char param[32];
+      int64_t seconds = 3600;
+      if (findQueryParam(request, "last", param, sizeof(param))) seconds = parseDuration(param);
+      if (seconds <= 0){
+            sendMessage(fd2, "{\n\"name\":\"Bad range.\"\n}\n");
+            return;
+      }
+      bool all = findQueryParam(request, "all", param, sizeof(param)) && strcmp(param, "1") == 0;
+      int64_t to = wallMillis() / 1000 + 1;
+      quantile_summary summary, part;
+      summaryInit(&summary);
+      for (int i = 0; i < sensor_count; i++){
+            if (!all && &sensors[i] != s) continue;
+            rollupQuantiles(&sensors[i].rollups, to - seconds, to, &part);
+            summaryMerge(&summary, &part);
+      }
+      if (summary.total == 0){
+            sendMessage(fd2, "{\n\"name\":\"No data available.\"\n}\n");
+            return;
+      }
+      double median = summaryQuantile(&summary, 0.5);
+      double p95 = summaryQuantile(&summary, 0.95);
+      double p99 = summaryQuantile(&summary, 0.99);
+      if (s->cOrF == 'F') {
+            median = median * 9 / 5 + 32;
+            p95 = p95 * 9 / 5 + 32;
+            p99 = p99 * 9 / 5 + 32;
+      }
+      sprintf(message, "{\n\"name\":\"MED: %.1f P95: %.1f P99: %.1f\",\n\"p50\":%.2f,\"p95\":%.2f,\"p99\":%.2f,\"count\":%lld,\"seconds\":%lld\n}\n",
+              median, p95, p99, median, p95, p99, summary.total, (long long) seconds);
+      sendMessage(fd2, message);
+}
+
+/*
+ * Converts a temperature to unit, 'c' or 'F'.
+ */
+double displayTemp(char unit, double value){
+      return unit == 'F' ? value * 9 / 5 + 32 : value;
+}
+
+/*
+ * Converts a temperature to the unit the sensor is displayed in.
+ */
+double displayTemp(sensor* s, double value){
+      return displayTemp(s->cOrF.load(), value);
+}
+
+/*
+ * Sends the readings taken in [from, to) ms as a JSON series downsampled to at most
+ * `points` points (GET /q?from=<ms>&to=<ms>&points=300&mode=minmax). `last=2h` can
+ * stand in for from. mode=minmax sends [time,min,max,avg] per time bucket, mode=lttb
+ * sends [time,value] points picked by LTTB. Points are formatted a batch at a time
+ * straight into the connection's response, so long series need no fixed buffer.
+ */
+void rangeSeries(int fd2, sensor* s, const char* request){
+      char param[32];
+      int64_t to = wallMillis() + 1;
+      if (findQueryParam(request, "to", param, sizeof(param))) to = strtoll(param, NULL, 10);
+      int64_t from = to - 3600 * 1000;
+      if (findQueryParam(request, "last", param, sizeof(param))) from = to - parseDuration(param) * 1000;
+      if (findQueryParam(request, "from", param, sizeof(param))) from = strtoll(param, NULL, 10);
+      int points = SERIES_DEFAULT_POINTS;
+      if (findQueryParam(request, "points", param, sizeof(param))) points = atoi(param);
+      bool lttb = findQueryParam(request, "mode", param, sizeof(param)) && strcmp(param, "lttb") == 0;
+      if (from >= to || from <= 0 || points < 2 || points > SERIES_MAX_POINTS){
+            setStatus(fd2, 400);
+            sendMessage(fd2, "{\n\"name\":\"Bad range.\"\n}\n");
+            return;
+      }
+      //the ring answers ranges it still covers with raw readings, the archive older ranges it
+      //holds and the rollups everything before that
+      int capacity = TEMP_HISTORY > SERIES_MAX_SOURCE ? TEMP_HISTORY : SERIES_MAX_SOURCE;
+      series_point* series = (series_point*) malloc(capacity * sizeof(series_point));
+      if (series == NULL){
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            setStatus(fd2, 503);
+            sendMessage(fd2, "{\n\"name\":\"Server busy.\"\n}\n");
+            return;
+      }
+      //a ring that has never wrapped holds every reading there is
+      int64_t ring_start = seriesRingStart(&s->ring);
+      bool complete = __atomic_load_n(&s->ring.header->inserted, __ATOMIC_RELAXED) < TEMP_HISTORY;
+      int64_t archive_start = archiveStart(&s->history);
+      int n;
+      if (ring_start > 0 && (from >= ring_start || complete)) n = seriesFromRing(&s->ring, from, to, series, capacity);
+      else if (archive_start > 0 && archive_start <= from) n = seriesFromArchive(&s->history, &s->ring, ring_start, from, to, series, capacity);
+      else n = seriesFromRollups(&s->rollups, from / 1000, (to + 999) / 1000, series, SERIES_MAX_SOURCE);
+      if (n < 0) n = 0;
+      n = lttb ? seriesLttb(series, n, points) : seriesBucket(series, n, from, to, points);
+
+      char batch[4096];
+      int len = snprintf(batch, sizeof(batch), "{\n\"sensor\":\"%s\",\"from\":%lld,\"to\":%lld,\"unit\":\"%c\",\"mode\":\"%s\",\n\"points\":[",
+                         s->id, (long long) from, (long long) to, s->cOrF.load(), lttb ? "lttb" : "minmax");
+      for (int i = 0; i < n; i++){
+            //leave room for the longest point before formatting it
+            if (len > (int) sizeof(batch) - 128){
+                  sendBytes(fd2, batch, len);
+                  len = 0;
+            }
+            const series_point* point = &series[i];
+            const char* separator = i == 0 ? "" : ",";
+            if (lttb){
+                  len += snprintf(batch + len, sizeof(batch) - len, "%s[%lld,%.2f]", separator,
+                                  (long long) point->time, displayTemp(s, point->avg));
+            }
+            else {
+                  len += snprintf(batch + len, sizeof(batch) - len, "%s[%lld,%.2f,%.2f,%.2f]", separator, (long long) point->time,
+                                  displayTemp(s, point->min), displayTemp(s, point->max), displayTemp(s, point->avg));
+            }
+      }
+      len += snprintf(batch + len, sizeof(batch) - len, "]\n}\n");
+      sendBytes(fd2, batch, len);
+      free(series);
+}
+
+/*
+ * Renders everything a Pebble screen shows into out, on one line: the latest temperature,
+ * high/low/average, trip and standby state, unit and Arduino health, all from one stats
+ * snapshot. Temperatures are rounded as displayed, so a new sample that changes nothing on
+ * screen renders the same text. Returns the length.
+ */
+int packageSnapshotJSON(sensor* s, const temp_summary* summary, char* out, int size){
+      //each piece of state is loaded once, so the fields agree with each other
+      char name[64];
+      char temps[96];
+      bool error = s->arduinoError;
+      bool tripped = s->tripped;
+      char unit = s->cOrF;
+      if (error) snprintf(name, sizeof(name), "Arudino Error!!!");
+      else if (summary->latest == NO_READING) snprintf(name, sizeof(name), "No data available.");
+      else snprintf(name, sizeof(name), "%.1f %c", displayTemp(unit, summary->latest), unit);
+      if (summary->latest == NO_READING || summary->count == 0){
+            snprintf(temps, sizeof(temps), "\"temp\":null,\"high\":null,\"low\":null,\"avg\":null");
+      }
+      else {
+            snprintf(temps, sizeof(temps), "\"temp\":%.1f,\"high\":%.1f,\"low\":%.1f,\"avg\":%.1f",
+                     displayTemp(unit, summary->latest), displayTemp(unit, summary->max), displayTemp(unit, summary->min),
+                     displayTemp(unit, summary->average));
+      }
+      return snprintf(out, size, "\"name\":\"%s\",%s,\"unit\":\"%c\",\"tripped\":%s,\"standby\":%s,\"error\":%s}\n",
+                      name, temps, unit, tripped ? "true" : "false", s->standbyActive ? "true" : "false", error ? "true" : "false");
+}
+
+/*
+ * Sends the whole screen's worth of state in one reply (GET /n), tagged with a version
+ * that only moves when the content does. A client that already has the current version,
+ * named by ?since=N or an If-None-Match: "N" header, gets an empty 304 instead, which
+ * is all an idle poll costs.
+ */
+void sendSnapshot(int fd2, sensor* s, const char* request, long long if_none_match){
+      cached_response* reply = &s->snapshot_reply;
+      if (!cacheFresh(reply, &s->generation)){
+            unsigned generation = s->generation.load(std::memory_order_acquire);
+            temp_summary summary;
+            statsRead(&s->published, &summary);
+            char content[CACHED_RESPONSE_SIZE];
+            int len = packageSnapshotJSON(s, &summary, content, sizeof(content));
+            //the cached body is {"gen":N, followed by the content it was rendered from
+            const char* previous = reply->valid ? strchr(reply->body, ',') + 1 : NULL;
+            if (previous == NULL || strcmp(previous, content) != 0) s->snapshot_version++;
+            len = snprintf(reply->body, sizeof(reply->body), "{\"gen\":%u,%s", s->snapshot_version, content);
+            cacheStore(reply, generation, len);
+      }
+      setETag(fd2, s->snapshot_version);
+      char param[32];
+      long long since = findQueryParam(request, "since", param, sizeof(param)) ? strtoll(param, NULL, 10) : if_none_match;
+      if (since == (long long) s->snapshot_version){
+            setStatus(fd2, 304);
+            return;
+      }
+      sendBytes(fd2, reply->body, reply->len);
+}
+
+/*
+ * Checks to see if the motion sensor has been trip. Sends message to Pebble in JSON format indicating T/F.
+ */
+void checkTripped(int fd2, sensor* s){  
+      if (s->tripped){
+            sendMessage(fd2, "{\n\"name\":\"tripped\"\n}\n");
+      }
+      else {
+            sendMessage(fd2, "{\n\"name\":\"nottripped\"\n}\n");
+      }
+}
+
+/*
+ * Asks the Arduino to display the warning message on the 7-Seg.
+ */
+void requestMessage(int fd2, sensor* s){
+      if (submitCommand(s, 'm')) journalRequest(fd2, s, JOURNAL_MESSAGE, 0);
+      sendMessage(fd2, "{\n\"name\":\"Message Sent\"\n}\n");
+}
+
+/*
+ * Sets var tripped back to false in both the server and the Arduino.
+ */
+void resetAlarm(int fd2, sensor* s){
+      bool was_tripped = s->tripped.exchange(false);
+      cacheBump(&s->generation);
+      //the journal records who reset the alarm, repeated presses included
+      if (submitCommand(s, 'r') || was_tripped) journalRequest(fd2, s, JOURNAL_RESET, was_tripped ? 1 : 0);
+      sendMessage(fd2, "{\n\"name\":\"Alarm Reset\"\n}\n");
+}
+
+/*
+ * Sends whatever response is pending on a connection and waits for the socket to
+ * become writable if it could not all go out. Once everything is sent the connection
+ * either waits for its next request or, if it is not kept alive, is closed.
+ */
+void finishRequest(connection* conn){
+      int status = flushResponse(conn);
+      if (status == -1 || (status == 1 && (!conn->keep_alive || conn->peer_closed))){
+            closeConnection(conn);
+            return;
+      }
+      if (status == 0){
+            watchEvents(conn, EPOLLOUT);
+            listTouch(&writing_list, conn);
+            return;
+      }
+      watchEvents(conn, EPOLLIN);
+      listTouch(&reading_list, conn);
+}
+
+/*
+ * Puts the status line and headers in front of the response body queued since body_start.
+ * HTTP/0.9 requests get the bare body, which is all the Pebble originally expected;
+ * HEAD requests get the headers alone.
+ */
+void frameResponse(connection* conn, int body_start){
+      if (conn->http_version < 0) return;
+      int body_len = conn->response_len - body_start;
+      if (conn->http_method == HTTP_HEAD) conn->response_len = body_start;
+      char header[256];
+      char etag[40] = "";
+      if (conn->http_etag >= 0) snprintf(etag, sizeof(etag), "ETag: \"%lld\"\r\n", conn->http_etag);
+      int len = snprintf(header, sizeof(header),
+                         "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n%sConnection: %s\r\n\r\n",
+                         conn->http_status, httpReason(conn->http_status), conn->http_content_type, body_len,
+                         etag, conn->keep_alive ? "keep-alive" : "close");
+      if (!insertResponse(conn, body_start, header, len)) conn->keep_alive = false;
+}
+
+/*
+ * Sends whatever a subscriber has pending and watches for writability only while
+ * something is left over. Subscribers that error out are closed, in which case
+ * false is returned.
+ */
+bool flushSubscriber(connection* conn){
+      int status = flushResponse(conn);
+      if (status == -1){
+            closeConnection(conn);
+            return false;
+      }
+      //a long-poll leaves pipelined requests in the socket and only listens for hangups
+      unsigned events = conn->stream == STREAM_LONGPOLL ? EPOLLRDHUP : EPOLLIN;
+      watchEvents(conn, status == 0 ? events | EPOLLOUT : events);
+      return true;
+}
+
+/*
+ * Queues text on an event stream. A subscriber that has stopped reading is dropped
+ * rather than buffering for it without bound.
+ */
+void pushToSubscriber(connection* conn, const char* text){
+      int len = strlen(text);
+      if (conn->response_len - conn->response_sent + len > MAX_SUBSCRIBER_BACKLOG || !queueResponse(conn, text, len)){
+            closeConnection(conn);
+            return;
+      }
+      flushSubscriber(conn);
+}
+
+void processRequests(connection* conn);
+
+/*
+ * Answers a long-poll subscriber with message, then carries on with the connection
+ * like any other request.
+ */
+void answerLongPoll(connection* conn, const char* message){
+      conn->stream = STREAM_NONE;
+      int body_start = conn->response_len;
+      sendMessage(conn->fd, message);
+      frameResponse(conn, body_start);
+      processRequests(conn);
+}
+
+/*
+ * Formats a trip event as a Server-Sent Event and as a long-poll JSON reply.
+ */
+void formatTripEvent(int index, int64_t when, char* event_text, int event_size, char* poll_text, int poll_size){
+      const char* id = sensors[index].id;
+      snprintf(event_text, event_size, "event: trip\ndata: {\"name\":\"tripped\",\"sensor\":\"%.*s\",\"time\":%lld}\n\n",
+               SENSOR_ID_LENGTH, id, (long long) when);
+      snprintf(poll_text, poll_size, "{\n\"name\":\"tripped\",\n\"sensor\":\"%.*s\",\n\"time\":%lld\n}\n",
+               SENSOR_ID_LENGTH, id, (long long) when);
+}
+
+/*
+ * Formats an alert firing as a Server-Sent Event.
+ */
+void formatAlertEvent(const notify_event* event, char* event_text, int event_size){
+      snprintf(event_text, event_size, "event: alert\ndata: {\"name\":\"alert\",\"sensor\":\"%.*s\",\"time\":%lld,%s}\n\n",
+               SENSOR_ID_LENGTH, sensors[event->sensor].id, (long long) event->time, event->detail);
+}
+
+/*
+ * Turns a request into a trip subscriber for sensor s (NULL for every sensor).
+ * GET /e streams Server-Sent Events; GET /w is a long-poll answered by the next trip,
+ * or straight away if a watched sensor has already tripped.
+ */
+void subscribeTrips(connection* conn, sensor* s, int mode){
+      conn->stream = mode;
+      conn->stream_sensor = s == NULL ? -1 : s - sensors;
+      if (mode == STREAM_EVENTS){
+            //the stream has no length, so it ends when either side closes the connection
+            if (conn->http_version >= 0){
+                  sendMessage(conn->fd, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n");
+            }
+            sendMessage(conn->fd, ": subscribed\n\n");
+      }
+      for (int i = 0; i < sensor_count; i++){
+            if ((conn->stream_sensor != -1 && conn->stream_sensor != i) || !sensors[i].tripped) continue;
+            char event_text[256], poll_text[256];
+            formatTripEvent(i, wallMillis(), event_text, sizeof(event_text), poll_text, sizeof(poll_text));
+            if (mode == STREAM_LONGPOLL){
+                  conn->stream = STREAM_NONE;
+                  sendMessage(conn->fd, poll_text);
+                  return;
+            }
+            sendMessage(conn->fd, event_text);
+      }
+      listTouch(&waiting_list, conn);
+}
+
+/*
+ * Handles socket activity on a subscriber: flushes pending output and closes the
+ * connection once the client goes away. Anything the client sends is ignored.
+ */
+void serviceSubscriber(connection* conn, uint32_t events){
+      if ((events & EPOLLOUT) && !flushSubscriber(conn)) return;
+      if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+            closeConnection(conn);
+            return;
+      }
+      if (events & EPOLLIN){
+            char discard[256];
+            while (true){
+                  int bytes_received = recv(conn->fd, discard, sizeof(discard), 0);
+                  if (bytes_received > 0) continue;
+                  if (bytes_received == -1 && errno == EINTR) continue;
+                  if (bytes_received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) closeConnection(conn);
+                  return;
+            }
+      }
+}
+
+/*
+ * Delivers queued trip events to every subscriber watching the tripped sensor, and alert
+ * firings to the event streams watching the sensor. Long-polls only answer trips.
+ */
+void deliverNotifications(){
+      notify_event events[NOTIFY_QUEUE_SIZE];
+      int n = notifyDrain(&notifications, events, NOTIFY_QUEUE_SIZE);
+      for (int e = 0; e < n; e++){
+            char event_text[384], poll_text[256];
+            bool alert = events[e].type == EVENT_ALERT;
+            if (alert) formatAlertEvent(&events[e], event_text, sizeof(event_text));
+            else formatTripEvent(events[e].sensor, events[e].time, event_text, sizeof(event_text), poll_text, sizeof(poll_text));
+            connection* conn = waiting_list.head;
+            while (conn != NULL){
+                  //the subscriber may be closed or moved, so step first
+                  connection* next = conn->next;
+                  if (conn->stream_sensor == -1 || conn->stream_sensor == events[e].sensor){
+                        if (conn->stream == STREAM_LONGPOLL){
+                              if (!alert) answerLongPoll(conn, poll_text);
+                        }
+                        else pushToSubscriber(conn, event_text);
+                  }
+                  conn = next;
+            }
+      }
+}
+
+/*
+ * Expires subscribers: long-polls get "nottripped", event streams get a keepalive comment.
+ */
+void expireSubscribers(){
+      long long now = nowMillis();
+      while (waiting_list.head != NULL && waiting_list.head->deadline <= now){
+            connection* conn = waiting_list.head;
+            if (conn->stream == STREAM_LONGPOLL){
+                  answerLongPoll(conn, "{\n\"name\":\"nottripped\"\n}\n");
+                  continue;
+            }
+            listTouch(&waiting_list, conn);
+            pushToSubscriber(conn, ": keepalive\n\n");
+      }
+}
+
+/*
+ * Sends one summary (quantiles, sum and count) built from a histogram in every metrics shard.
+ */
+void sendSummary(int fd2, const char* name, const char* labels, metric_histogram* const* parts, int n){
+      uint64_t counts[HISTOGRAM_BUCKETS];
+      memset(counts, 0, sizeof(counts));
+      uint64_t total = 0, sum_ns = 0;
+      for (int i = 0; i < n; i++){
+            histogramCollect(parts[i], counts);
+            total += counterRead(&parts[i]->total);
+            sum_ns += counterRead(&parts[i]->sum_ns);
+      }
+      if (total == 0) return;
+      char line[256];
+      const double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+      for (int q = 0; q < 4; q++){
+            snprintf(line, sizeof(line), "%s{%s%squantile=\"%g\"} %.9f\n", name, labels, labels[0] ? "," : "",
+                     quantiles[q], histogramQuantile(counts, total, quantiles[q]) / 1e9);
+            sendMessage(fd2, line);
+      }
+      const char* open = labels[0] ? "{" : "";
+      const char* close = labels[0] ? "}" : "";
+      snprintf(line, sizeof(line), "%s_sum%s%s%s %.9f\n%s_count%s%s%s %llu\n", name, open, labels, close, sum_ns / 1e9,
+               name, open, labels, close, (unsigned long long) total);
+      sendMessage(fd2, line);
+}
+
+/*
+ * Sends one counter or gauge sample.
+ */
+void sendCounter(int fd2, const char* name, const char* labels, uint64_t value){
+      char line[256];
+      if (labels[0]) snprintf(line, sizeof(line), "%s{%s} %llu\n", name, labels, (unsigned long long) value);
+      else snprintf(line, sizeof(line), "%s %llu\n", name, (unsigned long long) value);
+      sendMessage(fd2, line);
+}
+
+/*
+ * Sends every counter and latency summary in the Prometheus text format (GET /metrics).
+ */
+void serveMetrics(int fd2){
+      setContentType(fd2, "text/plain; version=0.0.4");
+      uint64_t accepts = 0, send_failures = 0, retries = 0;
+      for (int i = 0; i < METRICS_SHARDS; i++){
+            accepts += counterRead(&metrics_shards[i].accepts);
+            send_failures += counterRead(&metrics_shards[i].send_failures);
+            retries += counterRead(&metrics_shards[i].seqlock_retries);
+      }
+      sendMessage(fd2, "# TYPE watchdog_accepts_total counter\n");
+      sendCounter(fd2, "watchdog_accepts_total", "", accepts);
+      sendMessage(fd2, "# TYPE watchdog_send_failures_total counter\n");
+      sendCounter(fd2, "watchdog_send_failures_total", "", send_failures);
+      sendMessage(fd2, "# TYPE watchdog_seqlock_retries_total counter\n");
+      sendCounter(fd2, "watchdog_seqlock_retries_total", "", retries);
+
+      //per-route request counts and handler latency; routes nobody used are left out
+      char labels[64];
+      sendMessage(fd2, "# TYPE watchdog_requests_total counter\n");
+      for (int r = 0; r < METRIC_ROUTES; r++){
+            uint64_t requests = 0;
+            for (int i = 0; i < METRICS_SHARDS; i++) requests += counterRead(&metrics_shards[i].requests[r]);
+            if (requests == 0) continue;
+            metricsRouteLabel(r, labels, sizeof(labels));
+            sendCounter(fd2, "watchdog_requests_total", labels, requests);
+      }
+      sendMessage(fd2, "# TYPE watchdog_request_duration_seconds summary\n");
+      for (int r = 0; r < METRIC_ROUTES; r++){
+            metric_histogram* parts[METRICS_SHARDS];
+            for (int i = 0; i < METRICS_SHARDS; i++) parts[i] = &metrics_shards[i].request_latency[r];
+            metricsRouteLabel(r, labels, sizeof(labels));
+            sendSummary(fd2, "watchdog_request_duration_seconds", labels, parts, METRICS_SHARDS);
+      }
+      //executor workers
+      uint64_t tasks = 0, stolen = 0;
+      for (int i = METRICS_WORKER; i < METRICS_SHARDS; i++){
+            tasks += counterRead(&metrics_shards[i].tasks_run);
+            stolen += counterRead(&metrics_shards[i].tasks_stolen);
+      }
+      sendMessage(fd2, "# TYPE watchdog_executor_workers gauge\n");
+      sendCounter(fd2, "watchdog_executor_workers", "", pool.workers);
+      sendMessage(fd2, "# TYPE watchdog_executor_tasks_total counter\n");
+      sendCounter(fd2, "watchdog_executor_tasks_total", "", tasks);
+      sendMessage(fd2, "# TYPE watchdog_executor_steals_total counter\n");
+      sendCounter(fd2, "watchdog_executor_steals_total", "", stolen);
+      //io_uring event loops, by thread; both stay at zero on epoll
+      sendMessage(fd2, "# TYPE watchdog_uring_enters_total counter\n");
+      sendCounter(fd2, "watchdog_uring_enters_total", "thread=\"server\"", counterRead(&metrics_shards[METRICS_SERVER].ring_enters));
+      sendCounter(fd2, "watchdog_uring_enters_total", "thread=\"ingest\"", counterRead(&metrics_shards[METRICS_INGEST].ring_enters));
+      sendMessage(fd2, "# TYPE watchdog_uring_completions_total counter\n");
+      sendCounter(fd2, "watchdog_uring_completions_total", "thread=\"server\"", counterRead(&metrics_shards[METRICS_SERVER].ring_completions));
+      sendCounter(fd2, "watchdog_uring_completions_total", "thread=\"ingest\"", counterRead(&metrics_shards[METRICS_INGEST].ring_completions));
+      //replication, written by the ingest thread; an edge fills the first five, an aggregator the last two
+      const char* replica_names[7] = { "watchdog_replica_connects_total", "watchdog_replica_batches_total",
+                                       "watchdog_replica_readings_sent_total", "watchdog_replica_bytes_sent_total",
+                                       "watchdog_replica_gap_readings_total", "watchdog_replica_applied_total",
+                                       "watchdog_replica_duplicates_total" };
+      const metrics_shard* ingest = &metrics_shards[METRICS_INGEST];
+      const metric_counter* replica_counters[7] = { &ingest->replica_connects, &ingest->replica_batches, &ingest->replica_readings,
+                                                    &ingest->replica_bytes, &ingest->replica_gaps, &ingest->replica_applied,
+                                                    &ingest->replica_duplicates };
+      for (int m = 0; m < 7; m++){
+            char type[128];
+            snprintf(type, sizeof(type), "# TYPE %s counter\n", replica_names[m]);
+            sendMessage(fd2, type);
+            sendCounter(fd2, replica_names[m], "", counterRead(replica_counters[m]));
+      }
+      sendMessage(fd2, "# TYPE watchdog_replica_sites gauge\n");
+      sendCounter(fd2, "watchdog_replica_sites", "", replica_sites);
+      //event journal group commits
+      sendMessage(fd2, "# TYPE watchdog_journal_records_total counter\n");
+      sendCounter(fd2, "watchdog_journal_records_total", "", counterRead(&event_journal.records));
+      sendMessage(fd2, "# TYPE watchdog_journal_commits_total counter\n");
+      sendCounter(fd2, "watchdog_journal_commits_total", "", counterRead(&event_journal.commits));
+      sendMessage(fd2, "# TYPE watchdog_journal_dropped_total counter\n");
+      sendCounter(fd2, "watchdog_journal_dropped_total", "", counterRead(&event_journal.dropped));
+      sendMessage(fd2, "# TYPE watchdog_journal_commit_seconds summary\n");
+      metric_histogram* commit_latency = &event_journal.commit_latency;
+      sendSummary(fd2, "watchdog_journal_commit_seconds", "", &commit_latency, 1);
+      sendMessage(fd2, "# TYPE watchdog_alerts_fired_total counter\n");
+      sendCounter(fd2, "watchdog_alerts_fired_total", "", counterRead(&metrics_shards[METRICS_INGEST].alerts_fired));
+      //Arduino command queue
+      const char* command_names[4] = { "watchdog_commands_sent_total", "watchdog_commands_coalesced_total",
+                                        "watchdog_commands_expired_total", "watchdog_commands_unconfirmed_total" };
+      for (int m = 0; m < 4; m++){
+            uint64_t value = 0;
+            for (int i = 0; i < METRICS_SHARDS; i++){
+                  const metric_counter* counters[4] = { &metrics_shards[i].commands_sent, &metrics_shards[i].commands_coalesced,
+                                                        &metrics_shards[i].commands_expired, &metrics_shards[i].commands_unconfirmed };
+                  value += counterRead(counters[m]);
+            }
+            char type[128];
+            snprintf(type, sizeof(type), "# TYPE %s counter\n", command_names[m]);
+            sendMessage(fd2, type);
+            sendCounter(fd2, command_names[m], "", value);
+      }
+      metric_histogram* writes[METRICS_SHARDS];
+      metric_histogram* confirms[METRICS_SHARDS];
+      for (int i = 0; i < METRICS_SHARDS; i++){
+            writes[i] = &metrics_shards[i].command_write_latency;
+            confirms[i] = &metrics_shards[i].command_confirm_latency;
+      }
+      sendMessage(fd2, "# TYPE watchdog_command_write_seconds summary\n");
+      sendSummary(fd2, "watchdog_command_write_seconds", "", writes, METRICS_SHARDS);
+      sendMessage(fd2, "# TYPE watchdog_command_confirm_seconds summary\n");
+      sendSummary(fd2, "watchdog_command_confirm_seconds", "", confirms, METRICS_SHARDS);
+
+      sendMessage(fd2, "# TYPE watchdog_lock_wait_seconds summary\n");
+      metric_histogram* waits[METRICS_SHARDS];
+      for (int i = 0; i < METRICS_SHARDS; i++) waits[i] = &metrics_shards[i].lock_wait;
+      sendSummary(fd2, "watchdog_lock_wait_seconds", "", waits, METRICS_SHARDS);
+
+      //serial side, per sensor
+      const char* names[7] = { "watchdog_serial_bytes_total", "watchdog_serial_lines_total",
+                               "watchdog_serial_parse_errors_total", "watchdog_arduino_errors_total",
+                               "watchdog_serial_frames_total", "watchdog_serial_frames_lost_total",
+                               "watchdog_serial_crc_errors_total" };
+      for (int m = 0; m < 7; m++){
+            char type[128];
+            snprintf(type, sizeof(type), "# TYPE %s counter\n", names[m]);
+            sendMessage(fd2, type);
+            for (int i = 0; i < sensor_count; i++){
+                  sensor* s = &sensors[i];
+                  const metric_counter* counters[7] = { &s->serial_bytes, &s->serial_lines, &s->parse_errors, &s->error_transitions,
+                                                        &s->frames, &s->frames_lost, &s->crc_errors };
+                  snprintf(labels, sizeof(labels), "sensor=\"%.*s\"", SENSOR_ID_LENGTH, s->id);
+                  sendCounter(fd2, names[m], labels, counterRead(counters[m]));
+            }
+      }
+      sendMessage(fd2, "# TYPE watchdog_arduino_up gauge\n");
+      for (int i = 0; i < sensor_count; i++){
+            snprintf(labels, sizeof(labels), "sensor=\"%.*s\"", SENSOR_ID_LENGTH, sensors[i].id);
+            sendCounter(fd2, "watchdog_arduino_up", labels, sensors[i].arduinoError ? 0 : 1);
+      }
+}
+
+/*
+ * Pages through the event journal, newest first (GET /j). Takes ?type=trip|reset|standby|
+ * unit|message|error, ?last=7d, ?limit=N and ?before=<next> for the page after this one,
+ * or ?after=<seq> to read forward from seq instead, each page's next continuing forward.
+ */
+void journalHistory(int fd2, const char* sensor_id, const char* request){
+      char param[32];
+      journal_query q;
+      q.type = 0;
+      q.sensor = sensor_id;
+      q.since = INT64_MIN;
+      q.cursor = 0;
+      q.backward = true;
+      if (findQueryParam(request, "type", param, sizeof(param)) && (q.type = journalType(param)) == 0){
+            sendMessage(fd2, "{\n\"name\":\"Unknown event type.\"\n}\n");
+            return;
+      }
+      if (findQueryParam(request, "last", param, sizeof(param))){
+            int64_t seconds = parseDuration(param);
+            if (seconds <= 0){
+                  sendMessage(fd2, "{\n\"name\":\"Bad range.\"\n}\n");
+                  return;
+            }
+            q.since = wallMillis() - seconds * 1000;
+      }
+      if (findQueryParam(request, "after", param, sizeof(param))){
+            q.cursor = strtoull(param, NULL, 10);
+            q.backward = false;
+      }
+      else if (findQueryParam(request, "before", param, sizeof(param))) q.cursor = strtoull(param, NULL, 10);
+      int limit = 50;
+      if (findQueryParam(request, "limit", param, sizeof(param))) limit = atoi(param);
+      if (limit < 1) limit = 1;
+      if (limit > JOURNAL_MAX_PAGE) limit = JOURNAL_MAX_PAGE;
+      journal_record records[JOURNAL_MAX_PAGE];
+      uint64_t next;
+      int found = journalPage(&event_journal, &q, records, limit, &next);
+      if (found == -1){
+            setStatus(fd2, 500);
+            sendMessage(fd2, "{\n\"name\":\"Couldn't read the journal.\"\n}\n");
+            return;
+      }
+      sendMessage(fd2, "{\n\"events\":[");
+      for (int i = 0; i < found; i++){
+            journal_record* r = &records[i];
+            char state[8];
+            if (r->type == JOURNAL_UNIT) snprintf(state, sizeof(state), "\"%c\"", r->state);
+            else snprintf(state, sizeof(state), "%d", r->state);
+            char entry[256];
+            snprintf(entry, sizeof(entry), "%s\n{\"seq\":%llu,\"time\":%lld,\"type\":\"%s\",\"sensor\":\"%.*s\",\"state\":%s,\"origin\":\"%.*s\"}",
+                     i == 0 ? "" : ",", (unsigned long long) r->seq, (long long) r->time, journalTypeName(r->type),
+                     JOURNAL_SENSOR_LENGTH, r->sensor, state, JOURNAL_ORIGIN_LENGTH, r->origin);
+            sendMessage(fd2, entry);
+      }
+      char tail[64];
+      if (next != 0) snprintf(tail, sizeof(tail), "\n],\n\"next\":%llu\n}\n", (unsigned long long) next);
+      else snprintf(tail, sizeof(tail), "\n],\n\"next\":null\n}\n");
+      sendMessage(fd2, tail);
+}
+
+/*
+ * Lists every registered sensor with its latest reading and state in JSON format.
+ */
+void listSensors(int fd2){
+      sendMessage(fd2, "{\n\"sensors\":[");
+      for (int i = 0; i < sensor_count; i++){
+            sensor* s = &sensors[i];
+            temp_summary summary;
+            statsRead(&s->published, &summary);
+            char entry[256];
+            snprintf(entry, sizeof(entry), "%s\n{\"id\":\"%s\",\"latest\":%.2f,\"tripped\":%s,\"error\":%s,\"remote\":%s}",
+                     i == 0 ? "" : ",", s->id, summary.latest,
+                     s->tripped ? "true" : "false", s->arduinoError ? "true" : "false", s->remote ? "true" : "false");
+            sendMessage(fd2, entry);
+      }
+      sendMessage(fd2, "\n]\n}\n");
+}
+
+/*
+ * Runs the handler matching the single-letter route in a complete request.
+ * Requests address a sensor with ?sensor=<id>; without it the first sensor answers.
+ */
+void dispatchRequest(connection* conn, const http_request* req){
+      int fd2 = conn->fd;
+      //routes and query parameters are looked up in a NUL-terminated copy of the target
+      char request[REQUEST_BUFFER_SIZE + 1];
+      memcpy(request, req->target, req->target_len);
+      request[req->target_len] = '\0';
+      if (req->method == HTTP_OTHER){
+            setStatus(fd2, 405);
+            sendMessage(fd2, "{\n\"name\":\"Method not allowed.\"\n}\n");
+            return;
+      }
+      if (metricsRoute(request, req->target_len) == METRIC_ROUTE_METRICS){
+            serveMetrics(fd2);
+            return;
+      }
+      if (request[1] == 'l'){
+            listSensors(fd2);
+            return;
+      }
+      char id[SENSOR_ID_LENGTH];
+      bool addressed = findQueryParam(request, "sensor", id, sizeof(id));
+      //the journal covers every sensor unless one is named, including ones no longer configured
+      if (request[1] == 'j'){
+            journalHistory(fd2, addressed ? id : NULL, request);
+            return;
+      }
+      sensor* s = findSensor(addressed ? id : NULL);
+      if (s == NULL){
+            setStatus(fd2, 404);
+            sendMessage(fd2, "{\n\"name\":\"Unknown sensor.\"\n}\n");
+            return;
+      }
+      //trip subscriptions watch every sensor unless one is named
+      if (request[1] == 'e' || request[1] == 'w'){
+            subscribeTrips(conn, addressed ? s : NULL, request[1] == 'e' ? STREAM_EVENTS : STREAM_LONGPOLL);
+            return;
+      }
+      //this is a request for the most recent temperature 
+      switch (request[1]){
+            case 'a':
+                  changeSign(fd2, s);
+                  break;
+            case 'b':
+                  mostRecentTemp(fd2, s);
+                  break;
+            case 'd':
+                  highLowAverage(fd2, s); 
+                  break;
+            case 'h':
+                  rangeHighLowAverage(fd2, s, request);
+                  break;
+            case 'm':
+                  requestMessage(fd2, s);
+                  break;
+            case 'n':
+                  sendSnapshot(fd2, s, request, req->if_none_match);
+                  break;
+            case 'p':
+                  rangePercentiles(fd2, s, request);
+                  break;
+            case 'q':
+                  rangeSeries(fd2, s, request);
+                  break;
+            case 'r':
+                  resetAlarm(fd2, s);
+                  break;
+            case 's':
+                  toggleStandby(fd2, s);
+                  break;
+            case 't':
+                  checkTripped(fd2, s);
+                  break;
+            default:
+                  setStatus(fd2, 404);
+                  sendMessage(fd2, "{\n\"name\":\"Unknown request.\"\n}\n");
+                  break;
+      }  
+}
+
+/*
+ * Answers an unusable request with status and message and closes the connection after.
+ */
+void rejectRequest(connection* conn, int status, const char* message){
+      conn->http_method = HTTP_GET;
+      conn->http_content_type = "application/json";
+      conn->http_etag = -1;
+      if (conn->http_version < 0) conn->http_version = 1;
+      conn->http_status = status;
+      conn->keep_alive = false;
+      int body_start = conn->response_len;
+      sendMessage(conn->fd, message);
+      frameResponse(conn, body_start);
+}
+
+/*
+ * Returns true for the routes worth running on the executor: the ones that merge
+ * rollups or read the archive. The rest are cheaper than the handoff, and the cached
+ * replies and subscriptions belong to the server thread anyway.
+ */
+bool routeOffloaded(const http_request* req){
+      if (req->method == HTTP_OTHER || req->target_len < 2) return false;
+      char route = req->target[1];
+      return route == 'h' || route == 'j' || route == 'p' || route == 'q';
+}
+
+/*
+ * Runs a request's handler on a worker, then hands the reply back to the event loop.
+ */
+void runRequestJob(void* p){
+      request_job* job = (request_job*) p;
+      handler_reply = &job->reply;
+      dispatchRequest(&job->reply, &job->req);
+      handler_reply = NULL;
+      //latency counts the wait for a worker too
+      histogramRecord(&metrics_local->request_latency[job->route], metricsNanos() - job->started);
+      counterAdd(&metrics_local->requests[job->route], 1);
+      pthread_mutex_lock(&finished_lock);
+      job->next = finished_jobs;
+      finished_jobs = job;
+      pthread_mutex_unlock(&finished_lock);
+      uint64_t one = 1;
+      write(finished_fd, &one, sizeof(one));
+}
+
+/*
+ * Hands a parsed request to the executor. The connection is busy until finishJobs sends
+ * the reply, so nothing else is read, answered or expired on it meanwhile. Returns false
+ * if the request could not be queued and should be answered inline.
+ */
+bool submitRequest(connection* conn, const http_request* req, int route, int body_start, long long started){
+      request_job* job = (request_job*) calloc(1, sizeof(request_job));
+      if (job == NULL){
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return false;
+      }
+      job->conn = conn;
+      job->req = *req;
+      memcpy(job->target, req->target, req->target_len);
+      job->req.target = job->target;
+      job->route = route;
+      job->body_start = body_start;
+      job->started = started;
+      job->reply.fd = conn->fd;
+      job->reply.http_status = conn->http_status;
+      job->reply.http_content_type = conn->http_content_type;
+      job->reply.http_etag = conn->http_etag;
+      if (!executorSubmit(&pool, runRequestJob, job)){
+            free(job);
+            return false;
+      }
+      conn->busy = true;
+      listRemove(conn);
+      //a hangup is still reported once, but cannot spin the loop while the handler runs
+      watchEvents(conn, EPOLLONESHOT);
+      return true;
+}
+
+/*
+ * Answers every complete request in the connection's buffer in order, so pipelined
+ * requests are handled in one pass, then sends the replies. Stops early at a request
+ * that closes the connection or turns it into an event subscriber.
+ */
+void processRequests(connection* conn){
+      while (true){
+            http_request req;
+            int parsed = httpParse(conn->request, conn->request_len, &conn->request_scan, &req);
+            if (parsed == HTTP_PARSE_MORE){
+                  if (conn->request_len == REQUEST_BUFFER_SIZE) rejectRequest(conn, 413, "{\n\"name\":\"Request too large.\"\n}\n");
+                  break;
+            }
+            if (parsed == HTTP_PARSE_BAD){
+                  rejectRequest(conn, 400, "{\n\"name\":\"Bad request.\"\n}\n");
+                  break;
+            }
+            conn->http_method = req.method;
+            conn->http_version = req.version;
+            conn->http_status = 200;
+            conn->http_content_type = "application/json";
+            conn->http_etag = -1;
+            conn->keep_alive = req.keep_alive;
+            int body_start = conn->response_len;
+            if (req.chunked){
+                  rejectRequest(conn, 501, "{\n\"name\":\"Chunked requests are not supported.\"\n}\n");
+                  break;
+            }
+            //count and time the handler before the request bytes are dropped
+            int route = metricsRoute(req.target, req.target_len);
+            long long started = metricsNanos();
+            bool offloaded = routeOffloaded(&req) && submitRequest(conn, &req, route, body_start, started);
+            if (!offloaded){
+                  dispatchRequest(conn, &req);
+                  histogramRecord(&metrics_local->request_latency[route], metricsNanos() - started);
+                  counterAdd(&metrics_local->requests[route], 1);
+            }
+            //drop the request, keeping whatever the client pipelined behind it
+            conn->request_len -= req.length;
+            memmove(conn->request, conn->request + req.length, conn->request_len);
+            conn->request_scan = 0;
+            //finishJobs picks up from here once the worker is done
+            if (offloaded) return;
+            //subscribers stay open until an event or their timeout answers them
+            if (conn->stream != STREAM_NONE){
+                  flushSubscriber(conn);
+                  return;
+            }
+            frameResponse(conn, body_start);
+            if (!conn->keep_alive) break;
+      }
+      finishRequest(conn);
+}
+
+/*
+ * Reads whatever the client has sent and answers the requests that are now complete.
+ */
+void readRequest(connection* conn){
+      while (conn->request_len < REQUEST_BUFFER_SIZE){
+            // 5. recv: read incoming request message into buffer
+            int bytes_received = recv(conn->fd, conn->request + conn->request_len,
+                                      REQUEST_BUFFER_SIZE - conn->request_len, 0);
+            if (bytes_received > 0){
+                  conn->request_len += bytes_received;
+                  continue;
+            }
+            if (bytes_received == 0) conn->peer_closed = true;
+            else if (errno == EINTR) continue;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK){
+                  closeConnection(conn);
+                  return;
+            }
+            break;
+      }
+      processRequests(conn);
+}
+
+/*
+ * Sends the replies of every request the executor has finished, then carries on with
+ * whatever each client pipelined behind it. Called by the event loop when finished_fd
+ * is readable.
+ */
+void finishJobs(){
+      uint64_t count;
+      read(finished_fd, &count, sizeof(count));
+      pthread_mutex_lock(&finished_lock);
+      request_job* job = finished_jobs;
+      finished_jobs = NULL;
+      pthread_mutex_unlock(&finished_lock);
+      while (job != NULL){
+            request_job* next = job->next;
+            connection* conn = job->conn;
+            conn->busy = false;
+            conn->http_status = job->reply.http_status;
+            conn->http_content_type = job->reply.http_content_type;
+            conn->http_etag = job->reply.http_etag;
+            if (job->reply.response_len > 0 && !queueResponse(conn, job->reply.response, job->reply.response_len)){
+                  conn->keep_alive = false;
+            }
+            frameResponse(conn, job->body_start);
+            free(job->reply.response);
+            free(job);
+            if (conn->keep_alive) processRequests(conn);
+            else finishRequest(conn);
+            job = next;
+      }
+}
+
+/*
+ * Accepts every pending connection on the listening socket without blocking.
+ */
+void acceptConnections(int sock){
+      while (true){
+            // 4. accept: take the next queued connection, if there is one
+            struct sockaddr_in client_addr;
+            socklen_t sin_size = sizeof(struct sockaddr_in);
+            int fd2 = accept4(sock, (struct sockaddr *)&client_addr, &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd2 == -1){
+                  if (errno == EINTR || errno == ECONNABORTED) continue;
+                  if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept");
+                  return;
+            }
+            counterAdd(&metrics_local->accepts, 1);
+            if (openConnection(fd2) == NULL){
+                  close(fd2);
+            }
+      }
+}
+
+/*
+ * Handles one completion on the server's ring: the listening socket's accept, a poll of
+ * one of the eventfds, or an operation on a connection, which is carried on the way
+ * the epoll loop carries on after the matching event.
+ */
+void ringComplete(int sock, const struct io_uring_cqe* cqe){
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      //cancellations complete with no user data
+      if (data == 0) return;
+      if (data == RING_ACCEPT){
+            if (res >= 0){
+                  counterAdd(&metrics_local->accepts, 1);
+                  if (openConnection(res) == NULL) close(res);
+            }
+            else if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN){
+                  errno = -res;
+                  perror("Accept");
+            }
+            uringAccept(server_ring, sock, SOCK_NONBLOCK | SOCK_CLOEXEC, RING_ACCEPT);
+            return;
+      }
+      if (data == RING_NOTIFY){
+            deliverNotifications();
+            uringPoll(server_ring, notifications.event_fd, POLLIN, RING_NOTIFY);
+            return;
+      }
+      if (data == RING_FINISHED){
+            finishJobs();
+            uringPoll(server_ring, finished_fd, POLLIN, RING_FINISHED);
+            return;
+      }
+      connection* conn = (connection*) (uintptr_t) (data & ~(uint64_t) RING_TAG_MASK);
+      int op = data & RING_TAG_MASK;
+      if (!ringCompleted(conn, op)) return;
+      if (op == RING_SEND){
+            if (res < 0 && res != -EAGAIN && res != -EINTR){
+                  counterAdd(&metrics_local->send_failures, 1);
+                  closeConnection(conn);
+                  return;
+            }
+            if (res > 0) conn->response_sent += res;
+            //a busy connection sends the rest along with its handler's reply
+            if (conn->busy) return;
+            if (conn->stream != STREAM_NONE) serviceSubscriber(conn, EPOLLOUT);
+            else if (conn->list == &writing_list) finishRequest(conn);
+            return;
+      }
+      if (op == RING_POLL){
+            //only long-polls wait on a poll; a connection answered since sees hangups through its receive
+            if (conn->stream == STREAM_NONE) return;
+            if (res < 0 || (res & (POLLRDHUP | POLLHUP | POLLERR))) closeConnection(conn);
+            else watchEvents(conn, conn->epoll_events);
+            return;
+      }
+      if (res == -EAGAIN || res == -EINTR){
+            watchEvents(conn, conn->epoll_events);
+            return;
+      }
+      //what an event stream subscriber sends is ignored; its receive only notices it leaving
+      if (conn->stream != STREAM_NONE){
+            if (res <= 0) closeConnection(conn);
+            else watchEvents(conn, conn->epoll_events);
+            return;
+      }
+      if (res < 0){
+            closeConnection(conn);
+            return;
+      }
+      if (res == 0) conn->peer_closed = true;
+      conn->request_len += res;
+      processRequests(conn);
+}
+
+/*
+ * Serves connections from the server's ring until quit_signal is received. One accept,
+ * a poll on each eventfd and every connection's receive or send stay in flight, and each
+ * pass submits what the last one queued in the same call that waits for completions.
+ */
+void serveRing(int sock){
+      uringAccept(server_ring, sock, SOCK_NONBLOCK | SOCK_CLOEXEC, RING_ACCEPT);
+      uringPoll(server_ring, notifications.event_fd, POLLIN, RING_NOTIFY);
+      uringPoll(server_ring, finished_fd, POLLIN, RING_FINISHED);
+      while (quit_signal == 0){
+            //wake at least once a second to check quit_signal and expire stalled clients
+            if (!uringSubmit(server_ring, 1, 1000)){
+                  perror("io_uring");
+                  break;
+            }
+            struct io_uring_cqe cqe;
+            while (uringNext(server_ring, &cqe)) ringComplete(sock, &cqe);
+            expireConnections();
+            expireSubscribers();
+      }
+}
+
+/*
+Configures server and serves many connections at once from an epoll loop until quit_signal is received
+*/
+void* server_thread(void* p){
+//Server config implementation
+      //get info regarding server config details from Main method
+      server_info* info = (server_info*)p;
+      int PORT_NUMBER = info->port_num;
+      metricsRegisterThread(METRICS_SERVER);
+      // structs to represent the server
+      struct sockaddr_in server_addr;
+      int sock; // socket descriptor
+      // 1. socket: creates a socket descriptor that you later use to make other system calls
+      if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+      perror("Socket");
+      exit(1);
+      }
+      int temp = 1;
+      if (setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&temp,sizeof(int)) == -1) {
+      perror("Setsockopt");
+      exit(1);
+      }
+      // configure the server
+      server_addr.sin_port = htons(PORT_NUMBER); // specify port number
+      server_addr.sin_family = AF_INET;
+      server_addr.sin_addr.s_addr = INADDR_ANY;
+      bzero(&(server_addr.sin_zero),8);
+      // 2. bind: use the socket and associate it with the port number
+      if (bind(sock, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
+      perror("Unable to bind");
+      exit(1);
+      }
+      // 3. listen: indicates that we want to listen to the port to which we bound; second arg is the backlog of pending connections
+      if (listen(sock, LISTEN_BACKLOG) == -1) {
+      perror("Listen");
+      exit(1);
+      }
+      //with -u 1 the event loop runs on io_uring instead, if the kernel has it
+      uring ring;
+      if (use_uring){
+            if (uringInit(&ring, SERVER_RING_ENTRIES)) server_ring = &ring;
+            else printf("\nio_uring is not available, serving connections from epoll.\n");
+      }
+      //the event loop watches the listening socket and every client socket
+      if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+      perror("Epoll");
+      exit(1);
+      }
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = sock;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+      perror("Epoll");
+      exit(1);
+      }
+      //trip notifications from the ingest thread arrive through an eventfd
+      ev.events = EPOLLIN;
+      ev.data.fd = notifications.event_fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, notifications.event_fd, &ev) == -1) {
+      perror("Epoll");
+      exit(1);
+      }
+      //and replies from handlers that ran on the executor through another
+      ev.events = EPOLLIN;
+      ev.data.fd = finished_fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, finished_fd, &ev) == -1) {
+      perror("Epoll");
+      exit(1);
+      }
+      // once you get here, the server is set up and about to start listening
+      printf("\nServer configured to listen on port %d\n", PORT_NUMBER);
+      fflush(stdout);
+
+//Request Processing
+      //loops, waiting for socket events until quit_signal is activated
+      struct epoll_event events[256];
+      if (server_ring != NULL) serveRing(sock);
+      while (server_ring == NULL && quit_signal == 0){
+            //wake at least once a second to check quit_signal and expire stalled clients
+            int ready = epoll_wait(epoll_fd, events, 256, 1000);
+            if (ready == -1 && errno != EINTR){
+                  perror("Epoll");
+                  break;
+            }
+            for (int i = 0; i < ready; i++){
+                  int event_fd = events[i].data.fd;
+                  if (event_fd == sock){
+                        acceptConnections(sock);
+                        continue;
+                  }
+                  if (event_fd == notifications.event_fd){
+                        deliverNotifications();
+                        continue;
+                  }
+                  if (event_fd == finished_fd){
+                        finishJobs();
+                        continue;
+                  }
+                  connection* conn = connections[event_fd];
+                  if (conn == NULL || conn->busy) continue;
+                  if (conn->stream != STREAM_NONE){
+                        serviceSubscriber(conn, events[i].events);
+                  }
+                  else if (conn->list == &writing_list){
+                        finishRequest(conn);
+                  }
+                  else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+                        readRequest(conn);
+                  }
+            }
+            expireConnections();
+            expireSubscribers();
+      }
+      // 7. close: close every client and the listening socket
+      for (int i = 0; i < MAX_CONNECTIONS; i++){
+            if (connections[i] != NULL) closeConnection(connections[i]);
+      }
+      if (server_ring != NULL){
+            //connections closed with operations in flight are freed as their cancellations come back
+            for (int tries = 0; ring_closing > 0 && tries < 10 && uringSubmit(server_ring, 1, 100); tries++){
+                  struct io_uring_cqe cqe;
+                  while (uringNext(server_ring, &cqe)){
+                        if (cqe.user_data > RING_FINISHED){
+                              ringCompleted((connection*) (uintptr_t) (cqe.user_data & ~(uint64_t) RING_TAG_MASK), cqe.user_data & RING_TAG_MASK);
+                        }
+                  }
+            }
+            uringClose(server_ring);
+            server_ring = NULL;
+      }
+      close(epoll_fd);
+      close(sock);
+      printf("Server closed connection\n");
+      return 0;
+}
+
+/*
+Waits for input from user. If input is Q or q, updates quit_signal.
+*/
+void* input_thread (void* p){
+      //reads input into char array to avoid errors if extra keys are hit accidentally
+      char user_input[100];
+      while (user_input[0] != 'q' && user_input[0] != 'Q'){
+            scanf("%s", user_input);      
+      }
+      quit_signal = 1;
+      return NULL;
+}
+
+/*
+ * Queues an alert firing for the event streams.
+ */
+void postAlert(sensor* s, const alert_rule* rule, int64_t now, double value){
+      notify_event event;
+      event.type = EVENT_ALERT;
+      event.sensor = s - sensors;
+      event.time = now;
+      char text[48];
+      alertDescribe(rule, text, sizeof(text));
+      char shown[16];
+      if (validReading(value)) snprintf(shown, sizeof(shown), "%.2f", value);
+      else snprintf(shown, sizeof(shown), "null");
+      snprintf(event.detail, sizeof(event.detail), "\"rule\":\"%s\",\"value\":%s,\"condition\":\"%s\"", rule->name, shown, text);
+      notifyPost(&notifications, &event);
+      counterAdd(&metrics_local->alerts_fired, 1);
+}
+
+/*
+ * Runs a sensor's reading rules against a new reading.
+ */
+void evaluateRules(sensor* s, int64_t now, double value){
+      for (int i = 0; i < s->rule_count; i++){
+            if (alertReading(&s->rules[i], now, value)) postAlert(s, &s->rules[i], now, value);
+      }
+}
+
+/*
+ * Fires the silent rules of boards that have not sent a line for too long.
+ */
+void checkSilence(int64_t now){
+      for (int i = 0; i < sensor_count; i++){
+            sensor* s = &sensors[i];
+            for (int r = 0; r < s->rule_count; r++){
+                  if (s->rules[r].kind == ALERT_SILENT && alertSilence(&s->rules[r], now, s->last_line)){
+                        postAlert(s, &s->rules[r], now, NO_READING);
+                  }
+            }
+      }
+}
+
+void uplinkTrip(sensor* s, int64_t when);
 
 /*
- * Finds the highest temperature in the array of recorded temps and returns it.
+ * Handles the motion sensor being tripped at when, whether a "tripped" line, a frame's motion
+ * flag or a replicating edge said so.
  */
-double findMax() {
-      double max = -300.0;
-      for (int i = 0; i < 3600; i++) {
-            if (temps[i] > 200.0) continue;
-            if (temps[i] > max) max = temps[i];
+void handleTrip(sensor* s, int64_t when){
+      //the board repeats "tripped" while it sees motion; subscribers hear about the first one
+      if (s->tripped.exchange(true)) return;
+      cacheBump(&s->generation);
+      notify_event event;
+      event.type = EVENT_TRIP;
+      event.sensor = s - sensors;
+      event.time = when;
+      event.detail[0] = '\0';
+      notifyPost(&notifications, &event);
+      journalPost(&event_journal, JOURNAL_TRIP, s->id, 1, s->remote ? "replica" : "serial", when);
+      if (replicating && !s->remote) uplinkTrip(s, when);
+      printf("%s %s\n\n", "trip noticed on", s->id);
+      //motion rules only care while the board is armed, i.e. not in standby
+      for (int i = 0; i < s->rule_count && !s->standbyActive; i++){
+            if (s->rules[i].kind == ALERT_MOTION) postAlert(s, &s->rules[i], event.time, s->stats.latest);
       }
-      return max;
 }
 
 /*
- * Finds the lowest temperature in the array of recorded temps and returns it.
+ * Saves one temperature reading, in 1/10000 degrees, in the sensor's persistent ring,
+ * stats, rollups and archive.
  */
-double findMin() {
-      double min = 500.0;
-      for (int i = 0; i < 3600; i++) {
-            if (temps[i] < -200.0) continue;
-            if (temps[i] < min) min = temps[i];
+void handleReading(sensor* s, int32_t fixed, int64_t now){
+      //the ring keeps the sensor's 1/16 degree resolution, so everything else keeps it too
+      double value = sampleQuantize(fixed / 10000.0);
+      //a standby command is confirmed once the stream switches to (or away from) "no reading"
+      if (s->standby_sent != 0 && (value == NO_READING) == s->standby_expected){
+            histogramRecord(&metrics_local->command_confirm_latency, metricsNanos() - s->standby_sent);
+            s->standby_sent = 0;
+      }
+      //this thread is the only writer, readers pick up the new state without locking
+      statsInsert(&s->stats, ringValue(&s->ring, s->ring.header->next), value);
+      ringInsert(&s->ring, value, now);
+      rollupInsert(&s->rollups, now / 1000, value);
+      if (validReading(value)){
+            archiveAppend(&s->history, now, value);
+            evaluateRules(s, now, value);
       }
-      return min;
+      statsPublish(&s->published, &s->stats);
+      cacheBump(&s->generation);
+}
+
+/*
+ * Asks a board that is still sending lines to switch to binary frames. Boards that do
+ * not know the command ignore it, so each connection only asks a few times.
+ */
+void negotiateFrames(sensor* s){
+      if (!binary_frames || s->negotiations >= FRAME_NEGOTIATE_ATTEMPTS || nowMillis() < s->next_negotiation) return;
+      char code = FRAME_COMMAND;
+      if (write(s->fd, &code, 1) != 1) return;
+      s->negotiations++;
+      s->next_negotiation = nowMillis() + FRAME_NEGOTIATE_MS;
 }
 
 /*
- * Calculates the average of all the recorded temperatures and returns it.
+ * Handles one complete line from an Arduino: either the motion sensor's "tripped"
+ * notice or a temperature reading, which is saved in that sensor's persistent ring.
  */
-double findAverage() {
-      double sum = 0;
-      int count = 0;
-      for (int i = 0; i < 3600; i++) {
-            if (temps[i] > 200.0 || temps[i] < -200.0) continue;
-            sum += temps[i];
-            count++;
+void handleLine(const char* line, int len, void* context){
+      sensor* s = (sensor*) context;
+      if (s->capture != NULL) captureLine(s->capture, capture_start, line, len);
+      counterAdd(&s->serial_lines, 1);
+      s->last_line = wallMillis();
+      //checks to see if the word received is "tripped" notifying us of motion sensor
+      if (len >= 7 && strncmp(line, "tripped", 7) == 0){
+            handleTrip(s, wallMillis());
+            return;
+      }
+      //if not, adds the temp value into the array; garbled lines are dropped
+      int32_t fixed;
+      if (!parseFixedTemp(line, len, &fixed)){
+            counterAdd(&s->parse_errors, 1);
+            return;
       }
-      if (count == 0) return -274.0;
-      return sum / count;
+      negotiateFrames(s);
+      handleReading(s, fixed, wallMillis());
 }
 
 /*
- * Packages a JSON containing max, min and average temperatures and returns it for sending.
- * Returns "No data available." when temperature array is empty of there has been a problem receiving data.
- * Returns "Arudino Error!!!" if the Arudino is currently in an error state (such as when it is disconnected after starting).
+ * Handles one binary frame from an Arduino. The last reading is stamped with the time
+ * the frame arrived and the earlier ones by the board's interval before it. Captures
+ * record the readings as lines, so a replay works the same either way.
  */
-char* packageAvgJSON(){
-      char* latest_temp = (char*) malloc(1000);
-      if (latest_temp == NULL) {
-            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
-            return NULL;
+void handleFrame(const serial_frame* frame, void* context){
+      sensor* s = (sensor*) context;
+      int64_t now = wallMillis();
+      s->last_line = now;
+      int64_t latest = s->ring.timestamps[(s->ring.header->next + TEMP_HISTORY - 1) % TEMP_HISTORY];
+      for (int i = 0; i < frame->count; i++){
+            int32_t fixed = frameFixedTemp(frame->raw[i]);
+            if (s->capture != NULL){
+                  char text[32];
+                  int32_t magnitude = fixed < 0 ? -fixed : fixed;
+                  int len = snprintf(text, sizeof(text), "%s%d.%04d", fixed < 0 ? "-" : "", magnitude / 10000, magnitude % 10000);
+                  captureLine(s->capture, capture_start, text, len);
+            }
+            int64_t when = now - (int64_t) (frame->count - 1 - i) * frame->interval_ms;
+            //arrival jitter must not put a reading before the one stored ahead of it
+            if (when <= latest) when = latest + 1;
+            latest = when;
+            handleReading(s, fixed, when);
       }
-      if (arduinoError){
-            sprintf(latest_temp, "{\n\"name\":\"Arudino Error!!!\"\n}\n");
+      if (frame->flags & FRAME_MOTION){
+            if (s->capture != NULL) captureLine(s->capture, capture_start, "tripped", 7);
+            handleTrip(s, now);
       }
-      else {
-            if (nextTempPointer == 0 ){
-                  if (temps[3599] == -274.0){
-                        sprintf(latest_temp, "{\n\"name\":\"No data available.\"\n}\n");
-                        return latest_temp;
-                  }
+}
+
+/*
+ * Adds a connected sensor's serial descriptor to the ingest epoll set.
+ */
+void watchSensor(int serial_epoll, int index){
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.u32 = index;
+      if (epoll_ctl(serial_epoll, EPOLL_CTL_ADD, sensors[index].fd, &ev) == -1){
+            perror("Epoll");
+            sensorDisconnect(&sensors[index]);
+      }
+}
+
+/*
+ * Runs bytes read from a sensor's device through its line framer or frame decoder.
+ */
+void feedSensor(sensor* s, const char* buf, int bytes_read){
+      sensorClearError(s);
+      counterAdd(&s->serial_bytes, bytes_read);
+      long long dropped = s->framer.dropped;
+      frame_decoder before = s->decoder;
+      frameStreamFeed(&s->decoder, &s->framer, buf, bytes_read, handleFrame, handleLine, s);
+      if (s->framer.dropped != dropped) counterAdd(&s->parse_errors, s->framer.dropped - dropped);
+      counterAdd(&s->frames, s->decoder.frames - before.frames);
+      counterAdd(&s->frames_lost, s->decoder.lost - before.lost);
+      counterAdd(&s->crc_errors, s->decoder.crc_errors - before.crc_errors);
+      //a board that went back to lines was probably reset; ask it to switch again
+      if (s->decoder.fallbacks != before.fallbacks){
+            printf("Arduino %s went back to sending lines.\n", s->id);
+            s->negotiations = 0;
+      }
+}
+
+/*
+ * Drains everything a sensor's device has buffered. Disconnects it on a read error or hangup.
+ */
+void readSensor(int serial_epoll, sensor* s){
+      char buf[SENSOR_READ_SIZE];
+      while (true){
+            int bytes_read = read(s->fd, buf, sizeof(buf));
+            if (bytes_read > 0){
+                  feedSensor(s, buf, bytes_read);
+                  continue;
             }
-            else {
-                  if (temps[nextTempPointer - 1] == -274.0){
-                        sprintf(latest_temp, "{\n\"name\":\"No data available.\"\n}\n");
-                        return latest_temp;
-                  }     
+            if (bytes_read == -1 && errno == EINTR) continue;
+            //a read of 0 means the device hung up (unplugged board, closed pty)
+            if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+                  printf("Lost the connection with Arduino %s.\n", s->id);
+                  epoll_ctl(serial_epoll, EPOLL_CTL_DEL, s->fd, NULL);
+                  sensorDisconnect(s);
             }
-            double max = findMax();
-            double min = findMin();
-            double average = findAverage();
-            printf("%f\n%f\n%f\n\n", max, min, average);
-            if (cOrF == 'F') {
-                  max = max * 9 / 5 + 32;
-                  min = min * 9 / 5 + 32;
-                  average = average * 9 / 5 + 32;
+            return;
+      }
+}
+
+/*
+ * Moves the uplink's epoll registration to what it needs now: replies always, and
+ * writability while the connect is in progress or something is left to send.
+ */
+void uplinkWatch(int serial_epoll){
+      unsigned events = EPOLLIN | (!uplink.connected || bufferPending(&uplink.out) > 0 ? (unsigned) EPOLLOUT : 0);
+      if (events == uplink.events) return;
+      struct epoll_event ev;
+      ev.events = events;
+      ev.data.u32 = REPLICA_TAG_UPLINK;
+      epoll_ctl(serial_epoll, EPOLL_CTL_MOD, uplink.fd, &ev);
+      uplink.events = events;
+}
+
+/*
+ * Drops the connection to the aggregator and schedules the next attempt. Whatever it
+ * had not acknowledged is sent again once it says where to resume.
+ */
+void uplinkClose(int serial_epoll){
+      if (uplink.connected) printf("Lost the connection with the aggregator.\n");
+      epoll_ctl(serial_epoll, EPOLL_CTL_DEL, uplink.fd, NULL);
+      close(uplink.fd);
+      uplink.fd = -1;
+      uplink.connected = false;
+      uplink.next_connect = nowMillis() + REPLICA_RECONNECT_MS;
+}
+
+/*
+ * Starts connecting to the aggregator and queues the hello and the sensor list, which
+ * go out as soon as the connect completes.
+ */
+void uplinkConnect(int serial_epoll){
+      uplink.next_connect = nowMillis() + REPLICA_RECONNECT_MS;
+      int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd == -1) return;
+      if (connect(fd, (struct sockaddr*) &uplink.aggregator, sizeof(uplink.aggregator)) == -1 && errno != EINPROGRESS){
+            close(fd);
+            return;
+      }
+      struct epoll_event ev;
+      ev.events = EPOLLIN | EPOLLOUT;
+      ev.data.u32 = REPLICA_TAG_UPLINK;
+      if (epoll_ctl(serial_epoll, EPOLL_CTL_ADD, fd, &ev) == -1){
+            close(fd);
+            return;
+      }
+      uplink.fd = fd;
+      uplink.events = ev.events;
+      uplink.connected = false;
+      uplink.trip_queued = 0;
+      bufferReset(&uplink.in);
+      bufferReset(&uplink.out);
+      uint8_t hello[6 + REPLICA_SITE_LENGTH];
+      int name_len = strlen(uplink.site);
+      replicaPut32(hello, REPLICA_MAGIC);
+      replicaPut16(hello + 4, REPLICA_VERSION);
+      memcpy(hello + 6, uplink.site, name_len);
+      replicaQueue(&uplink.out, REPLICA_HELLO, hello, 6 + name_len);
+      for (int i = 0; i < sensor_count; i++){
+            //nothing is sent for a sensor until the aggregator says where it got to
+            uplink.resumed[i] = false;
+            if (sensors[i].remote) continue;
+            int id_len = strlen(sensors[i].id);
+            if (!sensorIdSafe(sensors[i].id, id_len)){
+                  printf("Not replicating sensor %s: ids sent to the aggregator may only use letters, digits, '.', '-' and '_'.\n", sensors[i].id);
+                  continue;
             }
-            sprintf(latest_temp, "{\n\"name\":\"H: %.1f L: %.1f AVG: %.1f\"\n}\n", max, min, average);
+            uint8_t announce[1 + SENSOR_ID_LENGTH];
+            announce[0] = i;
+            memcpy(announce + 1, sensors[i].id, id_len);
+            replicaQueue(&uplink.out, REPLICA_SENSOR, announce, 1 + id_len);
       }
-      return latest_temp;
 }
 
 /*
- * Packages a JSON containing the most recent temperature reading and returns it for sending.
- * Returns "No data available." when temperature array is empty of there has been a problem receiving it.
- * Returns "Arudino Error!!!" if the Arudino is currently in an error state (such as when it is disconnected after starting).
+ * Queues a trip event for the aggregator; it is sent again after every reconnect until
+ * acknowledged. The oldest is dropped if too many are waiting.
  */
-char* packageTempJSON(){
-      char* latest_temp = (char*) malloc(1000);
-      if (latest_temp == NULL) {
-            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
-            return NULL;
+void uplinkTrip(sensor* s, int64_t when){
+      if (uplink.trip_count == REPLICA_TRIPS){
+            memmove(uplink.trips, uplink.trips + 1, (REPLICA_TRIPS - 1) * sizeof(replica_trip));
+            uplink.trip_count--;
+            if (uplink.trip_queued > 0) uplink.trip_queued--;
+      }
+      replica_trip* trip = &uplink.trips[uplink.trip_count++];
+      trip->seq = ++uplink.next_trip;
+      trip->sensor = s - sensors;
+      trip->time = when;
+}
+
+/*
+ * Queues the TRIP message for a trip event. Returns false if the send buffer is full.
+ */
+bool uplinkQueueTrip(const replica_trip* trip){
+      uint8_t payload[17];
+      replicaPut64(payload, trip->seq);
+      payload[8] = trip->sensor;
+      replicaPut64(payload + 9, (uint64_t) trip->time);
+      return replicaQueue(&uplink.out, REPLICA_TRIP, payload, sizeof(payload));
+}
+
+/*
+ * Handles one message from the aggregator. Returns false if it makes no sense.
+ */
+bool uplinkMessage(int type, const uint8_t* payload, int len){
+      if (type == REPLICA_TRIP_ACK && len == 8){
+            uint64_t seq = replicaGet64(payload);
+            int done = 0;
+            while (done < uplink.trip_count && uplink.trips[done].seq <= seq) done++;
+            memmove(uplink.trips, uplink.trips + done, (uplink.trip_count - done) * sizeof(replica_trip));
+            uplink.trip_count -= done;
+            uplink.trip_queued = uplink.trip_queued > done ? uplink.trip_queued - done : 0;
+            return true;
       }
-      if (arduinoError){
-            sprintf(latest_temp, "{\n\"name\":\"Arudino Error!!!\"\n}\n");
+      if ((type != REPLICA_RESUME && type != REPLICA_ACK) || len != 9 || payload[0] >= sensor_count) return false;
+      int i = payload[0];
+      uint64_t seq = replicaGet64(payload + 1);
+      if (type == REPLICA_ACK){
+            if (seq > uplink.acked[i] && seq <= uplink.sent[i]) uplink.acked[i] = seq;
+            return true;
       }
-      else if (nextTempPointer == 0) {
-            if (temps[3599] == -274.0){
-                  sprintf(latest_temp, "{\n\"name\":\"No data available.\"\n}\n");
+      //an aggregator ahead of the ring has readings from before the ring file was recreated
+      uplink.restart[i] = seq > sensors[i].ring.header->inserted;
+      uplink.sent[i] = uplink.acked[i] = uplink.restart[i] ? 0 : seq;
+      uplink.resumed[i] = true;
+      return true;
+}
 
+/*
+ * Handles activity on the connection to the aggregator: completes the connect, reads
+ * its replies and sends what is queued.
+ */
+void uplinkEvent(int serial_epoll, uint32_t events){
+      if (!uplink.connected){
+            int error = 0;
+            socklen_t size = sizeof(error);
+            if (getsockopt(uplink.fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1 || error != 0){
+                  uplinkClose(serial_epoll);
+                  return;
             }
-            else{
-                  double convert = temps[3599];
-                  if (cOrF == 'F') {
-                        convert = temps[3599] * 9 / 5 + 32;
+            if (!(events & EPOLLOUT)) return;
+            uplink.connected = true;
+            counterAdd(&metrics_local->replica_connects, 1);
+            printf("Replicating to the aggregator as site %s.\n", uplink.site);
+      }
+      if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+            int room = bufferRoom(&uplink.in);
+            while (room > 0){
+                  int n = recv(uplink.fd, uplink.in.data + uplink.in.len, room, 0);
+                  if (n > 0){
+                        uplink.in.len += n;
+                        room -= n;
+                        continue;
+                  }
+                  if (n == -1 && errno == EINTR) continue;
+                  if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+                        uplinkClose(serial_epoll);
+                        return;
                   }
-                  sprintf(latest_temp, "{\n\"name\":\"%.1f %c\"\n}\n", convert, cOrF);
+                  break;
             }
-      }
-      else {
-            if (temps[nextTempPointer - 1] == -274.0){
-                  //sprintf(latest_temp, "{\n\"name\":\"No data available.\"\n}\n");
-                  sprintf(latest_temp, "{\n\"name\": \"No data available.\"}\n");
-            }
-            else{
-                  double convert = temps[nextTempPointer - 1];
-                  if (cOrF == 'F') {
-                        convert = temps[nextTempPointer - 1] * 9 / 5 + 32;
+            int offset = 0, used, type, len;
+            const uint8_t* payload;
+            while ((used = replicaNext(&uplink.in, offset, &type, &payload, &len)) > 0){
+                  if (!uplinkMessage(type, payload, len)){
+                        used = -1;
+                        break;
                   }
-                  sprintf(latest_temp, "{\n\"name\":\"%.1f %c\"\n}\n", convert, cOrF);
+                  offset += used;
+            }
+            if (used == -1){
+                  printf("The aggregator sent something unexpected.\n");
+                  uplinkClose(serial_epoll);
+                  return;
             }
+            replicaConsume(&uplink.in, offset);
+      }
+      if (!replicaFlush(uplink.fd, &uplink.out)){
+            uplinkClose(serial_epoll);
+            return;
       }
-      return latest_temp;
+      uplinkWatch(serial_epoll);
 }
 
 /*
- * Sends the most recent temperature reading to the Pebble in JSON format.
+ * Sends the aggregator what it has not had yet: each sensor's new readings, in batches
+ * once REPLICA_BATCH_SAMPLES are waiting or the oldest has waited REPLICA_BATCH_MS, and
+ * the queued trip events. A sensor with REPLICA_WINDOW readings unacknowledged, or a full
+ * send buffer, holds the rest back until the aggregator catches up.
  */
-void mostRecentTemp(int fd2){
-      pthread_mutex_lock(&lock);
-      char* latest_temp = packageTempJSON();
-      pthread_mutex_unlock(&lock);
-      //send the package JSON if it's not NULL
-      if (!(latest_temp == NULL)){
-            int completion_value = send(fd2, latest_temp, strlen(latest_temp), 0);
-            if (completion_value < 0){
-                  printf("Server failed to send message.");
+void uplinkPump(int serial_epoll){
+      if (uplink.fd == -1){
+            if (nowMillis() >= uplink.next_connect) uplinkConnect(serial_epoll);
+            return;
+      }
+      if (!uplink.connected) return;
+      int64_t now = wallMillis();
+      for (int i = 0; i < sensor_count; i++){
+            if (!uplink.resumed[i]) continue;
+            temp_ring* ring = &sensors[i].ring;
+            uint64_t inserted = ring->header->inserted;
+            //readings the ring wrapped over before they were sent are gone
+            uint64_t oldest = inserted > TEMP_HISTORY ? inserted - TEMP_HISTORY + 1 : 1;
+            if (uplink.sent[i] + 1 < oldest){
+                  counterAdd(&metrics_local->replica_gaps, oldest - 1 - uplink.sent[i]);
+                  uplink.sent[i] = uplink.acked[i] = oldest - 1;
             }
-            free(latest_temp);
+            while (inserted > uplink.sent[i] && uplink.sent[i] - uplink.acked[i] < REPLICA_WINDOW){
+                  uint64_t waiting = inserted - uplink.sent[i];
+                  int64_t first_time = ring->timestamps[ringSlot(ring, uplink.sent[i] + 1)];
+                  if (waiting < REPLICA_BATCH_SAMPLES && first_time <= now && now - first_time < REPLICA_BATCH_MS) break;
+                  uint64_t count = waiting < REPLICA_BATCH_SAMPLES ? waiting : REPLICA_BATCH_SAMPLES;
+                  uint64_t window = REPLICA_WINDOW - (uplink.sent[i] - uplink.acked[i]);
+                  if (count > window) count = window;
+                  int before = bufferPending(&uplink.out);
+                  int queued = replicaQueueBatch(&uplink.out, ring, i, uplink.restart[i] ? REPLICA_RESTART : 0, uplink.sent[i] + 1, count);
+                  if (queued == 0) break;
+                  uplink.sent[i] += queued;
+                  uplink.restart[i] = false;
+                  counterAdd(&metrics_local->replica_batches, 1);
+                  counterAdd(&metrics_local->replica_readings, queued);
+                  counterAdd(&metrics_local->replica_bytes, bufferPending(&uplink.out) - before);
+            }
+      }
+      while (uplink.trip_queued < uplink.trip_count && uplinkQueueTrip(&uplink.trips[uplink.trip_queued])) uplink.trip_queued++;
+      if (!replicaFlush(uplink.fd, &uplink.out)){
+            uplinkClose(serial_epoll);
+            return;
       }
+      uplinkWatch(serial_epoll);
 }
 
 /*
- * Tells the Arduino to change the display from c to F or vice versa. 
- * Sends the most recent temperature reading in the new style to the Pebble in JSON format.
- * (Does not change the format of temperatures being transmitted Arduino->Server, just processes differently for display on both sides.)
+ * Finds or registers the sensor standing for an edge sensor on this aggregator, named
+ * "<site>.<id>". Returns NULL if a local sensor has that name, it does not fit, the
+ * registry is full or its history cannot be opened.
  */
-void changeSign(int fd2){
-      if (celciusCount % 3 == 0){
-            write(fd, "f", 1);
-            if (cOrF == 'c')
-                  cOrF = 'F';
-            else 
-                  cOrF = 'c';
-            //send temp in new format
-            pthread_mutex_lock(&lock);
-            char* latest_temp = packageTempJSON();
-            pthread_mutex_unlock(&lock);
-            //send packaged JSON if not NULL
-            if (!(latest_temp == NULL)){
-                  int completion_value = send(fd2, latest_temp, strlen(latest_temp), 0);
-                  if (completion_value < 0){
-                        printf("Server failed to send message.");
-                  }
-                  free(latest_temp);
-            }
+sensor* remoteSensor(const replica_site* site, const char* id, int id_len){
+      char name[SENSOR_ID_LENGTH];
+      if (snprintf(name, sizeof(name), "%s.%.*s", site->name, id_len, id) >= (int) sizeof(name)) return NULL;
+      sensor* s = findSensor(name);
+      if (s != NULL) return s->remote ? s : NULL;
+      s = sensorPrepare(name, "");
+      if (s == NULL) return NULL;
+      s->remote = true;
+      if (!sensorOpenHistory(s, history_dir)) return NULL;
+      s->last_line = wallMillis();
+      //the request handlers only see the sensor once it is complete
+      sensor_count++;
+      printf("Added sensor %s from site %s.\n", name, site->name);
+      return s;
+}
+
+/*
+ * Moves a site's epoll registration to what it needs now. It stops reading while its
+ * receive buffer is full, which only happens while its replies cannot be sent.
+ */
+void siteWatch(int serial_epoll, replica_site* site){
+      unsigned events = (site->in.len < REPLICA_BUFFER ? (unsigned) EPOLLIN : 0) | (bufferPending(&site->out) > 0 ? (unsigned) EPOLLOUT : 0);
+      if (events == site->events) return;
+      struct epoll_event ev;
+      ev.events = events;
+      ev.data.u32 = REPLICA_TAG_SITE + (site - sites);
+      epoll_ctl(serial_epoll, EPOLL_CTL_MOD, site->fd, &ev);
+      site->events = events;
+}
+
+/*
+ * Drops a site's connection and flags its sensors, which stay registered for when it
+ * comes back.
+ */
+void siteClose(int serial_epoll, replica_site* site){
+      if (site->name[0] != '\0'){
+            printf("Lost the connection with site %s.\n", site->name);
+            replica_sites--;
+      }
+      for (int i = 0; i < MAX_SENSORS; i++){
+            if (site->local[i] != -1) sensorFlagError(&sensors[site->local[i]]);
       }
-      celciusCount += 1;
+      epoll_ctl(serial_epoll, EPOLL_CTL_DEL, site->fd, NULL);
+      close(site->fd);
+      site->fd = -1;
 }
 
 /*
- *Tells the Arduino to go into or come out of standby mode.
+ * Takes in every edge server waiting on the replication socket.
  */
-void toggleStandby(int fd2){
-      //*Note - UP button on Pebble sends request 3 times - mod processes once per click
-      if (standbyCount % 3 == 0){
-            //tell the Arduino to enter/leave standby
-            write(fd, "s", 1);  
-            //malloc space for a string and check that space was available
-            char* message = (char*) malloc(1000);
-            if (message == NULL) {
-                  printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+void siteAccept(int serial_epoll){
+      while (true){
+            int fd = accept4(replica_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1){
+                  if (errno == EINTR || errno == ECONNABORTED) continue;
                   return;
             }
-            //toggle standbyActive and fill string with appropriate message
-            standbyActive = !standbyActive;
-            if (standbyActive){
-                  sprintf(message, "{\n\"name\":\"Standby engaged.\"\n}\n");
+            replica_site* site = NULL;
+            for (int k = 0; k < REPLICA_MAX_SITES && site == NULL; k++){
+                  if (sites[k].fd == -1) site = &sites[k];
             }
-            else {
-                  sprintf(message, "{\n\"name\":\"Standby disengaged.\"\n}\n");    
-            } 
-            //send message to Pebble and check that it sent
-            int completion_value = send(fd2, message, strlen(message), 0);
-            if (completion_value < 0){
-                  printf("Server failed to send message.");
+            if (site == NULL){
+                  printf("Turned away an edge server: at most %d sites are supported.\n", REPLICA_MAX_SITES);
+                  close(fd);
+                  continue;
             }
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u32 = REPLICA_TAG_SITE + (site - sites);
+            if (epoll_ctl(serial_epoll, EPOLL_CTL_ADD, fd, &ev) == -1){
+                  close(fd);
+                  continue;
+            }
+            site->fd = fd;
+            site->events = ev.events;
+            site->name[0] = '\0';
+            for (int i = 0; i < MAX_SENSORS; i++) site->local[i] = -1;
+            bufferReset(&site->in);
+            bufferReset(&site->out);
       }
-      standbyCount++;
 }
 
+//where the batch being applied has got to
+typedef struct ReplicaApply replica_apply;
+struct ReplicaApply {
+  sensor* s;
+  uint64_t seq;                     // sequence number of the next reading
+  bool restart;                     // take the edge's numbering before the first reading
+};
+
 /*
- * Sends the max, min and average temperature readings to the Pebble in JSON format.
+ * Stores one replicated reading unless the sensor already has it.
  */
-void highLowAverage(int fd2){
-      pthread_mutex_lock(&lock);
-      char* latest_temp = packageAvgJSON();
-      pthread_mutex_unlock(&lock);
-      //send packaged JSON if not NULL
-      if (!(latest_temp == NULL)){
-            int completion_value = send(fd2, latest_temp, strlen(latest_temp), 0);
-            if (completion_value < 0){
-                  printf("Server failed to send message.");
-            }
-            free(latest_temp);
+void applyReplicated(int64_t time, double value, void* context){
+      replica_apply* apply = (replica_apply*) context;
+      ring_header* header = apply->s->ring.header;
+      if (apply->restart){
+            header->replicated = apply->seq - 1;
+            apply->restart = false;
       }
+      if (apply->seq > header->replicated){
+            handleReading(apply->s, lround(value * 10000), time);
+            header->replicated = apply->seq;
+            counterAdd(&metrics_local->replica_applied, 1);
+      }
+      else counterAdd(&metrics_local->replica_duplicates, 1);
+      apply->seq++;
 }
 
 /*
- * Checks to see if the motion sensor has been trip. Sends message to Pebble in JSON format indicating T/F.
+ * Handles one message from an edge server. Returns false if it makes no sense.
  */
-void checkTripped(int fd2){  
-      char* message = (char*) malloc(1000);
-      if (message == NULL) {
-            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
-            return;
+bool siteMessage(replica_site* site, int type, const uint8_t* payload, int len){
+      if (type == REPLICA_HELLO){
+            if (site->name[0] != '\0' || len < 6 || replicaGet32(payload) != REPLICA_MAGIC || replicaGet16(payload + 4) != REPLICA_VERSION
+                || !replicaSiteName((const char*) payload + 6, len - 6)) return false;
+            memcpy(site->name, payload + 6, len - 6);
+            site->name[len - 6] = '\0';
+            replica_sites++;
+            printf("Site %s connected.\n", site->name);
+            return true;
       }
-      if (tripped){
-            sprintf(message, "{\n\"name\":\"tripped\"\n}\n");    
+      //everything else comes after the hello
+      if (site->name[0] == '\0') return false;
+      if (type == REPLICA_SENSOR){
+            if (len < 2 || payload[0] >= MAX_SENSORS || !sensorIdSafe((const char*) payload + 1, len - 1)) return false;
+            sensor* s = remoteSensor(site, (const char*) payload + 1, len - 1);
+            if (s == NULL){
+                  printf("Couldn't add sensor %.*s from site %s.\n", len - 1, (const char*) payload + 1, site->name);
+                  return false;
+            }
+            site->local[payload[0]] = s - sensors;
+            sensorClearError(s);
+            cacheBump(&s->generation);
+            return replicaQueueSeq(&site->out, REPLICA_RESUME, payload[0], s->ring.header->replicated);
       }
-      else {
-            sprintf(message, "{\n\"name\":\"nottripped\"\n}\n"); 
+      if (type == REPLICA_BATCH){
+            if (len < REPLICA_BATCH_HEADER || payload[0] >= MAX_SENSORS || site->local[payload[0]] == -1) return false;
+            replica_apply apply;
+            apply.s = &sensors[site->local[payload[0]]];
+            apply.seq = replicaGet64(payload + 2);
+            apply.restart = payload[1] & REPLICA_RESTART;
+            int index, flags;
+            uint64_t first;
+            if (replicaDecodeBatch(payload, len, &index, &flags, &first, applyReplicated, &apply) == -1) return false;
+            apply.s->last_line = wallMillis();
+            return replicaQueueSeq(&site->out, REPLICA_ACK, index, apply.s->ring.header->replicated);
       }
-      int completion_value = send(fd2, message, strlen(message), 0);
-      if (completion_value < 0){
-            printf("Server failed to send message.");
+      if (type == REPLICA_TRIP){
+            if (len != 17 || payload[8] >= MAX_SENSORS || site->local[payload[8]] == -1) return false;
+            handleTrip(&sensors[site->local[payload[8]]], (int64_t) replicaGet64(payload + 9));
+            return replicaQueue(&site->out, REPLICA_TRIP_ACK, payload, 8);
       }
-      free(message);
+      return false;
 }
 
 /*
- * Asks the Arduino to display the warning message on the 7-Seg.
+ * Handles activity on an edge server's connection: sends queued replies, reads once
+ * and applies every complete message whose reply has room. Messages left over wait
+ * for the replies to drain, so an edge that outpaces this server is slowed down by
+ * its own acknowledgements.
  */
-void requestMessage(int fd2){
-      write(fd, "m", 1);
-      char* message = (char*) malloc(1000);
-      if (message == NULL) {
-            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+void siteEvent(int serial_epoll, replica_site* site, uint32_t events){
+      if (!replicaFlush(site->fd, &site->out)){
+            siteClose(serial_epoll, site);
+            return;
+      }
+      if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && site->in.len < REPLICA_BUFFER){
+            int n = recv(site->fd, site->in.data + site->in.len, REPLICA_BUFFER - site->in.len, 0);
+            if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+                  siteClose(serial_epoll, site);
+                  return;
+            }
+            if (n > 0) site->in.len += n;
+      }
+      int offset = 0, used = 0, type, len;
+      const uint8_t* payload;
+      while (bufferRoom(&site->out) >= REPLICA_HEADER_LENGTH + 9 && (used = replicaNext(&site->in, offset, &type, &payload, &len)) > 0){
+            if (!siteMessage(site, type, payload, len)){
+                  used = -1;
+                  break;
+            }
+            offset += used;
+      }
+      if (used == -1){
+            printf("Dropped site %s: it sent something unexpected.\n", site->name[0] != '\0' ? site->name : "(unnamed)");
+            siteClose(serial_epoll, site);
             return;
       }
-      sprintf(message, "{\n\"name\":\"Message Sent\"\n}\n"); 
-      int completion_value = send(fd2, message, strlen(message), 0);
-      if (completion_value < 0){
-            printf("Server failed to send message.");
+      replicaConsume(&site->in, offset);
+      if (!replicaFlush(site->fd, &site->out)){
+            siteClose(serial_epoll, site);
+            return;
       }
-      free(message);
+      siteWatch(serial_epoll, site);
 }
 
 /*
- * Sets var tripped back to false in both the server and the Arduino.
+ * Handles activity on a replication socket, by its ingest epoll tag.
  */
-void resetAlarm(int fd2){
-      tripped = false;
-      write(fd, "r", 1);
-      char* message = (char*) malloc(1000);
-      if (message == NULL) {
-            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
-            return;
-      }
-      sprintf(message, "{\n\"name\":\"Alarm Reset\"\n}\n"); 
-      int completion_value = send(fd2, message, strlen(message), 0);
-      if (completion_value < 0){
-            printf("Server failed to send message.");
+void replicaEvent(int serial_epoll, uint32_t tag, uint32_t events){
+      if (tag == REPLICA_TAG_UPLINK){
+            if (uplink.fd != -1) uplinkEvent(serial_epoll, events);
       }
-      free(message);
+      else if (tag == REPLICA_TAG_LISTEN) siteAccept(serial_epoll);
+      else if (sites[tag - REPLICA_TAG_SITE].fd != -1) siteEvent(serial_epoll, &sites[tag - REPLICA_TAG_SITE], events);
 }
 
 /*
-Configures server and loops, processing connections 1 by 1 until quit_signal is received
-*/
-void* server_thread(void* p){
-//Server config implementation
-      //get info regarding server config details from Main method
-      server_info* info = (server_info*)p;
-      int PORT_NUMBER = info->port_num;
-      // structs to represent the server and client
-      struct sockaddr_in server_addr,client_addr;
-      int sock; // socket descriptor
-      // 1. socket: creates a socket descriptor that you later use to make other system calls
-      if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-      perror("Socket");
-      exit(1);
-      }
-      int temp;
-      if (setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&temp,sizeof(int)) == -1) {
-      perror("Setsockopt");
-      exit(1);
-      }
-      // configure the server
-      server_addr.sin_port = htons(PORT_NUMBER); // specify port number
-      server_addr.sin_family = AF_INET;
-      server_addr.sin_addr.s_addr = INADDR_ANY;
-      bzero(&(server_addr.sin_zero),8);
-      // 2. bind: use the socket and associate it with the port number
-      if (bind(sock, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
-      perror("Unable to bind");
-      exit(1);
+ * Waits up to timeout_ms on the ingest epoll set and handles what is ready: sensor
+ * devices, replication sockets and the command eventfd. Returns true if commands were queued.
+ */
+bool pollIngest(int serial_epoll, int timeout_ms){
+      struct epoll_event events[REPLICA_TAG_SITE + REPLICA_MAX_SITES];
+      bool commands_ready = false;
+      int ready = epoll_wait(serial_epoll, events, REPLICA_TAG_SITE + REPLICA_MAX_SITES, timeout_ms);
+      for (int i = 0; i < ready; i++){
+            uint32_t tag = events[i].data.u32;
+            if (tag == MAX_SENSORS) commands_ready = true;
+            else if (tag > MAX_SENSORS) replicaEvent(serial_epoll, tag, events[i].events);
+            else if (sensors[tag].fd != -1) readSensor(serial_epoll, &sensors[tag]);
       }
-      // 3. listen: indicates that we want to listen to the port to which we bound; second arg is number of allowed connections
-      if (listen(sock, 1) == -1) {
-      perror("Listen");
-      exit(1);
+      return commands_ready;
+}
+
+/*
+ * Queues the next read of sensor index on the ingest ring, into its slice of the registered
+ * buffer when registration worked.
+ */
+void ringReadSensor(uring* ring, int index, bool fixed){
+      char* buf = sensor_reads[index];
+      if (fixed) uringReadFixed(ring, sensors[index].fd, buf, SENSOR_READ_SIZE, 0, index);
+      else uringRead(ring, sensors[index].fd, buf, SENSOR_READ_SIZE, index);
+}
+
+/*
+ * Waits up to timeout_ms on the ingest ring, feeds every sensor read that completed and
+ * queues each sensor's next read, all submitted together by the next wait. Disconnects
+ * a sensor on a read error or hangup. The replication sockets stay on serial_epoll,
+ * which the ring polls as one more operation. Returns true if commands were queued.
+ */
+bool ringIngest(uring* ring, int serial_epoll, bool fixed, int timeout_ms){
+      bool commands_ready = false;
+      if (!uringSubmit(ring, 1, timeout_ms)) return false;
+      struct io_uring_cqe cqe;
+      while (uringNext(ring, &cqe)){
+            int index = cqe.user_data;
+            if (index == MAX_SENSORS){
+                  commands_ready = true;
+                  uringPoll(ring, commands.event_fd, POLLIN, MAX_SENSORS);
+                  continue;
+            }
+            if (index == MAX_SENSORS + 1){
+                  pollIngest(serial_epoll, 0);
+                  uringPoll(ring, serial_epoll, POLLIN, MAX_SENSORS + 1);
+                  continue;
+            }
+            sensor* s = &sensors[index];
+            if (s->fd == -1) continue;
+            if (cqe.res > 0) feedSensor(s, sensor_reads[index], cqe.res);
+            //a read of 0 means the device hung up (unplugged board, closed pty)
+            if (cqe.res > 0 || cqe.res == -EINTR || cqe.res == -EAGAIN){
+                  ringReadSensor(ring, index, fixed);
+                  continue;
+            }
+            printf("Lost the connection with Arduino %s.\n", s->id);
+            sensorDisconnect(s);
       }
-      // once you get here, the server is set up and about to start listening
-      printf("\nServer configured to listen on port %d\n", PORT_NUMBER);
-      fflush(stdout);
+      return commands_ready;
+}
 
-//Request Processing
-      //loops, waiting for requests until quit_signal is activated
-      while (quit_signal == 0){
-            // 4. accept: wait here until we get a connection on that port
-            int sin_size = sizeof(struct sockaddr_in);
-            int fd2 = accept(sock, (struct sockaddr *)&client_addr,(socklen_t *)&sin_size);
-            printf("Server got a connection from (%s, %d)\n", inet_ntoa(client_addr.sin_addr),ntohs(client_addr.sin_port));
+/*
+ * Writes pending commands to their Arduinos and returns how many are still pending.
+ * A command for a board that cannot take it right now is retried until it expires.
+ */
+int writeCommands(arduino_command* pending, int count){
+      long long now = nowMillis();
+      long long now_ns = metricsNanos();
+      int kept = 0;
+      for (int i = 0; i < count; i++){
+            arduino_command* command = &pending[i];
+            sensor* s = &sensors[command->sensor];
+            int fd = s->fd;
+            if (fd != -1 && write(fd, &command->code, 1) == 1){
+                  counterAdd(&metrics_local->commands_sent, 1);
+                  histogramRecord(&metrics_local->command_write_latency, now_ns - command->queued_ns);
+                  //standby is the one command whose effect shows up in the serial stream
+                  if (command->code == 's' && s->standby_sent == 0){
+                        s->standby_sent = command->queued_ns;
+                        s->standby_expected = s->stats.latest != NO_READING;
+                  }
+                  continue;
+            }
+            if (now - command->queued >= COMMAND_EXPIRY_MS){
+                  counterAdd(&metrics_local->commands_expired, 1);
+                  continue;
+            }
+            pending[kept++] = *command;
+      }
+      return kept;
+}
 
-            // buffer to read data into
-            char request[1024];
-            // 5. recv: read incoming request message into buffer
-            int bytes_received = recv(fd2,request,1024,0);
-            request[bytes_received] = '\0';
-            printf("%s\n", request);
-            //this is a request for the most recent temperature 
-            switch (request[5]){
-                  case 'a':
-                        changeSign(fd2);
-                        break;
-                  case 'b':
-                        mostRecentTemp(fd2);
-                        break;
-                  case 'd':
-                        highLowAverage(fd2); 
-                        break;
-                  case 'm':
-                        requestMessage(fd2);
-                        break;
-                  case 'r':
-                        resetAlarm(fd2);
-                        break;
-                  case 's':
-                        toggleStandby(fd2);
-                        break;
-                  case 't':
-                        checkTripped(fd2);
-                        printf("%s\n\n", "in t");
-                        break;
-            }  
-            close(fd2);
+/*
+ * Gives up on standby commands the board has not acted on in time.
+ */
+void expireConfirmations(){
+      long long now = metricsNanos();
+      for (int i = 0; i < sensor_count; i++){
+            if (sensors[i].standby_sent != 0 && now - sensors[i].standby_sent >= COMMAND_CONFIRM_MS * 1000000LL){
+                  counterAdd(&metrics_local->commands_unconfirmed, 1);
+                  sensors[i].standby_sent = 0;
+            }
       }
-      // 7. close: close the socket connection
-      close(sock);
-      printf("Server closed connection\n");
-      return 0;
 }
 
 /*
-Waits for input from user. If input is Q or q, updates quit_signal.
-*/
-void* input_thread (void* p){
-      //reads input into char array to avoid errors if extra keys are hit accidentally
-      char user_input[100];
-      while (user_input[0] != 'q' && user_input[0] != 'Q'){
-            scanf("%s", user_input);      
+ * Compacts one sensor's archive. Runs on the executor.
+ */
+void compactSensor(void* p){
+      sensor* s = (sensor*) p;
+      if (quit_signal == 0) archiveCompact(&s->history, wallMillis());
+      s->compacting = false;
+}
+
+/*
+ * Queues a compaction of every sensor's archive that is not still being compacted,
+ * one job per sensor so they spread over the workers.
+ */
+void scheduleCompaction(){
+      for (int i = 0; i < sensor_count; i++){
+            sensor* s = &sensors[i];
+            if (s->compacting.exchange(true)) continue;
+            //a full executor just means this round is skipped for the sensor
+            if (!executorSubmit(&pool, compactSensor, s)) s->compacting = false;
       }
-      quit_signal = 1;
-      return NULL;
 }
 
 /*
- *Reads temp from Arduino and saves values in array.
+ *Reads temps from every Arduino through one epoll loop and saves values in each sensor's persistent ring.
  */
 void* storeData(void* p) {
-      //setup new array of temps
-      for (int i = 0; i < 3600; i++) {
-            pthread_mutex_lock(&lock);
-            temps[i] = -274.0;
-            pthread_mutex_unlock(&lock);
-      }
-      //for tracking where to insert next
-      pthread_mutex_lock(&lock);
-      nextTempPointer = 0;
-      pthread_mutex_unlock(&lock);
-      
-      char string[1000];
+      //the rings were attached in main, so new readings extend the stored history
+      metricsRegisterThread(METRICS_INGEST);
+      int serial_epoll = epoll_create1(EPOLL_CLOEXEC);
+      if (serial_epoll == -1){
+            perror("Epoll");
+            return NULL;
+      }
+      //with -u 1 every device read is a ring operation instead, kept in flight per sensor
+      uring ring;
+      bool on_ring = use_uring && uringInit(&ring, INGEST_RING_ENTRIES);
+      bool fixed = false;
+      if (use_uring && !on_ring) printf("\nio_uring is not available, reading the Arduinos from epoll.\n");
+      if (on_ring){
+            struct iovec buffers = { sensor_reads, (size_t) sensor_count * SENSOR_READ_SIZE };
+            fixed = sensor_count > 0 && uringRegisterBuffers(&ring, &buffers, 1);
+            uringPoll(&ring, commands.event_fd, POLLIN, MAX_SENSORS);
+            if (replicating || replica_listen != -1) uringPoll(&ring, serial_epoll, POLLIN, MAX_SENSORS + 1);
+      }
+      for (int i = 0; i < sensor_count; i++){
+            if (sensors[i].fd == -1) continue;
+            if (on_ring) ringReadSensor(&ring, i, fixed);
+            else watchSensor(serial_epoll, i);
+      }
+      //commands from the request handlers arrive through an eventfd, tagged past the last sensor
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.u32 = MAX_SENSORS;
+      if (!on_ring) epoll_ctl(serial_epoll, EPOLL_CTL_ADD, commands.event_fd, &ev);
+      if (replica_listen != -1){
+            ev.data.u32 = REPLICA_TAG_LISTEN;
+            epoll_ctl(serial_epoll, EPOLL_CTL_ADD, replica_listen, &ev);
+      }
+      arduino_command pending[COMMAND_QUEUE_SIZE];
+      int pending_count = 0;
+      long long next_reconnect = nowMillis() + SENSOR_RECONNECT_MS;
+      long long next_silence_check = nowMillis() + 1000;
+      long long next_compaction = nowMillis() + ARCHIVE_COMPACT_INTERVAL_MS;
+      //silent rules count from startup for boards that never send anything
+      for (int i = 0; i < sensor_count; i++) sensors[i].last_line = wallMillis();
       while(quit_signal == 0){
-            char buf[1000];
-            int bytes_read = read(fd, buf, 1000);
-            if (bytes_read == -1)
-                  arduinoError = true;
-            else
-                  arduinoError = false;
-            int i;
-            for(i = 0; i < bytes_read; i++){
-                  if (buf[i] == '\n'){
-                        char null = '\0';
-                        //appends null character to complete working string
-                        strcat(string, &null);
-                        //checks to see if the word received is "tripped" notifying us of motion sensor
-                        if (strncmp(string, "tripped", 7) == 0){
-                              tripped = true;
-                              printf("%s\n\n", "trip noticed");
-                        }
-                        //if not, adds the temp value into the array
-                        else { 
-                              pthread_mutex_lock(&lock);
-                              temps[nextTempPointer] = atof(string);
-                              nextTempPointer += 1;
-                              pthread_mutex_unlock(&lock);
+            //a tty that could not take a command is retried soon, not after a full second
+            int timeout = pending_count > 0 ? 10 : 1000;
+            //a batch that is not full goes out once its oldest reading has waited long enough
+            if (replicating && timeout > REPLICA_BATCH_MS) timeout = REPLICA_BATCH_MS;
+            bool commands_ready = false;
+            if (on_ring) commands_ready = ringIngest(&ring, serial_epoll, fixed, timeout);
+            else commands_ready = pollIngest(serial_epoll, timeout);
+            if (replicating) uplinkPump(serial_epoll);
+            if (commands_ready){
+                  //make room by giving up on the oldest command rather than spinning on a full backlog
+                  if (pending_count == COMMAND_QUEUE_SIZE){
+                        memmove(pending, pending + 1, (COMMAND_QUEUE_SIZE - 1) * sizeof(arduino_command));
+                        pending_count--;
+                        counterAdd(&metrics_local->commands_expired, 1);
+                  }
+                  pending_count += commandDrain(&commands, pending + pending_count, COMMAND_QUEUE_SIZE - pending_count);
+            }
+            if (pending_count > 0) pending_count = writeCommands(pending, pending_count);
+            expireConfirmations();
+            if (nowMillis() >= next_silence_check){
+                  checkSilence(wallMillis());
+                  next_silence_check = nowMillis() + 1000;
+            }
+            if (nowMillis() >= next_compaction){
+                  scheduleCompaction();
+                  next_compaction = nowMillis() + ARCHIVE_COMPACT_INTERVAL_MS;
+            }
+            //periodically retry devices that were unplugged or never opened
+            if (nowMillis() >= next_reconnect){
+                  for (int i = 0; i < sensor_count; i++){
+                        if (sensors[i].fd == -1 && !sensors[i].remote && sensorConnect(&sensors[i])){
+                              printf("Reconnected to Arduino %s.\n", sensors[i].id);
+                              if (on_ring) ringReadSensor(&ring, i, fixed);
+                              else watchSensor(serial_epoll, i);
                         }
-                        //clear working string to begin again
-                        string[0] = null;
-                        continue;   
                   }
-                  //simply adds individual character to string while '\n' has not been encountered
-                  char this_char = buf[i];
-                  strncat(string, &this_char, 1);     
+                  next_reconnect = nowMillis() + SENSOR_RECONNECT_MS;
+            }
+      }
+      if (on_ring) uringClose(&ring);
+      if (uplink.fd != -1) close(uplink.fd);
+      for (int k = 0; k < REPLICA_MAX_SITES; k++){
+            if (sites[k].fd != -1) close(sites[k].fd);
+      }
+      close(serial_epoll);
+      return NULL;
+}
+
+/*
+ * Compiles one line of the rules file into rule and copies the sensor it names (or "*")
+ * into sensor_id. Durations are written as for /h (90s, 30m, 24h, 7d). Returns false
+ * if the line is not a rule, or its name could not go into event JSON as is.
+ */
+bool parseRule(const char* line, alert_rule* rule, char* sensor_id, int size){
+      char name[64], target[64], kind[16], arg1[32], word[16], arg2[32];
+      int fields = sscanf(line, "%63s %63s %15s %31s %15s %31s", name, target, kind, arg1, word, arg2);
+      if (fields < 3 || !alertName(name) || strlen(target) >= (size_t) size) return false;
+      memset(rule, 0, sizeof(alert_rule));
+      snprintf(rule->name, sizeof(rule->name), "%s", name);
+      snprintf(sensor_id, size, "%s", target);
+      char* end;
+      if (strcmp(kind, "above") == 0 || strcmp(kind, "below") == 0){
+            rule->kind = kind[0] == 'a' ? ALERT_ABOVE : ALERT_BELOW;
+            if (fields != 4 && !(fields == 6 && strcmp(word, "for") == 0)) return false;
+            rule->limit = strtod(arg1, &end);
+            if (fields == 6) rule->window = parseDuration(arg2) * 1000;
+            return *end == '\0' && (fields == 4 || rule->window > 0);
+      }
+      if (strcmp(kind, "rise") == 0 || strcmp(kind, "fall") == 0){
+            rule->kind = kind[0] == 'r' ? ALERT_RISE : ALERT_FALL;
+            if (fields != 6 || strcmp(word, "within") != 0) return false;
+            rule->limit = strtod(arg1, &end);
+            rule->window = parseDuration(arg2) * 1000;
+            return *end == '\0' && rule->limit > 0 && rule->window > 0;
+      }
+      if (strcmp(kind, "silent") == 0){
+            rule->kind = ALERT_SILENT;
+            rule->window = fields == 4 ? parseDuration(arg1) * 1000 : 0;
+            return rule->window > 0;
+      }
+      if (strcmp(kind, "motion") == 0){
+            rule->kind = ALERT_MOTION;
+            return fields == 3;
+      }
+      return false;
+}
+
+/*
+ * Reads the rules file at path and attaches each rule to the sensors it names.
+ * Blank lines and lines starting with # are skipped. Returns false on the first bad line.
+ */
+bool loadRules(const char* path){
+      FILE* file = fopen(path, "r");
+      if (file == NULL){
+            perror("Rules file");
+            return false;
+      }
+      char line[256];
+      int number = 0, compiled = 0;
+      bool ok = true;
+      while (ok && fgets(line, sizeof(line), file) != NULL){
+            number++;
+            char* text = line + strspn(line, " \t");
+            if (text[0] == '#' || text[0] == '\n' || text[0] == '\0') continue;
+            alert_rule rule;
+            char target[SENSOR_ID_LENGTH];
+            if (!parseRule(text, &rule, target, sizeof(target))){
+                  printf("\nRules file %s, line %d: can't parse \"%.*s\".\n", path, number, (int) strcspn(text, "\n"), text);
+                  ok = false;
+                  break;
             }
-        }
-        return NULL;
+            bool matched = false;
+            for (int i = 0; i < sensor_count && ok; i++){
+                  if (strcmp(target, "*") != 0 && strcmp(target, sensors[i].id) != 0) continue;
+                  ok = sensorAddRule(&sensors[i], &rule);
+                  matched = true;
+                  compiled++;
+            }
+            if (!matched){
+                  printf("\nRules file %s, line %d: no sensor named %s.\n", path, number, target);
+                  ok = false;
+            }
+      }
+      fclose(file);
+      if (ok) printf("Loaded %d alert rules from %s.\n", compiled, path);
+      return ok;
 }
 
 /*
@@ -474,9 +2466,10 @@ void* storeData(void* p) {
 int main(int argc, char *argv[])
 {
 //setting up server	
-      // check the number of arguments
-	if (argc != 2){
+      // check the number of arguments: port, then optional flags
+	if (argc < 2 || argc % 2 != 0){
 		printf("\nPlease enter the proper number of arguments when executing.\n");
+		printf("Usage: %s <port> [-d device[=id]]... [-s id[=lines_per_sec]]... [-p id=capture[@speed]]... [-r ring_dir] [-c capture_dir] [-a rules_file] [-j workers] [-b 0|1] [-u 0|1] [-R host:port [-n site]] [-A port]\n", argv[0]);
 		exit(0);
 	}
       //package the arguments into a server_info struct and pass to server thread
@@ -484,24 +2477,172 @@ int main(int argc, char *argv[])
       if (start_info == NULL)
             printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
       start_info->port_num = atoi(argv[1]);
+      start_info->ring_dir = ".";
+      const char* capture_dir = NULL;
+      const char* rules_path = NULL;
+      int aggregator_port = 0;
+      uplink.fd = -1;
+      for (int k = 0; k < REPLICA_MAX_SITES; k++) sites[k].fd = -1;
+      //an edge is known to the aggregator by its host name unless -n says otherwise
+      char host[256] = "";
+      gethostname(host, sizeof(host) - 1);
+      for (int k = 0; host[k] != '\0' && k < REPLICA_SITE_LENGTH - 1; k++){
+            uplink.site[k] = replicaSiteName(&host[k], 1) ? host[k] : '-';
+      }
+      if (uplink.site[0] == '\0') snprintf(uplink.site, sizeof(uplink.site), "edge");
+      for (int i = 2; i < argc; i += 2){
+            if (strcmp(argv[i], "-r") == 0)
+                  start_info->ring_dir = argv[i + 1];
+            else if (strcmp(argv[i], "-c") == 0)
+                  capture_dir = argv[i + 1];
+            else if (strcmp(argv[i], "-a") == 0)
+                  rules_path = argv[i + 1];
+            else if (strcmp(argv[i], "-j") == 0)
+                  worker_count = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-b") == 0)
+                  binary_frames = atoi(argv[i + 1]) != 0;
+            else if (strcmp(argv[i], "-u") == 0)
+                  use_uring = atoi(argv[i + 1]) != 0;
+            else if (strcmp(argv[i], "-A") == 0)
+                  aggregator_port = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-n") == 0){
+                  if (!replicaSiteName(argv[i + 1], strlen(argv[i + 1]))){
+                        printf("\nSite name \"%s\" must be 1 to %d letters, digits, '-' or '_'.\n", argv[i + 1], REPLICA_SITE_LENGTH - 1);
+                        exit(0);
+                  }
+                  snprintf(uplink.site, sizeof(uplink.site), "%s", argv[i + 1]);
+            }
+            else if (strcmp(argv[i], "-R") == 0){
+                  //edge mode: replicate readings and trips to the aggregator at host:port
+                  char address[256];
+                  snprintf(address, sizeof(address), "%s", argv[i + 1]);
+                  char* port = strrchr(address, ':');
+                  if (port != NULL) *port++ = '\0';
+                  struct addrinfo hints, *found = NULL;
+                  memset(&hints, 0, sizeof(hints));
+                  hints.ai_family = AF_INET;
+                  hints.ai_socktype = SOCK_STREAM;
+                  if (port == NULL || getaddrinfo(address, port, &hints, &found) != 0){
+                        printf("\nCouldn't resolve aggregator address %s; use host:port.\n", argv[i + 1]);
+                        exit(0);
+                  }
+                  memcpy(&uplink.aggregator, found->ai_addr, sizeof(uplink.aggregator));
+                  freeaddrinfo(found);
+                  replicating = true;
+            }
+            else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-p") == 0){
+                  //simulated Arduino: -s id[=lines per second] synthesizes, -p id=capture[@speed] replays
+                  char spec[512];
+                  snprintf(spec, sizeof(spec), "%s", argv[i + 1]);
+                  char* arg = strchr(spec, '=');
+                  if (arg != NULL) *arg++ = '\0';
+                  //each simulator becomes a sensor, so both tables must have room
+                  if (simulator_count >= MAX_SENSORS || sensor_count >= MAX_SENSORS){
+                        printf("\nCouldn't start simulated sensor \"%s\": at most %d sensors are supported.\n", spec, MAX_SENSORS);
+                        exit(0);
+                  }
+                  simulator* sim = &simulators[simulator_count];
+                  bool opened;
+                  if (argv[i][1] == 's'){
+                        opened = simSynthetic(sim, arg != NULL ? atof(arg) : 1, simulator_count + 1);
+                  }
+                  else {
+                        char* speed = arg != NULL ? strrchr(arg, '@') : NULL;
+                        if (speed != NULL) *speed++ = '\0';
+                        opened = arg != NULL && simReplay(sim, arg, speed != NULL ? atof(speed) : 1);
+                  }
+                  if (!opened || spec[0] == '\0' || (sensor_count > 0 && findSensor(spec) != NULL)){
+                        printf("\nCouldn't start simulated sensor \"%s\".\n", spec);
+                        exit(0);
+                  }
+                  simulator_count++;
+                  if (sensorAdd(spec, sim->device_path) == NULL){
+                        printf("\nCouldn't add sensor %s: at most %d sensors with ids under %d characters are supported.\n", spec, MAX_SENSORS, SENSOR_ID_LENGTH);
+                        exit(0);
+                  }
+            }
+            else if (strcmp(argv[i], "-d") == 0){
+                  //device path, optionally followed by =id; the id defaults to the device name
+                  char device[256];
+                  snprintf(device, sizeof(device), "%s", argv[i + 1]);
+                  char* id = strchr(device, '=');
+                  if (id != NULL) *id++ = '\0';
+                  else id = strrchr(device, '/') ? strrchr(device, '/') + 1 : device;
+                  if (id[0] == '\0' || (sensor_count > 0 && findSensor(id) != NULL)){
+                        printf("\nSensor id \"%s\" is empty or used twice.\n", id);
+                        exit(0);
+                  }
+                  if (sensorAdd(id, device) == NULL){
+                        printf("\nCouldn't add sensor %s: at most %d sensors with ids under %d characters are supported.\n", id, MAX_SENSORS, SENSOR_ID_LENGTH);
+                        exit(0);
+                  }
+            }
+            else {
+                  printf("\nUnknown option %s\n", argv[i]);
+                  exit(0);
+            }
+      }
+      //an aggregator may have no boards of its own, only the sensors its sites replicate
+      if (sensor_count == 0 && aggregator_port == 0) sensorAdd("cu.usbmodem1451", DEFAULT_DEVICE);
+      history_dir = start_info->ring_dir;
+      if (rules_path != NULL && !loadRules(rules_path)) return 0;
+
+//record every sensor's raw serial stream for later replay with -p
+      capture_start = simMillis();
+      for (int i = 0; capture_dir != NULL && i < sensor_count; i++){
+            sensors[i].capture = captureOpen(capture_dir, sensors[i].id);
+            if (sensors[i].capture == NULL) return 0;
+      }
+
+//reattach each sensor's stored temperature history so the first request is answered from it
+      for (int i = 0; i < sensor_count; i++){
+            if (!sensorOpenHistory(&sensors[i], start_info->ring_dir)) return 0;
+      }
 
-//setting up arudino connection
-      pthread_mutex_init(&lock, NULL);
+//journal trips, resets, standby, unit changes, messages and Arduino errors from here on
+      if (!journalOpen(&event_journal, start_info->ring_dir) || !journalStart(&event_journal)) return 0;
 
-      //establish connection w/Arduino
-      fd = open("/dev/cu.usbmodem1451", O_RDWR);
-      if(fd == -1){ // couldn't open
+//setting up arudino connections
+      //establish connection w/every Arduino; ones that are missing are retried by storeData
+      int connected = 0;
+      for (int i = 0; i < sensor_count; i++){
+            if (sensorConnect(&sensors[i])) connected++;
+            else printf("Couldn't establish a connection with Arduino %s (%s).\n", sensors[i].id, sensors[i].device_path);
+      }
+      if (connected == 0 && aggregator_port == 0){ // couldn't open any
         printf("Couldn't establish a connection with Arduino.\n");
         return 0;
       }
 
-      //configure connection
-      struct termios options;
-      tcgetattr(fd, &options);
-      cfsetispeed(&options, 9600); //how fast to receive
-      cfsetospeed(&options, 9600); //how fast to send
-      tcsetattr(fd, TCSANOW, &options);
-
+      if (!notifyInit(&notifications) || !commandInit(&commands)) return 0;
+      finished_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (finished_fd == -1){
+            perror("Eventfd");
+            return 0;
+      }
+      if (!executorStart(&pool, worker_count > 0 ? worker_count : executorDefaultWorkers(), METRICS_WORKER)){
+            printf("Couldn't start the worker threads.\n");
+            return 0;
+      }
+      printf("Running request handlers and compaction on %d worker threads.\n", pool.workers);
+      if (aggregator_port > 0){
+            //edge servers connect here; storeData takes them in alongside the boards
+            replica_listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            struct sockaddr_in address;
+            memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = INADDR_ANY;
+            address.sin_port = htons(aggregator_port);
+            int reuse = 1;
+            setsockopt(replica_listen, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (replica_listen == -1 || bind(replica_listen, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(replica_listen, REPLICA_MAX_SITES) == -1){
+                  perror("Replication socket");
+                  return 0;
+            }
+            printf("Aggregating readings from edge servers on port %d.\n", aggregator_port);
+      }
+      if (replicating) printf("Replicating to %s:%d as site %s.\n", inet_ntoa(uplink.aggregator.sin_addr), ntohs(uplink.aggregator.sin_port), uplink.site);
+      for (int i = 0; i < simulator_count; i++) simStart(&simulators[i]);
 
 //create and join threads
       pthread_t thread1, thread2, thread3;
@@ -513,12 +2654,31 @@ int main(int argc, char *argv[])
       pthread_join(thread1, NULL);
       pthread_join(thread2, NULL);
       pthread_join(thread3, NULL);
+      //nothing submits any more; let queued jobs finish, then drop replies nobody will send
+      executorStop(&pool);
+      while (finished_jobs != NULL){
+            request_job* next = finished_jobs->next;
+            free(finished_jobs->reply.response);
+            free(finished_jobs);
+            finished_jobs = next;
+      }
+      close(finished_fd);
+      //write out the last events; the shutdown below is not journaled as Arduino errors
+      journalStop(&event_journal);
+      if (replica_listen != -1) close(replica_listen);
 
 //TERMINATION
       //free the server_info package once server has terminated execution
       free(start_info);
       //close
-      close(fd);
+      for (int i = 0; i < sensor_count; i++){
+            sensorDisconnect(&sensors[i]);
+            ringClose(&sensors[i].ring);
+            archiveClose(&sensors[i].history);
+            if (sensors[i].capture != NULL) fclose(sensors[i].capture);
+            free(sensors[i].rules);
+      }
+      for (int i = 0; i < simulator_count; i++) simStop(&simulators[i]);
       return 1;
 
 }
@@ -0,0 +1,1455 @@
+/*
+ * WatchDogBench
+ * Benchmarks for the WatchDog server, built separately from the server itself:
+ *     g++ -O2 -o WatchDogBench WatchDogBench.cpp -lpthread
+ * Modes:
+ *     parse [lines]    serial line framing/parsing throughput, old strncat+atof loop vs line_framer
+ *     frames [readings]
+ *                      decode rate of binary serial frames against the same readings sent as
+ *                      lines; one frame in 50 has a byte flipped and one in 70 never arrives,
+ *                      and every frame the decoder accepts is checked against what was sent
+ *     stress [seconds] [readers]
+ *                      ingest and request-side readers at full speed against the lock-free
+ *                      stats/rollup snapshots; every snapshot is checked against a recount
+ *     quantiles [readings]
+ *                      rollup sketch insert rate and the rank error of p50/p95/p99 over the
+ *                      whole range against the exact quantiles of the same readings
+ *     columns [samples]
+ *                      min/max/sum/count over a column of samples: the old three branchy passes
+ *                      over doubles with -274.0 sentinels against the fused int16 + validity
+ *                      bitmap pass, scalar and each vector width the CPU has; every pass is
+ *                      checked against the others on random subranges too
+ *     archive [readings] [restart_every]
+ *                      append/compact/scan throughput and bytes per reading of the compressed
+ *                      archive, reopening it every restart_every readings; every reading is
+ *                      checked on the way back out
+ *     replica [readings]
+ *                      the edge-to-aggregator replication path: readings go into a ring, out as
+ *                      batch messages and back through the aggregator's decoder, with one
+ *                      connection dropped halfway and resumed from the last acknowledgement;
+ *                      every reading is checked to arrive once, in order and unchanged
+ *     journal [events] [threads]
+ *                      event journal group commit: threads post bursts of events while the writer
+ *                      batches them into fdatasyncs, against one fdatasync per event; every record
+ *                      is then paged back by time and by type and checked
+ *     executor [tasks]
+ *                      throughput of the work-stealing executor at 1, 2, 4, ... workers up to the
+ *                      core count; half the tasks are spawned from inside other tasks so workers
+ *                      have to steal them, and every task is checked to have run exactly once
+ *     http [-p port] [-t seconds] [-c clients] [-T threads] [-r requests_per_sec] [-u routes]
+ *          [-k 0|1] [-s server_binary] [-S sim_lines_per_sec] [-U 0|1] [-j]
+ *                      HTTP load against a running server, or one started with -s and fed by
+ *                      a simulated sensor at -S lines/sec. Closed loop by default; -r switches to
+ *                      an open loop at that total rate, with latency measured from each request's
+ *                      scheduled time. -u picks the routes to cycle through (default "bdt"),
+ *                      -k 0 opens a new connection per request, -U 1 starts the server on its
+ *                      io_uring backend and -j prints JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <atomic>
+#include "line_framer.h"
+#include "serial_frame.h"
+#include "temp_stats.h"
+#include "sample_column.h"
+#include "rollup.h"
+#include "archive.h"
+#include "executor.h"
+#include "replica.h"
+
+/*
+ * Returns a monotonic timestamp in seconds.
+ */
+double benchSeconds() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Fills a buffer with n lines in the Arduino's serial format and returns its length.
+ */
+int buildSerialStream(char* stream, int n) {
+      int len = 0;
+      for (int i = 0; i < n; i++) {
+            if (i % 97 == 13) len += sprintf(stream + len, "tripped\n");
+            else if (i % 211 == 5) len += sprintf(stream + len, "-274.0\n");
+            else len += sprintf(stream + len, "%d.%d\n", 18 + i % 9, (i % 16) * 625);
+      }
+      return len;
+}
+
+double legacy_sum;
+long long legacy_lines;
+
+/*
+ * The serial loop as storeData originally ran it: one strncat per character and atof per line.
+ */
+void legacyParse(const char* stream, int len) {
+      char string[1000];
+      string[0] = '\0';
+      for (int offset = 0; offset < len; offset += 1000) {
+            const char* buf = stream + offset;
+            int bytes_read = len - offset < 1000 ? len - offset : 1000;
+            for (int i = 0; i < bytes_read; i++) {
+                  if (buf[i] == '\n') {
+                        char null = '\0';
+                        strcat(string, &null);
+                        if (strncmp(string, "tripped", 7) != 0) legacy_sum += atof(string);
+                        legacy_lines++;
+                        string[0] = null;
+                        continue;
+                  }
+                  char this_char = buf[i];
+                  strncat(string, &this_char, 1);
+            }
+      }
+}
+
+long long framed_sum;
+
+void benchLine(const char* line, int len, void* context) {
+      (void) context;
+      int32_t fixed;
+      if (len >= 7 && strncmp(line, "tripped", 7) == 0) return;
+      if (parseFixedTemp(line, len, &fixed)) framed_sum += fixed;
+}
+
+/*
+ * The serial loop as storeData runs it now, fed the same 1000-byte reads.
+ */
+void framedParse(const char* stream, int len, line_framer* framer) {
+      for (int offset = 0; offset < len; offset += 1000) {
+            int bytes_read = len - offset < 1000 ? len - offset : 1000;
+            framerFeed(framer, stream + offset, bytes_read, benchLine, NULL);
+      }
+}
+
+/*
+ * Compares lines/sec of the old and new serial parsing paths.
+ */
+int benchParse(int n) {
+      char* stream = (char*) malloc((size_t) n * 16 + 1);
+      if (stream == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return 1;
+      }
+      int len = buildSerialStream(stream, n);
+      double start = benchSeconds();
+      legacyParse(stream, len);
+      double legacy = benchSeconds() - start;
+      line_framer framer;
+      framerInit(&framer);
+      start = benchSeconds();
+      framedParse(stream, len, &framer);
+      double framed = benchSeconds() - start;
+      printf("lines: %d (%d bytes)\n", n, len);
+      printf("strncat+atof:  %12.0f lines/sec\n", legacy_lines / legacy);
+      printf("line_framer:   %12.0f lines/sec (%.1fx)\n", framer.lines / framed, legacy / framed);
+      printf("checksums: %.4f %.4f\n", legacy_sum, framed_sum / 10000.0);
+      free(stream);
+      return 0;
+}
+
+#define BENCH_FRAME_CORRUPT 50
+#define BENCH_FRAME_DROP 70
+
+serial_frame* frames_sent;
+int frames_total;
+int frames_cursor;                  // index of the last frame matched
+long long frames_delivered;
+long long frames_mismatched;
+long long frames_corrupt_accepted;
+long long frames_lines;
+
+bool frameCorrupted(int f) {
+      return f % BENCH_FRAME_CORRUPT == 17;
+}
+
+bool frameDropped(int f) {
+      return f % BENCH_FRAME_DROP == BENCH_FRAME_DROP - 1;
+}
+
+/*
+ * Matches a decoded frame to the next sent frame with its sequence number and compares them.
+ */
+void benchFrame(const serial_frame* frame, void* context) {
+      (void) context;
+      frames_delivered++;
+      int f = frames_cursor + 1;
+      while (f < frames_total && f - frames_cursor < 8 && frames_sent[f].seq != frame->seq) f++;
+      if (f == frames_total || frames_sent[f].seq != frame->seq) {
+            frames_mismatched++;
+            return;
+      }
+      frames_cursor = f;
+      const serial_frame* sent = &frames_sent[f];
+      if (frameCorrupted(f)) frames_corrupt_accepted++;
+      if (frame->count != sent->count || frame->flags != sent->flags || frame->device_ms != sent->device_ms
+          || frame->interval_ms != sent->interval_ms || memcmp(frame->raw, sent->raw, sent->count * sizeof(int16_t)) != 0) {
+            frames_mismatched++;
+      }
+      for (int i = 0; i < frame->count; i++) framed_sum += frameFixedTemp(frame->raw[i]);
+}
+
+void benchFrameLine(const char* line, int len, void* context) {
+      (void) line;
+      (void) len;
+      (void) context;
+      frames_lines++;
+}
+
+/*
+ * Sends n readings as full frames after a couple of lines (the board before it switches),
+ * damages and drops some frames on the way, and checks what the decoder makes of them.
+ */
+int benchFrames(int n) {
+      frames_total = n / FRAME_MAX_SAMPLES;
+      n = frames_total * FRAME_MAX_SAMPLES;
+      frames_sent = (serial_frame*) malloc(frames_total * sizeof(serial_frame));
+      uint8_t* stream = (uint8_t*) malloc((size_t) frames_total * FRAME_MAX_LENGTH + 64);
+      char* lines = (char*) malloc((size_t) n * 16 + 1);
+      if (frames_sent == NULL || stream == NULL || lines == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return 1;
+      }
+      int len = sprintf((char*) stream, "21.4375\n21.5\n");
+      long long corrupted = 0, dropped = 0;
+      for (int f = 0; f < frames_total; f++) {
+            serial_frame* frame = &frames_sent[f];
+            frame->flags = f % 97 == 13 ? FRAME_MOTION : 0;
+            frame->count = FRAME_MAX_SAMPLES;
+            frame->seq = (uint16_t) f;
+            frame->device_ms = 5000u + (uint32_t) f * 1000u;
+            frame->interval_ms = 1000 / FRAME_MAX_SAMPLES;
+            for (int i = 0; i < FRAME_MAX_SAMPLES; i++) {
+                  int k = f * FRAME_MAX_SAMPLES + i;
+                  frame->raw[i] = k % 211 == 5 ? FRAME_NO_READING : (int16_t) ((18 + k % 9) * 16 + k % 16);
+            }
+            if (frameDropped(f)) {
+                  dropped++;
+                  continue;
+            }
+            int frame_len = frameEncode(frame, stream + len);
+            if (frameCorrupted(f)) {
+                  stream[len + 2 + (f * 7) % (frame_len - 2)] ^= 0x10;
+                  corrupted++;
+            }
+            len += frame_len;
+      }
+      frame_decoder decoder;
+      decoderInit(&decoder);
+      frames_cursor = -1;
+      line_framer framer;
+      framerInit(&framer);
+      framed_sum = 0;
+      double start = benchSeconds();
+      for (int offset = 0; offset < len; offset += 1000) {
+            int bytes_read = len - offset < 1000 ? len - offset : 1000;
+            frameStreamFeed(&decoder, &framer, (const char*) stream + offset, bytes_read, benchFrame, benchFrameLine, NULL);
+      }
+      double decode = benchSeconds() - start;
+      //the same readings as lines, through the line path storeData used before
+      int text_len = buildSerialStream(lines, n);
+      framerInit(&framer);
+      start = benchSeconds();
+      framedParse(lines, text_len, &framer);
+      double parse = benchSeconds() - start;
+
+      long long sent = frames_total - dropped;
+      //a damaged length byte can swallow the frame after it as well
+      bool enough = frames_delivered >= sent - 2 * corrupted;
+      bool accounted = decoder.lost == frames_cursor + 1 - frames_delivered;
+      printf("frames: %d of %d readings (%d bytes, %.2f bytes/reading; lines take %.2f)\n", frames_total,
+             FRAME_MAX_SAMPLES, len, (double) len / n, (double) text_len / n);
+      printf("delivered %lld of %lld sent, %lld damaged: %lld CRC errors, %lld counted lost, %lld lines before the switch\n",
+             frames_delivered, sent, corrupted, decoder.crc_errors, decoder.lost, frames_lines);
+      printf("frames:        %12.0f readings/sec\n", frames_delivered * FRAME_MAX_SAMPLES / decode);
+      printf("lines:         %12.0f readings/sec\n", framer.lines / parse);
+      printf("mismatched frames: %lld, damaged frames accepted: %lld\n", frames_mismatched, frames_corrupt_accepted);
+      free(frames_sent);
+      free(stream);
+      free(lines);
+      bool ok = frames_mismatched == 0 && frames_corrupt_accepted == 0 && enough && accounted && frames_lines == 2 && decoder.fallbacks == 0;
+      return ok ? 0 : 1;
+}
+
+temp_stats stress_stats;
+published_stats stress_published;
+rollup_store stress_rollups;
+double stress_ring[TEMP_HISTORY];
+std::atomic<bool> stress_done(false);
+std::atomic<long long> stress_failures(0);
+
+/*
+ * The reading the stress writer inserts as its seq-th sample; every 37th is "no reading".
+ */
+double stressValue(long long seq) {
+      if (seq % 37 == 36) return NO_READING;
+      return ((seq * 7919) % 1601 - 800) / 16.0;
+}
+
+/*
+ * Ingest side: inserts readings as fast as possible, one simulated second apart.
+ */
+void* stressWriter(void* p) {
+      long long* inserted = (long long*) p;
+      long long seq = 0;
+      while (!stress_done.load(std::memory_order_relaxed)) {
+            double value = stressValue(seq);
+            int slot = seq % TEMP_HISTORY;
+            statsInsert(&stress_stats, stress_ring[slot], value);
+            stress_ring[slot] = value;
+            rollupInsert(&stress_rollups, 1000000 + seq, value);
+            statsPublish(&stress_published, &stress_stats);
+            seq++;
+      }
+      *inserted = seq;
+      return NULL;
+}
+
+/*
+ * Request side: reads snapshots and recomputes what they must contain from the insert count.
+ */
+void* stressReader(void* p) {
+      long long* reads = (long long*) p;
+      long long last_rollup_count = 0;
+      while (!stress_done.load(std::memory_order_relaxed)) {
+            temp_summary summary;
+            statsRead(&stress_published, &summary);
+            long long n = summary.inserted;
+            long long first = n > TEMP_HISTORY ? n - TEMP_HISTORY : 0;
+            long long sum = 0;
+            int count = 0;
+            double max = -1e9, min = 1e9;
+            for (long long seq = first; seq < n; seq++) {
+                  double value = stressValue(seq);
+                  if (!validReading(value)) continue;
+                  sum += llround(value * 10000.0);
+                  count++;
+                  if (value > max) max = value;
+                  if (value < min) min = value;
+            }
+            bool ok = summary.count == count && (n == 0 || summary.latest == stressValue(n - 1));
+            if (count > 0) ok = ok && summary.max == max && summary.min == min
+                                  && summary.average == sum / 10000.0 / count;
+            rollup_result result;
+            rollupQuery(&stress_rollups, 0, 1LL << 40, &result);
+            if (result.count > 0) ok = ok && result.min <= result.average && result.average <= result.max
+                                        && result.min >= -50.0 && result.max <= 50.0;
+            ok = ok && result.count >= last_rollup_count;
+            last_rollup_count = result.count;
+            if (!ok) stress_failures++;
+            (*reads)++;
+      }
+      return NULL;
+}
+
+/*
+ * Runs one writer and several readers for the given time and reports throughput and failures.
+ */
+int benchStress(int seconds, int readers) {
+      statsInit(&stress_stats);
+      seqlockInit(&stress_published.lock);
+      statsPublish(&stress_published, &stress_stats);
+      if (!rollupInit(&stress_rollups)) return 1;
+      for (int i = 0; i < TEMP_HISTORY; i++) stress_ring[i] = NO_READING;
+      long long inserted = 0;
+      long long* reads = (long long*) calloc(readers, sizeof(long long));
+      pthread_t writer;
+      pthread_t* threads = (pthread_t*) calloc(readers, sizeof(pthread_t));
+      if (reads == NULL || threads == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return 1;
+      }
+      pthread_create(&writer, NULL, &stressWriter, &inserted);
+      for (int i = 0; i < readers; i++) pthread_create(&threads[i], NULL, &stressReader, &reads[i]);
+      struct timespec duration = { seconds, 0 };
+      nanosleep(&duration, NULL);
+      stress_done = true;
+      pthread_join(writer, NULL);
+      long long total_reads = 0;
+      for (int i = 0; i < readers; i++) {
+            pthread_join(threads[i], NULL);
+            total_reads += reads[i];
+      }
+      printf("inserts: %12.0f /sec\n", (double) inserted / seconds);
+      printf("reads:   %12.0f /sec across %d readers\n", (double) total_reads / seconds, readers);
+      printf("inconsistent snapshots: %lld\n", stress_failures.load());
+      free(reads);
+      free(threads);
+      return stress_failures.load() == 0 ? 0 : 1;
+}
+
+int compareDoubles(const void* a, const void* b) {
+      double x = *(const double*) a, y = *(const double*) b;
+      return x < y ? -1 : x > y;
+}
+
+/*
+ * Feeds a skewed, noisy series through the rollups and compares the percentiles merged
+ * from their sketches with the exact ones. Fails if any rank error exceeds 1%.
+ */
+int benchQuantiles(int n) {
+      double* values = (double*) malloc(n * sizeof(double));
+      rollup_store* store = (rollup_store*) calloc(1, sizeof(rollup_store));
+      if (values == NULL || store == NULL || !rollupInit(store)) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return 1;
+      }
+      srand(42);
+      for (int i = 0; i < n; i++) {
+            //daily swing plus sensor noise rounded to the DS18B20's 1/16 degree, with rare spikes
+            double noise = (rand() % 1000) / 1000.0 - 0.5;
+            double spike = rand() % 500 == 0 ? 15 : 0;
+            values[i] = round((20 + 4 * sin(i * 2 * M_PI / 86400) + noise + spike) * 16) / 16;
+      }
+      double start = benchSeconds();
+      for (int i = 0; i < n; i++) rollupInsert(store, 1000000000LL + i, values[i]);
+      double insert = benchSeconds() - start;
+      quantile_summary summary;
+      start = benchSeconds();
+      rollupQuantiles(store, 0, 1LL << 40, &summary);
+      double query = benchSeconds() - start;
+      qsort(values, n, sizeof(double), compareDoubles);
+      const double quantiles[3] = { 0.5, 0.95, 0.99 };
+      double worst = 0;
+      for (int q = 0; q < 3; q++) {
+            double estimate = summaryQuantile(&summary, quantiles[q]);
+            //rank error: how far the estimate's rank range is from the target rank
+            int below = 0;
+            while (below < n && values[below] < estimate) below++;
+            int through = below;
+            while (through < n && values[through] <= estimate) through++;
+            double target = quantiles[q] * n;
+            double error = target < below ? below - target : target > through ? target - through : 0;
+            if (error / n > worst) worst = error / n;
+            printf("p%-4g exact %8.4f  sketch %8.4f  rank error %.4f%%\n", quantiles[q] * 100,
+                   values[(int) (quantiles[q] * (n - 1))], estimate, 100.0 * error / n);
+      }
+      printf("inserts: %12.0f /sec\n", n / insert);
+      printf("query:   %12.1f us over %lld readings in %d centroids\n", query * 1e6, summary.total, summary.n);
+      free(values);
+      return worst <= 0.01 && summary.total == n ? 0 : 1;
+}
+
+/*
+ * The old findMax/findMin/findAverage, one pass each over doubles with in-band sentinels.
+ */
+void legacyAggregate(const double* temps, int n, double* max, double* min, double* average) {
+      *max = -300.0;
+      for (int i = 0; i < n; i++) {
+            if (temps[i] > 200.0) continue;
+            if (temps[i] > *max) *max = temps[i];
+      }
+      *min = 500.0;
+      for (int i = 0; i < n; i++) {
+            if (temps[i] < -200.0) continue;
+            if (temps[i] < *min) *min = temps[i];
+      }
+      double sum = 0;
+      int count = 0;
+      for (int i = 0; i < n; i++) {
+            if (temps[i] < -200.0 || temps[i] > 200.0) continue;
+            sum += temps[i];
+            count++;
+      }
+      *average = count > 0 ? sum / count : NO_READING;
+}
+
+bool aggregatesEqual(const column_aggregate* a, const column_aggregate* b) {
+      return a->count == b->count && a->sum == b->sum && (a->count == 0 || (a->min == b->min && a->max == b->max));
+}
+
+/*
+ * Times each aggregation pass over n samples, about one in 37 of them missing, and checks
+ * the passes agree with each other and with the old scan. Fails on any disagreement.
+ */
+int benchColumns(int n) {
+      double* temps = (double*) malloc(n * sizeof(double));
+      int16_t* values = (int16_t*) malloc(n * sizeof(int16_t));
+      uint64_t* valid = (uint64_t*) calloc(SAMPLE_BITMAP_WORDS(n), sizeof(uint64_t));
+      if (temps == NULL || values == NULL || valid == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return 1;
+      }
+      srand(42);
+      for (int i = 0; i < n; i++) {
+            temps[i] = rand() % 37 == 0 ? NO_READING : ((rand() % 2401) - 1200) / 16.0;
+            sampleStore(values, valid, i, temps[i]);
+      }
+      struct { const char* name; column_kernel kernel; } passes[3];
+      int pass_count = 0;
+      passes[pass_count].name = "scalar";
+      passes[pass_count++].kernel = columnAggregateScalar;
+#ifdef SAMPLE_COLUMN_X86
+      passes[pass_count].name = "sse2";
+      passes[pass_count++].kernel = columnAggregateSse2;
+      if (__builtin_cpu_supports("avx2")) {
+            passes[pass_count].name = "avx2";
+            passes[pass_count++].kernel = columnAggregateAvx2;
+      }
+#endif
+      const char* chosen;
+      columnKernel(&chosen);
+      int rounds = 200000000 / n + 1;
+      int mismatches = 0;
+      //the old scan, as the baseline the others are checked and timed against
+      double max = 0, min = 0, average = 0, checksum = 0;
+      double start = benchSeconds();
+      for (int r = 0; r < rounds; r++) {
+            legacyAggregate(temps, n, &max, &min, &average);
+            checksum += max;
+      }
+      double legacy = benchSeconds() - start;
+      printf("doubles, 3 passes: %12.0f samples/sec  (8 bytes/sample)\n", (double) n * rounds / legacy);
+      column_aggregate reference;
+      aggregateInit(&reference);
+      columnAggregateScalar(values, valid, 0, n, &reference);
+      if (reference.count > 0 && (reference.max / 16.0 != max || reference.min / 16.0 != min
+                                  || fabs(reference.sum / 16.0 / reference.count - average) > 1e-9)) mismatches++;
+      for (int p = 0; p < pass_count; p++) {
+            column_aggregate agg;
+            start = benchSeconds();
+            for (int r = 0; r < rounds; r++) {
+                  aggregateInit(&agg);
+                  passes[p].kernel(values, valid, 0, n, &agg);
+                  checksum += agg.max;
+            }
+            double elapsed = benchSeconds() - start;
+            if (!aggregatesEqual(&agg, &reference)) mismatches++;
+            printf("int16 %-6s fused: %12.0f samples/sec  (%.3f bytes/sample)%s\n", passes[p].name, (double) n * rounds / elapsed,
+                   2 + 1 / 8.0, strcmp(passes[p].name, chosen) == 0 ? "  <- picked at runtime" : "");
+      }
+      //ragged edges: every pass over random subranges, checked against the scalar one
+      for (int t = 0; t < 10000; t++) {
+            int from = rand() % n;
+            int to = from + rand() % (n - from + 1);
+            column_aggregate expected;
+            aggregateInit(&expected);
+            columnAggregateScalar(values, valid, from, to, &expected);
+            for (int p = 1; p < pass_count; p++) {
+                  column_aggregate agg;
+                  aggregateInit(&agg);
+                  passes[p].kernel(values, valid, from, to, &agg);
+                  if (!aggregatesEqual(&agg, &expected)) mismatches++;
+            }
+      }
+      printf("mismatches: %d (checksum %.0f)\n", mismatches, checksum);
+      free(temps);
+      free(values);
+      free(valid);
+      return mismatches == 0 ? 0 : 1;
+}
+
+int64_t* archive_times;
+double* archive_values;
+long long archive_seen;
+long long archive_mismatches;
+
+/*
+ * A reading shaped like a slowly drifting thermistor sampled at about 1 Hz.
+ */
+void archiveReading(long long i, int64_t* time, double* value) {
+      *time = 1700000000000LL + i * 1000 + (i * 7) % 5;
+      *value = 20.0 + ((i / 60) % 40) * 0.0625 + (i % 3 == 0 ? 0.0625 : 0);
+}
+
+void archiveCheck(int64_t time, double value, void* context) {
+      (void) context;
+      long long i = archive_seen++;
+      if (archive_times[i] != time || archive_values[i] != value) archive_mismatches++;
+}
+
+/*
+ * Measures the archive's append, compaction and scan rates and its bytes per reading.
+ */
+int benchArchive(long long n, long long restart_every) {
+      char dir[] = "/tmp/watchdog-archive-XXXXXX";
+      archive_times = (int64_t*) malloc(n * sizeof(int64_t));
+      archive_values = (double*) malloc(n * sizeof(double));
+      archive* history = (archive*) calloc(1, sizeof(archive));
+      if (archive_times == NULL || archive_values == NULL || history == NULL || mkdtemp(dir) == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return 1;
+      }
+      for (long long i = 0; i < n; i++) archiveReading(i, &archive_times[i], &archive_values[i]);
+      if (!archiveOpen(history, dir, "bench")) return 1;
+      double start = benchSeconds();
+      for (long long i = 0; i < n; i++) {
+            archiveAppend(history, archive_times[i], archive_values[i]);
+            //a server restart closes the segment with a partial block
+            if (restart_every > 0 && (i + 1) % restart_every == 0 && i + 1 < n) {
+                  archiveClose(history);
+                  if (!archiveOpen(history, dir, "bench")) return 1;
+            }
+      }
+      archiveClose(history);
+      double append = benchSeconds() - start;
+      if (!archiveOpen(history, dir, "bench")) return 1;
+      int segments = history->count;
+      start = benchSeconds();
+      archiveCompact(history, archive_times[n - 1]);
+      double compact = benchSeconds() - start;
+      long long bytes = 0;
+      for (int i = 0; i < history->count; i++) bytes += history->segments[i].size;
+      start = benchSeconds();
+      long long visited = archiveScan(history, INT64_MIN, INT64_MAX, archiveCheck, NULL);
+      double scan = benchSeconds() - start;
+      //a narrow query should decode just the blocks around it
+      archive_seen = n / 2;
+      long long narrow = archiveScan(history, archive_times[n / 2], archive_times[n / 2] + 60000, archiveCheck, NULL);
+      printf("appends: %12.0f /sec\n", n / append);
+      printf("scan:    %12.0f readings/sec\n", visited / scan);
+      printf("compact: %d segments -> %d in %.3f sec\n", segments, history->count, compact);
+      printf("size:    %12.2f bytes/reading (ring: %d)\n", (double) bytes / n, (int) (sizeof(double) + sizeof(int64_t)));
+      printf("readings back: %lld of %lld, narrow query: %lld, mismatches: %lld\n", visited, n, narrow, archive_mismatches);
+      for (int i = history->count - 1; i >= 0; i--) archiveRemove(history, i);
+      archiveClose(history);
+      rmdir(dir);
+      bool ok = visited == n && narrow == 60 && archive_mismatches == 0;
+      free(archive_times);
+      free(archive_values);
+      free(history);
+      return ok ? 0 : 1;
+}
+
+uint64_t replica_applied;                   // what the simulated aggregator's ring header would hold
+long long replica_duplicates;
+long long replica_mismatches;
+uint64_t replica_next_seq;
+
+/*
+ * The aggregator's side of a batch: applies readings it has not had, checking each one.
+ */
+void replicaCheck(int64_t time, double value, void* context) {
+      (void) context;
+      uint64_t seq = replica_next_seq++;
+      if (seq <= replica_applied) {
+            replica_duplicates++;
+            return;
+      }
+      int64_t expected_time;
+      double expected;
+      archiveReading(seq - 1, &expected_time, &expected);
+      if ((seq - 1) % 97 == 0) expected = NO_READING;
+      if (seq != replica_applied + 1 || time != expected_time || value != expected) replica_mismatches++;
+      replica_applied = seq;
+}
+
+/*
+ * Hands everything queued to the aggregator and decodes it there. Returns the batches decoded.
+ */
+int replicaDeliver(replica_buffer* out, replica_buffer* in) {
+      memcpy(in->data + in->len, out->data + out->sent, bufferPending(out));
+      in->len += bufferPending(out);
+      bufferReset(out);
+      int offset = 0, used, type, len, batches = 0;
+      const uint8_t* payload;
+      while ((used = replicaNext(in, offset, &type, &payload, &len)) > 0) {
+            int index, flags;
+            uint64_t first;
+            replica_next_seq = len >= REPLICA_BATCH_HEADER ? replicaGet64(payload + 2) : 0;
+            if (type != REPLICA_BATCH || replicaDecodeBatch(payload, len, &index, &flags, &first, replicaCheck, NULL) == -1) replica_mismatches++;
+            offset += used;
+            batches++;
+      }
+      replicaConsume(in, offset);
+      return batches;
+}
+
+/*
+ * Measures how fast readings are batched out of a ring and applied from the batches,
+ * and how many bytes each takes on the wire.
+ */
+int benchReplica(long long n) {
+      char dir[] = "/tmp/watchdog-replica-XXXXXX";
+      temp_ring* ring = (temp_ring*) calloc(1, sizeof(temp_ring));
+      replica_buffer* out = (replica_buffer*) calloc(1, sizeof(replica_buffer));
+      replica_buffer* in = (replica_buffer*) calloc(1, sizeof(replica_buffer));
+      if (ring == NULL || out == NULL || in == NULL || mkdtemp(dir) == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return 1;
+      }
+      char path[128];
+      snprintf(path, sizeof(path), "%s/bench.ring", dir);
+      if (!ringOpen(ring, path)) return 1;
+      uint64_t sent = 0;
+      long long bytes = 0, batches = 0, resent = 0, expected_duplicates = 0;
+      bool dropped = n < 2 * REPLICA_BATCH_SAMPLES;
+      double queueing = 0, applying = 0;
+      for (long long i = 0; i < n; i++) {
+            int64_t time;
+            double value;
+            archiveReading(i, &time, &value);
+            ringInsert(ring, i % 97 == 0 ? NO_READING : value, time);
+            uint64_t inserted = ring->header->inserted;
+            if (inserted - sent < REPLICA_BATCH_SAMPLES && i + 1 < n) continue;
+            if (inserted - sent > TEMP_HISTORY) {
+                  printf("\nThe ring wrapped over readings that were never sent.\n");
+                  return 1;
+            }
+            double start = benchSeconds();
+            while (sent < inserted) {
+                  uint64_t count = inserted - sent < REPLICA_BATCH_SAMPLES ? inserted - sent : REPLICA_BATCH_SAMPLES;
+                  int before = bufferPending(out);
+                  int queued = replicaQueueBatch(out, ring, 0, 0, sent + 1, count);
+                  if (queued == 0) break;
+                  sent += queued;
+                  bytes += bufferPending(out) - before;
+            }
+            double middle = benchSeconds();
+            queueing += middle - start;
+            //halfway through, the connection drops with a batch in flight and the edge resumes
+            //from an older acknowledgement, so the aggregator is sent readings it already has
+            if (!dropped && i + 1 >= n / 2) {
+                  dropped = true;
+                  bufferReset(out);
+                  uint64_t stale = replica_applied > 100 ? replica_applied - 100 : 0;
+                  expected_duplicates = replica_applied - stale;
+                  resent = sent - stale;
+                  sent = stale;
+                  continue;
+            }
+            batches += replicaDeliver(out, in);
+            applying += benchSeconds() - middle;
+      }
+      printf("readings: %lld in %lld batches, %lld resent after the drop\n", n, batches, resent);
+      printf("queue:   %12.0f readings/sec\n", n / queueing);
+      printf("apply:   %12.0f readings/sec\n", n / applying);
+      printf("size:    %12.2f bytes/reading on the wire (ring: %d)\n", (double) bytes / n, (int) (sizeof(int16_t) + sizeof(int64_t)));
+      printf("applied: %llu of %lld, duplicates skipped: %lld, mismatches: %lld\n", (unsigned long long) replica_applied, n, replica_duplicates, replica_mismatches);
+      ringClose(ring);
+      unlink(path);
+      rmdir(dir);
+      bool ok = replica_applied == (uint64_t) n && replica_mismatches == 0 && replica_duplicates == expected_duplicates;
+      free(ring);
+      free(out);
+      free(in);
+      return ok ? 0 : 1;
+}
+
+#define JOURNAL_BURST 64                    // events a poster sends before pausing, like a busy moment
+
+int journal_per_thread;
+std::atomic<long long> journal_post_ns;
+std::atomic<long long> journal_max_post_ns;
+
+/*
+ * One poster: bursts of events of every type, pausing a millisecond between bursts.
+ */
+void* journalPoster(void* p) {
+      long id = (long) p;
+      char sensor[16];
+      snprintf(sensor, sizeof(sensor), "s%ld", id);
+      long long total = 0, worst = 0;
+      for (int i = 0; i < journal_per_thread; i++) {
+            long long start = metricsNanos();
+            journalPost(&event_journal, 1 + i % (JOURNAL_TYPES - 1), sensor, i, "bench", 1700000000000LL + i);
+            long long took = metricsNanos() - start;
+            total += took;
+            if (took > worst) worst = took;
+            if ((i + 1) % JOURNAL_BURST == 0) usleep(1000);
+      }
+      journal_post_ns += total;
+      long long seen = journal_max_post_ns.load();
+      while (worst > seen && !journal_max_post_ns.compare_exchange_weak(seen, worst)) {}
+      return NULL;
+}
+
+/*
+ * Measures what posting an event costs the posting thread and how many events each
+ * fdatasync carries, then pages every record back out of the journal.
+ */
+int benchJournal(int n, int threads) {
+      char dir[] = "/tmp/watchdog-journal-XXXXXX";
+      if (mkdtemp(dir) == NULL || threads < 1) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return 1;
+      }
+      //the baseline: one write and fdatasync per event
+      if (!journalOpen(&event_journal, dir)) return 1;
+      int single = n / 100 > 0 ? n / 100 : 1;
+      journal_record record;
+      memset(&record, 0, sizeof(record));
+      record.type = JOURNAL_TRIP;
+      double start = benchSeconds();
+      for (int i = 0; i < single; i++) {
+            if (!journalWrite(&event_journal, &record, 1, i + 1)) return 1;
+      }
+      double per_event = (benchSeconds() - start) / single;
+      journalStop(&event_journal);
+      char path[128];
+      snprintf(path, sizeof(path), "%s/watchdog.journal", dir);
+      unlink(path);
+
+      if (!journalOpen(&event_journal, dir) || !journalStart(&event_journal)) return 1;
+      journal_per_thread = n / threads;
+      n = journal_per_thread * threads;
+      pthread_t posters[64];
+      if (threads > 64) threads = 64;
+      start = benchSeconds();
+      for (long t = 0; t < threads; t++) pthread_create(&posters[t], NULL, journalPoster, (void*) t);
+      for (int t = 0; t < threads; t++) pthread_join(posters[t], NULL);
+      //let the writer catch up before counting
+      pthread_mutex_lock(&event_journal.lock);
+      while (event_journal.pending_count > 0) {
+            pthread_mutex_unlock(&event_journal.lock);
+            usleep(1000);
+            pthread_mutex_lock(&event_journal.lock);
+      }
+      pthread_mutex_unlock(&event_journal.lock);
+      usleep(50000);
+      double elapsed = benchSeconds() - start;
+      uint64_t records = counterRead(&event_journal.records);
+      uint64_t commits = counterRead(&event_journal.commits);
+      uint64_t dropped = counterRead(&event_journal.dropped);
+
+      //page everything back: forward over every type, then each type newest first
+      long long errors = 0, read_back = 0;
+      journal_record page[JOURNAL_MAX_PAGE];
+      journal_query q;
+      q.type = 0;
+      q.sensor = NULL;
+      q.since = INT64_MIN;
+      q.cursor = 0;
+      q.backward = false;
+      uint64_t expected = 1;
+      double scan_start = benchSeconds();
+      do {
+            uint64_t next;
+            int found = journalPage(&event_journal, &q, page, JOURNAL_MAX_PAGE, &next);
+            if (found < 0) return 1;
+            for (int i = 0; i < found; i++) {
+                  if (page[i].seq != expected++ || page[i].checksum != journalChecksum(&page[i]) || strcmp(page[i].origin, "bench") != 0) errors++;
+            }
+            read_back += found;
+            q.cursor = next;
+      } while (q.cursor != 0);
+      double scan = benchSeconds() - scan_start;
+      long long typed = 0;
+      for (int type = 1; type < JOURNAL_TYPES; type++) {
+            q.type = type;
+            q.cursor = 0;
+            q.backward = true;
+            uint64_t last = UINT64_MAX;
+            do {
+                  uint64_t next;
+                  int found = journalPage(&event_journal, &q, page, JOURNAL_MAX_PAGE, &next);
+                  if (found < 0) return 1;
+                  for (int i = 0; i < found; i++) {
+                        if (page[i].type != type || page[i].seq >= last) errors++;
+                        last = page[i].seq;
+                  }
+                  typed += found;
+                  q.cursor = next;
+            } while (q.cursor != 0);
+      }
+      printf("fdatasync per event:   %10.0f events/sec\n", 1 / per_event);
+      printf("group commit:          %10.0f events/sec from %d threads (bursts of %d, 1 ms apart)\n", records / elapsed, threads, JOURNAL_BURST);
+      printf("post:                  %10.0f ns average, %lld ns worst\n", (double) journal_post_ns.load() / n, journal_max_post_ns.load());
+      printf("commits: %llu for %llu records (%.1f per fdatasync), dropped: %llu\n",
+             (unsigned long long) commits, (unsigned long long) records, commits > 0 ? (double) records / commits : 0, (unsigned long long) dropped);
+      printf("paged back: %lld in order at %.0f records/sec, %lld by type, errors: %lld\n", read_back, read_back / scan, typed, errors);
+      journalStop(&event_journal);
+      unlink(path);
+      rmdir(dir);
+      bool ok = errors == 0 && records + dropped == (uint64_t) n && read_back == (long long) records && typed == read_back;
+      return ok ? 0 : 1;
+}
+
+#define EXECUTOR_CHILDREN 7                 // tasks each externally submitted task spawns
+#define EXECUTOR_TASK_WORK 2000
+
+executor bench_pool;
+std::atomic<int>* executor_runs;            // times each task ran
+std::atomic<long long> executor_remaining;
+std::atomic<long long> executor_sink;
+
+/*
+ * A task that burns a fixed amount of CPU, standing in for a range query.
+ */
+void executorLeaf(void* p) {
+      long id = (long) p;
+      double x = id;
+      for (int i = 0; i < EXECUTOR_TASK_WORK; i++) x = x * 0.999 + sqrt(x + i);
+      executor_sink.fetch_add((long long) x % 2, std::memory_order_relaxed);
+      executor_runs[id].fetch_add(1, std::memory_order_relaxed);
+      executor_remaining.fetch_sub(1);
+}
+
+/*
+ * A task that spawns its children onto its own worker's deque before doing its own work.
+ */
+void executorRoot(void* p) {
+      long id = (long) p;
+      for (long c = 1; c <= EXECUTOR_CHILDREN; c++) {
+            if (!executorSubmit(&bench_pool, executorLeaf, (void*) (id + c))) executorLeaf((void*) (id + c));
+      }
+      executorLeaf(p);
+}
+
+/*
+ * Runs the same batch of tasks on a growing number of workers and reports the speedup.
+ */
+int benchExecutor(int n) {
+      int roots = n / (EXECUTOR_CHILDREN + 1);
+      n = roots * (EXECUTOR_CHILDREN + 1);
+      executor_runs = (std::atomic<int>*) calloc(n, sizeof(std::atomic<int>));
+      if (executor_runs == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return 1;
+      }
+      long long errors = 0;
+      double single = 0;
+      int cores = executorDefaultWorkers();
+      for (int workers = 1; ; workers *= 2) {
+            if (workers > cores) workers = cores;
+            for (int i = 0; i < n; i++) executor_runs[i] = 0;
+            executor_remaining = n;
+            if (!executorStart(&bench_pool, workers, -1)) return 1;
+            double start = benchSeconds();
+            for (long r = 0; r < roots; r++) {
+                  void* id = (void*) (r * (EXECUTOR_CHILDREN + 1));
+                  if (!executorSubmit(&bench_pool, executorRoot, id)) executorRoot(id);
+            }
+            while (executor_remaining.load() > 0) sched_yield();
+            double elapsed = benchSeconds() - start;
+            executorStop(&bench_pool);
+            for (int i = 0; i < n; i++) {
+                  if (executor_runs[i].load() != 1) errors++;
+            }
+            if (workers == 1) single = elapsed;
+            printf("%2d workers: %10.0f tasks/sec  speedup %.2fx\n", workers, n / elapsed, single / elapsed);
+            if (workers == cores) break;
+      }
+      printf("tasks not run exactly once: %lld\n", errors);
+      free(executor_runs);
+      return errors == 0 ? 0 : 1;
+}
+
+#define HTTP_MAX_CLIENTS 4096
+#define HTTP_MAX_ROUTES 16
+#define HTTP_BACKLOG 65536
+#define LATENCY_BUCKETS 1024
+
+#define CLIENT_IDLE 0
+#define CLIENT_SENDING 1
+#define CLIENT_READING 2
+
+typedef struct LatencyHistogram latency_histogram;
+typedef struct BenchClient bench_client;
+typedef struct HttpWorker http_worker;
+
+/*
+ * Log-linear latency histogram in microseconds: exact below 32us, then 16 buckets per
+ * power of two, so every percentile is within about 6%.
+ */
+struct LatencyHistogram {
+  long long counts[LATENCY_BUCKETS];
+  long long total;
+  long long max;
+};
+
+struct BenchClient {
+  int fd;                           // -1 while not connected
+  int state;
+  char out[128];
+  int out_len;
+  int out_sent;
+  char in[4096];
+  int in_len;
+  int route;                        // index into http_routes of the request in flight
+  long long started;                // ns the request was sent, or scheduled in an open loop
+};
+
+struct HttpWorker {
+  int index;
+  int clients;
+  double rate;                      // this worker's share of the open-loop rate, 0 for closed loop
+  long long deadline;
+  latency_histogram histograms[HTTP_MAX_ROUTES];
+  long long errors;
+  long long connects;
+  long long dropped;                // open-loop requests that could not even be queued
+};
+
+struct sockaddr_in http_server;
+char http_routes[HTTP_MAX_ROUTES + 1] = "bdt";
+int http_route_count = 3;
+bool http_keep_alive = true;
+
+long long benchNanos() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int latencyBucket(long long us) {
+      if (us < 32) return us < 0 ? 0 : us;
+      int shift = 63 - __builtin_clzll(us) - 4;
+      return (shift + 1) * 16 + (int) ((us >> shift) - 16);
+}
+
+long long latencyValue(int bucket) {
+      if (bucket < 32) return bucket;
+      int shift = bucket / 16 - 1;
+      long long low = (long long) (bucket % 16 + 16) << shift;
+      return low + (1LL << shift) / 2;
+}
+
+void latencyRecord(latency_histogram* h, long long ns) {
+      long long us = ns / 1000;
+      h->counts[latencyBucket(us)]++;
+      h->total++;
+      if (us > h->max) h->max = us;
+}
+
+void latencyMerge(latency_histogram* into, const latency_histogram* from) {
+      for (int i = 0; i < LATENCY_BUCKETS; i++) into->counts[i] += from->counts[i];
+      into->total += from->total;
+      if (from->max > into->max) into->max = from->max;
+}
+
+/*
+ * Returns the latency in us below which the given fraction of requests completed.
+ */
+long long latencyPercentile(const latency_histogram* h, double fraction) {
+      long long rank = (long long) (fraction * h->total + 0.5);
+      if (rank < 1) rank = 1;
+      long long seen = 0;
+      for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += h->counts[i];
+            if (seen >= rank) return latencyValue(i) < h->max ? latencyValue(i) : h->max;
+      }
+      return h->max;
+}
+
+/*
+ * Starts a non-blocking connect for a client. Returns false if no socket could be made.
+ */
+bool clientConnect(bench_client* c, int epoll, http_worker* w) {
+      c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (c->fd == -1) return false;
+      int one = 1;
+      setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      if (connect(c->fd, (struct sockaddr*) &http_server, sizeof(http_server)) == -1 && errno != EINPROGRESS) {
+            close(c->fd);
+            c->fd = -1;
+            return false;
+      }
+      struct epoll_event ev;
+      ev.events = EPOLLOUT;
+      ev.data.ptr = c;
+      epoll_ctl(epoll, EPOLL_CTL_ADD, c->fd, &ev);
+      w->connects++;
+      return true;
+}
+
+void clientClose(bench_client* c, int epoll) {
+      if (c->fd == -1) return;
+      epoll_ctl(epoll, EPOLL_CTL_DEL, c->fd, NULL);
+      close(c->fd);
+      c->fd = -1;
+}
+
+/*
+ * Sends as much of the pending request as the socket takes. Returns false on error.
+ */
+bool clientSend(bench_client* c, int epoll) {
+      while (c->out_sent < c->out_len) {
+            int sent = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+            if (sent > 0) {
+                  c->out_sent += sent;
+                  continue;
+            }
+            if (sent == -1 && errno == EINTR) continue;
+            return sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN);
+      }
+      c->state = CLIENT_READING;
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = c;
+      epoll_ctl(epoll, EPOLL_CTL_MOD, c->fd, &ev);
+      return true;
+}
+
+/*
+ * Issues the next request on a client, cycling through the routes. started is when the
+ * request counts as sent for latency purposes.
+ */
+bool clientRequest(bench_client* c, int epoll, http_worker* w, long long started) {
+      if (c->fd == -1 && !clientConnect(c, epoll, w)) return false;
+      c->route = (c->route + 1) % http_route_count;
+      c->out_len = snprintf(c->out, sizeof(c->out), "GET /%c HTTP/1.1\r\nHost: watchdog\r\n%s\r\n",
+                            http_routes[c->route], http_keep_alive ? "" : "Connection: close\r\n");
+      c->out_sent = 0;
+      c->in_len = 0;
+      c->started = started;
+      c->state = CLIENT_SENDING;
+      struct epoll_event ev;
+      ev.events = EPOLLOUT;
+      ev.data.ptr = c;
+      epoll_ctl(epoll, EPOLL_CTL_MOD, c->fd, &ev);
+      return true;
+}
+
+/*
+ * Reads the response to the request in flight. Returns 1 once it is complete, 0 if more is
+ * needed and -1 if the connection failed or the server answered with an error status.
+ */
+int clientReceive(bench_client* c) {
+      bool closed = false;
+      while (true) {
+            int received = recv(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len, 0);
+            if (received > 0) {
+                  c->in_len += received;
+                  if (c->in_len == (int) sizeof(c->in) - 1) return -1;
+                  continue;
+            }
+            if (received == -1 && errno == EINTR) continue;
+            if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (received == 0) closed = true;
+            else return -1;
+            break;
+      }
+      c->in[c->in_len] = '\0';
+      char* body = strstr(c->in, "\r\n\r\n");
+      if (body == NULL) return closed ? -1 : 0;
+      char* length = strstr(c->in, "Content-Length: ");
+      if (length == NULL || length > body) return -1;
+      if (c->in + c->in_len < body + 4 + atoi(length + 16)) return closed ? -1 : 0;
+      return strncmp(c->in, "HTTP/1.1 200", 12) == 0 ? 1 : -1;
+}
+
+/*
+ * Drives one share of the clients from its own epoll loop until the deadline.
+ */
+void* httpWorker(void* p) {
+      http_worker* w = (http_worker*) p;
+      int epoll = epoll_create1(EPOLL_CLOEXEC);
+      bench_client* clients = (bench_client*) calloc(w->clients, sizeof(bench_client));
+      int* idle = (int*) malloc(w->clients * sizeof(int));
+      long long* backlog = (long long*) malloc(HTTP_BACKLOG * sizeof(long long));
+      if (epoll == -1 || clients == NULL || idle == NULL || backlog == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return NULL;
+      }
+      //the open loop is paced by a timerfd so requests go out on time rather than on the next ms tick
+      int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      struct epoll_event timer_event;
+      timer_event.events = EPOLLIN;
+      timer_event.data.ptr = NULL;
+      epoll_ctl(epoll, EPOLL_CTL_ADD, timer, &timer_event);
+      int idle_count = 0;
+      int backlog_head = 0, backlog_len = 0;
+      long long now = benchNanos();
+      long long interval = w->rate > 0 ? (long long) (1e9 / w->rate) : 0;
+      long long next_send = now + (interval * w->index) / 8;
+      for (int i = 0; i < w->clients; i++) {
+            clients[i].fd = -1;
+            clients[i].route = (i + w->index) % http_route_count;
+            if (w->rate > 0) idle[idle_count++] = i;
+            else if (!clientRequest(&clients[i], epoll, w, now)) w->errors++;
+      }
+      struct epoll_event events[256];
+      while ((now = benchNanos()) < w->deadline) {
+            //open loop: hand every request that is due to an idle client or queue it
+            while (interval > 0 && next_send <= now) {
+                  if (backlog_len < HTTP_BACKLOG) backlog[(backlog_head + backlog_len++) % HTTP_BACKLOG] = next_send;
+                  else w->dropped++;
+                  next_send += interval;
+            }
+            while (backlog_len > 0 && idle_count > 0) {
+                  bench_client* c = &clients[idle[--idle_count]];
+                  if (!clientRequest(c, epoll, w, backlog[backlog_head])) {
+                        w->errors++;
+                        idle[idle_count++] = c - clients;
+                        break;
+                  }
+                  backlog_head = (backlog_head + 1) % HTTP_BACKLOG;
+                  backlog_len--;
+            }
+            if (interval > 0) {
+                  struct itimerspec when = { { 0, 0 }, { next_send / 1000000000LL, next_send % 1000000000LL } };
+                  timerfd_settime(timer, TFD_TIMER_ABSTIME, &when, NULL);
+            }
+            int ready = epoll_wait(epoll, events, 256, 10);
+            now = benchNanos();
+            for (int i = 0; i < ready; i++) {
+                  bench_client* c = (bench_client*) events[i].data.ptr;
+                  if (c == NULL) {
+                        uint64_t expirations;
+                        read(timer, &expirations, sizeof(expirations));
+                        continue;
+                  }
+                  int done = 0;
+                  if (events[i].events & (EPOLLERR | EPOLLHUP) && c->state != CLIENT_READING) done = -1;
+                  else if (c->state == CLIENT_SENDING) done = clientSend(c, epoll) ? 0 : -1;
+                  else if (c->state == CLIENT_READING) done = clientReceive(c);
+                  if (done == 0) continue;
+                  if (done == 1) latencyRecord(&w->histograms[c->route], now - c->started);
+                  else w->errors++;
+                  if (done == -1 || !http_keep_alive) clientClose(c, epoll);
+                  c->state = CLIENT_IDLE;
+                  //closed loop: the next request goes out as soon as the last one is answered
+                  if (interval == 0) {
+                        if (!clientRequest(c, epoll, w, now)) w->errors++;
+                  }
+                  else if (backlog_len > 0) {
+                        if (clientRequest(c, epoll, w, backlog[backlog_head])) {
+                              backlog_head = (backlog_head + 1) % HTTP_BACKLOG;
+                              backlog_len--;
+                        }
+                        else {
+                              w->errors++;
+                              idle[idle_count++] = c - clients;
+                        }
+                  }
+                  else idle[idle_count++] = c - clients;
+            }
+      }
+      //requests still queued or in flight at the deadline were never answered in time
+      w->dropped += backlog_len;
+      for (int i = 0; i < w->clients; i++) clientClose(&clients[i], epoll);
+      close(timer);
+      close(epoll);
+      free(clients);
+      free(idle);
+      free(backlog);
+      return NULL;
+}
+
+/*
+ * Starts the server binary on port with one simulated sensor at sim_rate lines/sec, on its
+ * io_uring backend if uring is set, and waits until it accepts connections. Returns its pid, or -1 if it did not come up.
+ * control is left holding the write end of the server's stdin, which is how it is stopped.
+ */
+pid_t spawnServer(const char* binary, int port, double sim_rate, bool uring, char* ring_dir, int* control) {
+      int pipe_fds[2];
+      if (mkdtemp(ring_dir) == NULL || pipe(pipe_fds) == -1) {
+            perror("Spawn");
+            return -1;
+      }
+      pid_t pid = fork();
+      if (pid == 0) {
+            dup2(pipe_fds[0], 0);
+            close(pipe_fds[1]);
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, 1);
+            char port_arg[16], sim_arg[64];
+            snprintf(port_arg, sizeof(port_arg), "%d", port);
+            snprintf(sim_arg, sizeof(sim_arg), "bench=%g", sim_rate);
+            execl(binary, binary, port_arg, "-s", sim_arg, "-r", ring_dir, "-u", uring ? "1" : "0", (char*) NULL);
+            perror("Spawn");
+            _exit(1);
+      }
+      close(pipe_fds[0]);
+      *control = pipe_fds[1];
+      for (int attempt = 0; attempt < 100; attempt++) {
+            int probe = socket(AF_INET, SOCK_STREAM, 0);
+            bool up = connect(probe, (struct sockaddr*) &http_server, sizeof(http_server)) == 0;
+            close(probe);
+            if (up) return pid;
+            struct timespec pause = { 0, 50000000 };
+            nanosleep(&pause, NULL);
+      }
+      printf("The server did not start listening on port %d.\n", port);
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+      return -1;
+}
+
+/*
+ * Asks a spawned server to quit the way an operator would and cleans up its ring directory.
+ */
+void stopServer(pid_t pid, int control, const char* ring_dir) {
+      write(control, "q\n", 2);
+      close(control);
+      waitpid(pid, NULL, 0);
+      char path[512];
+      snprintf(path, sizeof(path), "%s/watchdog-bench.ring", ring_dir);
+      unlink(path);
+      rmdir(ring_dir);
+}
+
+void printLatency(const char* name, const latency_histogram* h, double seconds, bool json, bool last) {
+      if (json) {
+            printf("    \"%s\": {\"requests\": %lld, \"rps\": %.1f, \"p50_us\": %lld, \"p99_us\": %lld, \"p999_us\": %lld, \"max_us\": %lld}%s\n",
+                   name, h->total, h->total / seconds, latencyPercentile(h, 0.5), latencyPercentile(h, 0.99),
+                   latencyPercentile(h, 0.999), h->max, last ? "" : ",");
+            return;
+      }
+      printf("%-6s %10lld %12.0f %9lld %9lld %9lld %9lld\n", name, h->total, h->total / seconds,
+             latencyPercentile(h, 0.5), latencyPercentile(h, 0.99), latencyPercentile(h, 0.999), h->max);
+}
+
+/*
+ * Runs the HTTP load test described by the command line and reports per-route throughput
+ * and latency percentiles.
+ */
+int benchHttp(int argc, char* argv[]) {
+      int port = 3002, seconds = 10, clients = 64, threads = 2;
+      double rate = 0, sim_rate = 1000;
+      const char* server_binary = NULL;
+      bool json = false, uring = false;
+      for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-j") == 0) {
+                  json = true;
+                  continue;
+            }
+            if (i + 1 == argc) {
+                  printf("Option %s needs a value.\n", argv[i]);
+                  return 1;
+            }
+            const char* value = argv[++i];
+            if (strcmp(argv[i - 1], "-p") == 0) port = atoi(value);
+            else if (strcmp(argv[i - 1], "-t") == 0) seconds = atoi(value);
+            else if (strcmp(argv[i - 1], "-c") == 0) clients = atoi(value);
+            else if (strcmp(argv[i - 1], "-T") == 0) threads = atoi(value);
+            else if (strcmp(argv[i - 1], "-r") == 0) rate = atof(value);
+            else if (strcmp(argv[i - 1], "-k") == 0) http_keep_alive = atoi(value) != 0;
+            else if (strcmp(argv[i - 1], "-s") == 0) server_binary = value;
+            else if (strcmp(argv[i - 1], "-S") == 0) sim_rate = atof(value);
+            else if (strcmp(argv[i - 1], "-U") == 0) uring = atoi(value) != 0;
+            else if (strcmp(argv[i - 1], "-u") == 0) {
+                  snprintf(http_routes, sizeof(http_routes), "%s", value);
+                  http_route_count = strlen(http_routes);
+            }
+            else {
+                  printf("Unknown option %s\n", argv[i - 1]);
+                  return 1;
+            }
+      }
+      if (seconds <= 0 || clients <= 0 || clients > HTTP_MAX_CLIENTS || threads <= 0 || http_route_count == 0) {
+            printf("Bad http benchmark options.\n");
+            return 1;
+      }
+      if (threads > clients) threads = clients;
+      http_server.sin_family = AF_INET;
+      http_server.sin_port = htons(port);
+      http_server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+      pid_t server = -1;
+      int control = -1;
+      char ring_dir[] = "/tmp/watchdog-bench-XXXXXX";
+      if (server_binary != NULL) {
+            server = spawnServer(server_binary, port, sim_rate, uring, ring_dir, &control);
+            if (server == -1) return 1;
+      }
+      http_worker* workers = (http_worker*) calloc(threads, sizeof(http_worker));
+      pthread_t* ids = (pthread_t*) calloc(threads, sizeof(pthread_t));
+      if (workers == NULL || ids == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return 1;
+      }
+      long long deadline = benchNanos() + (long long) seconds * 1000000000LL;
+      for (int i = 0; i < threads; i++) {
+            workers[i].index = i;
+            workers[i].clients = clients / threads + (i < clients % threads ? 1 : 0);
+            workers[i].rate = rate / threads;
+            workers[i].deadline = deadline;
+            pthread_create(&ids[i], NULL, &httpWorker, &workers[i]);
+      }
+      latency_histogram total, routes[HTTP_MAX_ROUTES];
+      memset(&total, 0, sizeof(total));
+      memset(routes, 0, sizeof(routes));
+      long long errors = 0, connects = 0, dropped = 0;
+      for (int i = 0; i < threads; i++) {
+            pthread_join(ids[i], NULL);
+            for (int r = 0; r < http_route_count; r++) {
+                  latencyMerge(&routes[r], &workers[i].histograms[r]);
+                  latencyMerge(&total, &workers[i].histograms[r]);
+            }
+            errors += workers[i].errors;
+            connects += workers[i].connects;
+            dropped += workers[i].dropped;
+      }
+      if (server != -1) stopServer(server, control, ring_dir);
+
+      //routes that appear more than once in -u are reported once
+      if (json) {
+            printf("{\n  \"mode\": \"%s\", \"seconds\": %d, \"clients\": %d, \"threads\": %d, \"target_rps\": %.1f,\n",
+                   rate > 0 ? "open" : "closed", seconds, clients, threads, rate);
+            printf("  \"keep_alive\": %s, \"sim_lines_per_sec\": %.1f, \"errors\": %lld, \"connects\": %lld, \"dropped\": %lld,\n",
+                   http_keep_alive ? "true" : "false", server != -1 ? sim_rate : 0.0, errors, connects, dropped);
+            printf("  \"routes\": {\n");
+      }
+      else {
+            printf("%s loop, %d clients on %d threads, %d s, keep-alive %s\n", rate > 0 ? "open" : "closed",
+                   clients, threads, seconds, http_keep_alive ? "on" : "off");
+            printf("%-6s %10s %12s %9s %9s %9s %9s\n", "route", "requests", "req/sec", "p50 us", "p99 us", "p999 us", "max us");
+      }
+      for (int r = 0; r < http_route_count; r++) {
+            if (strchr(http_routes, http_routes[r]) != &http_routes[r]) continue;
+            for (int again = r + 1; again < http_route_count; again++) {
+                  if (http_routes[again] == http_routes[r]) latencyMerge(&routes[r], &routes[again]);
+            }
+            char name[2] = { http_routes[r], '\0' };
+            printLatency(name, &routes[r], seconds, json, false);
+      }
+      printLatency("all", &total, seconds, json, true);
+      if (json) printf("  }\n}\n");
+      else printf("errors: %lld  connects: %lld  dropped: %lld\n", errors, connects, dropped);
+      free(workers);
+      free(ids);
+      return errors == 0 ? 0 : 1;
+}
+
+/*
+ * Picks the benchmark to run from the command line.
+ */
+int main(int argc, char* argv[]) {
+      if (argc < 2) {
+            printf("Usage: %s parse [lines] | frames [readings] | stress [seconds] [readers] | quantiles [readings] | columns [samples] | archive [readings] [restart_every] | replica [readings] | journal [events] [threads] | executor [tasks] | http [options]\n", argv[0]);
+            return 1;
+      }
+      if (strcmp(argv[1], "parse") == 0) {
+            return benchParse(argc > 2 ? atoi(argv[2]) : 2000000);
+      }
+      if (strcmp(argv[1], "frames") == 0) {
+            return benchFrames(argc > 2 ? atoi(argv[2]) : 2000000);
+      }
+      if (strcmp(argv[1], "stress") == 0) {
+            return benchStress(argc > 2 ? atoi(argv[2]) : 5, argc > 3 ? atoi(argv[3]) : 4);
+      }
+      if (strcmp(argv[1], "quantiles") == 0) {
+            return benchQuantiles(argc > 2 ? atoi(argv[2]) : 2000000);
+      }
+      if (strcmp(argv[1], "columns") == 0) {
+            return benchColumns(argc > 2 ? atoi(argv[2]) : TEMP_HISTORY);
+      }
+      if (strcmp(argv[1], "archive") == 0) {
+            return benchArchive(argc > 2 ? atoll(argv[2]) : 2000000, argc > 3 ? atoll(argv[3]) : 100000);
+      }
+      if (strcmp(argv[1], "replica") == 0) {
+            return benchReplica(argc > 2 ? atoll(argv[2]) : 2000000);
+      }
+      if (strcmp(argv[1], "journal") == 0) {
+            return benchJournal(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 4);
+      }
+      if (strcmp(argv[1], "executor") == 0) {
+            return benchExecutor(argc > 2 ? atoi(argv[2]) : 100000);
+      }
+      if (strcmp(argv[1], "http") == 0) {
+            return benchHttp(argc, argv);
+      }
+      printf("Unknown benchmark %s\n", argv[1]);
+      return 1;
+}
@@ -0,0 +1,169 @@
+/*
+ * alert.h
+ *
+ * Server-side alert rules, evaluated by the ingest thread as readings arrive.
+ * Each rule from the rules file is compiled into a fixed-size evaluator on
+ * every sensor it names, so a reading costs a constant amount of work per rule
+ * on that sensor and nothing for rules on other sensors:
+ *
+ *     above/below T [for D]   the reading is past T (for at least D)
+ *     rise/fall X within D    the reading moved X degrees within the last D
+ *     silent D                no line arrived from the board for D
+ *     motion                  the board reported a trip while not in standby
+ *
+ * Rate rules keep the min and max of ALERT_SLICES slices of their window, so
+ * their memory and per-reading cost do not grow with the window. A rule fires
+ * once when its condition starts to hold and re-arms only after it clears
+ * (thresholds by ALERT_HYSTERESIS degrees), so a reading hovering at a limit
+ * does not flood subscribers.
+ */
+
+#ifndef ALERT_H
+#define ALERT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ALERT_NAME_LENGTH 32
+#define ALERT_SLICES 16
+#define ALERT_HYSTERESIS 0.25
+
+#define ALERT_ABOVE 1
+#define ALERT_BELOW 2
+#define ALERT_RISE 3
+#define ALERT_FALL 4
+#define ALERT_SILENT 5
+#define ALERT_MOTION 6
+
+typedef struct AlertSlice alert_slice;
+typedef struct AlertRule alert_rule;
+
+struct AlertSlice {
+  int64_t start;          // ms the slice begins, 0 if unused
+  float min;
+  float max;
+};
+
+struct AlertRule {
+  char name[ALERT_NAME_LENGTH];
+  int kind;               // ALERT_*
+  double limit;           // threshold, or change in degrees for rate rules
+  int64_t window;         // ms the condition must hold, the rate window or the allowed silence
+  bool firing;            // fired and not yet cleared
+  int64_t since;          // ms the condition started holding, 0 if it does not
+  alert_slice slices[ALERT_SLICES];
+};
+
+/*
+ * Returns true if name can be a rule name: letters, digits, '.', '-' and '_', so it
+ * goes into event JSON as is.
+ */
+static inline bool alertName(const char* name) {
+      if (name[0] == '\0' || strlen(name) >= ALERT_NAME_LENGTH) return false;
+      for (const char* p = name; *p != '\0'; p++) {
+            char c = *p;
+            if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '_')) return false;
+      }
+      return true;
+}
+
+/*
+ * Evaluates a threshold rule against a reading. Returns true if the rule fires now.
+ */
+static inline bool alertThreshold(alert_rule* rule, int64_t now, double value) {
+      double past = rule->kind == ALERT_ABOVE ? value - rule->limit : rule->limit - value;
+      if (past <= 0) {
+            rule->since = 0;
+            if (past < -ALERT_HYSTERESIS) rule->firing = false;
+            return false;
+      }
+      if (rule->since == 0) rule->since = now;
+      if (rule->firing || now - rule->since < rule->window) return false;
+      rule->firing = true;
+      return true;
+}
+
+/*
+ * Evaluates a rate rule against a reading: the reading is compared with the lowest
+ * (rise) or highest (fall) value seen in the window. Returns true if the rule fires now.
+ */
+static inline bool alertRate(alert_rule* rule, int64_t now, double value) {
+      int64_t width = rule->window / ALERT_SLICES + 1;
+      int64_t start = now - now % width;
+      alert_slice* slice = &rule->slices[(start / width) % ALERT_SLICES];
+      if (slice->start != start) {
+            slice->start = start;
+            slice->min = slice->max = (float) value;
+      }
+      if (value < slice->min) slice->min = (float) value;
+      if (value > slice->max) slice->max = (float) value;
+      double extreme = value;
+      for (int i = 0; i < ALERT_SLICES; i++) {
+            const alert_slice* s = &rule->slices[i];
+            if (s->start == 0 || s->start + width <= now - rule->window) continue;
+            if (rule->kind == ALERT_RISE && s->min < extreme) extreme = s->min;
+            if (rule->kind == ALERT_FALL && s->max > extreme) extreme = s->max;
+      }
+      double change = rule->kind == ALERT_RISE ? value - extreme : extreme - value;
+      if (change < rule->limit) {
+            rule->firing = false;
+            return false;
+      }
+      if (rule->firing) return false;
+      rule->firing = true;
+      return true;
+}
+
+/*
+ * Evaluates any rule that looks at readings. Returns true if the rule fires now.
+ */
+static inline bool alertReading(alert_rule* rule, int64_t now, double value) {
+      switch (rule->kind) {
+            case ALERT_ABOVE:
+            case ALERT_BELOW:
+                  return alertThreshold(rule, now, value);
+            case ALERT_RISE:
+            case ALERT_FALL:
+                  return alertRate(rule, now, value);
+      }
+      return false;
+}
+
+/*
+ * Evaluates a silent rule given when the board last sent a line. Returns true if the rule fires now.
+ */
+static inline bool alertSilence(alert_rule* rule, int64_t now, int64_t last_line) {
+      if (now - last_line < rule->window) {
+            rule->firing = false;
+            return false;
+      }
+      if (rule->firing) return false;
+      rule->firing = true;
+      return true;
+}
+
+/*
+ * Writes a short description of a rule, as it was written in the rules file, into text.
+ */
+static inline void alertDescribe(const alert_rule* rule, char* text, int size) {
+      switch (rule->kind) {
+            case ALERT_ABOVE:
+            case ALERT_BELOW:
+                  snprintf(text, size, "%s %.2f for %llds", rule->kind == ALERT_ABOVE ? "above" : "below", rule->limit,
+                           (long long) (rule->window / 1000));
+                  break;
+            case ALERT_RISE:
+            case ALERT_FALL:
+                  snprintf(text, size, "%s %.2f within %llds", rule->kind == ALERT_RISE ? "rise" : "fall", rule->limit,
+                           (long long) (rule->window / 1000));
+                  break;
+            case ALERT_SILENT:
+                  snprintf(text, size, "silent %llds", (long long) (rule->window / 1000));
+                  break;
+            default:
+                  snprintf(text, size, "motion");
+      }
+}
+
+#endif
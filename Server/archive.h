@@ -0,0 +1,789 @@
+/*
+ * archive.h
+ *
+ * Long-term history of every reading, far beyond what the ring holds. Readings
+ * are compressed Gorilla-style into self-contained blocks: timestamps as
+ * delta-of-delta with variable-width buckets and values as the XOR against the
+ * previous value, storing only the meaningful bits. A steady 1 Hz stream costs
+ * a couple of bytes per reading instead of the ring's sixteen.
+ *
+ * Blocks are appended to numbered segment files in <ring_dir>/watchdog-<id>.archive.
+ * Each segment keeps an in-memory sparse index (time range and file offset of
+ * every block), so a range query reads and decodes only the blocks it touches.
+ * The ingest thread owns the block being filled and the segment being appended
+ * to; a background thread compacts small closed segments (left behind by
+ * restarts and partial blocks) into full ones and drops segments past their
+ * retention. A compacted segment records the first segment it replaces and
+ * atomically takes the name of the last one, so a crash mid-compaction leaves
+ * at worst inputs that the next open deletes. The mutex guards only the segment
+ * list and indexes and is never held across file I/O of block contents.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ARCHIVE_SEGMENT_MAGIC 0x47455357      // "WSEG"
+#define ARCHIVE_BLOCK_MAGIC 0x4b4c4257        // "WBLK"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_BLOCK_SAMPLES 512
+#define ARCHIVE_BLOCK_BYTES 8192
+#define ARCHIVE_MAX_SAMPLE_BITS 160           // worst case for one encoded reading
+#define ARCHIVE_SEGMENT_BLOCKS 1024           // full segments hold about six days at 1 Hz
+#define ARCHIVE_COMPACT_BYTES (256 * 1024)    // closed segments smaller than this get merged
+#define ARCHIVE_RETENTION_DAYS 400
+#define ARCHIVE_COMPACT_INTERVAL_MS 60000
+
+typedef struct ArchiveEncoder archive_encoder;
+typedef struct BitReader bit_reader;
+typedef struct ArchiveSegmentHeader archive_segment_header;
+typedef struct ArchiveBlockHeader archive_block_header;
+typedef struct ArchiveBlockIndex archive_block_index;
+typedef struct ArchiveSegment archive_segment;
+typedef struct Archive archive;
+typedef void (*archive_visitor)(int64_t time, double value, void* context);
+
+struct ArchiveEncoder {
+  uint8_t bytes[ARCHIVE_BLOCK_BYTES];
+  int bits;               // bits written so far
+  int count;              // readings in the block
+  int64_t first;          // ms timestamps of the first and last reading
+  int64_t last;
+  int64_t prev_delta;
+  uint64_t prev_value;    // bit pattern of the previous value
+  int leading;            // XOR window of the previous value, -1 before the first one
+  int trailing;
+};
+
+struct BitReader {
+  const uint8_t* bytes;
+  int bits;
+  int limit;
+  bool bad;               // a read ran past the end of the block
+};
+
+struct ArchiveSegmentHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t replaces_from; // first segment this one was compacted from, 0 if none
+  uint64_t reserved[2];   // pads the header to 32 bytes
+};
+
+struct ArchiveBlockHeader {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t bytes;         // encoded bytes following the header
+  uint32_t reserved;
+  int64_t first;
+  int64_t last;
+};
+
+struct ArchiveBlockIndex {
+  int64_t first;
+  int64_t last;
+  int64_t offset;         // file offset of the block header
+  int count;
+};
+
+struct ArchiveSegment {
+  uint64_t seq;           // file name; later segments have higher numbers
+  uint64_t replaces_from;
+  int64_t first;
+  int64_t last;
+  int64_t size;           // bytes in the file
+  long long samples;
+  archive_block_index* index;
+  int blocks;
+  int index_cap;
+};
+
+struct Archive {
+  char dir[512];
+  pthread_mutex_t lock;           // guards segments and their indexes
+  archive_segment* segments;      // ordered by seq
+  int count;
+  int cap;
+  uint64_t next_seq;
+  uint64_t active_seq;            // segment the ingest thread appends to, 0 if none
+  int active_fd;
+  archive_encoder block;          // readings not yet written, owned by the ingest thread
+};
+
+/*
+ * Appends the low n bits of value, most significant first.
+ */
+static inline void bitsWrite(archive_encoder* enc, uint64_t value, int n) {
+      while (n > 0) {
+            int room = 8 - (enc->bits & 7);
+            int take = n < room ? n : room;
+            uint8_t chunk = (value >> (n - take)) & ((1u << take) - 1);
+            enc->bytes[enc->bits >> 3] |= chunk << (room - take);
+            enc->bits += take;
+            n -= take;
+      }
+}
+
+static inline uint64_t bitsRead(bit_reader* reader, int n) {
+      if (reader->bits + n > reader->limit) {
+            reader->bad = true;
+            return 0;
+      }
+      uint64_t value = 0;
+      while (n > 0) {
+            int room = 8 - (reader->bits & 7);
+            int take = n < room ? n : room;
+            uint8_t byte = reader->bytes[reader->bits >> 3];
+            value = (value << take) | ((byte >> (room - take)) & ((1u << take) - 1));
+            reader->bits += take;
+            n -= take;
+      }
+      return value;
+}
+
+static inline void encoderReset(archive_encoder* enc) {
+      memset(enc->bytes, 0, sizeof(enc->bytes));
+      enc->bits = 0;
+      enc->count = 0;
+      enc->first = enc->last = 0;
+      enc->prev_delta = 0;
+      enc->prev_value = 0;
+      enc->leading = -1;
+      enc->trailing = 0;
+}
+
+/*
+ * Returns true if the block cannot be guaranteed room for another reading.
+ */
+static inline bool encoderFull(const archive_encoder* enc) {
+      return enc->count == ARCHIVE_BLOCK_SAMPLES || enc->bits + ARCHIVE_MAX_SAMPLE_BITS > ARCHIVE_BLOCK_BYTES * 8;
+}
+
+/*
+ * Encodes one reading. The first reading of a block is stored whole; later ones
+ * store their delta-of-delta timestamp and the XOR of their value with the last.
+ */
+static inline void encoderAdd(archive_encoder* enc, int64_t time, double value) {
+      uint64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      if (enc->count == 0) {
+            bitsWrite(enc, (uint64_t) time, 64);
+            bitsWrite(enc, bits, 64);
+            enc->first = time;
+      }
+      else {
+            int64_t delta = time - enc->last;
+            int64_t dod = delta - enc->prev_delta;
+            if (dod == 0) bitsWrite(enc, 0, 1);
+            else if (dod >= -63 && dod <= 64) {
+                  bitsWrite(enc, 0x2, 2);
+                  bitsWrite(enc, (uint64_t) dod & 0x7f, 7);
+            }
+            else if (dod >= -255 && dod <= 256) {
+                  bitsWrite(enc, 0x6, 3);
+                  bitsWrite(enc, (uint64_t) dod & 0x1ff, 9);
+            }
+            else if (dod >= -2047 && dod <= 2048) {
+                  bitsWrite(enc, 0xe, 4);
+                  bitsWrite(enc, (uint64_t) dod & 0xfff, 12);
+            }
+            else {
+                  bitsWrite(enc, 0xf, 4);
+                  bitsWrite(enc, (uint64_t) dod, 64);
+            }
+            enc->prev_delta = delta;
+            uint64_t x = bits ^ enc->prev_value;
+            if (x == 0) bitsWrite(enc, 0, 1);
+            else {
+                  int leading = __builtin_clzll(x);
+                  int trailing = __builtin_ctzll(x);
+                  if (leading > 31) leading = 31;
+                  if (enc->leading >= 0 && leading >= enc->leading && trailing >= enc->trailing) {
+                        //fits the previous window: send just the bits inside it
+                        bitsWrite(enc, 0x2, 2);
+                        bitsWrite(enc, x >> enc->trailing, 64 - enc->leading - enc->trailing);
+                  }
+                  else {
+                        int meaningful = 64 - leading - trailing;
+                        bitsWrite(enc, 0x3, 2);
+                        bitsWrite(enc, leading, 5);
+                        bitsWrite(enc, meaningful & 63, 6);     // 64 is stored as 0
+                        bitsWrite(enc, x >> trailing, meaningful);
+                        enc->leading = leading;
+                        enc->trailing = trailing;
+                  }
+            }
+      }
+      enc->last = time;
+      enc->prev_value = bits;
+      enc->count++;
+}
+
+/*
+ * Decodes a block of count readings and calls visit for each one taken in [from, to) ms.
+ * Returns the number visited, or -1 if the block is damaged.
+ */
+static inline int blockDecode(const uint8_t* bytes, int size, int count, int64_t from, int64_t to,
+                              archive_visitor visit, void* context) {
+      bit_reader reader = { bytes, 0, size * 8, false };
+      int64_t time = 0, delta = 0;
+      uint64_t value = 0;
+      int leading = 0, trailing = 0;
+      int visited = 0;
+      for (int i = 0; i < count; i++) {
+            if (i == 0) {
+                  time = (int64_t) bitsRead(&reader, 64);
+                  value = bitsRead(&reader, 64);
+            }
+            else {
+                  int64_t dod;
+                  if (bitsRead(&reader, 1) == 0) dod = 0;
+                  else if (bitsRead(&reader, 1) == 0) {
+                        dod = bitsRead(&reader, 7);
+                        if (dod > 64) dod -= 128;
+                  }
+                  else if (bitsRead(&reader, 1) == 0) {
+                        dod = bitsRead(&reader, 9);
+                        if (dod > 256) dod -= 512;
+                  }
+                  else if (bitsRead(&reader, 1) == 0) {
+                        dod = bitsRead(&reader, 12);
+                        if (dod > 2048) dod -= 4096;
+                  }
+                  else dod = (int64_t) bitsRead(&reader, 64);
+                  delta += dod;
+                  time += delta;
+                  if (bitsRead(&reader, 1) == 1) {
+                        if (bitsRead(&reader, 1) == 1) {
+                              leading = bitsRead(&reader, 5);
+                              int meaningful = bitsRead(&reader, 6);
+                              if (meaningful == 0) meaningful = 64;
+                              trailing = 64 - leading - meaningful;
+                              if (trailing < 0) return -1;
+                        }
+                        value ^= bitsRead(&reader, 64 - leading - trailing) << trailing;
+                  }
+            }
+            if (reader.bad) return -1;
+            if (time >= from && time < to) {
+                  double reading;
+                  memcpy(&reading, &value, sizeof(reading));
+                  visit(time, reading, context);
+                  visited++;
+            }
+      }
+      return visited;
+}
+
+/*
+ * Writes the encoder's block at offset of fd. Returns the bytes written, or -1 on error.
+ */
+static inline int blockWrite(int fd, int64_t offset, const archive_encoder* enc) {
+      char out[sizeof(archive_block_header) + ARCHIVE_BLOCK_BYTES];
+      archive_block_header header;
+      memset(&header, 0, sizeof(header));
+      header.magic = ARCHIVE_BLOCK_MAGIC;
+      header.count = enc->count;
+      header.bytes = (enc->bits + 7) / 8;
+      header.first = enc->first;
+      header.last = enc->last;
+      memcpy(out, &header, sizeof(header));
+      memcpy(out + sizeof(header), enc->bytes, header.bytes);
+      int len = sizeof(header) + header.bytes;
+      if (pwrite(fd, out, len, offset) != len) return -1;
+      return len;
+}
+
+/*
+ * Records a block in a segment's index. Returns false if memory could not be allocated.
+ */
+static inline bool segmentIndexAdd(archive_segment* seg, int64_t first, int64_t last, int64_t offset, int count, int len) {
+      if (seg->blocks == seg->index_cap) {
+            int cap = seg->index_cap ? seg->index_cap * 2 : 64;
+            archive_block_index* grown = (archive_block_index*) realloc(seg->index, cap * sizeof(archive_block_index));
+            if (grown == NULL) {
+                  printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+                  return false;
+            }
+            seg->index = grown;
+            seg->index_cap = cap;
+      }
+      archive_block_index* entry = &seg->index[seg->blocks++];
+      entry->first = first;
+      entry->last = last;
+      entry->offset = offset;
+      entry->count = count;
+      if (seg->samples == 0 || first < seg->first) seg->first = first;
+      if (seg->samples == 0 || last > seg->last) seg->last = last;
+      seg->samples += count;
+      seg->size = offset + len;
+      return true;
+}
+
+static inline void archivePath(const archive* a, uint64_t seq, const char* ext, char* path, int size) {
+      snprintf(path, size, "%s/%llu.%s", a->dir, (unsigned long long) seq, ext);
+}
+
+/*
+ * Adds a segment to the list, keeping it ordered by seq. Call with the lock held.
+ */
+static inline bool archiveInsert(archive* a, const archive_segment* seg) {
+      if (a->count == a->cap) {
+            int cap = a->cap ? a->cap * 2 : 16;
+            archive_segment* grown = (archive_segment*) realloc(a->segments, cap * sizeof(archive_segment));
+            if (grown == NULL) {
+                  printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+                  return false;
+            }
+            a->segments = grown;
+            a->cap = cap;
+      }
+      int i = a->count;
+      while (i > 0 && a->segments[i - 1].seq > seg->seq) {
+            a->segments[i] = a->segments[i - 1];
+            i--;
+      }
+      a->segments[i] = *seg;
+      a->count++;
+      return true;
+}
+
+/*
+ * Removes the segment at position i from the list and deletes its file. Call with the lock held.
+ */
+static inline void archiveRemove(archive* a, int i) {
+      char path[600];
+      archivePath(a, a->segments[i].seq, "seg", path, sizeof(path));
+      unlink(path);
+      free(a->segments[i].index);
+      memmove(&a->segments[i], &a->segments[i + 1], (a->count - i - 1) * sizeof(archive_segment));
+      a->count--;
+}
+
+/*
+ * Reads segment seq's header and block headers into a new list entry. A block torn
+ * by a crash mid-write is cut off. Returns false if the file is not a segment.
+ */
+static inline bool archiveLoad(archive* a, uint64_t seq) {
+      char path[600];
+      archivePath(a, seq, "seg", path, sizeof(path));
+      int fd = open(path, O_RDWR | O_CLOEXEC);
+      if (fd == -1) return false;
+      struct stat info;
+      archive_segment_header header;
+      if (fstat(fd, &info) == -1 || pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+          || header.magic != ARCHIVE_SEGMENT_MAGIC || header.version != ARCHIVE_VERSION) {
+            printf("Ignoring damaged archive segment %s.\n", path);
+            close(fd);
+            return false;
+      }
+      archive_segment seg;
+      memset(&seg, 0, sizeof(seg));
+      seg.seq = seq;
+      seg.replaces_from = header.replaces_from;
+      seg.size = sizeof(header);
+      int64_t offset = sizeof(header);
+      while (offset < info.st_size) {
+            archive_block_header block;
+            if (pread(fd, &block, sizeof(block), offset) != (ssize_t) sizeof(block) || block.magic != ARCHIVE_BLOCK_MAGIC
+                || block.count == 0 || block.bytes > ARCHIVE_BLOCK_BYTES
+                || offset + (int64_t) sizeof(block) + block.bytes > info.st_size) {
+                  printf("Truncating archive segment %s after %d blocks.\n", path, seg.blocks);
+                  ftruncate(fd, offset);
+                  break;
+            }
+            int len = sizeof(block) + block.bytes;
+            if (!segmentIndexAdd(&seg, block.first, block.last, offset, block.count, len)) break;
+            offset += len;
+      }
+      close(fd);
+      return archiveInsert(a, &seg);
+}
+
+/*
+ * Opens (creating if needed) the archive of sensor id in ring_dir and indexes its
+ * segments. Leftovers of an interrupted compaction are cleaned up. Returns false if
+ * the directory cannot be created or read.
+ */
+static inline bool archiveOpen(archive* a, const char* ring_dir, const char* id) {
+      pthread_mutex_init(&a->lock, NULL);
+      a->segments = NULL;
+      a->count = a->cap = 0;
+      a->next_seq = 1;
+      a->active_seq = 0;
+      a->active_fd = -1;
+      encoderReset(&a->block);
+      if (snprintf(a->dir, sizeof(a->dir), "%s/watchdog-%s.archive", ring_dir, id) >= (int) sizeof(a->dir)
+          || (mkdir(a->dir, 0755) == -1 && errno != EEXIST)) {
+            printf("Couldn't create the archive directory %s.\n", a->dir);
+            return false;
+      }
+      DIR* dir = opendir(a->dir);
+      if (dir == NULL) {
+            perror("Archive");
+            return false;
+      }
+      struct dirent* entry;
+      while ((entry = readdir(dir)) != NULL) {
+            char* ext;
+            uint64_t seq = strtoull(entry->d_name, &ext, 10);
+            if (ext == entry->d_name || seq == 0) continue;
+            if (strcmp(ext, ".tmp") == 0) {
+                  //a compaction that never got committed
+                  char path[600];
+                  archivePath(a, seq, "tmp", path, sizeof(path));
+                  unlink(path);
+            }
+            else if (strcmp(ext, ".seg") == 0) {
+                  archiveLoad(a, seq);
+            }
+            if (seq >= a->next_seq) a->next_seq = seq + 1;
+      }
+      closedir(dir);
+      //a committed compaction whose inputs were not all deleted yet
+      for (int i = a->count - 1; i >= 0; i--) {
+            if (i >= a->count || a->segments[i].replaces_from == 0) continue;
+            uint64_t from = a->segments[i].replaces_from;
+            uint64_t seq = a->segments[i].seq;
+            for (int j = a->count - 1; j >= 0; j--) {
+                  if (a->segments[j].seq >= from && a->segments[j].seq < seq) archiveRemove(a, j);
+            }
+      }
+      return true;
+}
+
+/*
+ * Writes the block being filled to the active segment, starting a new segment when
+ * there is none or the active one is full. Called by the ingest thread.
+ */
+static inline void archiveFlush(archive* a) {
+      archive_encoder* enc = &a->block;
+      if (enc->count == 0) return;
+      if (a->active_fd == -1) {
+            uint64_t seq = a->next_seq++;
+            char path[600];
+            archivePath(a, seq, "seg", path, sizeof(path));
+            int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            archive_segment_header header;
+            memset(&header, 0, sizeof(header));
+            header.magic = ARCHIVE_SEGMENT_MAGIC;
+            header.version = ARCHIVE_VERSION;
+            if (fd == -1 || pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+                  perror("Archive");
+                  if (fd != -1) close(fd);
+                  encoderReset(enc);
+                  return;
+            }
+            archive_segment seg;
+            memset(&seg, 0, sizeof(seg));
+            seg.seq = seq;
+            seg.size = sizeof(header);
+            //compaction reads active_seq under the lock, so it never sees the new segment as closed
+            pthread_mutex_lock(&a->lock);
+            bool added = archiveInsert(a, &seg);
+            if (added) {
+                  a->active_fd = fd;
+                  a->active_seq = seq;
+            }
+            pthread_mutex_unlock(&a->lock);
+            if (!added) {
+                  close(fd);
+                  unlink(path);
+                  encoderReset(enc);
+                  return;
+            }
+      }
+      //only this thread grows the active segment, so its size can be read unlocked
+      archive_segment* seg = NULL;
+      pthread_mutex_lock(&a->lock);
+      for (int i = a->count - 1; i >= 0 && seg == NULL; i--) {
+            if (a->segments[i].seq == a->active_seq) seg = &a->segments[i];
+      }
+      int64_t offset = seg->size;
+      pthread_mutex_unlock(&a->lock);
+      int len = blockWrite(a->active_fd, offset, enc);
+      if (len == -1) perror("Archive");
+      bool full = false;
+      pthread_mutex_lock(&a->lock);
+      //compaction may have moved the entry while the lock was released
+      for (int i = a->count - 1; i >= 0; i--) {
+            if (a->segments[i].seq != a->active_seq) continue;
+            seg = &a->segments[i];
+            if (len != -1) segmentIndexAdd(seg, enc->first, enc->last, offset, enc->count, len);
+            full = seg->blocks >= ARCHIVE_SEGMENT_BLOCKS;
+            break;
+      }
+      int full_fd = a->active_fd;
+      if (full) {
+            a->active_fd = -1;
+            a->active_seq = 0;
+      }
+      pthread_mutex_unlock(&a->lock);
+      if (full) close(full_fd);
+      encoderReset(enc);
+}
+
+/*
+ * Archives one reading taken at time ms. Called by the ingest thread.
+ */
+static inline void archiveAppend(archive* a, int64_t time, double value) {
+      if (encoderFull(&a->block)) archiveFlush(a);
+      encoderAdd(&a->block, time, value);
+}
+
+/*
+ * Returns the time of the oldest archived reading in ms, or 0 if nothing is archived yet.
+ */
+static inline int64_t archiveStart(archive* a) {
+      int64_t start = 0;
+      pthread_mutex_lock(&a->lock);
+      for (int i = 0; i < a->count; i++) {
+            if (a->segments[i].samples > 0 && (start == 0 || a->segments[i].first < start)) start = a->segments[i].first;
+      }
+      pthread_mutex_unlock(&a->lock);
+      return start;
+}
+
+typedef struct ArchiveRead archive_read;
+struct ArchiveRead {
+  int fd;
+  int64_t offset;
+};
+
+/*
+ * Calls visit for every archived reading taken in [from, to) ms, segment by segment.
+ * Only blocks whose range overlaps the query are read. Readings still in the block
+ * being filled are not visited; the ring has them. Returns the number of readings
+ * visited, or -1 on an error.
+ */
+static inline long long archiveScan(archive* a, int64_t from, int64_t to, archive_visitor visit, void* context) {
+      archive_read* reads = NULL;
+      int count = 0, cap = 0;
+      int fd_count = 0;
+      //pick the blocks and open their files under the lock; reads happen after it
+      pthread_mutex_lock(&a->lock);
+      int* fds = (int*) malloc((a->count + 1) * sizeof(int));
+      bool failed = fds == NULL;
+      for (int i = 0; i < a->count && !failed; i++) {
+            archive_segment* seg = &a->segments[i];
+            if (seg->samples == 0 || seg->last < from || seg->first >= to) continue;
+            char path[600];
+            archivePath(a, seg->seq, "seg", path, sizeof(path));
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                  failed = true;
+                  break;
+            }
+            fds[fd_count++] = fd;
+            for (int b = 0; b < seg->blocks; b++) {
+                  if (seg->index[b].last < from || seg->index[b].first >= to) continue;
+                  if (count == cap) {
+                        cap = cap ? cap * 2 : 256;
+                        archive_read* grown = (archive_read*) realloc(reads, cap * sizeof(archive_read));
+                        if (grown == NULL) {
+                              failed = true;
+                              break;
+                        }
+                        reads = grown;
+                  }
+                  reads[count].fd = fd;
+                  reads[count].offset = seg->index[b].offset;
+                  count++;
+            }
+      }
+      pthread_mutex_unlock(&a->lock);
+      long long visited = 0;
+      char buf[sizeof(archive_block_header) + ARCHIVE_BLOCK_BYTES];
+      for (int r = 0; r < count && !failed; r++) {
+            int n = pread(reads[r].fd, buf, sizeof(buf), reads[r].offset);
+            archive_block_header header;
+            memcpy(&header, buf, sizeof(header));
+            if (n < (int) sizeof(header) || header.magic != ARCHIVE_BLOCK_MAGIC || n < (int) (sizeof(header) + header.bytes)) {
+                  failed = true;
+                  break;
+            }
+            int decoded = blockDecode((uint8_t*) buf + sizeof(header), header.bytes, header.count, from, to, visit, context);
+            if (decoded < 0) failed = true;
+            else visited += decoded;
+      }
+      for (int i = 0; i < fd_count; i++) close(fds[i]);
+      free(fds);
+      free(reads);
+      return failed ? -1 : visited;
+}
+
+typedef struct ArchiveRewrite archive_rewrite;
+struct ArchiveRewrite {
+  int fd;
+  archive_segment seg;
+  archive_encoder enc;
+  bool failed;
+};
+
+static inline void rewriteFlush(archive_rewrite* out) {
+      if (out->enc.count == 0 || out->failed) return;
+      int len = blockWrite(out->fd, out->seg.size, &out->enc);
+      if (len == -1 || !segmentIndexAdd(&out->seg, out->enc.first, out->enc.last, out->seg.size, out->enc.count, len)) out->failed = true;
+      encoderReset(&out->enc);
+}
+
+static inline void rewriteReading(int64_t time, double value, void* context) {
+      archive_rewrite* out = (archive_rewrite*) context;
+      if (encoderFull(&out->enc)) rewriteFlush(out);
+      encoderAdd(&out->enc, time, value);
+}
+
+/*
+ * Merges the closed segments at positions [first, last] into one segment of full
+ * blocks that takes the last one's name. Returns false if the merge was abandoned.
+ */
+static inline bool archiveMerge(archive* a, int first, int last) {
+      //closed segments never change and only this thread removes them, so they are read unlocked
+      pthread_mutex_lock(&a->lock);
+      uint64_t from_seq = a->segments[first].seq;
+      uint64_t to_seq = a->segments[last].seq;
+      int n = last - first + 1;
+      archive_segment* inputs = (archive_segment*) malloc(n * sizeof(archive_segment));
+      bool copied = inputs != NULL;
+      for (int i = 0; i < n && copied; i++) {
+            inputs[i] = a->segments[first + i];
+            inputs[i].index = (archive_block_index*) malloc(inputs[i].blocks * sizeof(archive_block_index) + 1);
+            if (inputs[i].index == NULL) {
+                  n = i;
+                  copied = false;
+                  break;
+            }
+            memcpy(inputs[i].index, a->segments[first + i].index, inputs[i].blocks * sizeof(archive_block_index));
+      }
+      pthread_mutex_unlock(&a->lock);
+      archive_rewrite* out = (archive_rewrite*) calloc(1, sizeof(archive_rewrite));
+      char tmp[600], path[600];
+      archivePath(a, to_seq, "tmp", tmp, sizeof(tmp));
+      archivePath(a, to_seq, "seg", path, sizeof(path));
+      bool ok = copied && out != NULL;
+      if (ok) {
+            out->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            archive_segment_header header;
+            memset(&header, 0, sizeof(header));
+            header.magic = ARCHIVE_SEGMENT_MAGIC;
+            header.version = ARCHIVE_VERSION;
+            header.replaces_from = from_seq;
+            ok = out->fd != -1 && pwrite(out->fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header);
+            out->seg.seq = to_seq;
+            out->seg.replaces_from = from_seq;
+            out->seg.size = sizeof(header);
+            encoderReset(&out->enc);
+      }
+      for (int i = 0; i < n && ok; i++) {
+            //the sparse index was copied, so decode each input's blocks directly
+            archive_segment* seg = &inputs[i];
+            char input[600];
+            archivePath(a, seg->seq, "seg", input, sizeof(input));
+            int fd = open(input, O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                  ok = false;
+                  break;
+            }
+            char buf[sizeof(archive_block_header) + ARCHIVE_BLOCK_BYTES];
+            for (int b = 0; b < seg->blocks && ok; b++) {
+                  int got = pread(fd, buf, sizeof(buf), seg->index[b].offset);
+                  archive_block_header block;
+                  memcpy(&block, buf, sizeof(block));
+                  ok = got >= (int) sizeof(block) && got >= (int) (sizeof(block) + block.bytes)
+                       && blockDecode((uint8_t*) buf + sizeof(block), block.bytes, block.count, INT64_MIN, INT64_MAX, rewriteReading, out) >= 0
+                       && !out->failed;
+            }
+            close(fd);
+      }
+      if (ok) {
+            rewriteFlush(out);
+            ok = !out->failed && fsync(out->fd) == 0;
+      }
+      if (out != NULL && out->fd > 0) close(out->fd);
+      if (ok) {
+            //swap the merged segment in; its header names the inputs if the unlinks are cut short
+            pthread_mutex_lock(&a->lock);
+            ok = rename(tmp, path) == 0;
+            if (ok) {
+                  for (int i = a->count - 1; i >= 0; i--) {
+                        if (a->segments[i].seq >= from_seq && a->segments[i].seq < to_seq) archiveRemove(a, i);
+                        else if (a->segments[i].seq == to_seq) {
+                              free(a->segments[i].index);
+                              a->segments[i] = out->seg;
+                        }
+                  }
+            }
+            pthread_mutex_unlock(&a->lock);
+      }
+      if (!ok) {
+            unlink(tmp);
+            if (out != NULL) free(out->seg.index);
+      }
+      for (int i = 0; i < n; i++) free(inputs[i].index);
+      free(inputs);
+      free(out);
+      return ok;
+}
+
+/*
+ * Drops closed segments older than the retention period and merges runs of small
+ * closed segments. Runs on the background compaction thread; now is in ms.
+ */
+static inline void archiveCompact(archive* a, int64_t now) {
+      int64_t cutoff = now - (int64_t) ARCHIVE_RETENTION_DAYS * 86400 * 1000;
+      pthread_mutex_lock(&a->lock);
+      for (int i = a->count - 1; i >= 0; i--) {
+            if (a->segments[i].seq != a->active_seq && a->segments[i].samples > 0 && a->segments[i].last < cutoff) archiveRemove(a, i);
+      }
+      pthread_mutex_unlock(&a->lock);
+      while (true) {
+            //find the first run of two or more small closed segments
+            int first = -1, last = -1;
+            pthread_mutex_lock(&a->lock);
+            int blocks = 0;
+            for (int i = 0; i < a->count; i++) {
+                  archive_segment* seg = &a->segments[i];
+                  bool small = seg->seq != a->active_seq && seg->size < ARCHIVE_COMPACT_BYTES;
+                  if (small && (first == -1 || blocks + seg->blocks <= ARCHIVE_SEGMENT_BLOCKS)) {
+                        if (first == -1) first = i;
+                        last = i;
+                        blocks += seg->blocks;
+                        continue;
+                  }
+                  if (first != -1 && last > first) break;
+                  first = small ? i : -1;
+                  last = first;
+                  blocks = small ? seg->blocks : 0;
+            }
+            pthread_mutex_unlock(&a->lock);
+            if (first == -1 || last == first || !archiveMerge(a, first, last)) return;
+      }
+}
+
+/*
+ * Writes out the block being filled and releases the archive. Called once the ingest thread has stopped.
+ */
+static inline void archiveClose(archive* a) {
+      archiveFlush(a);
+      if (a->active_fd != -1) {
+            fsync(a->active_fd);
+            close(a->active_fd);
+            a->active_fd = -1;
+      }
+      for (int i = 0; i < a->count; i++) free(a->segments[i].index);
+      free(a->segments);
+      a->segments = NULL;
+      a->count = a->cap = 0;
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * command_queue.h
+ *
+ * Outbound commands to the Arduinos ('f' unit, 's' standby, 'm' message,
+ * 'r' reset). Request handlers submit commands here instead of writing to the
+ * 9600-baud tty themselves; the ingest thread owns the serial descriptors and
+ * writes queued commands from its epoll loop, woken through an eventfd. The
+ * Pebble sends every button press three times, so a command identical to one
+ * accepted for the same sensor within COMMAND_COALESCE_MS is coalesced away
+ * rather than toggling the board back and forth. Like notify.h, commands are
+ * rare enough for a mutex.
+ */
+
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define COMMAND_QUEUE_SIZE 256
+#define COMMAND_HISTORY 64            // accepted commands remembered for coalescing
+#define COMMAND_COALESCE_MS 1500      // repeats inside this window are dropped
+#define COMMAND_EXPIRY_MS 5000        // commands for an unreachable board are dropped after this
+#define COMMAND_CONFIRM_MS 5000       // how long the board gets to show it acted on a command
+
+typedef struct ArduinoCommand arduino_command;
+typedef struct CommandQueue command_queue;
+
+struct ArduinoCommand {
+  int sensor;               // index into the sensor registry
+  char code;
+  long long queued;         // ms timestamp (monotonic) the command was accepted
+  long long queued_ns;      // the same in ns, for the latency histograms
+};
+
+struct CommandQueue {
+  pthread_mutex_t lock;
+  arduino_command commands[COMMAND_QUEUE_SIZE];
+  int head;
+  int len;
+  arduino_command history[COMMAND_HISTORY];
+  int history_next;
+  int event_fd;             // readable whenever commands are queued
+};
+
+/*
+ * Sets up the queue and its eventfd. Returns false if the eventfd cannot be created.
+ */
+static inline bool commandInit(command_queue* queue) {
+      pthread_mutex_init(&queue->lock, NULL);
+      queue->head = queue->len = 0;
+      queue->history_next = 0;
+      for (int i = 0; i < COMMAND_HISTORY; i++) queue->history[i].sensor = -1;
+      queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (queue->event_fd == -1) {
+            perror("Eventfd");
+            return false;
+      }
+      return true;
+}
+
+/*
+ * Queues code for sensor unless the same command was accepted within the coalescing
+ * window or the queue is full. Returns true if the command was queued.
+ */
+static inline bool commandSubmit(command_queue* queue, int sensor, char code, long long now) {
+      pthread_mutex_lock(&queue->lock);
+      for (int i = 0; i < COMMAND_HISTORY; i++) {
+            const arduino_command* recent = &queue->history[i];
+            if (recent->sensor == sensor && recent->code == code && now - recent->queued < COMMAND_COALESCE_MS) {
+                  pthread_mutex_unlock(&queue->lock);
+                  return false;
+            }
+      }
+      if (queue->len == COMMAND_QUEUE_SIZE) {
+            pthread_mutex_unlock(&queue->lock);
+            return false;
+      }
+      arduino_command* command = &queue->commands[(queue->head + queue->len) % COMMAND_QUEUE_SIZE];
+      command->sensor = sensor;
+      command->code = code;
+      command->queued = now;
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      command->queued_ns = (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+      queue->len++;
+      queue->history[queue->history_next] = *command;
+      queue->history_next = (queue->history_next + 1) % COMMAND_HISTORY;
+      pthread_mutex_unlock(&queue->lock);
+      uint64_t one = 1;
+      write(queue->event_fd, &one, sizeof(one));
+      return true;
+}
+
+/*
+ * Moves up to max queued commands into commands and clears the eventfd. Returns how many were moved.
+ */
+static inline int commandDrain(command_queue* queue, arduino_command* commands, int max) {
+      uint64_t count;
+      read(queue->event_fd, &count, sizeof(count));
+      pthread_mutex_lock(&queue->lock);
+      int n = 0;
+      while (n < max && queue->len > 0) {
+            commands[n++] = queue->commands[queue->head];
+            queue->head = (queue->head + 1) % COMMAND_QUEUE_SIZE;
+            queue->len--;
+      }
+      if (queue->len > 0) {
+            uint64_t one = 1;
+            write(queue->event_fd, &one, sizeof(one));
+      }
+      pthread_mutex_unlock(&queue->lock);
+      return n;
+}
+
+#endif
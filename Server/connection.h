@@ -0,0 +1,388 @@
+/*
+ * connection.h
+ *
+ * Per-client connection state for the epoll event loop in server_thread.
+ * Connections are kept in a table indexed by socket descriptor so request
+ * handlers can keep taking the client fd and queue their reply through
+ * sendMessage. Each connection sits in exactly one timeout list (reading,
+ * writing or, for event subscribers, waiting); every list is FIFO so the
+ * oldest connection is always at the head. Keep-alive connections go back to
+ * the reading list between requests, so READ_TIMEOUT_MS is also their idle timeout.
+ * A connection whose handler was handed to the executor is busy: it sits in no
+ * list and its socket events are ignored until the handler's reply comes back.
+ * The table is the server thread's alone, so a handler on a worker writes into
+ * the reply it was given (handler_reply) rather than looking its fd up.
+ * When the server runs on io_uring (-u 1) the same states drive ring operations
+ * instead of epoll interest: watching EPOLLIN keeps a receive into the request
+ * buffer in flight, flushResponse hands pending bytes to a send, and a long-poll
+ * waits on a POLLRDHUP poll. A connection closed with operations still in flight
+ * is freed once their (cancelled) completions come back.
+ */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "uring.h"
+
+#define MAX_CONNECTIONS 4096
+#define LISTEN_BACKLOG 1024
+#define REQUEST_BUFFER_SIZE 1024
+#define RESPONSE_BUFFER_SIZE 1024
+#define READ_TIMEOUT_MS 5000
+#define WRITE_TIMEOUT_MS 5000
+#define WAIT_TIMEOUT_MS 25000               // long-poll expiry and event stream keepalive interval
+#define MAX_SUBSCRIBER_BACKLOG 65536        // unsent bytes after which a slow subscriber is dropped
+
+#define RING_RECV 1                         // tags of a connection's operations in their ring user data
+#define RING_SEND 2
+#define RING_POLL 3
+#define RING_TAG_MASK 3
+#define RING_ACCEPT 1                       // user data of the loop's own operations, which carry no connection
+#define RING_NOTIFY 2
+#define RING_FINISHED 3
+#define SERVER_RING_ENTRIES 1024            // submissions queued per pass before the ring is flushed early
+
+#define STREAM_NONE 0
+#define STREAM_EVENTS 1                     // Server-Sent Events, held open indefinitely
+#define STREAM_LONGPOLL 2                   // answered and closed by the first matching event
+
+typedef struct Connection connection;
+typedef struct ConnectionList connection_list;
+
+struct Connection {
+  int fd;
+  char request[REQUEST_BUFFER_SIZE + 1];
+  int request_len;
+  int request_scan;         // parser progress through a partially received request
+  int http_method;          // method of the request being answered (HTTP_GET, HTTP_HEAD, ...)
+  int http_version;         // minor version of the request being answered, -1 for HTTP/0.9
+  int http_status;          // status of the response being built
+  const char* http_content_type;
+  long long http_etag;      // version sent as the ETag of the response, -1 for none
+  bool keep_alive;          // keep the connection open once the response is sent
+  bool peer_closed;         // the client shut down its side; close after answering
+  char* response;
+  int response_len;
+  int response_sent;
+  int response_cap;
+  unsigned epoll_events;    // events the descriptor is currently registered for
+  int stream;               // STREAM_* mode of a subscriber connection
+  int stream_sensor;        // sensor index a subscriber listens to, -1 for all
+  bool busy;                // a handler for this connection is running on the executor
+  unsigned ring_ops;        // bit 1 << RING_* for each ring operation in flight
+  char* ring_send_buf;      // buffer the in-flight send reads from, kept if the response moves
+  bool closed;              // closed, waiting for its ring operations to complete
+  long long deadline;       // ms timestamp after which the connection is dropped
+  connection_list* list;    // timeout list currently holding this connection
+  connection* prev;
+  connection* next;
+};
+
+struct ConnectionList {
+  connection* head;
+  connection* tail;
+  int timeout_ms;
+};
+
+connection* connections[MAX_CONNECTIONS];
+connection_list reading_list = { NULL, NULL, READ_TIMEOUT_MS };
+connection_list writing_list = { NULL, NULL, WRITE_TIMEOUT_MS };
+connection_list waiting_list = { NULL, NULL, WAIT_TIMEOUT_MS };
+int epoll_fd = -1;
+uring* server_ring = NULL;                       // the event loop's ring when it runs on io_uring
+int ring_closing = 0;                            // closed connections still waiting for their operations
+thread_local connection* handler_reply = NULL;   // set on executor workers while a handler runs
+
+/*
+ * Returns a monotonic timestamp in milliseconds.
+ */
+static inline long long nowMillis() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Removes a connection from whichever timeout list currently holds it.
+ */
+static inline void listRemove(connection* conn) {
+      connection_list* list = conn->list;
+      if (list == NULL) return;
+      if (conn->prev) conn->prev->next = conn->next;
+      else list->head = conn->next;
+      if (conn->next) conn->next->prev = conn->prev;
+      else list->tail = conn->prev;
+      conn->prev = conn->next = NULL;
+      conn->list = NULL;
+}
+
+/*
+ * Moves a connection to the tail of a timeout list and restarts its deadline.
+ */
+static inline void listTouch(connection_list* list, connection* conn) {
+      listRemove(conn);
+      conn->deadline = nowMillis() + list->timeout_ms;
+      conn->list = list;
+      conn->prev = list->tail;
+      conn->next = NULL;
+      if (list->tail) list->tail->next = conn;
+      else list->head = conn;
+      list->tail = conn;
+}
+
+static inline uint64_t ringData(connection* conn, int op) {
+      return (uint64_t) (uintptr_t) conn | op;
+}
+
+/*
+ * Keeps the ring operations that stand in for events in flight: a receive into the
+ * request buffer for EPOLLIN and a hangup poll for EPOLLRDHUP. Writability needs
+ * nothing, since flushResponse sends directly.
+ */
+static inline void ringArm(connection* conn, unsigned events) {
+      if ((events & EPOLLIN) && !(conn->ring_ops & (1 << RING_RECV))) {
+            int room = REQUEST_BUFFER_SIZE - conn->request_len;
+            //a full buffer is answered with 413 before the connection reads again
+            if (room > 0 && uringRecv(server_ring, conn->fd, conn->request + conn->request_len, room, ringData(conn, RING_RECV))) {
+                  conn->ring_ops |= 1 << RING_RECV;
+            }
+      }
+      else if ((events & EPOLLRDHUP) && !(events & EPOLLIN) && !(conn->ring_ops & (1 << RING_POLL))) {
+            if (uringPoll(server_ring, conn->fd, POLLRDHUP, ringData(conn, RING_POLL))) conn->ring_ops |= 1 << RING_POLL;
+      }
+}
+
+/*
+ * Changes the events epoll reports for a connection, skipping the syscall if they are unchanged.
+ */
+static inline void watchEvents(connection* conn, unsigned events) {
+      if (server_ring != NULL) {
+            conn->epoll_events = events;
+            ringArm(conn, events);
+            return;
+      }
+      if (conn->epoll_events == events) return;
+      struct epoll_event ev;
+      ev.events = events;
+      ev.data.fd = conn->fd;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+      conn->epoll_events = events;
+}
+
+/*
+ * Creates the connection record for a newly accepted, non-blocking socket.
+ * Returns NULL if the descriptor cannot be tracked.
+ */
+static inline connection* openConnection(int fd2) {
+      if (fd2 < 0 || fd2 >= MAX_CONNECTIONS) return NULL;
+      connection* conn = (connection*) calloc(1, sizeof(connection));
+      if (conn == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return NULL;
+      }
+      conn->fd = fd2;
+      conn->keep_alive = true;  // wait for the first request however it arrives
+      if (server_ring != NULL) {
+            connections[fd2] = conn;
+            listTouch(&reading_list, conn);
+            watchEvents(conn, EPOLLIN);
+            return conn;
+      }
+      conn->epoll_events = EPOLLIN;
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = fd2;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd2, &ev) == -1) {
+            free(conn);
+            return NULL;
+      }
+      connections[fd2] = conn;
+      listTouch(&reading_list, conn);
+      return conn;
+}
+
+/*
+ * Unregisters, closes and frees a connection.
+ */
+static inline void closeConnection(connection* conn) {
+      listRemove(conn);
+      connections[conn->fd] = NULL;
+      if (server_ring != NULL && conn->ring_ops != 0) {
+            //queued operations must look the descriptor up before its number can be reused
+            if (server_ring->queued > 0) uringSubmit(server_ring, 0, 0);
+            for (int op = RING_RECV; op <= RING_POLL; op++) {
+                  if (conn->ring_ops & (1 << op)) uringCancel(server_ring, ringData(conn, op));
+            }
+            close(conn->fd);
+            conn->closed = true;
+            ring_closing++;
+            return;
+      }
+      if (server_ring == NULL) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+      close(conn->fd);
+      if (conn->ring_send_buf != conn->response) free(conn->ring_send_buf);
+      free(conn->response);
+      free(conn);
+}
+
+/*
+ * Records that a ring operation on a connection completed, and frees a closed connection
+ * once nothing is in flight. Returns false if the connection is closed.
+ */
+static inline bool ringCompleted(connection* conn, int op) {
+      conn->ring_ops &= ~(1u << op);
+      if (op == RING_SEND) {
+            if (conn->ring_send_buf != conn->response) free(conn->ring_send_buf);
+            conn->ring_send_buf = NULL;
+      }
+      if (!conn->closed) return true;
+      if (conn->ring_ops == 0) {
+            ring_closing--;
+            free(conn->response);
+            free(conn);
+      }
+      return false;
+}
+
+/*
+ * Appends bytes to the connection's pending response, growing the buffer as needed.
+ * Returns false if memory could not be allocated.
+ */
+static inline bool queueResponse(connection* conn, const char* data, int len) {
+      if (conn->response_len + len > conn->response_cap) {
+            int cap = conn->response_cap ? conn->response_cap : RESPONSE_BUFFER_SIZE;
+            while (cap < conn->response_len + len) cap *= 2;
+            //an in-flight send keeps reading the old buffer, which is freed when it completes
+            bool sending = conn->ring_send_buf != NULL && conn->ring_send_buf == conn->response;
+            char* grown = (char*) (sending ? malloc(cap) : realloc(conn->response, cap));
+            if (sending && grown != NULL) memcpy(grown, conn->response, conn->response_len);
+            if (grown == NULL) {
+                  printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+                  return false;
+            }
+            conn->response = grown;
+            conn->response_cap = cap;
+      }
+      memcpy(conn->response + conn->response_len, data, len);
+      conn->response_len += len;
+      return true;
+}
+
+/*
+ * Inserts bytes into the pending response at offset, ahead of what was queued after it.
+ * Returns false if memory could not be allocated.
+ */
+static inline bool insertResponse(connection* conn, int offset, const char* data, int len) {
+      int tail = conn->response_len - offset;
+      if (!queueResponse(conn, data, len)) return false;
+      memmove(conn->response + offset + len, conn->response + offset, tail);
+      memcpy(conn->response + offset, data, len);
+      return true;
+}
+
+/*
+ * Writes as much of the pending response as the socket will take without blocking.
+ * Returns 1 when everything was sent, 0 if the socket is full (on io_uring, if a send
+ * is on its way) and -1 on error.
+ */
+static inline int flushResponse(connection* conn) {
+      if (server_ring != NULL) {
+            if (conn->response_sent == conn->response_len) {
+                  conn->response_len = conn->response_sent = 0;
+                  return 1;
+            }
+            //the send's completion calls back in here, like writability does under epoll
+            if (!(conn->ring_ops & (1 << RING_SEND)) && uringSend(server_ring, conn->fd, conn->response + conn->response_sent,
+                                                                   conn->response_len - conn->response_sent, ringData(conn, RING_SEND))) {
+                  conn->ring_ops |= 1 << RING_SEND;
+                  conn->ring_send_buf = conn->response;
+            }
+            return 0;
+      }
+      while (conn->response_sent < conn->response_len) {
+            int completion_value = send(conn->fd, conn->response + conn->response_sent,
+                                        conn->response_len - conn->response_sent, MSG_NOSIGNAL);
+            if (completion_value < 0) {
+                  if (errno == EINTR) continue;
+                  if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                  if (metrics_local != NULL) counterAdd(&metrics_local->send_failures, 1);
+                  return -1;
+            }
+            conn->response_sent += completion_value;
+      }
+      conn->response_len = conn->response_sent = 0;
+      return 1;
+}
+
+/*
+ * Returns the connection a handler answering socket fd2 writes its response into,
+ * or NULL if there is none.
+ */
+static inline connection* replyFor(int fd2) {
+      if (handler_reply != NULL) return handler_reply;
+      if (fd2 < 0 || fd2 >= MAX_CONNECTIONS) return NULL;
+      return connections[fd2];
+}
+
+/*
+ * Queues len bytes for the client on socket fd2. The event loop flushes them.
+ */
+static inline void sendBytes(int fd2, const char* data, int len) {
+      connection* conn = replyFor(fd2);
+      if (conn != NULL) queueResponse(conn, data, len);
+}
+
+/*
+ * Sets the HTTP status of the response being built for the client on socket fd2.
+ */
+static inline void setStatus(int fd2, int status) {
+      connection* conn = replyFor(fd2);
+      if (conn != NULL) conn->http_status = status;
+}
+
+/*
+ * Sets the Content-Type of the response being built for the client on socket fd2.
+ */
+static inline void setContentType(int fd2, const char* content_type) {
+      connection* conn = replyFor(fd2);
+      if (conn != NULL) conn->http_content_type = content_type;
+}
+
+/*
+ * Tags the response being built for the client on socket fd2 with a version for conditional requests.
+ */
+static inline void setETag(int fd2, long long version) {
+      connection* conn = replyFor(fd2);
+      if (conn != NULL) conn->http_etag = version;
+}
+
+/*
+ * Queues a message for the client on socket fd2. The event loop flushes it.
+ */
+static inline void sendMessage(int fd2, const char* message) {
+      sendBytes(fd2, message, strlen(message));
+}
+
+/*
+ * Drops every connection whose read or write deadline has passed.
+ */
+static inline void expireConnections() {
+      long long now = nowMillis();
+      connection_list* lists[2] = { &reading_list, &writing_list };
+      for (int i = 0; i < 2; i++) {
+            while (lists[i]->head != NULL && lists[i]->head->deadline <= now) {
+                  closeConnection(lists[i]->head);
+            }
+      }
+}
+
+#endif
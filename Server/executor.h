@@ -0,0 +1,227 @@
+/*
+ * executor.h
+ *
+ * A work-stealing pool of worker threads for request handlers and background
+ * jobs, so a slow range query or a compaction pass runs beside the event loop
+ * instead of in it. Every worker owns a deque: tasks a worker submits itself
+ * go on the bottom of its own deque and it pops from the bottom, newest first,
+ * while its cache is still warm; tasks from other threads are dealt round-robin
+ * over the deques. A worker whose deque is empty steals the oldest task from
+ * the top of another one, so a burst landing on one worker spreads over all of
+ * them. Each deque has its own mutex, which only a thief ever contends for;
+ * idle workers sleep on a condition variable and are woken per submission.
+ */
+
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include "metrics.h"
+
+#define EXECUTOR_MAX_WORKERS 16
+#define EXECUTOR_DEQUE_SIZE 1024            // tasks per worker, a power of two
+
+typedef struct ExecutorTask executor_task;
+typedef struct WorkerDeque worker_deque;
+typedef struct Executor executor;
+
+struct ExecutorTask {
+  void (*run)(void* arg);
+  void* arg;
+};
+
+struct WorkerDeque {
+  pthread_mutex_t lock;
+  unsigned top;             // thieves take from here
+  unsigned bottom;          // the owner pushes and pops here
+  executor_task tasks[EXECUTOR_DEQUE_SIZE];
+} __attribute__((aligned(64)));
+
+struct Executor {
+  int workers;              // 0 until started; submissions then fail and callers run the task themselves
+  int metrics_shard;        // shard of worker 0, the others follow it
+  worker_deque deques[EXECUTOR_MAX_WORKERS];
+  pthread_t threads[EXECUTOR_MAX_WORKERS];
+  std::atomic<int> queued;  // tasks sitting in any deque
+  std::atomic<int> sleeping;
+  std::atomic<unsigned> next;
+  std::atomic<bool> stopping;
+  pthread_mutex_t sleep_lock;
+  pthread_cond_t wake;
+};
+
+typedef struct ExecutorWorker executor_worker;
+
+struct ExecutorWorker {
+  executor* pool;
+  int index;
+};
+
+//index of the calling thread's deque if it is one of the pool's workers, -1 otherwise
+thread_local int executor_self = -1;
+
+/*
+ * Returns the number of workers to start by default: one per online core.
+ */
+static inline int executorDefaultWorkers() {
+      long cores = sysconf(_SC_NPROCESSORS_ONLN);
+      if (cores < 1) return 1;
+      return cores > EXECUTOR_MAX_WORKERS ? EXECUTOR_MAX_WORKERS : (int) cores;
+}
+
+/*
+ * Pushes a task on the bottom of deque d. Returns false if it is full.
+ */
+static inline bool dequePush(worker_deque* d, const executor_task* task) {
+      pthread_mutex_lock(&d->lock);
+      if (d->bottom - d->top == EXECUTOR_DEQUE_SIZE) {
+            pthread_mutex_unlock(&d->lock);
+            return false;
+      }
+      d->tasks[d->bottom % EXECUTOR_DEQUE_SIZE] = *task;
+      d->bottom++;
+      pthread_mutex_unlock(&d->lock);
+      return true;
+}
+
+/*
+ * Takes the newest task (the owner) or the oldest (a thief) from deque d. Returns false if it is empty.
+ */
+static inline bool dequeTake(worker_deque* d, executor_task* task, bool steal) {
+      pthread_mutex_lock(&d->lock);
+      if (d->bottom == d->top) {
+            pthread_mutex_unlock(&d->lock);
+            return false;
+      }
+      if (steal) *task = d->tasks[d->top++ % EXECUTOR_DEQUE_SIZE];
+      else *task = d->tasks[--d->bottom % EXECUTOR_DEQUE_SIZE];
+      pthread_mutex_unlock(&d->lock);
+      return true;
+}
+
+/*
+ * Finds the next task for worker self: its own deque first, then the others in turn.
+ */
+static inline bool executorFind(executor* pool, int self, executor_task* task) {
+      if (dequeTake(&pool->deques[self], task, false)) return true;
+      for (int i = 1; i < pool->workers; i++) {
+            if (dequeTake(&pool->deques[(self + i) % pool->workers], task, true)) {
+                  if (metrics_local != NULL) counterAdd(&metrics_local->tasks_stolen, 1);
+                  return true;
+            }
+      }
+      return false;
+}
+
+/*
+ * Runs tasks until the pool is stopped and every queued task has run.
+ */
+static inline void* executorWorker(void* p) {
+      executor_worker* worker = (executor_worker*) p;
+      executor* pool = worker->pool;
+      executor_self = worker->index;
+      if (pool->metrics_shard >= 0) metricsRegisterThread(pool->metrics_shard + worker->index);
+      while (true) {
+            executor_task task;
+            if (executorFind(pool, executor_self, &task)) {
+                  pool->queued.fetch_sub(1);
+                  task.run(task.arg);
+                  if (metrics_local != NULL) counterAdd(&metrics_local->tasks_run, 1);
+                  continue;
+            }
+            //a submitter bumps queued before it looks for sleepers, so one of the two sees the other
+            pthread_mutex_lock(&pool->sleep_lock);
+            pool->sleeping.fetch_add(1);
+            while (pool->queued.load() == 0 && !pool->stopping.load()) pthread_cond_wait(&pool->wake, &pool->sleep_lock);
+            pool->sleeping.fetch_sub(1);
+            bool done = pool->stopping.load() && pool->queued.load() == 0;
+            pthread_mutex_unlock(&pool->sleep_lock);
+            if (done) break;
+      }
+      free(worker);
+      return NULL;
+}
+
+/*
+ * Starts workers threads (at most EXECUTOR_MAX_WORKERS). Worker i records metrics into
+ * shard metrics_shard + i, or nowhere if metrics_shard is -1. Returns false if they
+ * could not all be started, in which case submissions keep failing.
+ */
+static inline bool executorStart(executor* pool, int workers, int metrics_shard) {
+      if (workers > EXECUTOR_MAX_WORKERS) workers = EXECUTOR_MAX_WORKERS;
+      if (workers < 1) workers = 1;
+      //fixed before any worker starts, since thieves walk every deque up to it
+      pool->workers = workers;
+      pool->metrics_shard = metrics_shard;
+      pool->queued = 0;
+      pool->sleeping = 0;
+      pool->next = 0;
+      pool->stopping = false;
+      pthread_mutex_init(&pool->sleep_lock, NULL);
+      pthread_cond_init(&pool->wake, NULL);
+      for (int i = 0; i < workers; i++) {
+            pthread_mutex_init(&pool->deques[i].lock, NULL);
+            pool->deques[i].top = pool->deques[i].bottom = 0;
+      }
+      int started = 0;
+      for (; started < workers; started++) {
+            executor_worker* worker = (executor_worker*) malloc(sizeof(executor_worker));
+            if (worker == NULL) {
+                  printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+                  break;
+            }
+            worker->pool = pool;
+            worker->index = started;
+            if (pthread_create(&pool->threads[started], NULL, executorWorker, worker) != 0) {
+                  perror("Executor");
+                  free(worker);
+                  break;
+            }
+      }
+      if (started == workers) return true;
+      //nothing was submitted yet, so the ones that did start just exit
+      pthread_mutex_lock(&pool->sleep_lock);
+      pool->stopping = true;
+      pthread_cond_broadcast(&pool->wake);
+      pthread_mutex_unlock(&pool->sleep_lock);
+      for (int i = 0; i < started; i++) pthread_join(pool->threads[i], NULL);
+      pool->workers = 0;
+      return false;
+}
+
+/*
+ * Queues fn(arg) to run on a worker. Safe to call from any thread, including a task.
+ * Returns false if the pool is not running or the chosen deque is full; the caller
+ * should then run the task itself. Submitting threads must be done before executorStop.
+ */
+static inline bool executorSubmit(executor* pool, void (*fn)(void*), void* arg) {
+      if (pool->workers == 0 || pool->stopping.load()) return false;
+      executor_task task = { fn, arg };
+      int d = executor_self >= 0 ? executor_self : (int) (pool->next.fetch_add(1) % pool->workers);
+      if (!dequePush(&pool->deques[d], &task)) return false;
+      pool->queued.fetch_add(1);
+      if (pool->sleeping.load() > 0) {
+            pthread_mutex_lock(&pool->sleep_lock);
+            pthread_cond_signal(&pool->wake);
+            pthread_mutex_unlock(&pool->sleep_lock);
+      }
+      return true;
+}
+
+/*
+ * Stops accepting tasks, lets the workers finish every queued one and joins them.
+ */
+static inline void executorStop(executor* pool) {
+      if (pool->workers == 0) return;
+      pthread_mutex_lock(&pool->sleep_lock);
+      pool->stopping = true;
+      pthread_cond_broadcast(&pool->wake);
+      pthread_mutex_unlock(&pool->sleep_lock);
+      for (int i = 0; i < pool->workers; i++) pthread_join(pool->threads[i], NULL);
+      pool->workers = 0;
+}
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * http_request.h
+ *
+ * Incremental HTTP/1.x request parser for the event loop. The parser works in
+ * place on a connection's request buffer and is simply called again whenever
+ * more bytes arrive: it returns HTTP_PARSE_MORE until a whole request (request
+ * line, headers and any Content-Length body) is buffered, remembering how far
+ * it already searched for the end of the headers so partial reads are not
+ * rescanned. A request line without a version is treated as HTTP/0.9, which is
+ * what the Pebble and plain telnet sessions used to send.
+ */
+
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define HTTP_PARSE_BAD -1
+#define HTTP_PARSE_MORE 0
+#define HTTP_PARSE_DONE 1
+
+#define HTTP_GET 1
+#define HTTP_HEAD 2
+#define HTTP_OTHER 3
+
+typedef struct HttpRequest http_request;
+
+struct HttpRequest {
+  int method;                 // HTTP_GET, HTTP_HEAD or HTTP_OTHER
+  int version;                // minor version of HTTP/1.x, -1 for an HTTP/0.9 request line
+  const char* target;         // path and query, not NUL-terminated
+  int target_len;
+  bool keep_alive;            // connection stays open after the response
+  bool chunked;               // request body uses Transfer-Encoding, which is not supported
+  long long content_length;
+  long long if_none_match;    // version in an If-None-Match: "N" header, -1 if there is none
+  int length;                 // bytes this request occupies in the buffer, body included
+};
+
+/*
+ * Returns true if the header line [line, end) is named name (case-insensitive) and
+ * points value at its trimmed value.
+ */
+static inline bool httpHeader(const char* line, const char* end, const char* name, const char** value, int* value_len) {
+      int name_len = strlen(name);
+      if (end - line <= name_len || line[name_len] != ':' || strncasecmp(line, name, name_len) != 0) return false;
+      const char* v = line + name_len + 1;
+      while (v < end && (*v == ' ' || *v == '\t')) v++;
+      while (end > v && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+      *value = v;
+      *value_len = end - v;
+      return true;
+}
+
+/*
+ * Returns true if the comma-separated header value contains token (case-insensitive).
+ */
+static inline bool httpHasToken(const char* value, int len, const char* token) {
+      int token_len = strlen(token);
+      for (int i = 0; i + token_len <= len; i++) {
+            if (strncasecmp(value + i, token, token_len) == 0
+                && (i == 0 || value[i - 1] == ',' || value[i - 1] == ' ')
+                && (i + token_len == len || value[i + token_len] == ',' || value[i + token_len] == ' ')) return true;
+      }
+      return false;
+}
+
+/*
+ * Parses the request at the start of buf[0..len). scan holds how far an earlier call
+ * searched for the end of the headers and must be reset to 0 for every new request.
+ * Returns HTTP_PARSE_DONE and fills req once the whole request is buffered,
+ * HTTP_PARSE_MORE if more bytes are needed and HTTP_PARSE_BAD for a malformed request.
+ */
+static inline int httpParse(const char* buf, int len, int* scan, http_request* req) {
+      //tolerate the stray CRLF some clients send between requests
+      int start = 0;
+      while (start < len && (buf[start] == '\r' || buf[start] == '\n')) start++;
+      const char* line_end = (const char*) memchr(buf + start, '\n', len - start);
+      if (line_end == NULL) return HTTP_PARSE_MORE;
+
+      //request line: METHOD SP target [SP HTTP/1.x]
+      const char* p = buf + start;
+      const char* sp = (const char*) memchr(p, ' ', line_end - p);
+      if (sp == NULL) return HTTP_PARSE_BAD;
+      if (sp - p == 3 && strncmp(p, "GET", 3) == 0) req->method = HTTP_GET;
+      else if (sp - p == 4 && strncmp(p, "HEAD", 4) == 0) req->method = HTTP_HEAD;
+      else req->method = HTTP_OTHER;
+      req->target = sp + 1;
+      const char* target_end = req->target;
+      while (target_end < line_end && *target_end != ' ' && *target_end != '\r') target_end++;
+      req->target_len = target_end - req->target;
+      if (req->target_len == 0 || req->target[0] != '/') return HTTP_PARSE_BAD;
+      req->keep_alive = false;
+      req->chunked = false;
+      req->content_length = 0;
+      req->if_none_match = -1;
+      if (*target_end != ' ') {
+            req->version = -1;
+            req->length = line_end + 1 - buf;
+            return HTTP_PARSE_DONE;
+      }
+      const char* version = target_end + 1;
+      if (line_end - version < 8 || strncmp(version, "HTTP/1.", 7) != 0 || version[7] < '0' || version[7] > '9') return HTTP_PARSE_BAD;
+      req->version = version[7] - '0';
+      req->keep_alive = req->version >= 1;
+
+      //find the blank line ending the headers, resuming where the last call stopped
+      int header_end = -1;
+      int i = *scan > line_end - buf ? *scan : line_end - buf;
+      for (; i < len; i++) {
+            if (buf[i] != '\n') continue;
+            if (i + 1 < len && buf[i + 1] == '\n') header_end = i + 2;
+            else if (i + 2 < len && buf[i + 1] == '\r' && buf[i + 2] == '\n') header_end = i + 3;
+            else if (i + 2 >= len) break;
+            if (header_end != -1) break;
+      }
+      if (header_end == -1) {
+            *scan = i;
+            return HTTP_PARSE_MORE;
+      }
+
+      //headers that affect framing and persistence
+      const char* line = line_end + 1;
+      while (line < buf + header_end) {
+            const char* end = (const char*) memchr(line, '\n', buf + header_end - line);
+            const char* value;
+            int value_len;
+            if (httpHeader(line, end, "Connection", &value, &value_len)) {
+                  if (httpHasToken(value, value_len, "close")) req->keep_alive = false;
+                  else if (httpHasToken(value, value_len, "keep-alive")) req->keep_alive = true;
+            }
+            else if (httpHeader(line, end, "Content-Length", &value, &value_len)) {
+                  char* digits_end;
+                  req->content_length = strtoll(value, &digits_end, 10);
+                  if (value_len == 0 || digits_end != value + value_len || req->content_length < 0) return HTTP_PARSE_BAD;
+            }
+            else if (httpHeader(line, end, "Transfer-Encoding", &value, &value_len)) {
+                  req->chunked = true;
+            }
+            else if (httpHeader(line, end, "If-None-Match", &value, &value_len)) {
+                  //only the server's own "N" tags mean anything, weak or not
+                  if (value_len > 2 && value[0] == 'W' && value[1] == '/') {
+                        value += 2;
+                        value_len -= 2;
+                  }
+                  if (value_len > 2 && value[0] == '"' && value[1] >= '0' && value[1] <= '9') req->if_none_match = strtoll(value + 1, NULL, 10);
+            }
+            line = end + 1;
+      }
+      if (req->chunked) {
+            req->length = header_end;
+            return HTTP_PARSE_DONE;
+      }
+      if (req->content_length > len - header_end) return HTTP_PARSE_MORE;
+      req->length = header_end + req->content_length;
+      return HTTP_PARSE_DONE;
+}
+
+/*
+ * Returns the reason phrase for the status codes the server sends.
+ */
+static inline const char* httpReason(int status) {
+      switch (status) {
+            case 200: return "OK";
+            case 304: return "Not Modified";
+            case 400: return "Bad Request";
+            case 404: return "Not Found";
+            case 405: return "Method Not Allowed";
+            case 413: return "Content Too Large";
+            case 501: return "Not Implemented";
+      }
+      return "Internal Server Error";
+}
+
+#endif
@@ -0,0 +1,470 @@
+/*
+ * journal.h
+ *
+ * Append-only history of what happened to the sensors, kept across restarts in
+ * <ring_dir>/watchdog.journal: motion trips, alarm resets, standby toggles, unit
+ * changes, message commands and Arduino error transitions, each with its time,
+ * sensor and where it came from (the client's address for requests). Records
+ * have a fixed size, so record n sits at a known offset and has sequence number n + 1.
+ *
+ * Any thread posts an event with journalPost, which only copies it into the pending
+ * batch under the mutex. The journal's own thread writes each batch with one write and
+ * one fdatasync (group commit), so the ingest thread and the request handlers never wait
+ * on the disk; events posted while a flush runs go out together in the next one. When
+ * the pending batch is full the new event is dropped and counted.
+ *
+ * Readers only see committed records. The writer keeps an in-memory index of them:
+ * the latest time up to the end of every JOURNAL_INDEX_STRIDE records, so the start of
+ * a time range is a binary search even if the clock once stepped back, and the record
+ * numbers of every event type, so paging through one type never reads the others. A
+ * record torn by a crash mid-write fails its checksum and is cut off on open. The mutex
+ * guards the pending batch and the index and is never held across file I/O.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "metrics.h"
+
+#define JOURNAL_MAGIC 0x4e524a57            // "WJRN"
+#define JOURNAL_VERSION 1
+#define JOURNAL_PENDING 1024                // events posted but not yet handed to the writer
+#define JOURNAL_INDEX_STRIDE 64             // records per time index entry
+#define JOURNAL_SCAN_LIMIT 4096             // records one page may look at before it stops
+#define JOURNAL_MAX_PAGE 200
+#define JOURNAL_SENSOR_LENGTH 32
+#define JOURNAL_ORIGIN_LENGTH 40
+
+#define JOURNAL_TRIP 1
+#define JOURNAL_RESET 2                     // state: 1 if the alarm was tripped when reset
+#define JOURNAL_STANDBY 3                   // state: 1 engaged, 0 disengaged
+#define JOURNAL_UNIT 4                      // state: the unit now shown, 'c' or 'F'
+#define JOURNAL_MESSAGE 5
+#define JOURNAL_ERROR 6                     // state: 1 into the error state, 0 out of it
+#define JOURNAL_TYPES 7
+
+typedef struct JournalHeader journal_header;
+typedef struct JournalRecord journal_record;
+typedef struct JournalQuery journal_query;
+typedef struct Journal journal;
+
+struct JournalHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t reserved[5];   // pads the header to 32 bytes
+};
+
+struct JournalRecord {
+  uint32_t checksum;      // FNV-1a of the rest of the record
+  uint16_t type;
+  int16_t state;
+  uint64_t seq;
+  int64_t time;           // ms since the epoch
+  char sensor[JOURNAL_SENSOR_LENGTH];
+  char origin[JOURNAL_ORIGIN_LENGTH];
+};
+
+//one page of history: records matching every filter, walking from cursor (exclusive)
+struct JournalQuery {
+  int type;               // 0 for every type
+  const char* sensor;     // NULL for every sensor
+  int64_t since;          // ms, INT64_MIN for no bound
+  uint64_t cursor;        // 0 to start at the newest (backward) or the oldest (forward)
+  bool backward;          // newest first
+};
+
+struct Journal {
+  bool opened;                      // events posted before journalOpen succeeds are ignored
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;              // signalled when events are posted or the writer should stop
+  journal_record* pending;          // posted events, handed to the writer whole
+  journal_record* flushing;         // the batch the writer is writing
+  int pending_count;
+  bool stopping;
+  bool running;
+  pthread_t writer;
+  uint64_t committed;               // records durable on disk
+  int64_t latest;                   // latest time among them
+  int64_t* stride_latest;           // latest time up to the end of each stride, the last one partial
+  int stride_cap;
+  uint32_t* by_type[JOURNAL_TYPES]; // record numbers of each type, ascending
+  int type_count[JOURNAL_TYPES];
+  int type_cap[JOURNAL_TYPES];
+  metric_counter records;           // counters below are written by the writer, dropped under the lock
+  metric_counter commits;
+  metric_counter dropped;
+  metric_histogram commit_latency;  // write plus fdatasync of one batch
+};
+
+journal event_journal;
+
+static inline uint32_t journalChecksum(const journal_record* record) {
+      const uint8_t* p = (const uint8_t*) record + sizeof(record->checksum);
+      uint32_t hash = 2166136261u;
+      for (size_t i = 0; i < sizeof(journal_record) - sizeof(record->checksum); i++) hash = (hash ^ p[i]) * 16777619u;
+      return hash;
+}
+
+static inline off_t journalOffset(uint64_t seq) {
+      return sizeof(journal_header) + (off_t) (seq - 1) * sizeof(journal_record);
+}
+
+static inline const char* journalTypeName(int type) {
+      static const char* names[JOURNAL_TYPES] = { "", "trip", "reset", "standby", "unit", "message", "error" };
+      return type > 0 && type < JOURNAL_TYPES ? names[type] : "";
+}
+
+/*
+ * Returns the event type called name, or 0 if there is none.
+ */
+static inline int journalType(const char* name) {
+      for (int type = 1; type < JOURNAL_TYPES; type++) {
+            if (strcmp(journalTypeName(type), name) == 0) return type;
+      }
+      return 0;
+}
+
+/*
+ * Returns array grown to hold at least need elements of size bytes, or NULL if memory
+ * could not be allocated (array is then left as it was).
+ */
+static inline void* journalGrow(void* array, int* cap, int need, size_t size) {
+      if (need <= *cap) return array;
+      int grown_cap = *cap ? *cap * 2 : 1024;
+      while (grown_cap < need) grown_cap *= 2;
+      void* grown = realloc(array, grown_cap * size);
+      if (grown == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return NULL;
+      }
+      *cap = grown_cap;
+      return grown;
+}
+
+/*
+ * Adds committed record seq to the index. Called with the lock held, or before the writer starts.
+ */
+static inline bool journalIndex(journal* j, const journal_record* record) {
+      uint64_t n = record->seq - 1;
+      int stride = n / JOURNAL_INDEX_STRIDE;
+      int type = record->type;
+      int64_t* strides = (int64_t*) journalGrow(j->stride_latest, &j->stride_cap, stride + 1, sizeof(int64_t));
+      if (strides == NULL) return false;
+      j->stride_latest = strides;
+      uint32_t* list = (uint32_t*) journalGrow(j->by_type[type], &j->type_cap[type], j->type_count[type] + 1, sizeof(uint32_t));
+      if (list == NULL) return false;
+      j->by_type[type] = list;
+      if (n == 0 || record->time > j->latest) j->latest = record->time;
+      j->stride_latest[stride] = j->latest;
+      j->by_type[type][j->type_count[type]++] = n;
+      j->committed = record->seq;
+      return true;
+}
+
+/*
+ * Grows the index to take count records numbered from first, so indexing them once they
+ * are written cannot fail. Called with the lock held. Returns false if memory runs out.
+ */
+static inline bool journalReserve(journal* j, const journal_record* batch, int count, uint64_t first) {
+      int stride = (first + count - 2) / JOURNAL_INDEX_STRIDE;
+      int64_t* strides = (int64_t*) journalGrow(j->stride_latest, &j->stride_cap, stride + 1, sizeof(int64_t));
+      if (strides == NULL) return false;
+      j->stride_latest = strides;
+      int need[JOURNAL_TYPES] = {0};
+      for (int i = 0; i < count; i++) need[batch[i].type]++;
+      for (int type = 1; type < JOURNAL_TYPES; type++) {
+            if (need[type] == 0) continue;
+            uint32_t* list = (uint32_t*) journalGrow(j->by_type[type], &j->type_cap[type], j->type_count[type] + need[type], sizeof(uint32_t));
+            if (list == NULL) return false;
+            j->by_type[type] = list;
+      }
+      return true;
+}
+
+/*
+ * Opens the journal in dir, creating it if needed, cuts off a torn tail and indexes what
+ * is left. Returns false if the file cannot be opened.
+ */
+static inline bool journalOpen(journal* j, const char* dir) {
+      j->pending_count = 0;
+      j->stopping = j->running = false;
+      j->committed = 0;
+      j->latest = 0;
+      j->stride_latest = NULL;
+      j->stride_cap = 0;
+      for (int type = 0; type < JOURNAL_TYPES; type++) {
+            j->by_type[type] = NULL;
+            j->type_count[type] = j->type_cap[type] = 0;
+      }
+      pthread_mutex_init(&j->lock, NULL);
+      pthread_cond_init(&j->wake, NULL);
+      char path[512];
+      snprintf(path, sizeof(path), "%s/watchdog.journal", dir);
+      int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      j->pending = (journal_record*) malloc(JOURNAL_PENDING * sizeof(journal_record));
+      j->flushing = (journal_record*) malloc(JOURNAL_PENDING * sizeof(journal_record));
+      if (j->pending == NULL || j->flushing == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            if (fd != -1) close(fd);
+            return false;
+      }
+      if (fd == -1) {
+            perror("Journal");
+            return false;
+      }
+      journal_header header;
+      if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || header.magic != JOURNAL_MAGIC
+          || header.version != JOURNAL_VERSION || header.record_size != sizeof(journal_record)) {
+            //a new file, or one this build cannot read, starts over
+            memset(&header, 0, sizeof(header));
+            header.magic = JOURNAL_MAGIC;
+            header.version = JOURNAL_VERSION;
+            header.record_size = sizeof(journal_record);
+            if (ftruncate(fd, 0) == -1 || pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || fdatasync(fd) == -1) {
+                  perror("Journal");
+                  close(fd);
+                  return false;
+            }
+      }
+      journal_record chunk[256];
+      while (true) {
+            ssize_t got = pread(fd, chunk, sizeof(chunk), journalOffset(j->committed + 1));
+            int records = got > 0 ? got / sizeof(journal_record) : 0;
+            int good = 0;
+            while (good < records && chunk[good].seq == j->committed + 1 && chunk[good].type > 0 && chunk[good].type < JOURNAL_TYPES
+                   && chunk[good].checksum == journalChecksum(&chunk[good]) && journalIndex(j, &chunk[good])) good++;
+            if (good < (int) (sizeof(chunk) / sizeof(journal_record))) break;
+      }
+      if (ftruncate(fd, journalOffset(j->committed + 1)) == -1) perror("Journal");
+      j->fd = fd;
+      j->opened = true;
+      return true;
+}
+
+/*
+ * Queues an event for the writer. Safe to call from any thread, and a no-op before the
+ * journal is opened. Never waits for the disk.
+ */
+static inline void journalPost(journal* j, int type, const char* sensor, int state, const char* origin, int64_t time) {
+      if (!j->opened) return;
+      pthread_mutex_lock(&j->lock);
+      if (j->pending_count == JOURNAL_PENDING) {
+            counterAdd(&j->dropped, 1);
+            pthread_mutex_unlock(&j->lock);
+            return;
+      }
+      journal_record* record = &j->pending[j->pending_count++];
+      memset(record, 0, sizeof(journal_record));
+      record->type = type;
+      record->state = state;
+      record->time = time;
+      snprintf(record->sensor, sizeof(record->sensor), "%.*s", (int) sizeof(record->sensor) - 1, sensor);
+      snprintf(record->origin, sizeof(record->origin), "%.*s", (int) sizeof(record->origin) - 1, origin);
+      pthread_cond_signal(&j->wake);
+      pthread_mutex_unlock(&j->lock);
+}
+
+/*
+ * Writes count records, numbered from first, and waits for them to reach the disk.
+ * Returns false on an I/O error.
+ */
+static inline bool journalWrite(journal* j, journal_record* batch, int count, uint64_t first) {
+      for (int i = 0; i < count; i++) {
+            batch[i].seq = first + i;
+            batch[i].checksum = journalChecksum(&batch[i]);
+      }
+      const char* p = (const char*) batch;
+      size_t left = count * sizeof(journal_record);
+      off_t offset = journalOffset(first);
+      while (left > 0) {
+            ssize_t n = pwrite(j->fd, p, left, offset);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            left -= n;
+            offset += n;
+      }
+      return fdatasync(j->fd) == 0;
+}
+
+/*
+ * The writer thread: takes the whole pending batch, commits it and indexes it, until
+ * the journal is stopped and everything posted is written.
+ */
+static inline void* journalWriter(void* p) {
+      journal* j = (journal*) p;
+      pthread_mutex_lock(&j->lock);
+      while (true) {
+            while (j->pending_count == 0 && !j->stopping) pthread_cond_wait(&j->wake, &j->lock);
+            if (j->pending_count == 0) break;
+            journal_record* batch = j->pending;
+            int count = j->pending_count;
+            j->pending = j->flushing;
+            j->flushing = batch;
+            j->pending_count = 0;
+            uint64_t first = j->committed + 1;
+            if (!journalReserve(j, batch, count, first)) {
+                  //nothing was written, so the next batch takes the same sequence numbers
+                  counterAdd(&j->dropped, count);
+                  continue;
+            }
+            pthread_mutex_unlock(&j->lock);
+            long long start = metricsNanos();
+            bool ok = journalWrite(j, batch, count, first);
+            histogramRecord(&j->commit_latency, metricsNanos() - start);
+            counterAdd(&j->commits, 1);
+            pthread_mutex_lock(&j->lock);
+            if (!ok) {
+                  //the batch is lost; the next one overwrites whatever part of it reached the file
+                  perror("Journal");
+                  counterAdd(&j->dropped, count);
+                  continue;
+            }
+            //journalReserve made room, so every record written is indexed and committed
+            for (int i = 0; i < count; i++) journalIndex(j, &batch[i]);
+            counterAdd(&j->records, count);
+      }
+      pthread_mutex_unlock(&j->lock);
+      return NULL;
+}
+
+/*
+ * Starts the writer thread. Returns false if it cannot be created.
+ */
+static inline bool journalStart(journal* j) {
+      if (pthread_create(&j->writer, NULL, journalWriter, j) != 0) {
+            printf("Couldn't start the journal writer.\n");
+            return false;
+      }
+      j->running = true;
+      return true;
+}
+
+/*
+ * Writes out everything still pending, stops the writer and closes the journal.
+ */
+static inline void journalStop(journal* j) {
+      if (!j->opened) return;
+      if (j->running) {
+            pthread_mutex_lock(&j->lock);
+            j->stopping = true;
+            pthread_cond_signal(&j->wake);
+            pthread_mutex_unlock(&j->lock);
+            pthread_join(j->writer, NULL);
+            j->running = false;
+      }
+      j->opened = false;
+      close(j->fd);
+      free(j->pending);
+      free(j->flushing);
+      free(j->stride_latest);
+      for (int type = 0; type < JOURNAL_TYPES; type++) free(j->by_type[type]);
+}
+
+/*
+ * Returns the sequence number of the first committed record at or after since by the
+ * time index: every record before it is older. Called with the lock held.
+ */
+static inline uint64_t journalSeek(const journal* j, int64_t since) {
+      int strides = (j->committed + JOURNAL_INDEX_STRIDE - 1) / JOURNAL_INDEX_STRIDE;
+      int lo = 0, hi = strides;
+      while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (j->stride_latest[mid] < since) lo = mid + 1;
+            else hi = mid;
+      }
+      return (uint64_t) lo * JOURNAL_INDEX_STRIDE + 1;
+}
+
+/*
+ * Collects up to max sequence numbers of records of the query's type, walking from pos
+ * (inclusive) towards end (inclusive). Called with the lock held.
+ */
+static inline int journalCandidates(const journal* j, const journal_query* q, uint64_t pos, uint64_t end, uint64_t* seqs, int max) {
+      int n = 0;
+      if (q->type == 0) {
+            while (n < max && (q->backward ? pos >= end : pos <= end)) {
+                  seqs[n++] = pos;
+                  pos += q->backward ? -1 : 1;
+            }
+            return n;
+      }
+      const uint32_t* list = j->by_type[q->type];
+      int lo = 0, hi = j->type_count[q->type];
+      //first entry past pos - 1, i.e. at or after pos
+      while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if ((uint64_t) list[mid] + 1 < pos) lo = mid + 1;
+            else hi = mid;
+      }
+      if (q->backward) {
+            int i = lo < j->type_count[q->type] && list[lo] + 1 == pos ? lo : lo - 1;
+            for (; i >= 0 && n < max && (uint64_t) list[i] + 1 >= end; i--) seqs[n++] = list[i] + 1;
+      }
+      else {
+            for (int i = lo; i < j->type_count[q->type] && n < max && (uint64_t) list[i] + 1 <= end; i++) seqs[n++] = list[i] + 1;
+      }
+      return n;
+}
+
+/*
+ * Reads one page of history into out, at most max records. Sets *next to the cursor
+ * that continues the page, or 0 if nothing is left. Returns the records found, or -1
+ * on a read error.
+ */
+static inline int journalPage(journal* j, const journal_query* q, journal_record* out, int max, uint64_t* next) {
+      *next = 0;
+      if (!j->opened) return 0;
+      pthread_mutex_lock(&j->lock);
+      uint64_t committed = j->committed;
+      uint64_t oldest = q->since == INT64_MIN || committed == 0 ? 1 : journalSeek(j, q->since);
+      pthread_mutex_unlock(&j->lock);
+      uint64_t pos, end;
+      if (q->backward) {
+            pos = q->cursor != 0 && q->cursor - 1 < committed ? q->cursor - 1 : committed;
+            end = oldest;
+            if (pos < end || pos == 0) return 0;
+      }
+      else {
+            pos = q->cursor + 1 > oldest ? q->cursor + 1 : oldest;
+            end = committed;
+            if (pos > end) return 0;
+      }
+      int found = 0, scanned = 0;
+      while (found < max && scanned < JOURNAL_SCAN_LIMIT) {
+            uint64_t seqs[64];
+            pthread_mutex_lock(&j->lock);
+            int n = journalCandidates(j, q, pos, end, seqs, 64);
+            pthread_mutex_unlock(&j->lock);
+            if (n == 0) {
+                  *next = 0;
+                  return found;
+            }
+            for (int i = 0; i < n && found < max; i++) {
+                  journal_record record;
+                  if (pread(j->fd, &record, sizeof(record), journalOffset(seqs[i])) != (ssize_t) sizeof(record)) return -1;
+                  scanned++;
+                  *next = seqs[i];
+                  pos = q->backward ? seqs[i] - 1 : seqs[i] + 1;
+                  if (record.time < q->since || (q->sensor != NULL && strcmp(record.sensor, q->sensor) != 0)) continue;
+                  out[found++] = record;
+            }
+            if (q->backward ? pos < end || pos == 0 : pos > end) {
+                  *next = 0;
+                  return found;
+            }
+      }
+      return found;
+}
+
+#endif
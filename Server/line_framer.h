@@ -0,0 +1,122 @@
+/*
+ * line_framer.h
+ *
+ * Splits the Arduino's serial stream into '\n'-terminated lines. Each read()
+ * buffer is scanned with memchr and complete lines are handed to the callback
+ * as pointers into that buffer; only a line split across reads is copied into
+ * the framer's fixed partial buffer. Temperatures are parsed as fixed point
+ * (1/10000 degree) without atof or any other locale-aware conversion.
+ */
+
+#ifndef LINE_FRAMER_H
+#define LINE_FRAMER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define LINE_MAX_LENGTH 64
+
+typedef struct LineFramer line_framer;
+typedef void (*line_handler)(const char* line, int len, void* context);
+
+struct LineFramer {
+  char partial[LINE_MAX_LENGTH];
+  int len;
+  bool overflow;          // the current line outgrew partial and is being skipped
+  long long lines;        // complete lines delivered
+  long long dropped;      // overlong lines discarded
+};
+
+/*
+ * Resets the framer to the start of a line.
+ */
+static inline void framerInit(line_framer* framer) {
+      framer->len = 0;
+      framer->overflow = false;
+      framer->lines = 0;
+      framer->dropped = 0;
+}
+
+/*
+ * Delivers one line to handler, without its trailing '\r' if the sender used CRLF.
+ */
+static inline void framerDeliver(line_framer* framer, const char* line, int len, line_handler handler, void* context) {
+      if (len > 0 && line[len - 1] == '\r') len--;
+      framer->lines++;
+      handler(line, len, context);
+}
+
+/*
+ * Scans n bytes of data for complete lines and calls handler for each of them.
+ * A trailing partial line is kept for the next call.
+ */
+static inline void framerFeed(line_framer* framer, const char* data, int n, line_handler handler, void* context) {
+      const char* end = data + n;
+      while (data < end) {
+            const char* newline = (const char*) memchr(data, '\n', end - data);
+            int chunk = (newline ? newline : end) - data;
+            if (framer->overflow) {
+                  //discard the rest of an overlong line
+            }
+            else if (framer->len + chunk > LINE_MAX_LENGTH) {
+                  framer->overflow = true;
+            }
+            else if (newline != NULL && framer->len == 0) {
+                  //whole line inside this buffer: hand it over in place
+                  framerDeliver(framer, data, chunk, handler, context);
+            }
+            else {
+                  memcpy(framer->partial + framer->len, data, chunk);
+                  framer->len += chunk;
+                  if (newline != NULL) framerDeliver(framer, framer->partial, framer->len, handler, context);
+            }
+            if (newline == NULL) break;
+            if (framer->overflow) framer->dropped++;
+            framer->overflow = false;
+            framer->len = 0;
+            data = newline + 1;
+      }
+}
+
+/*
+ * Parses a decimal temperature such as "23.1250" or "-274.0" into 1/10000 degrees.
+ * Digits past the fourth decimal place are ignored. Returns false unless the whole
+ * text is a number.
+ */
+static inline bool parseFixedTemp(const char* text, int len, int32_t* result) {
+      const char* p = text;
+      const char* end = text + len;
+      bool negative = false;
+      if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p == '-';
+            p++;
+      }
+      int32_t whole = 0;
+      int digits = 0;
+      while (p < end && *p >= '0' && *p <= '9') {
+            if (whole > 100000) return false;
+            whole = whole * 10 + (*p - '0');
+            p++;
+            digits++;
+      }
+      int32_t fraction = 0;
+      int places = 0;
+      if (p < end && *p == '.') {
+            p++;
+            while (p < end && *p >= '0' && *p <= '9') {
+                  if (places < 4) {
+                        fraction = fraction * 10 + (*p - '0');
+                        places++;
+                  }
+                  p++;
+                  digits++;
+            }
+      }
+      if (p != end || digits == 0) return false;
+      for (; places < 4; places++) fraction *= 10;
+      int32_t value = whole * 10000 + fraction;
+      *result = negative ? -value : value;
+      return true;
+}
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * metrics.h
+ *
+ * Counters and latency histograms for the /metrics route. Every counter has a
+ * single writing thread, so updates are a relaxed load and store with no lock
+ * prefix or shared cache line; the scrape (on the server thread) just loads
+ * them. Values that belong to a thread rather than a sensor live in that
+ * thread's shard, which the thread selects once with metricsRegisterThread;
+ * every executor worker has a shard of its own. Threads that never register
+ * (the benchmarks) record nothing.
+ *
+ * Histograms are log-linear like HdrHistogram: exact below 32ns, then 16
+ * buckets per power of two, so any quantile is within about 6% of the truth.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define METRICS_SERVER 0
+#define METRICS_INGEST 1
+#define METRICS_WORKER 2            // executor worker i records into METRICS_WORKER + i
+#define METRICS_SHARDS 18           // room for EXECUTOR_MAX_WORKERS workers
+
+#define METRIC_ROUTE_METRICS 26     // routes 0-25 are the single-letter routes a-z
+#define METRIC_ROUTE_OTHER 27
+#define METRIC_ROUTES 28
+
+#define HISTOGRAM_BUCKETS 1024
+
+typedef struct MetricCounter metric_counter;
+typedef struct MetricHistogram metric_histogram;
+typedef struct MetricsShard metrics_shard;
+
+struct MetricCounter {
+  std::atomic<uint64_t> value;
+};
+
+struct MetricHistogram {
+  std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS];
+  metric_counter total;
+  metric_counter sum_ns;
+};
+
+struct MetricsShard {
+  metric_counter accepts;
+  metric_counter send_failures;
+  metric_counter seqlock_retries;           // snapshot copies redone because the writer was mid-update
+  metric_counter requests[METRIC_ROUTES];
+  metric_histogram request_latency[METRIC_ROUTES];
+  metric_histogram lock_wait;               // time spent acquiring the notification queue mutex
+  metric_counter commands_sent;
+  metric_counter commands_coalesced;        // repeats of a recent command that were dropped
+  metric_counter commands_expired;          // commands never written because the board was unreachable
+  metric_counter commands_unconfirmed;      // written, but the board never showed it acted on them
+  metric_histogram command_write_latency;   // from accepted to written to the tty
+  metric_histogram command_confirm_latency; // from accepted to the board's stream reflecting it
+  metric_counter alerts_fired;
+  metric_counter tasks_run;                 // executor tasks this worker ran
+  metric_counter tasks_stolen;              // of those, taken from another worker's deque
+  metric_counter ring_enters;               // io_uring_enter calls by an io_uring event loop
+  metric_counter ring_completions;          // completions it reaped
+  metric_counter replica_connects;          // edge: connections made to the aggregator
+  metric_counter replica_batches;           // edge: batches sent
+  metric_counter replica_readings;          // edge: readings in them
+  metric_counter replica_bytes;             // edge: compressed bytes of those readings
+  metric_counter replica_gaps;              // edge: readings overwritten before the aggregator had them
+  metric_counter replica_applied;           // aggregator: readings applied
+  metric_counter replica_duplicates;        // aggregator: readings it already had, skipped
+};
+
+metrics_shard metrics_shards[METRICS_SHARDS];
+thread_local metrics_shard* metrics_local = NULL;
+
+/*
+ * Makes the calling thread record into shard.
+ */
+static inline void metricsRegisterThread(int shard) {
+      metrics_local = &metrics_shards[shard];
+}
+
+/*
+ * Adds n to a counter. Only the counter's owning thread may call this.
+ */
+static inline void counterAdd(metric_counter* counter, uint64_t n) {
+      counter->value.store(counter->value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline uint64_t counterRead(const metric_counter* counter) {
+      return counter->value.load(std::memory_order_relaxed);
+}
+
+static inline long long metricsNanos() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline int histogramBucket(uint64_t ns) {
+      if (ns < 32) return ns;
+      int shift = 63 - __builtin_clzll(ns) - 4;
+      return (shift + 1) * 16 + (int) ((ns >> shift) - 16);
+}
+
+/*
+ * Returns the midpoint of a bucket in ns.
+ */
+static inline uint64_t histogramValue(int bucket) {
+      if (bucket < 32) return bucket;
+      int shift = bucket / 16 - 1;
+      return ((uint64_t) (bucket % 16 + 16) << shift) + (1ULL << shift) / 2;
+}
+
+/*
+ * Records one duration. Only the histogram's owning thread may call this.
+ */
+static inline void histogramRecord(metric_histogram* histogram, long long ns) {
+      if (ns < 0) ns = 0;
+      std::atomic<uint64_t>* bucket = &histogram->counts[histogramBucket(ns)];
+      bucket->store(bucket->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      counterAdd(&histogram->total, 1);
+      counterAdd(&histogram->sum_ns, ns);
+}
+
+/*
+ * Adds a histogram's buckets into counts, for merging shards at scrape time.
+ */
+static inline void histogramCollect(const metric_histogram* histogram, uint64_t* counts) {
+      for (int i = 0; i < HISTOGRAM_BUCKETS; i++) counts[i] += histogram->counts[i].load(std::memory_order_relaxed);
+}
+
+/*
+ * Returns the q quantile in ns of collected bucket counts holding total samples.
+ */
+static inline uint64_t histogramQuantile(const uint64_t* counts, uint64_t total, double q) {
+      uint64_t rank = (uint64_t) (q * total + 0.5);
+      if (rank < 1) rank = 1;
+      uint64_t seen = 0;
+      for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) return histogramValue(i);
+      }
+      return 0;
+}
+
+/*
+ * Maps the len-byte request target at path to its metrics route.
+ */
+static inline int metricsRoute(const char* path, int len) {
+      if (len >= 8 && strncmp(path, "/metrics", 8) == 0 && (len == 8 || path[8] == '?')) return METRIC_ROUTE_METRICS;
+      if (len >= 2 && path[1] >= 'a' && path[1] <= 'z') return path[1] - 'a';
+      return METRIC_ROUTE_OTHER;
+}
+
+/*
+ * Writes the Prometheus label for a metrics route into labels.
+ */
+static inline void metricsRouteLabel(int route, char* labels, int size) {
+      if (route == METRIC_ROUTE_METRICS) snprintf(labels, size, "route=\"metrics\"");
+      else if (route == METRIC_ROUTE_OTHER) snprintf(labels, size, "route=\"other\"");
+      else snprintf(labels, size, "route=\"%c\"", 'a' + route);
+}
+
+/*
+ * Counts one redone seqlock read on the calling thread, if it records metrics.
+ */
+static inline void metricsSeqlockRetry() {
+      if (metrics_local != NULL) counterAdd(&metrics_local->seqlock_retries, 1);
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * notify.h
+ *
+ * Hands events such as motion trips and alert firings from the ingest thread to the server's
+ * event loop. Producers append to a small queue and bump an eventfd that the
+ * event loop watches, so subscribers are woken as soon as the event is parsed
+ * instead of on their next poll. Events are rare, so a mutex guards the queue;
+ * when it is full the oldest event is dropped.
+ */
+
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "metrics.h"
+
+#define NOTIFY_QUEUE_SIZE 256
+#define NOTIFY_DETAIL_LENGTH 128
+
+#define EVENT_TRIP 1
+#define EVENT_ALERT 2                 // detail holds the rule name and the reading as JSON members
+
+typedef struct NotifyEvent notify_event;
+typedef struct NotifyQueue notify_queue;
+
+struct NotifyEvent {
+  int type;
+  int sensor;             // index into the sensor registry
+  int64_t time;           // ms since the epoch
+  char detail[NOTIFY_DETAIL_LENGTH];
+};
+
+struct NotifyQueue {
+  pthread_mutex_t lock;
+  notify_event events[NOTIFY_QUEUE_SIZE];
+  int head;
+  int len;
+  long long dropped;
+  int event_fd;           // readable whenever events are queued
+};
+
+/*
+ * Sets up the queue and its eventfd. Returns false if the eventfd cannot be created.
+ */
+static inline bool notifyInit(notify_queue* queue) {
+      pthread_mutex_init(&queue->lock, NULL);
+      queue->head = queue->len = 0;
+      queue->dropped = 0;
+      queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (queue->event_fd == -1) {
+            perror("Eventfd");
+            return false;
+      }
+      return true;
+}
+
+/*
+ * Takes the queue mutex, recording how long the calling thread had to wait for it.
+ */
+static inline void notifyLock(notify_queue* queue) {
+      if (pthread_mutex_trylock(&queue->lock) == 0) {
+            if (metrics_local != NULL) histogramRecord(&metrics_local->lock_wait, 0);
+            return;
+      }
+      long long start = metricsNanos();
+      pthread_mutex_lock(&queue->lock);
+      if (metrics_local != NULL) histogramRecord(&metrics_local->lock_wait, metricsNanos() - start);
+}
+
+/*
+ * Queues an event and wakes the event loop. Safe to call from any thread.
+ */
+static inline void notifyPost(notify_queue* queue, const notify_event* event) {
+      notifyLock(queue);
+      if (queue->len == NOTIFY_QUEUE_SIZE) {
+            queue->head = (queue->head + 1) % NOTIFY_QUEUE_SIZE;
+            queue->len--;
+            queue->dropped++;
+      }
+      queue->events[(queue->head + queue->len) % NOTIFY_QUEUE_SIZE] = *event;
+      queue->len++;
+      pthread_mutex_unlock(&queue->lock);
+      uint64_t one = 1;
+      write(queue->event_fd, &one, sizeof(one));
+}
+
+/*
+ * Moves up to max queued events into events and clears the eventfd. Returns how many were moved.
+ * Called by the event loop when the eventfd is readable.
+ */
+static inline int notifyDrain(notify_queue* queue, notify_event* events, int max) {
+      uint64_t count;
+      read(queue->event_fd, &count, sizeof(count));
+      notifyLock(queue);
+      int n = 0;
+      while (n < max && queue->len > 0) {
+            events[n++] = queue->events[queue->head];
+            queue->head = (queue->head + 1) % NOTIFY_QUEUE_SIZE;
+            queue->len--;
+      }
+      if (queue->len > 0) {
+            //more than max were queued, leave the eventfd readable for the next round
+            uint64_t one = 1;
+            write(queue->event_fd, &one, sizeof(one));
+      }
+      pthread_mutex_unlock(&queue->lock);
+      return n;
+}
+
+#endif
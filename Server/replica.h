@@ -0,0 +1,276 @@
+/*
+ * replica.h
+ *
+ * Replication of readings and trip events from edge servers (-R) to an
+ * aggregator (-A) over TCP. Every message is a 4-byte little-endian payload
+ * length, a type byte and the payload:
+ *
+ *     HELLO     edge -> aggregator   magic, version, site name
+ *     SENSOR    edge -> aggregator   edge sensor index, sensor id
+ *     RESUME    aggregator -> edge   sensor index, last sequence number applied
+ *     BATCH     edge -> aggregator   sensor index, flags, first sequence number, count,
+ *                                    readings compressed like an archive block
+ *     TRIP      edge -> aggregator   event sequence number, sensor index, ms time
+ *     ACK       aggregator -> edge   sensor index, last sequence number applied
+ *     TRIP_ACK  aggregator -> edge   event sequence number
+ *
+ * A reading's sequence number is its position in the edge sensor's ring over
+ * the life of the ring file (ring_header.inserted), so the edge resends
+ * straight out of the ring after a disconnect, from wherever the aggregator
+ * says it got to. The aggregator keeps that point in its own ring's header.
+ * Readings the edge ring overwrote before they were acknowledged are lost and
+ * counted. The edge keeps at most REPLICA_WINDOW readings per sensor
+ * unacknowledged and never queues more than its send buffer holds, so an
+ * aggregator that stops reading stops the edge instead of growing its memory.
+ * Trip events are kept in memory until acknowledged. On the aggregator an
+ * edge's sensor becomes sensor "<site>.<id>", served by the same routes as
+ * local ones.
+ */
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "archive.h"
+#include "sensor.h"
+#include "temp_ring.h"
+
+#define REPLICA_MAGIC 0x50524457            // "WDRP"
+#define REPLICA_VERSION 1
+#define REPLICA_HEADER_LENGTH 5
+#define REPLICA_HELLO 1
+#define REPLICA_SENSOR 2
+#define REPLICA_RESUME 3
+#define REPLICA_BATCH 4
+#define REPLICA_TRIP 5
+#define REPLICA_ACK 6
+#define REPLICA_TRIP_ACK 7
+#define REPLICA_RESTART 0x01                // batch flag: the edge's ring was reset, take its numbering
+#define REPLICA_BATCH_HEADER 12             // index, flags, first sequence number, count
+#define REPLICA_MAX_MESSAGE (REPLICA_HEADER_LENGTH + REPLICA_BATCH_HEADER + ARCHIVE_BLOCK_BYTES)
+#define REPLICA_BUFFER 65536
+#define REPLICA_BATCH_SAMPLES 256           // readings per batch at most
+#define REPLICA_BATCH_MS 250                // how long a reading waits for others to share its batch
+#define REPLICA_WINDOW 2048                 // unacknowledged readings per sensor, well within the ring
+#define REPLICA_RECONNECT_MS 2000
+#define REPLICA_MAX_SITES 16
+#define REPLICA_SITE_LENGTH 16
+#define REPLICA_TRIPS 64                    // unacknowledged trip events kept by the edge
+#define REPLICA_TAG_UPLINK (MAX_SENSORS + 1)  // ingest epoll tags, past the sensors and the command eventfd
+#define REPLICA_TAG_LISTEN (MAX_SENSORS + 2)
+#define REPLICA_TAG_SITE (MAX_SENSORS + 3)    // plus the site's slot
+
+typedef struct ReplicaBuffer replica_buffer;
+typedef struct ReplicaTrip replica_trip;
+typedef struct ReplicaUplink replica_uplink;
+typedef struct ReplicaSite replica_site;
+
+//bytes received but not yet parsed, or queued but not yet sent ([sent, len))
+struct ReplicaBuffer {
+  uint8_t data[REPLICA_BUFFER];
+  int len;
+  int sent;
+};
+
+struct ReplicaTrip {
+  uint64_t seq;
+  int sensor;
+  int64_t time;
+};
+
+//the edge's connection to its aggregator, owned by the ingest thread
+struct ReplicaUplink {
+  struct sockaddr_in aggregator;
+  char site[REPLICA_SITE_LENGTH];
+  int fd;                           // -1 while disconnected
+  bool connected;                   // the connect completed
+  unsigned events;                  // epoll events the socket is registered for
+  long long next_connect;           // ms (monotonic) of the next attempt
+  bool resumed[MAX_SENSORS];        // the aggregator said where to resume the sensor
+  bool restart[MAX_SENSORS];        // the next batch carries REPLICA_RESTART
+  uint64_t sent[MAX_SENSORS];       // last sequence number sent
+  uint64_t acked[MAX_SENSORS];      // last sequence number the aggregator applied
+  replica_trip trips[REPLICA_TRIPS];// unacknowledged trip events, oldest first
+  int trip_count;
+  int trip_queued;                  // how many of them are queued on this connection
+  uint64_t next_trip;
+  replica_buffer in;
+  replica_buffer out;
+};
+
+//one edge connected to the aggregator, owned by the ingest thread
+struct ReplicaSite {
+  int fd;                           // -1 for a free slot
+  char name[REPLICA_SITE_LENGTH];   // empty until the hello arrives
+  unsigned events;
+  int local[MAX_SENSORS];           // index of each edge sensor's local sensor, -1 if not announced
+  replica_buffer in;
+  replica_buffer out;
+};
+
+static inline void replicaPut16(uint8_t* p, uint16_t v) {
+      p[0] = v & 0xFF;
+      p[1] = v >> 8;
+}
+
+static inline void replicaPut32(uint8_t* p, uint32_t v) {
+      for (int i = 0; i < 4; i++) p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static inline void replicaPut64(uint8_t* p, uint64_t v) {
+      for (int i = 0; i < 8; i++) p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static inline uint16_t replicaGet16(const uint8_t* p) {
+      return p[0] | (uint16_t) p[1] << 8;
+}
+
+static inline uint32_t replicaGet32(const uint8_t* p) {
+      return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline uint64_t replicaGet64(const uint8_t* p) {
+      return replicaGet32(p) | (uint64_t) replicaGet32(p + 4) << 32;
+}
+
+static inline void bufferReset(replica_buffer* buf) {
+      buf->len = buf->sent = 0;
+}
+
+/*
+ * Returns how many more bytes fit, moving unsent bytes to the front first.
+ */
+static inline int bufferRoom(replica_buffer* buf) {
+      if (buf->sent > 0) {
+            memmove(buf->data, buf->data + buf->sent, buf->len - buf->sent);
+            buf->len -= buf->sent;
+            buf->sent = 0;
+      }
+      return REPLICA_BUFFER - buf->len;
+}
+
+static inline int bufferPending(const replica_buffer* buf) {
+      return buf->len - buf->sent;
+}
+
+/*
+ * Queues a message. Returns false if it does not fit.
+ */
+static inline bool replicaQueue(replica_buffer* out, int type, const uint8_t* payload, int len) {
+      if (bufferRoom(out) < REPLICA_HEADER_LENGTH + len) return false;
+      uint8_t* p = out->data + out->len;
+      replicaPut32(p, len);
+      p[4] = type;
+      memcpy(p + REPLICA_HEADER_LENGTH, payload, len);
+      out->len += REPLICA_HEADER_LENGTH + len;
+      return true;
+}
+
+/*
+ * Finds the next complete message among the bytes received, starting at offset. Returns
+ * the bytes it takes up, 0 if it has not all arrived and -1 if its length is impossible.
+ */
+static inline int replicaNext(const replica_buffer* in, int offset, int* type, const uint8_t** payload, int* len) {
+      if (in->len - offset < REPLICA_HEADER_LENGTH) return 0;
+      uint32_t size = replicaGet32(in->data + offset);
+      if (size > REPLICA_MAX_MESSAGE - REPLICA_HEADER_LENGTH) return -1;
+      if (in->len - offset < REPLICA_HEADER_LENGTH + (int) size) return 0;
+      *type = in->data[offset + 4];
+      *payload = in->data + offset + REPLICA_HEADER_LENGTH;
+      *len = size;
+      return REPLICA_HEADER_LENGTH + size;
+}
+
+/*
+ * Drops the first used bytes received, which have been handled.
+ */
+static inline void replicaConsume(replica_buffer* in, int used) {
+      memmove(in->data, in->data + used, in->len - used);
+      in->len -= used;
+}
+
+/*
+ * Sends as much of the queue as the socket takes without blocking. Returns false on error.
+ */
+static inline bool replicaFlush(int fd, replica_buffer* out) {
+      while (bufferPending(out) > 0) {
+            int n = send(fd, out->data + out->sent, bufferPending(out), MSG_NOSIGNAL);
+            if (n < 0) {
+                  if (errno == EINTR) continue;
+                  return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            out->sent += n;
+      }
+      bufferReset(out);
+      return true;
+}
+
+/*
+ * Queues a message carrying an index and a sequence number (RESUME, ACK).
+ */
+static inline bool replicaQueueSeq(replica_buffer* out, int type, int index, uint64_t seq) {
+      uint8_t payload[9];
+      payload[0] = index;
+      replicaPut64(payload + 1, seq);
+      return replicaQueue(out, type, payload, sizeof(payload));
+}
+
+/*
+ * Compresses up to count readings of ring, starting at sequence number first, into a batch
+ * message for sensor index. Stops early if the block fills. Returns the readings queued, or
+ * 0 if the message did not fit. Only the ring's writing thread may call this.
+ */
+static inline int replicaQueueBatch(replica_buffer* out, const temp_ring* ring, int index, int flags, uint64_t first, int count) {
+      static thread_local archive_encoder enc;
+      encoderReset(&enc);
+      for (int i = 0; i < count && !encoderFull(&enc); i++) {
+            int slot = ringSlot(ring, first + i);
+            encoderAdd(&enc, ring->timestamps[slot], ringValue(ring, slot));
+      }
+      int bytes = (enc.bits + 7) / 8;
+      if (bufferRoom(out) < REPLICA_HEADER_LENGTH + REPLICA_BATCH_HEADER + bytes) return 0;
+      uint8_t* p = out->data + out->len;
+      replicaPut32(p, REPLICA_BATCH_HEADER + bytes);
+      p[4] = REPLICA_BATCH;
+      p += REPLICA_HEADER_LENGTH;
+      p[0] = index;
+      p[1] = flags;
+      replicaPut64(p + 2, first);
+      replicaPut16(p + 10, enc.count);
+      memcpy(p + REPLICA_BATCH_HEADER, enc.bytes, bytes);
+      out->len += REPLICA_HEADER_LENGTH + REPLICA_BATCH_HEADER + bytes;
+      return enc.count;
+}
+
+/*
+ * Decodes a batch message, calling visit for each reading in order. Returns the readings
+ * visited, or -1 if the batch is damaged.
+ */
+static inline int replicaDecodeBatch(const uint8_t* payload, int len, int* index, int* flags, uint64_t* first,
+                                     archive_visitor visit, void* context) {
+      if (len < REPLICA_BATCH_HEADER) return -1;
+      *index = payload[0];
+      *flags = payload[1];
+      *first = replicaGet64(payload + 2);
+      int count = replicaGet16(payload + 10);
+      if (count == 0 || count > ARCHIVE_BLOCK_SAMPLES) return -1;
+      return blockDecode(payload + REPLICA_BATCH_HEADER, len - REPLICA_BATCH_HEADER, count, INT64_MIN, INT64_MAX, visit, context);
+}
+
+/*
+ * Returns true if name can be a site name: letters, digits, '-' and '_'.
+ */
+static inline bool replicaSiteName(const char* name, int len) {
+      if (len == 0 || len >= REPLICA_SITE_LENGTH) return false;
+      for (int i = 0; i < len; i++) {
+            char c = name[i];
+            if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_')) return false;
+      }
+      return true;
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * response_cache.h
+ *
+ * Pre-rendered JSON replies. A sensor's replies only change when a new sample
+ * is published, its unit is toggled or its connection state changes; each of
+ * those bumps the sensor's generation. A cached reply remembers the generation
+ * it was rendered for, so the first request after a change renders it once into
+ * the reply's buffer and every other request just queues the stored bytes.
+ * Replies are only rendered and read by the server thread, so they need no lock.
+ */
+
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <atomic>
+
+#define CACHED_RESPONSE_SIZE 256
+
+typedef struct CachedResponse cached_response;
+
+struct CachedResponse {
+  unsigned generation;      // sensor generation the body was rendered for
+  bool valid;
+  int len;
+  char body[CACHED_RESPONSE_SIZE];
+};
+
+static inline void cacheInit(cached_response* reply) {
+      reply->valid = false;
+      reply->len = 0;
+}
+
+/*
+ * Returns true if the reply was rendered for the current generation and can be sent as is.
+ */
+static inline bool cacheFresh(const cached_response* reply, const std::atomic<unsigned>* generation) {
+      return reply->valid && reply->generation == generation->load(std::memory_order_acquire);
+}
+
+/*
+ * Records that body now holds len bytes rendered for the given generation.
+ */
+static inline void cacheStore(cached_response* reply, unsigned generation, int len) {
+      reply->generation = generation;
+      reply->len = len < CACHED_RESPONSE_SIZE ? len : CACHED_RESPONSE_SIZE - 1;
+      reply->valid = true;
+}
+
+/*
+ * Marks a change to the state replies are rendered from. Safe to call from any thread.
+ */
+static inline void cacheBump(std::atomic<unsigned>* generation) {
+      generation->fetch_add(1, std::memory_order_release);
+}
+
+#endif
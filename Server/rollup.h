@@ -0,0 +1,246 @@
+/*
+ * rollup.h
+ *
+ * Multi-resolution min/max/sum/count buckets (1 second, 1 minute, 1 hour and
+ * 1 day) fed by every reading. Each tier is a fixed ring of buckets, so memory
+ * stays bounded while the coarser tiers reach back months. Range queries stitch
+ * together the coarsest buckets that fit the range, which costs O(buckets)
+ * instead of O(samples). Buckets of the minute, hour and day tiers also carry
+ * a quantile sketch, so percentiles over a range merge one sketch per bucket.
+ * The sketches take about 1 KB per bucket, 6 MB per sensor over the three
+ * tiers; they are calloc'd up front but their pages are only touched as
+ * buckets fill, about 2 MB in the first month and 1 KB a day after that.
+ * The ingest thread is the only writer; queries run under a seqlock read and
+ * simply retry if a reading landed mid-query.
+ */
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdint.h>
+#include <math.h>
+#include "temp_stats.h"
+#include "seqlock.h"
+#include "sketch.h"
+
+#define ROLLUP_TIERS 4
+
+typedef struct RollupBucket rollup_bucket;
+typedef struct RollupTier rollup_tier;
+typedef struct RollupStore rollup_store;
+typedef struct RollupResult rollup_result;
+typedef void (*rollup_visitor)(rollup_store* store, int t, rollup_bucket* bucket, void* context);
+
+struct RollupBucket {
+  int64_t start;          // seconds since the epoch, a multiple of the tier width
+  double min;
+  double max;
+  long long sum;          // in 1/10000 degrees, like temp_stats
+  int count;
+};
+
+struct RollupTier {
+  int64_t width;          // seconds covered by one bucket
+  int size;               // buckets kept
+  rollup_bucket* buckets;
+  quantile_sketch* sketches;   // one per bucket, NULL for the 1 second tier
+};
+
+struct RollupStore {
+  rollup_tier tiers[ROLLUP_TIERS];   // finest first
+  int64_t latest;                    // second of the newest reading
+  seqlock lock;
+};
+
+struct RollupResult {
+  double min;
+  double max;
+  double average;
+  long long count;
+  int buckets;            // buckets combined to answer the query
+};
+
+static const int64_t ROLLUP_WIDTHS[ROLLUP_TIERS] = { 1, 60, 3600, 86400 };
+static const int ROLLUP_SIZES[ROLLUP_TIERS] = { 3600, 1440, 720, 3650 };   // 1 hour, 1 day, 30 days, 10 years
+
+/*
+ * Allocates every tier. Returns false if memory could not be allocated.
+ */
+static inline bool rollupInit(rollup_store* store) {
+      store->latest = 0;
+      seqlockInit(&store->lock);
+      for (int t = 0; t < ROLLUP_TIERS; t++) {
+            rollup_tier* tier = &store->tiers[t];
+            tier->width = ROLLUP_WIDTHS[t];
+            tier->size = ROLLUP_SIZES[t];
+            tier->buckets = (rollup_bucket*) calloc(tier->size, sizeof(rollup_bucket));
+            //the second tier holds about one reading per bucket, which min/max/avg already describe
+            tier->sketches = t == 0 ? NULL : (quantile_sketch*) calloc(tier->size, sizeof(quantile_sketch));
+            if (tier->buckets == NULL || (t > 0 && tier->sketches == NULL)) {
+                  printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+                  return false;
+            }
+            for (int i = 0; i < tier->size; i++) tier->buckets[i].start = -1;
+      }
+      return true;
+}
+
+/*
+ * Folds one reading taken at second `when` into the matching bucket of every tier.
+ */
+static inline void rollupInsert(rollup_store* store, int64_t when, double value) {
+      if (!validReading(value)) return;
+      seqlockWriteBegin(&store->lock);
+      for (int t = 0; t < ROLLUP_TIERS; t++) {
+            rollup_tier* tier = &store->tiers[t];
+            int64_t start = when - when % tier->width;
+            int slot = (start / tier->width) % tier->size;
+            rollup_bucket* bucket = &tier->buckets[slot];
+            if (bucket->start != start) {
+                  //the slot still holds an expired bucket, recycle it
+                  bucket->start = start;
+                  bucket->min = bucket->max = value;
+                  bucket->sum = 0;
+                  bucket->count = 0;
+                  if (tier->sketches != NULL) sketchInit(&tier->sketches[slot]);
+            }
+            if (value < bucket->min) bucket->min = value;
+            if (value > bucket->max) bucket->max = value;
+            bucket->sum += llround(value * 10000.0);
+            bucket->count++;
+            if (tier->sketches != NULL) sketchAdd(&tier->sketches[slot], value);
+      }
+      if (when > store->latest) store->latest = when;
+      seqlockWriteEnd(&store->lock);
+}
+
+/*
+ * Returns the bucket of tier starting at `start` if the tier still holds it, else NULL.
+ */
+static inline rollup_bucket* rollupBucket(rollup_store* store, int t, int64_t start) {
+      rollup_tier* tier = &store->tiers[t];
+      int64_t newest = store->latest - store->latest % tier->width;
+      if (start > newest || start <= newest - tier->size * tier->width) return NULL;
+      rollup_bucket* bucket = &tier->buckets[(start / tier->width) % tier->size];
+      return bucket;
+}
+
+/*
+ * Returns the sketch of a bucket returned by rollupBucket, or NULL for the 1 second tier.
+ */
+static inline quantile_sketch* rollupSketch(rollup_store* store, int t, const rollup_bucket* bucket) {
+      rollup_tier* tier = &store->tiers[t];
+      return tier->sketches == NULL ? NULL : &tier->sketches[bucket - tier->buckets];
+}
+
+/*
+ * Calls visit for each non-empty bucket that together cover [from, to) seconds. Whole
+ * coarse buckets are used wherever they fit inside the range; edges older than the
+ * finer tiers retain are answered by the enclosing coarse bucket.
+ */
+static inline void rollupWalk(rollup_store* store, int64_t from, int64_t to, rollup_visitor visit, void* context) {
+      int64_t pos = from;
+      while (pos < to) {
+            //largest aligned bucket that lies inside the range and is still retained
+            int chosen = -1;
+            rollup_bucket* bucket = NULL;
+            for (int t = ROLLUP_TIERS - 1; t >= 0 && bucket == NULL; t--) {
+                  int64_t width = store->tiers[t].width;
+                  if (pos % width == 0 && pos + width <= to) {
+                        bucket = rollupBucket(store, t, pos);
+                        chosen = t;
+                  }
+            }
+            int64_t start = pos;
+            if (bucket == NULL) {
+                  //no aligned fit: use the finest tier that still retains pos
+                  for (int t = 0; t < ROLLUP_TIERS && bucket == NULL; t++) {
+                        int64_t width = store->tiers[t].width;
+                        start = pos - pos % width;
+                        bucket = rollupBucket(store, t, start);
+                        chosen = t;
+                  }
+                  if (bucket == NULL) {
+                        //older than every tier: skip ahead to the oldest retained second
+                        rollup_tier* oldest = &store->tiers[ROLLUP_TIERS - 1];
+                        int64_t newest = store->latest - store->latest % oldest->width;
+                        int64_t first = newest - (oldest->size - 1) * oldest->width;
+                        if (first <= pos) break;
+                        pos = first;
+                        continue;
+                  }
+            }
+            if (bucket->start == start && bucket->count > 0) visit(store, chosen, bucket, context);
+            pos = start + store->tiers[chosen].width;
+      }
+}
+
+typedef struct RollupTotals rollup_totals;
+struct RollupTotals {
+  rollup_result* result;
+  long long sum;
+};
+
+static inline void rollupAddBucket(rollup_store* store, int t, rollup_bucket* bucket, void* context) {
+      (void) store;
+      (void) t;
+      rollup_totals* totals = (rollup_totals*) context;
+      rollup_result* result = totals->result;
+      if (bucket->min < result->min) result->min = bucket->min;
+      if (bucket->max > result->max) result->max = bucket->max;
+      totals->sum += bucket->sum;
+      result->count += bucket->count;
+      result->buckets++;
+}
+
+/*
+ * Aggregates readings taken in [from, to) seconds.
+ */
+static inline void rollupQueryOnce(rollup_store* store, int64_t from, int64_t to, rollup_result* result) {
+      result->min = 1e9;
+      result->max = -1e9;
+      result->count = 0;
+      result->buckets = 0;
+      rollup_totals totals = { result, 0 };
+      rollupWalk(store, from, to, rollupAddBucket, &totals);
+      long long sum = totals.sum;
+      if (result->count == 0) {
+            result->min = result->max = result->average = NO_READING;
+            return;
+      }
+      result->average = sum / 10000.0 / result->count;
+}
+
+/*
+ * Runs rollupQueryOnce until it completes without the ingest thread writing concurrently.
+ */
+static inline void rollupQuery(rollup_store* store, int64_t from, int64_t to, rollup_result* result) {
+      unsigned seq;
+      do {
+            seq = seqlockReadBegin(&store->lock);
+            rollupQueryOnce(store, from, to, result);
+      } while (seqlockReadRetry(&store->lock, seq));
+}
+
+static inline void rollupSketchBucket(rollup_store* store, int t, rollup_bucket* bucket, void* context) {
+      quantile_summary* summary = (quantile_summary*) context;
+      quantile_sketch* sketch = rollupSketch(store, t, bucket);
+      if (sketch != NULL) summaryMergeSketch(summary, sketch, bucket->min, bucket->max);
+      else summaryAddBucket(summary, bucket->min, bucket->max, bucket->sum / 10000.0 / bucket->count, bucket->count);
+}
+
+/*
+ * Merges the sketches of the buckets covering [from, to) seconds into summary, retrying
+ * until no reading landed mid-merge. Readings in 1 second buckets count by their min,
+ * max and average.
+ */
+static inline void rollupQuantiles(rollup_store* store, int64_t from, int64_t to, quantile_summary* summary) {
+      unsigned seq;
+      do {
+            seq = seqlockReadBegin(&store->lock);
+            summaryInit(summary);
+            rollupWalk(store, from, to, rollupSketchBucket, summary);
+      } while (seqlockReadRetry(&store->lock, seq));
+}
+
+#endif
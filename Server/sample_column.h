@@ -0,0 +1,229 @@
+/*
+ * sample_column.h
+ *
+ * Temperature samples stored the way the thermometer produces them: int16
+ * fixed point in 1/16 degrees, with whether a slot holds a reading at all
+ * kept in a separate validity bitmap instead of an in-band -274.0 sentinel.
+ * A column of samples is a quarter the size of the doubles it replaces, and
+ * min, max, sum and count over any run of it come from one fused pass that
+ * needs no per-element range checks. The pass is vectorized with AVX2 (16
+ * samples per step) or SSE2 (8 per step), picked once at runtime from what
+ * the CPU supports, with a plain loop for everything else.
+ */
+
+#ifndef SAMPLE_COLUMN_H
+#define SAMPLE_COLUMN_H
+
+#include <stdint.h>
+#include <math.h>
+#include "temp_stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_COLUMN_X86 1
+#endif
+
+#define SAMPLE_SCALE 16                                 // samples per degree, the sensor's resolution
+#define SAMPLE_BITMAP_WORDS(n) (((n) + 63) / 64)
+#define SAMPLE_FLUSH_STEPS 16384                        // vector steps before the 32-bit lane sums are widened
+
+typedef struct ColumnAggregate column_aggregate;
+typedef void (*column_kernel)(const int16_t* values, const uint64_t* valid, int start, int end, column_aggregate* agg);
+
+//aggregates of the valid samples in a run, in 1/16 degrees
+struct ColumnAggregate {
+  int min;
+  int max;
+  long long sum;
+  int count;
+};
+
+/*
+ * Rounds a reading to the sensor's resolution. Sentinels and garbage are left as they are.
+ */
+static inline double sampleQuantize(double value) {
+      if (!validReading(value)) return value;
+      return lround(value * SAMPLE_SCALE) / (double) SAMPLE_SCALE;
+}
+
+static inline bool sampleValid(const uint64_t* valid, int i) {
+      return (__atomic_load_n(&valid[i >> 6], __ATOMIC_RELAXED) >> (i & 63)) & 1;
+}
+
+/*
+ * Returns slot i as degrees, or NO_READING if it holds no reading.
+ */
+static inline double sampleValue(const int16_t* values, const uint64_t* valid, int i) {
+      return sampleValid(valid, i) ? values[i] / (double) SAMPLE_SCALE : NO_READING;
+}
+
+/*
+ * Writes value into slot i, clearing its bit if the value is not a valid reading.
+ * Only one thread may write a column.
+ */
+static inline void sampleStore(int16_t* values, uint64_t* valid, int i, double value) {
+      uint64_t word = valid[i >> 6];
+      uint64_t bit = (uint64_t) 1 << (i & 63);
+      if (validReading(value)) {
+            values[i] = (int16_t) lround(value * SAMPLE_SCALE);
+            word |= bit;
+      }
+      else {
+            values[i] = 0;
+            word &= ~bit;
+      }
+      __atomic_store_n(&valid[i >> 6], word, __ATOMIC_RELAXED);
+}
+
+static inline void aggregateInit(column_aggregate* agg) {
+      agg->min = INT16_MAX;
+      agg->max = INT16_MIN;
+      agg->sum = 0;
+      agg->count = 0;
+}
+
+static inline void aggregateMerge(column_aggregate* into, const column_aggregate* from) {
+      if (from->min < into->min) into->min = from->min;
+      if (from->max > into->max) into->max = from->max;
+      into->sum += from->sum;
+      into->count += from->count;
+}
+
+/*
+ * Folds slots [start, end) into agg one at a time.
+ */
+static inline void columnAggregateScalar(const int16_t* values, const uint64_t* valid, int start, int end, column_aggregate* agg) {
+      for (int i = start; i < end; i++) {
+            if (!((valid[i >> 6] >> (i & 63)) & 1)) continue;
+            int v = values[i];
+            if (v < agg->min) agg->min = v;
+            if (v > agg->max) agg->max = v;
+            agg->sum += v;
+            agg->count++;
+      }
+}
+
+#ifdef SAMPLE_COLUMN_X86
+
+/*
+ * The SSE2 pass, 8 samples per step. Invalid lanes are swapped for the identity of each
+ * reduction before they are folded in: INT16_MAX for min, INT16_MIN for max, 0 for the sum.
+ */
+__attribute__((target("sse2")))
+static inline void columnAggregateSse2(const int16_t* values, const uint64_t* valid, int start, int end, column_aggregate* agg) {
+      int i = start;
+      int head = (start + 7) & ~7;
+      if (head > end) head = end;
+      columnAggregateScalar(values, valid, i, head, agg);
+      i = head;
+      const __m128i bits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+      const __m128i ones = _mm_set1_epi16(1);
+      const __m128i high = _mm_set1_epi16(INT16_MAX);
+      const __m128i low = _mm_set1_epi16(INT16_MIN);
+      __m128i vmin = high, vmax = low, vsum = _mm_setzero_si128();
+      int steps = 0;
+      for (; i + 8 <= end; i += 8) {
+            int m = (valid[i >> 6] >> (i & 63)) & 0xFF;
+            if (m == 0) continue;
+            __m128i v = _mm_loadu_si128((const __m128i*) (values + i));
+            __m128i mask = _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16((short) m), bits), bits);
+            vmin = _mm_min_epi16(vmin, _mm_or_si128(_mm_and_si128(mask, v), _mm_andnot_si128(mask, high)));
+            vmax = _mm_max_epi16(vmax, _mm_or_si128(_mm_and_si128(mask, v), _mm_andnot_si128(mask, low)));
+            vsum = _mm_add_epi32(vsum, _mm_madd_epi16(_mm_and_si128(mask, v), ones));
+            agg->count += __builtin_popcount(m);
+            if (++steps == SAMPLE_FLUSH_STEPS) {
+                  int32_t lanes[4];
+                  _mm_storeu_si128((__m128i*) lanes, vsum);
+                  agg->sum += (long long) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+                  vsum = _mm_setzero_si128();
+                  steps = 0;
+            }
+      }
+      int16_t mins[8], maxs[8];
+      int32_t lanes[4];
+      _mm_storeu_si128((__m128i*) mins, vmin);
+      _mm_storeu_si128((__m128i*) maxs, vmax);
+      _mm_storeu_si128((__m128i*) lanes, vsum);
+      for (int k = 0; k < 8; k++) {
+            if (mins[k] < agg->min) agg->min = mins[k];
+            if (maxs[k] > agg->max) agg->max = maxs[k];
+      }
+      agg->sum += (long long) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+      columnAggregateScalar(values, valid, i, end, agg);
+}
+
+/*
+ * The AVX2 pass, 16 samples per step.
+ */
+__attribute__((target("avx2")))
+static inline void columnAggregateAvx2(const int16_t* values, const uint64_t* valid, int start, int end, column_aggregate* agg) {
+      int i = start;
+      int head = (start + 15) & ~15;
+      if (head > end) head = end;
+      columnAggregateScalar(values, valid, i, head, agg);
+      i = head;
+      const __m256i bits = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, INT16_MIN);
+      const __m256i ones = _mm256_set1_epi16(1);
+      const __m256i high = _mm256_set1_epi16(INT16_MAX);
+      const __m256i low = _mm256_set1_epi16(INT16_MIN);
+      __m256i vmin = high, vmax = low, vsum = _mm256_setzero_si256();
+      int steps = 0;
+      for (; i + 16 <= end; i += 16) {
+            int m = (valid[i >> 6] >> (i & 63)) & 0xFFFF;
+            if (m == 0) continue;
+            __m256i v = _mm256_loadu_si256((const __m256i*) (values + i));
+            __m256i mask = _mm256_cmpeq_epi16(_mm256_and_si256(_mm256_set1_epi16((short) m), bits), bits);
+            vmin = _mm256_min_epi16(vmin, _mm256_blendv_epi8(high, v, mask));
+            vmax = _mm256_max_epi16(vmax, _mm256_blendv_epi8(low, v, mask));
+            vsum = _mm256_add_epi32(vsum, _mm256_madd_epi16(_mm256_and_si256(mask, v), ones));
+            agg->count += __builtin_popcount(m);
+            if (++steps == SAMPLE_FLUSH_STEPS) {
+                  int32_t lanes[8];
+                  _mm256_storeu_si256((__m256i*) lanes, vsum);
+                  for (int k = 0; k < 8; k++) agg->sum += lanes[k];
+                  vsum = _mm256_setzero_si256();
+                  steps = 0;
+            }
+      }
+      int16_t mins[16], maxs[16];
+      int32_t lanes[8];
+      _mm256_storeu_si256((__m256i*) mins, vmin);
+      _mm256_storeu_si256((__m256i*) maxs, vmax);
+      _mm256_storeu_si256((__m256i*) lanes, vsum);
+      for (int k = 0; k < 16; k++) {
+            if (mins[k] < agg->min) agg->min = mins[k];
+            if (maxs[k] > agg->max) agg->max = maxs[k];
+      }
+      for (int k = 0; k < 8; k++) agg->sum += lanes[k];
+      columnAggregateScalar(values, valid, i, end, agg);
+}
+
+#endif
+
+/*
+ * Returns the widest pass this CPU runs, and its name in name if that is not NULL.
+ */
+static inline column_kernel columnKernel(const char** name) {
+#ifdef SAMPLE_COLUMN_X86
+      static const bool avx2 = __builtin_cpu_supports("avx2");
+      if (avx2) {
+            if (name != NULL) *name = "avx2";
+            return columnAggregateAvx2;
+      }
+      if (name != NULL) *name = "sse2";
+      return columnAggregateSse2;
+#else
+      if (name != NULL) *name = "scalar";
+      return columnAggregateScalar;
+#endif
+}
+
+/*
+ * Folds the valid samples in slots [start, end) into agg with the widest pass available.
+ */
+static inline void columnAggregate(const int16_t* values, const uint64_t* valid, int start, int end, column_aggregate* agg) {
+      static const column_kernel kernel = columnKernel(NULL);
+      kernel(values, valid, start, end, agg);
+}
+
+#endif
@@ -0,0 +1,249 @@
+/*
+ * sensor.h
+ *
+ * Registry of the Arduino sensor boards the server reads from. Every sensor
+ * has its own serial device, line framer and frame decoder, persistent ring, running stats,
+ * rollups, archive and state flags, so sensors never share a lock. The serial side of a
+ * sensor (framer, stats, ring writes) belongs to the ingest thread; the
+ * request handlers only read its published snapshots and atomic flags.
+ * Transitions into and out of the error state are journaled (see journal.h).
+ * A remote sensor has no device: an edge server replicates its readings to
+ * this one (see replica.h). Remote sensors are registered by the ingest thread
+ * while the server runs, so a sensor is set up completely before sensor_count
+ * is raised to take it in.
+ */
+
+#ifndef SENSOR_H
+#define SENSOR_H
+
+#include <atomic>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "temp_stats.h"
+#include "temp_ring.h"
+#include "rollup.h"
+#include "archive.h"
+#include "line_framer.h"
+#include "serial_frame.h"
+#include "response_cache.h"
+#include "metrics.h"
+#include "alert.h"
+#include "journal.h"
+
+#define MAX_SENSORS 128
+#define SENSOR_ID_LENGTH 32
+#define DEFAULT_DEVICE "/dev/cu.usbmodem1451"
+#define SENSOR_RECONNECT_MS 2000
+#define SENSOR_READ_SIZE 1000               // bytes taken from a device per read
+#define INGEST_RING_ENTRIES 256             // room for a read per sensor and the command poll (-u 1)
+
+typedef struct Sensor sensor;
+
+struct Sensor {
+  char id[SENSOR_ID_LENGTH];
+  char device_path[256];
+  bool remote;                      // fed by a replicating edge server, not a device
+  std::atomic<int> fd;              // serial descriptor, -1 while disconnected
+  line_framer framer;
+  frame_decoder decoder;            // takes over from framer once the board sends binary frames
+  int negotiations;                 // FRAME_COMMAND requests sent since connecting
+  long long next_negotiation;       // ms (monotonic) before which no other is sent
+  temp_ring ring;
+  temp_stats stats;                 // touched only by the ingest thread
+  published_stats published;        // lock-free snapshot of stats for the request handlers
+  rollup_store rollups;
+  archive history;                  // compressed long-term readings, appended by the ingest thread
+  std::atomic<bool> compacting;     // a compaction job for history is queued or running
+  std::atomic<bool> arduinoError;
+  std::atomic<bool> tripped;
+  std::atomic<char> cOrF;
+  std::atomic<bool> standbyActive;
+  long long standby_sent;           // ns an 's' was accepted that the stream has not yet reflected, 0 if none
+  bool standby_expected;            // whether that 's' should put the board into standby
+  std::atomic<unsigned> generation; // bumped whenever a cached reply could change
+  cached_response temp_reply;       // rendered /b reply, owned by the server thread
+  cached_response avg_reply;        // rendered /d reply, owned by the server thread
+  cached_response snapshot_reply;   // rendered /n reply, owned by the server thread
+  unsigned snapshot_version;        // bumped when the /n reply's content changes
+  FILE* capture;                    // raw serial lines are recorded here when capturing
+  alert_rule* rules;                // compiled alert rules, evaluated by the ingest thread
+  int rule_count;
+  int rule_cap;
+  int64_t last_line;                // ms the board last sent a line, for silent rules
+  metric_counter serial_bytes;      // counters below are written only by the ingest thread
+  metric_counter serial_lines;
+  metric_counter parse_errors;      // unparseable and overlong lines
+  metric_counter frames;            // good binary frames
+  metric_counter frames_lost;       // frames missing from the sequence numbers
+  metric_counter crc_errors;        // frames dropped for a bad CRC
+  metric_counter error_transitions; // times the sensor went into the error state
+};
+
+sensor sensors[MAX_SENSORS];
+std::atomic<int> sensor_count(0);
+
+/*
+ * Returns true if id can name a replicated sensor: letters, digits, '.', '-' and '_',
+ * so it is safe in paths and goes into JSON as is.
+ */
+static inline bool sensorIdSafe(const char* id, int len) {
+      if (len == 0 || len >= SENSOR_ID_LENGTH) return false;
+      for (int i = 0; i < len; i++) {
+            char c = id[i];
+            if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '_')) return false;
+      }
+      return true;
+}
+
+/*
+ * Sets up the next free sensor slot without registering it. Returns NULL if the
+ * registry is full or the id or path do not fit.
+ */
+static inline sensor* sensorPrepare(const char* id, const char* device_path) {
+      if (sensor_count == MAX_SENSORS) return NULL;
+      sensor* s = &sensors[sensor_count];
+      if (snprintf(s->id, sizeof(s->id), "%s", id) >= (int) sizeof(s->id)) return NULL;
+      if (snprintf(s->device_path, sizeof(s->device_path), "%s", device_path) >= (int) sizeof(s->device_path)) return NULL;
+      s->remote = false;
+      s->fd = -1;
+      framerInit(&s->framer);
+      decoderInit(&s->decoder);
+      s->arduinoError = false;
+      s->tripped = false;
+      s->cOrF = 'c';
+      s->standbyActive = false;
+      s->standby_sent = 0;
+      s->standby_expected = false;
+      s->generation = 0;
+      cacheInit(&s->temp_reply);
+      cacheInit(&s->avg_reply);
+      cacheInit(&s->snapshot_reply);
+      s->snapshot_version = 0;
+      s->capture = NULL;
+      s->rules = NULL;
+      s->rule_count = s->rule_cap = 0;
+      s->last_line = 0;
+      return s;
+}
+
+/*
+ * Registers a sensor read from device_path. Returns NULL if the registry is full
+ * or the id or path do not fit.
+ */
+static inline sensor* sensorAdd(const char* id, const char* device_path) {
+      sensor* s = sensorPrepare(id, device_path);
+      if (s != NULL) sensor_count++;
+      return s;
+}
+
+/*
+ * Attaches a compiled alert rule to the sensor. Returns false if memory could not be allocated.
+ */
+static inline bool sensorAddRule(sensor* s, const alert_rule* rule) {
+      if (s->rule_count == s->rule_cap) {
+            int cap = s->rule_cap ? s->rule_cap * 2 : 8;
+            alert_rule* grown = (alert_rule*) realloc(s->rules, cap * sizeof(alert_rule));
+            if (grown == NULL) {
+                  printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+                  return false;
+            }
+            s->rules = grown;
+            s->rule_cap = cap;
+      }
+      s->rules[s->rule_count++] = *rule;
+      return true;
+}
+
+/*
+ * Looks a sensor up by id. A NULL or empty id selects the first sensor, which keeps
+ * the Pebble's unaddressed requests working.
+ */
+static inline sensor* findSensor(const char* id) {
+      if (sensor_count == 0) return NULL;
+      if (id == NULL || id[0] == '\0') return &sensors[0];
+      for (int i = 0; i < sensor_count; i++) {
+            if (strcmp(sensors[i].id, id) == 0) return &sensors[i];
+      }
+      return NULL;
+}
+
+/*
+ * Attaches the sensor's persistent ring and archive in ring_dir and rebuilds its stats and
+ * rollups from the ring. Returns false if either cannot be opened.
+ */
+static inline bool sensorOpenHistory(sensor* s, const char* ring_dir) {
+      char path[512];
+      if (snprintf(path, sizeof(path), "%s/watchdog-%s.ring", ring_dir, s->id) >= (int) sizeof(path) || !ringOpen(&s->ring, path)) {
+            printf("Couldn't open the temperature history file %s.\n", path);
+            return false;
+      }
+      ringRebuildStats(&s->ring, &s->stats);
+      seqlockInit(&s->published.lock);
+      statsPublish(&s->published, &s->stats);
+      cacheBump(&s->generation);
+      if (!rollupInit(&s->rollups) || !archiveOpen(&s->history, ring_dir, s->id)) return false;
+      for (int i = 0; i < TEMP_HISTORY; i++) {
+            int slot = (s->ring.header->next + i) % TEMP_HISTORY;
+            if (s->ring.timestamps[slot] > 0) rollupInsert(&s->rollups, s->ring.timestamps[slot] / 1000, ringValue(&s->ring, slot));
+      }
+      return true;
+}
+
+/*
+ * Puts the sensor into the error state, counting the transition if it was healthy.
+ */
+static inline void sensorFlagError(sensor* s) {
+      if (!s->arduinoError.exchange(true)) {
+            counterAdd(&s->error_transitions, 1);
+            journalPost(&event_journal, JOURNAL_ERROR, s->id, 1, s->remote ? "replica" : "serial", wallMillis());
+      }
+      cacheBump(&s->generation);
+}
+
+/*
+ * Takes the sensor out of the error state, journaling the recovery if it was in it.
+ */
+static inline void sensorClearError(sensor* s) {
+      if (s->arduinoError.exchange(false)) journalPost(&event_journal, JOURNAL_ERROR, s->id, 0, s->remote ? "replica" : "serial", wallMillis());
+}
+
+/*
+ * Opens and configures the sensor's serial device for non-blocking reads at 9600 baud.
+ * Returns false (and flags the sensor as in error) if the device cannot be opened.
+ */
+static inline bool sensorConnect(sensor* s) {
+      int fd = open(s->device_path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+      if (fd == -1) {
+            sensorFlagError(s);
+            return false;
+      }
+      //configure connection
+      struct termios options;
+      tcgetattr(fd, &options);
+      cfsetispeed(&options, 9600); //how fast to receive
+      cfsetospeed(&options, 9600); //how fast to send
+      tcsetattr(fd, TCSANOW, &options);
+      framerInit(&s->framer);
+      //a reconnected board starts out on lines again and is asked to switch anew
+      decoderInit(&s->decoder);
+      s->negotiations = 0;
+      s->next_negotiation = 0;
+      s->fd = fd;
+      sensorClearError(s);
+      cacheBump(&s->generation);
+      return true;
+}
+
+/*
+ * Closes the sensor's serial device after an error and flags the sensor.
+ */
+static inline void sensorDisconnect(sensor* s) {
+      int fd = s->fd.exchange(-1);
+      if (fd != -1) close(fd);
+      sensorFlagError(s);
+}
+
+#endif
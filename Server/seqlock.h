@@ -0,0 +1,62 @@
+/*
+ * seqlock.h
+ *
+ * Sequence lock for state with a single writer and any number of readers.
+ * The writer never waits: it makes the sequence odd, updates the data and
+ * makes it even again. Readers copy the data and retry if the sequence was odd
+ * or changed while they were copying, so they never block the writer either.
+ */
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <atomic>
+#include "metrics.h"
+
+typedef struct SeqLock seqlock;
+
+struct SeqLock {
+  std::atomic<unsigned> seq;
+};
+
+static inline void seqlockInit(seqlock* lock) {
+      lock->seq.store(0, std::memory_order_relaxed);
+}
+
+/*
+ * Marks the start of an update. Only the single writer may call this.
+ */
+static inline void seqlockWriteBegin(seqlock* lock) {
+      lock->seq.store(lock->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+}
+
+/*
+ * Publishes an update started with seqlockWriteBegin.
+ */
+static inline void seqlockWriteEnd(seqlock* lock) {
+      lock->seq.store(lock->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/*
+ * Waits out an update in progress and returns the sequence to validate the read against.
+ */
+static inline unsigned seqlockReadBegin(const seqlock* lock) {
+      unsigned seq = lock->seq.load(std::memory_order_acquire);
+      while (seq & 1) {
+            seq = lock->seq.load(std::memory_order_acquire);
+      }
+      return seq;
+}
+
+/*
+ * Returns true if the data read since seqlockReadBegin may be torn and must be read again.
+ */
+static inline bool seqlockReadRetry(const seqlock* lock, unsigned seq) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      bool retry = lock->seq.load(std::memory_order_relaxed) != seq;
+      if (retry) metricsSeqlockRetry();
+      return retry;
+}
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * serial_frame.h
+ *
+ * The compact binary format a board switches to when the server sends it the
+ * FRAME_COMMAND byte; boards that ignore the command keep sending ASCII lines,
+ * which the server keeps reading as before. A frame carries a batch of raw
+ * thermometer readings (12-bit, in 1/16 degrees, so no text or floating point
+ * is involved anywhere) taken interval_ms apart starting at device_ms:
+ *
+ *     0   2   sync 0xA5 0x5A
+ *     2   1   flags: FRAME_MOTION if the motion sensor saw anything during the batch
+ *     3   1   count of readings, 1 to FRAME_MAX_SAMPLES
+ *     4   2   sequence number, +1 per frame
+ *     6   4   device_ms, the board's millis() at the first reading
+ *     10  2   interval_ms between readings
+ *     12  2n  readings, FRAME_NO_READING in standby
+ *     ..  2   CRC-16/CCITT of bytes 2 up to here
+ *
+ * Multi-byte fields are little-endian, as the AVR stores them. The sync bytes
+ * never occur in the ASCII format, so the decoder switches to frames at the
+ * first one it sees. A frame that fails its CRC is dropped and the decoder
+ * resyncs on the next sync pair; a gap in sequence numbers counts the frames
+ * lost in between. If too many bytes go by without a good frame (the board was
+ * reset and is back to ASCII) the decoder falls back to lines.
+ */
+
+#ifndef SERIAL_FRAME_H
+#define SERIAL_FRAME_H
+
+#include <stdint.h>
+#include <string.h>
+#include "line_framer.h"
+
+#define FRAME_SYNC_0 0xA5
+#define FRAME_SYNC_1 0x5A
+#define FRAME_HEADER_LENGTH 12
+#define FRAME_MAX_SAMPLES 16
+#define FRAME_MAX_LENGTH (FRAME_HEADER_LENGTH + 2 * FRAME_MAX_SAMPLES + 2)
+#define FRAME_MOTION 0x01
+#define FRAME_NO_READING -32768
+#define FRAME_COMMAND 'b'                     // asks a board to switch to frames
+#define FRAME_FALLBACK_BYTES (4 * FRAME_MAX_LENGTH)   // junk without a good frame before going back to lines
+#define FRAME_NEGOTIATE_ATTEMPTS 3            // times a board still sending lines is asked per connect
+#define FRAME_NEGOTIATE_MS 5000               // between those requests
+
+typedef struct SerialFrame serial_frame;
+typedef struct FrameDecoder frame_decoder;
+typedef void (*frame_handler)(const serial_frame* frame, void* context);
+
+struct SerialFrame {
+  uint8_t flags;
+  int count;
+  uint16_t seq;
+  uint32_t device_ms;
+  uint16_t interval_ms;
+  int16_t raw[FRAME_MAX_SAMPLES];
+};
+
+struct FrameDecoder {
+  bool active;            // the stream is in frames, not lines
+  uint8_t buf[FRAME_MAX_LENGTH];
+  int len;
+  bool have_seq;          // next_seq is known
+  uint16_t next_seq;
+  int junk;               // bytes skipped since the last good frame
+  long long frames;       // good frames delivered
+  long long lost;         // frames missing from the sequence
+  long long crc_errors;   // frames dropped for a bad CRC or length
+  long long fallbacks;    // times the stream went back to lines
+};
+
+/*
+ * CRC-16/CCITT (polynomial 0x1021, initial 0xFFFF) a nibble at a time. The sketch, short
+ * on flash and in no hurry, computes the same CRC a bit at a time.
+ */
+static inline uint16_t frameCrc(const uint8_t* data, int len) {
+      static const uint16_t nibbles[16] = { 0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+                                            0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF };
+      uint16_t crc = 0xFFFF;
+      for (int i = 0; i < len; i++) {
+            crc = (crc << 4) ^ nibbles[(crc >> 12) ^ (data[i] >> 4)];
+            crc = (crc << 4) ^ nibbles[(crc >> 12) ^ (data[i] & 0x0F)];
+      }
+      return crc;
+}
+
+static inline int frameLength(int count) {
+      return FRAME_HEADER_LENGTH + 2 * count + 2;
+}
+
+/*
+ * Converts a raw reading to 1/10000 degrees, the fixed point the line parser produces.
+ */
+static inline int32_t frameFixedTemp(int16_t raw) {
+      return raw == FRAME_NO_READING ? -2740000 : (int32_t) raw * 625;
+}
+
+/*
+ * Encodes a frame into out, which needs FRAME_MAX_LENGTH bytes, and returns its length.
+ */
+static inline int frameEncode(const serial_frame* frame, uint8_t* out) {
+      out[0] = FRAME_SYNC_0;
+      out[1] = FRAME_SYNC_1;
+      out[2] = frame->flags;
+      out[3] = (uint8_t) frame->count;
+      out[4] = frame->seq & 0xFF;
+      out[5] = frame->seq >> 8;
+      for (int i = 0; i < 4; i++) out[6 + i] = (frame->device_ms >> (8 * i)) & 0xFF;
+      out[10] = frame->interval_ms & 0xFF;
+      out[11] = frame->interval_ms >> 8;
+      for (int i = 0; i < frame->count; i++) {
+            out[FRAME_HEADER_LENGTH + 2 * i] = (uint16_t) frame->raw[i] & 0xFF;
+            out[FRAME_HEADER_LENGTH + 2 * i + 1] = (uint16_t) frame->raw[i] >> 8;
+      }
+      int len = FRAME_HEADER_LENGTH + 2 * frame->count;
+      uint16_t crc = frameCrc(out + 2, len - 2);
+      out[len] = crc & 0xFF;
+      out[len + 1] = crc >> 8;
+      return len + 2;
+}
+
+/*
+ * Resets the decoder to reading lines.
+ */
+static inline void decoderInit(frame_decoder* decoder) {
+      memset(decoder, 0, sizeof(frame_decoder));
+}
+
+/*
+ * Decodes the len-byte frame at b, checking its CRC.
+ */
+static inline bool frameDecode(const uint8_t* b, int len, serial_frame* frame) {
+      uint16_t crc = b[len - 2] | (uint16_t) b[len - 1] << 8;
+      if (frameCrc(b + 2, len - 4) != crc) return false;
+      frame->flags = b[2];
+      frame->count = b[3];
+      frame->seq = b[4] | (uint16_t) b[5] << 8;
+      frame->device_ms = b[6] | (uint32_t) b[7] << 8 | (uint32_t) b[8] << 16 | (uint32_t) b[9] << 24;
+      frame->interval_ms = b[10] | (uint16_t) b[11] << 8;
+      for (int i = 0; i < frame->count; i++) {
+            frame->raw[i] = (int16_t) (b[FRAME_HEADER_LENGTH + 2 * i] | (uint16_t) b[FRAME_HEADER_LENGTH + 2 * i + 1] << 8);
+      }
+      return true;
+}
+
+static inline int decoderBytes(frame_decoder* decoder, const uint8_t* data, int n, frame_handler handler, void* context);
+
+/*
+ * Gives up on the bytes buffered so far: the first is skipped and the rest are scanned
+ * again, since the next frame may start inside them.
+ */
+static inline void decoderResync(frame_decoder* decoder, frame_handler handler, void* context) {
+      uint8_t rest[FRAME_MAX_LENGTH];
+      int n = decoder->len - 1;
+      memcpy(rest, decoder->buf + 1, n);
+      decoder->len = 0;
+      decoder->junk++;
+      decoderBytes(decoder, rest, n, handler, context);
+}
+
+/*
+ * Counts a good frame and hands it over.
+ */
+static inline void decoderDeliver(frame_decoder* decoder, const serial_frame* frame, frame_handler handler, void* context) {
+      decoder->junk = 0;
+      if (decoder->have_seq && frame->seq != decoder->next_seq) decoder->lost += (uint16_t) (frame->seq - decoder->next_seq);
+      decoder->have_seq = true;
+      decoder->next_seq = frame->seq + 1;
+      decoder->frames++;
+      handler(frame, context);
+}
+
+/*
+ * Runs bytes through the frame state machine, delivering every good frame. Returns how
+ * many bytes were used, which is fewer than n if the decoder fell back to lines.
+ */
+static inline int decoderBytes(frame_decoder* decoder, const uint8_t* data, int n, frame_handler handler, void* context) {
+      for (int i = 0; i < n; i++) {
+            if (!decoder->active) return i;
+            uint8_t b = data[i];
+            //a whole frame inside this read is decoded in place
+            if (decoder->len == 0 && b == FRAME_SYNC_0 && n - i >= FRAME_HEADER_LENGTH && data[i + 1] == FRAME_SYNC_1
+                && data[i + 3] > 0 && data[i + 3] <= FRAME_MAX_SAMPLES && n - i >= frameLength(data[i + 3])) {
+                  serial_frame frame;
+                  if (frameDecode(data + i, frameLength(data[i + 3]), &frame)) {
+                        i += frameLength(data[i + 3]) - 1;
+                        decoderDeliver(decoder, &frame, handler, context);
+                        continue;
+                  }
+            }
+            if (decoder->len == 0 && b != FRAME_SYNC_0) {
+                  decoder->junk++;
+                  if (decoder->junk > FRAME_FALLBACK_BYTES) {
+                        decoder->active = false;
+                        decoder->have_seq = false;
+                        decoder->fallbacks++;
+                        return i + 1;
+                  }
+                  continue;
+            }
+            if (decoder->len == 1 && b != FRAME_SYNC_1) {
+                  decoder->junk++;
+                  decoder->len = b == FRAME_SYNC_0 ? 1 : 0;
+                  continue;
+            }
+            decoder->buf[decoder->len++] = b;
+            if (decoder->len == 4 && (b == 0 || b > FRAME_MAX_SAMPLES)) {
+                  decoder->crc_errors++;
+                  decoderResync(decoder, handler, context);
+                  continue;
+            }
+            if (decoder->len < FRAME_HEADER_LENGTH || decoder->len < frameLength(decoder->buf[3])) continue;
+            serial_frame frame;
+            if (!frameDecode(decoder->buf, decoder->len, &frame)) {
+                  decoder->crc_errors++;
+                  decoderResync(decoder, handler, context);
+                  continue;
+            }
+            decoder->len = 0;
+            decoderDeliver(decoder, &frame, handler, context);
+      }
+      return n;
+}
+
+/*
+ * Feeds n bytes from a board that may send lines or frames. Lines go to on_line through
+ * the framer until the first sync byte; from then on frames go to on_frame, until the
+ * decoder falls back to lines.
+ */
+static inline void frameStreamFeed(frame_decoder* decoder, line_framer* framer, const char* data, int n,
+                                   frame_handler on_frame, line_handler on_line, void* context) {
+      while (n > 0) {
+            if (!decoder->active) {
+                  const char* sync = (const char*) memchr(data, FRAME_SYNC_0, n);
+                  int text = sync != NULL ? sync - data : n;
+                  framerFeed(framer, data, text, on_line, context);
+                  if (sync == NULL) return;
+                  //whatever line was in progress is cut off by the switch
+                  framer->len = 0;
+                  framer->overflow = false;
+                  decoder->active = true;
+                  decoder->len = 0;
+                  decoder->junk = 0;
+                  data += text;
+                  n -= text;
+            }
+            int used = decoderBytes(decoder, (const uint8_t*) data, n, on_frame, context);
+            data += used;
+            n -= used;
+      }
+}
+
+#endif
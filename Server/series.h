@@ -0,0 +1,304 @@
+/*
+ * series.h
+ *
+ * Timestamped temperature series for range queries. Points come straight from
+ * a sensor's ring while the range is still inside it, from the compressed
+ * archive for older ranges it holds, and from the finest rollup tier that
+ * reaches back far enough otherwise. A series is reduced to
+ * the requested number of points either by min/max/avg over equal-width time
+ * buckets or by largest-triangle-three-buckets (LTTB), which keeps the shape
+ * of the curve with one value per point.
+ */
+
+#ifndef SERIES_H
+#define SERIES_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "temp_stats.h"
+#include "temp_ring.h"
+#include "rollup.h"
+#include "archive.h"
+
+#define SERIES_MAX_SOURCE 8192     // points read from a rollup tier for one query
+#define SERIES_MAX_POINTS 5000     // points a client may ask for
+#define SERIES_DEFAULT_POINTS 300
+
+typedef struct SeriesPoint series_point;
+typedef struct SeriesBuilder series_builder;
+
+struct SeriesPoint {
+  int64_t time;           // ms since the epoch; the bucket start for aggregated points
+  double min;
+  double max;
+  double avg;
+  int count;              // readings folded into the point
+};
+
+//folds time-ordered readings into at most capacity equal slices of a range as they arrive
+struct SeriesBuilder {
+  series_point* points;
+  int n;
+  int capacity;
+  int64_t from;
+  int64_t span;
+  int64_t slice;          // slice of the last point
+  long long sum;          // of the last point, in 1/10000 degrees
+};
+
+/*
+ * Copies the valid readings taken in [from, to) ms out of the ring, oldest first.
+ * The ring is copied whole and the slots the ingest thread overwrote meanwhile are
+ * discarded, so the reader never holds up ingest. Returns the number of points,
+ * or -1 if memory could not be allocated.
+ */
+static inline int seriesFromRing(const temp_ring* ring, int64_t from, int64_t to, series_point* out, int capacity) {
+      int16_t* values = (int16_t*) malloc(TEMP_HISTORY * sizeof(int16_t));
+      uint64_t* valid = (uint64_t*) malloc(RING_VALID_WORDS * sizeof(uint64_t));
+      int64_t* timestamps = (int64_t*) malloc(TEMP_HISTORY * sizeof(int64_t));
+      if (values == NULL || valid == NULL || timestamps == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            free(values);
+            free(valid);
+            free(timestamps);
+            return -1;
+      }
+      uint32_t first = __atomic_load_n(&ring->header->next, __ATOMIC_ACQUIRE);
+      memcpy(values, ring->values, TEMP_HISTORY * sizeof(int16_t));
+      memcpy(valid, ring->valid, RING_VALID_WORDS * sizeof(uint64_t));
+      memcpy(timestamps, ring->timestamps, TEMP_HISTORY * sizeof(int64_t));
+      uint32_t last = __atomic_load_n(&ring->header->next, __ATOMIC_ACQUIRE);
+      //slots first..last may hold a newer reading than the one published at first
+      int overwritten = (last + TEMP_HISTORY - first) % TEMP_HISTORY + 1;
+      int n = 0;
+      for (int i = overwritten; i < TEMP_HISTORY && n < capacity; i++) {
+            int slot = (first + i) % TEMP_HISTORY;
+            int64_t when = timestamps[slot];
+            if (when < from || when >= to || !sampleValid(valid, slot)) continue;
+            series_point* point = &out[n++];
+            point->time = when;
+            point->min = point->max = point->avg = sampleValue(values, valid, slot);
+            point->count = 1;
+      }
+      free(values);
+      free(valid);
+      free(timestamps);
+      return n;
+}
+
+/*
+ * Returns the oldest timestamp still held by the ring in ms, or 0 if it is empty.
+ */
+static inline int64_t seriesRingStart(const temp_ring* ring) {
+      uint32_t next = __atomic_load_n(&ring->header->next, __ATOMIC_ACQUIRE);
+      for (int i = 0; i < TEMP_HISTORY; i++) {
+            int64_t when = ring->timestamps[(next + i) % TEMP_HISTORY];
+            if (when > 0) return when;
+      }
+      return 0;
+}
+
+/*
+ * Copies the buckets of rollup tier t that start in [from, to) seconds, oldest first.
+ */
+static inline int seriesFromTierOnce(rollup_store* store, int t, int64_t from, int64_t to, series_point* out, int capacity) {
+      int64_t width = store->tiers[t].width;
+      int n = 0;
+      for (int64_t start = from - from % width; start < to && n < capacity; start += width) {
+            rollup_bucket* bucket = rollupBucket(store, t, start);
+            if (bucket == NULL || bucket->start != start || bucket->count == 0) continue;
+            series_point* point = &out[n++];
+            point->time = start * 1000;
+            point->min = bucket->min;
+            point->max = bucket->max;
+            point->avg = bucket->sum / 10000.0 / bucket->count;
+            point->count = bucket->count;
+      }
+      return n;
+}
+
+/*
+ * Copies the rollup buckets covering [from, to) seconds from the finest tier that
+ * still retains from and needs no more than capacity buckets (the coarsest tier
+ * otherwise). Retries if a reading landed mid-copy.
+ */
+static inline int seriesFromRollups(rollup_store* store, int64_t from, int64_t to, series_point* out, int capacity) {
+      int n;
+      unsigned seq;
+      do {
+            seq = seqlockReadBegin(&store->lock);
+            int t = 0;
+            for (; t < ROLLUP_TIERS - 1; t++) {
+                  rollup_tier* tier = &store->tiers[t];
+                  int64_t oldest = store->latest - store->latest % tier->width - (tier->size - 1) * tier->width;
+                  if (from >= oldest && (to - from) / tier->width < capacity) break;
+            }
+            n = seriesFromTierOnce(store, t, from, to, out, capacity);
+      } while (seqlockReadRetry(&store->lock, seq));
+      return n;
+}
+
+static inline void builderInit(series_builder* builder, series_point* points, int capacity, int64_t from, int64_t to) {
+      builder->points = points;
+      builder->n = 0;
+      builder->capacity = capacity;
+      builder->from = from;
+      builder->span = to - from;
+      builder->slice = -1;
+      builder->sum = 0;
+}
+
+/*
+ * Adds one reading. Readings in the same slice as the previous one are merged into
+ * its point, which keeps the time of the first reading in the slice.
+ */
+static inline void builderAdd(int64_t time, double value, void* context) {
+      series_builder* builder = (series_builder*) context;
+      if (!validReading(value)) return;
+      int64_t slice = (time - builder->from) * builder->capacity / builder->span;
+      if (slice != builder->slice || builder->n == 0) {
+            if (builder->n == builder->capacity) return;
+            if (builder->n > 0) builder->points[builder->n - 1].avg = builder->sum / 10000.0 / builder->points[builder->n - 1].count;
+            series_point* point = &builder->points[builder->n++];
+            point->time = time;
+            point->min = point->max = value;
+            point->count = 1;
+            builder->slice = slice;
+            builder->sum = llround(value * 10000.0);
+            return;
+      }
+      series_point* point = &builder->points[builder->n - 1];
+      if (value < point->min) point->min = value;
+      if (value > point->max) point->max = value;
+      point->count++;
+      builder->sum += llround(value * 10000.0);
+}
+
+/*
+ * Returns the number of points built, with the last one's average filled in.
+ */
+static inline int builderFinish(series_builder* builder) {
+      if (builder->n > 0) builder->points[builder->n - 1].avg = builder->sum / 10000.0 / builder->points[builder->n - 1].count;
+      return builder->n;
+}
+
+/*
+ * Collects the readings taken in [from, to) ms from the archive, continuing with the
+ * ring from ring_start on, since the archive lacks the readings still being blocked up.
+ * Ranges with more readings than capacity are folded into capacity equal slices.
+ * Returns the number of points, or -1 on an error.
+ */
+static inline int seriesFromArchive(archive* history, const temp_ring* ring, int64_t ring_start, int64_t from, int64_t to,
+                                    series_point* out, int capacity) {
+      series_builder builder;
+      builderInit(&builder, out, capacity, from, to);
+      int64_t split = ring_start > from && ring_start < to ? ring_start : to;
+      if (archiveScan(history, from, split, builderAdd, &builder) < 0) return -1;
+      if (split < to) {
+            series_point* recent = (series_point*) malloc(TEMP_HISTORY * sizeof(series_point));
+            if (recent == NULL) {
+                  printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+                  return -1;
+            }
+            int n = seriesFromRing(ring, split, to, recent, TEMP_HISTORY);
+            for (int i = 0; i < n; i++) builderAdd(recent[i].time, recent[i].avg, &builder);
+            free(recent);
+      }
+      return builderFinish(&builder);
+}
+
+/*
+ * Reduces points in [from, to) ms to at most buckets points, each the min, max and
+ * average of the points in one equal-width slice of the range. Empty slices are
+ * left out. Works in place and returns the number of points kept.
+ */
+static inline int seriesBucket(series_point* points, int n, int64_t from, int64_t to, int buckets) {
+      if (n <= buckets) return n;
+      int64_t span = to - from;
+      int kept = 0;
+      int64_t current = -1;
+      long long sum = 0;
+      for (int i = 0; i < n; i++) {
+            series_point point = points[i];
+            int64_t b = (point.time - from) * buckets / span;
+            //a rollup bucket may start just before the range
+            if (b < 0) b = 0;
+            if (b >= buckets) b = buckets - 1;
+            if (b != current) {
+                  if (kept > 0) points[kept - 1].avg = sum / 10000.0 / points[kept - 1].count;
+                  current = b;
+                  series_point* merged = &points[kept++];
+                  *merged = point;
+                  merged->time = from + span * b / buckets;
+                  sum = llround(point.avg * 10000.0) * point.count;
+                  continue;
+            }
+            series_point* merged = &points[kept - 1];
+            if (point.min < merged->min) merged->min = point.min;
+            if (point.max > merged->max) merged->max = point.max;
+            merged->count += point.count;
+            sum += llround(point.avg * 10000.0) * point.count;
+      }
+      if (kept > 0) points[kept - 1].avg = sum / 10000.0 / points[kept - 1].count;
+      return kept;
+}
+
+/*
+ * Picks threshold (at least 2) of the points by largest-triangle-three-buckets on their averages.
+ * The first and last points are always kept. Works in place and returns the number
+ * of points kept.
+ */
+static inline int seriesLttb(series_point* points, int n, int threshold) {
+      if (threshold >= n) return n;
+      if (threshold < 3) {
+            points[1] = points[n - 1];
+            return 2;
+      }
+      //bucket b covers points [b * (n - 2) / buckets + 1, (b + 1) * (n - 2) / buckets + 1), in integers
+      //so the edges land exactly and the last bucket ends just before the final point
+      int buckets = threshold - 2;
+      int kept = 1;         // points[0] stays where it is
+      int a = 0;
+      for (int b = 0; b < buckets; b++) {
+            bool last = b == buckets - 1;
+            //average of the next bucket is the triangle's third corner; the last bucket
+            //looks at the fixed final point instead
+            double avg_time = points[n - 1].time, avg_value = points[n - 1].avg;
+            if (!last) {
+                  int next_start = (int) ((long long) (b + 1) * (n - 2) / buckets) + 1;
+                  int next_end = (int) ((long long) (b + 2) * (n - 2) / buckets) + 1;
+                  avg_time = avg_value = 0;
+                  for (int i = next_start; i < next_end; i++) {
+                        avg_time += points[i].time;
+                        avg_value += points[i].avg;
+                  }
+                  int next_len = next_end - next_start;
+                  if (next_len > 0) {
+                        avg_time /= next_len;
+                        avg_value /= next_len;
+                  }
+            }
+            int start = (int) ((long long) b * (n - 2) / buckets) + 1;
+            int end = (int) ((long long) (b + 1) * (n - 2) / buckets) + 1;
+            double a_time = points[a].time;
+            double a_value = points[a].avg;
+            double best_area = -1;
+            int best = start;
+            for (int i = start; i < end; i++) {
+                  double area = fabs((a_time - avg_time) * (points[i].avg - a_value)
+                                     - (a_time - points[i].time) * (avg_value - a_value));
+                  if (area > best_area) {
+                        best_area = area;
+                        best = i;
+                  }
+            }
+            //earlier picks were moved below start, so the buckets ahead are untouched
+            points[kept++] = points[best];
+            a = kept - 1;
+      }
+      points[kept++] = points[n - 1];
+      return kept;
+}
+
+#endif
@@ -8,6 +8,7 @@
 typedef struct ServerInfo server_info;
 struct ServerInfo {
   int port_num;
+  const char* ring_dir;      // directory holding each sensor's persistent temperature ring
 };
 
 
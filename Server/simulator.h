@@ -0,0 +1,331 @@
+/*
+ * simulator.h
+ *
+ * Stand-in Arduinos for testing and benchmarking without the hardware. A
+ * simulator owns the master side of a pseudo-terminal and the server opens the
+ * slave side as if it were the board's serial device. It either synthesizes a
+ * stream in the sketch's own line format ("23.625\n", "tripped\n", and
+ * "-274.0\n" while in standby) at any rate, or replays a capture of a real
+ * session. It also answers the 's' standby command the way WatchDog.ino does,
+ * and a synthetic board switches to binary frames when asked like the sketch;
+ * a replayed one acts like old firmware and stays on lines.
+ * Captures are written by the ingest thread as "<ms since start>\t<line>"
+ * records, so a replay reproduces the original pacing (or runs flat out).
+ */
+
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "serial_frame.h"
+
+#define SIM_SYNTHETIC 1
+#define SIM_REPLAY 2
+#define SIM_BATCH_LINES 256         // most lines written per wakeup, so commands are still read at high rates
+#define SIM_TRIP_ODDS 600           // a synthetic sample is followed by "tripped" about once in this many
+
+typedef struct Simulator simulator;
+
+struct Simulator {
+  int mode;                         // SIM_SYNTHETIC or SIM_REPLAY
+  int master_fd;                    // our end of the pseudo-terminal
+  int slave_fd;                     // held open so the pty survives the server reconnecting
+  char device_path[64];             // slave device the server opens
+  double rate;                      // synthetic lines per second
+  double speed;                     // replay speed factor, 0 to replay as fast as possible
+  FILE* replay;
+  uint64_t seed;                    // synthetic streams are reproducible from the seed
+  int temp16;                       // synthetic temperature in 1/16 degrees, like the thermometer
+  bool standby;
+  bool frames;                      // sending binary frames instead of lines
+  uint16_t frame_seq;
+  long long lines;                  // lines, or readings while sending frames
+  std::atomic<bool> running;
+  pthread_t thread;
+};
+
+/*
+ * Creates the pseudo-terminal and puts it in raw mode, so nothing the simulator writes is
+ * echoed back as a command. Returns false if no pty is available.
+ */
+static inline bool simOpen(simulator* sim) {
+      sim->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+      if (sim->master_fd == -1 || grantpt(sim->master_fd) == -1 || unlockpt(sim->master_fd) == -1) {
+            perror("Pseudo-terminal");
+            return false;
+      }
+      snprintf(sim->device_path, sizeof(sim->device_path), "%s", ptsname(sim->master_fd));
+      sim->slave_fd = open(sim->device_path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+      if (sim->slave_fd == -1) {
+            perror("Pseudo-terminal");
+            return false;
+      }
+      struct termios options;
+      tcgetattr(sim->slave_fd, &options);
+      cfmakeraw(&options);
+      tcsetattr(sim->slave_fd, TCSANOW, &options);
+      fcntl(sim->master_fd, F_SETFL, fcntl(sim->master_fd, F_GETFL) | O_NONBLOCK);
+      sim->standby = false;
+      sim->frames = false;
+      sim->frame_seq = 0;
+      sim->lines = 0;
+      sim->running = false;
+      return true;
+}
+
+/*
+ * Sets the simulator up to synthesize rate lines per second.
+ */
+static inline bool simSynthetic(simulator* sim, double rate, uint64_t seed) {
+      if (!simOpen(sim)) return false;
+      sim->mode = SIM_SYNTHETIC;
+      sim->replay = NULL;
+      sim->rate = rate > 0 ? rate : 1;
+      sim->seed = seed ? seed : 1;
+      sim->temp16 = 22 * 16;
+      return true;
+}
+
+/*
+ * Sets the simulator up to replay a capture at speed times its original pace (0 = unpaced).
+ * Returns false if the capture cannot be opened.
+ */
+static inline bool simReplay(simulator* sim, const char* path, double speed) {
+      sim->replay = fopen(path, "r");
+      if (sim->replay == NULL) {
+            printf("Couldn't open the capture %s.\n", path);
+            return false;
+      }
+      if (!simOpen(sim)) return false;
+      sim->mode = SIM_REPLAY;
+      sim->speed = speed;
+      return true;
+}
+
+static inline uint64_t simRandom(simulator* sim) {
+      sim->seed ^= sim->seed << 13;
+      sim->seed ^= sim->seed >> 7;
+      sim->seed ^= sim->seed << 17;
+      return sim->seed;
+}
+
+/*
+ * Takes the next synthetic reading in the thermometer's raw 1/16 degrees, or
+ * FRAME_NO_READING in standby. The temperature wanders a step at a time. Sets trip
+ * if the motion sensor goes off along with it.
+ */
+static inline int simSyntheticSample(simulator* sim, bool* trip) {
+      *trip = false;
+      if (sim->standby) return FRAME_NO_READING;
+      uint64_t r = simRandom(sim);
+      if (r % 4 == 0 && sim->temp16 < 30 * 16) sim->temp16++;
+      else if (r % 4 == 1 && sim->temp16 > 15 * 16) sim->temp16--;
+      *trip = (r >> 8) % SIM_TRIP_ODDS == 0;
+      return sim->temp16;
+}
+
+/*
+ * Appends the next synthetic line(s) to out and returns the bytes written, printed
+ * the way the sketch's SerialMonitorPrint does.
+ */
+static inline int simSyntheticLine(simulator* sim, char* out) {
+      bool trip;
+      int raw = simSyntheticSample(sim, &trip);
+      if (raw == FRAME_NO_READING) return sprintf(out, "-274.0\n");
+      int len = sprintf(out, "%d.%d\n", raw / 16, (raw % 16) * 625);
+      if (trip) len += sprintf(out + len, "tripped\n");
+      return len;
+}
+
+/*
+ * Appends a frame of count synthetic readings to out and returns the bytes written.
+ */
+static inline int simSyntheticFrame(simulator* sim, uint8_t* out, int count, long long now) {
+      serial_frame frame;
+      frame.flags = 0;
+      frame.count = count;
+      frame.seq = sim->frame_seq++;
+      frame.interval_ms = (uint16_t) (1000 / sim->rate);
+      frame.device_ms = (uint32_t) (now - (long long) (count - 1) * frame.interval_ms);
+      for (int i = 0; i < count; i++) {
+            bool trip;
+            frame.raw[i] = (int16_t) simSyntheticSample(sim, &trip);
+            if (trip) frame.flags |= FRAME_MOTION;
+      }
+      return frameEncode(&frame, out);
+}
+
+/*
+ * Reads the next capture record into out, looping back to the start at the end of the file.
+ * Sets when to the record's offset in ms. Returns the line length, or -1 if the capture is empty.
+ */
+static inline int simReplayLine(simulator* sim, char* out, int size, long long* when) {
+      char record[128];
+      for (int attempt = 0; attempt < 2; attempt++) {
+            while (fgets(record, sizeof(record), sim->replay) != NULL) {
+                  char* tab = strchr(record, '\t');
+                  if (tab == NULL) continue;
+                  *when = atoll(record);
+                  return snprintf(out, size, "%s", tab + 1);
+            }
+            rewind(sim->replay);
+      }
+      return -1;
+}
+
+/*
+ * Writes len bytes to the pty, waiting while the server is behind. Returns false on shutdown or error.
+ */
+static inline bool simWrite(simulator* sim, const char* data, int len) {
+      while (len > 0) {
+            int written = write(sim->master_fd, data, len);
+            if (written > 0) {
+                  data += written;
+                  len -= written;
+                  continue;
+            }
+            if (written == -1 && errno != EAGAIN && errno != EINTR) return false;
+            if (!sim->running) return false;
+            struct pollfd pfd = { sim->master_fd, POLLOUT, 0 };
+            poll(&pfd, 1, 100);
+      }
+      return true;
+}
+
+/*
+ * Handles commands the server sent to the board. Only standby and the switch to frames
+ * change what the board transmits.
+ */
+static inline void simCommands(simulator* sim) {
+      char commands[64];
+      int n;
+      while ((n = read(sim->master_fd, commands, sizeof(commands))) > 0) {
+            for (int i = 0; i < n; i++) {
+                  if (commands[i] == 's') sim->standby = !sim->standby;
+                  if (commands[i] == FRAME_COMMAND && sim->mode == SIM_SYNTHETIC) sim->frames = true;
+            }
+      }
+}
+
+static inline long long simMillis() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Feeds the pty until simStop. Lines are written in batches of whatever is due, so rates
+ * far above the scheduler's tick still come out evenly on average.
+ */
+static inline void* simThread(void* p) {
+      simulator* sim = (simulator*) p;
+      char batch[SIM_BATCH_LINES * 128];
+      long long start = simMillis();
+      //replay keeps the next record aside until it is due
+      char pending[128];
+      int pending_len = -1;
+      long long pending_due = 0;
+      long long first_offset = -1, last_offset = 0, wrap = 0;
+      while (sim->running) {
+            simCommands(sim);
+            int len = 0;
+            int count = 0;
+            long long now = simMillis();
+            if (sim->mode == SIM_SYNTHETIC) {
+                  long long due = (long long) ((now - start) * sim->rate / 1000.0) - sim->lines;
+                  while (count < due && count < SIM_BATCH_LINES) {
+                        if (!sim->frames) {
+                              len += simSyntheticLine(sim, batch + len);
+                              count++;
+                              continue;
+                        }
+                        //whatever is due goes out at once, in as few frames as it fits
+                        int n = due - count;
+                        if (n > SIM_BATCH_LINES - count) n = SIM_BATCH_LINES - count;
+                        if (n > FRAME_MAX_SAMPLES) n = FRAME_MAX_SAMPLES;
+                        len += simSyntheticFrame(sim, (uint8_t*) batch + len, n, now);
+                        count += n;
+                  }
+            }
+            else {
+                  while (count < SIM_BATCH_LINES) {
+                        if (pending_len < 0) {
+                              long long when;
+                              pending_len = simReplayLine(sim, pending, sizeof(pending), &when);
+                              if (pending_len < 0) break;
+                              if (first_offset < 0) first_offset = when;
+                              //the capture looped, carry on from where its timeline ended
+                              if (when < last_offset) wrap += last_offset - first_offset;
+                              last_offset = when;
+                              pending_due = when - first_offset + wrap;
+                        }
+                        if (sim->speed > 0 && pending_due / sim->speed > now - start) break;
+                        memcpy(batch + len, pending, pending_len);
+                        len += pending_len;
+                        pending_len = -1;
+                        count++;
+                  }
+            }
+            if (len > 0 && !simWrite(sim, batch, len)) break;
+            sim->lines += count;
+            if (count < SIM_BATCH_LINES) {
+                  struct timespec pause = { 0, 1000000 };
+                  nanosleep(&pause, NULL);
+            }
+      }
+      return NULL;
+}
+
+/*
+ * Starts feeding the pty from its own thread.
+ */
+static inline void simStart(simulator* sim) {
+      sim->running = true;
+      pthread_create(&sim->thread, NULL, &simThread, sim);
+}
+
+/*
+ * Stops the feeding thread and closes the pty.
+ */
+static inline void simStop(simulator* sim) {
+      if (sim->running.exchange(false)) pthread_join(sim->thread, NULL);
+      close(sim->master_fd);
+      close(sim->slave_fd);
+      if (sim->replay != NULL) fclose(sim->replay);
+}
+
+/*
+ * Opens the capture file for sensor id in dir. Returns NULL if it cannot be created.
+ */
+static inline FILE* captureOpen(const char* dir, const char* id) {
+      char path[512];
+      if (snprintf(path, sizeof(path), "%s/capture-%s.txt", dir, id) >= (int) sizeof(path)) {
+            printf("Couldn't create the capture file for %s.\n", id);
+            return NULL;
+      }
+      FILE* capture = fopen(path, "w");
+      if (capture == NULL) printf("Couldn't create the capture file %s.\n", path);
+      //line buffered so a capture cut short by a crash or kill is still usable
+      else setvbuf(capture, NULL, _IOLBF, 0);
+      return capture;
+}
+
+/*
+ * Appends one serial line to a capture, stamped with ms since start.
+ */
+static inline void captureLine(FILE* capture, long long start, const char* line, int len) {
+      fprintf(capture, "%lld\t%.*s\n", simMillis() - start, len, line);
+}
+
+#endif
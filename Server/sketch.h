@@ -0,0 +1,233 @@
+/*
+ * sketch.h
+ *
+ * Mergeable quantile sketches in the style of a merging t-digest. A sketch is
+ * a sorted list of centroids (mean, count); readings that repeat a centroid's
+ * value just bump its count, and when the list fills up it is compressed in
+ * one pass under the arcsine scale function, which keeps centroids near the
+ * tails small so p95/p99 stay accurate while the middle is coarse. Rollup
+ * buckets carry a small fixed-size sketch; queries merge the buckets (and
+ * sensors) they cover into a larger summary, so a quantile over months costs
+ * one merge per coarse bucket rather than a pass over raw readings.
+ */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "temp_stats.h"
+
+#define SKETCH_CENTROIDS 128           // per rollup bucket, 1 KB each
+#define SKETCH_SUMMARY_CENTROIDS 512   // per query
+#define CENTROID_COUNT_MAX 0x7fffffff  // a value seen more often than this spills into a second centroid
+
+typedef struct Centroid centroid;
+typedef struct QuantileSketch quantile_sketch;
+typedef struct QuantileSummary quantile_summary;
+
+struct Centroid {
+  float mean;
+  uint32_t count : 31;
+  uint32_t mixed : 1;   // set once compression folds distinct values into it
+};
+
+struct QuantileSketch {
+  int n;
+  centroid c[SKETCH_CENTROIDS];
+};
+
+struct QuantileSummary {
+  int n;
+  long long total;
+  double min;
+  double max;
+  centroid c[SKETCH_SUMMARY_CENTROIDS];
+};
+
+/*
+ * Merges neighbouring centroids of a sorted list in one pass, so that each one spans
+ * at most one unit of k(q) = delta / pi * asin(2q - 1) and holds at most
+ * CENTROID_COUNT_MAX readings. Leaves at most about delta + 1 centroids.
+ */
+static inline void centroidsCompress(centroid* c, int* n, int delta) {
+      long long total = 0;
+      for (int i = 0; i < *n; i++) total += c[i].count;
+      if (total == 0) return;
+      double scale = delta / M_PI;
+      int kept = 0;
+      long long before = 0;       // readings ahead of the centroid being built
+      //k(q) is inverted once per output centroid to get the readings it may grow to
+      double limit = total * (sin((scale * asin(-1.0) + 1) / scale) + 1) / 2;
+      double sum = c[0].mean * (double) c[0].count;
+      long long weight = c[0].count;
+      bool mixed = c[0].mixed;
+      for (int i = 1; i < *n; i++) {
+            if (before + weight + c[i].count <= limit && weight + c[i].count <= CENTROID_COUNT_MAX) {
+                  sum += c[i].mean * (double) c[i].count;
+                  weight += c[i].count;
+                  mixed = true;
+                  continue;
+            }
+            c[kept].mean = (float) (sum / weight);
+            c[kept].count = (uint32_t) weight;
+            c[kept].mixed = mixed;
+            kept++;
+            before += weight;
+            double k = scale * asin(2.0 * before / total - 1) + 1;
+            limit = k >= scale * M_PI / 2 ? total : total * (sin(k / scale) + 1) / 2;
+            sum = c[i].mean * (double) c[i].count;
+            weight = c[i].count;
+            mixed = c[i].mixed;
+      }
+      c[kept].mean = (float) (sum / weight);
+      c[kept].count = (uint32_t) weight;
+      c[kept].mixed = mixed;
+      *n = kept + 1;
+}
+
+/*
+ * Adds count readings of value to a sorted list of at most cap centroids.
+ */
+static inline void centroidsAdd(centroid* c, int* n, int cap, double value, uint32_t count) {
+      float mean = (float) value;
+      int lo = 0, hi = *n;
+      while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (c[mid].mean < mean) lo = mid + 1;
+            else hi = mid;
+      }
+      if (lo < *n && c[lo].mean == mean && c[lo].count <= CENTROID_COUNT_MAX - count) {
+            c[lo].count += count;
+            return;
+      }
+      if (*n == cap) {
+            centroidsCompress(c, n, cap / 2);
+            centroidsAdd(c, n, cap, value, count);
+            return;
+      }
+      memmove(&c[lo + 1], &c[lo], (*n - lo) * sizeof(centroid));
+      c[lo].mean = mean;
+      c[lo].count = count;
+      c[lo].mixed = false;
+      (*n)++;
+}
+
+/*
+ * Merges the sorted list src into the sorted list c of at most cap centroids.
+ */
+static inline void centroidsMerge(centroid* c, int* n, int cap, const centroid* src, int src_n) {
+      centroid merged[2 * SKETCH_SUMMARY_CENTROIDS];
+      if (src_n > SKETCH_SUMMARY_CENTROIDS) src_n = SKETCH_SUMMARY_CENTROIDS;
+      int i = 0, j = 0, m = 0;
+      while (i < *n || j < src_n) {
+            centroid next = j == src_n || (i < *n && c[i].mean <= src[j].mean) ? c[i++] : src[j++];
+            //as in centroidsAdd, a repeated value only adds to its centroid's count while it fits
+            if (m > 0 && merged[m - 1].mean == next.mean && merged[m - 1].count <= CENTROID_COUNT_MAX - next.count) {
+                  merged[m - 1].count += next.count;
+                  merged[m - 1].mixed |= next.mixed;
+            }
+            else merged[m++] = next;
+      }
+      if (m > cap) centroidsCompress(merged, &m, cap / 2);
+      memcpy(c, merged, m * sizeof(centroid));
+      *n = m;
+}
+
+static inline void sketchInit(quantile_sketch* sketch) {
+      sketch->n = 0;
+}
+
+static inline void sketchAdd(quantile_sketch* sketch, double value) {
+      centroidsAdd(sketch->c, &sketch->n, SKETCH_CENTROIDS, value, 1);
+}
+
+static inline void summaryInit(quantile_summary* summary) {
+      summary->n = 0;
+      summary->total = 0;
+      summary->min = 1e9;
+      summary->max = -1e9;
+}
+
+/*
+ * Folds a bucket's sketch into a summary. The sketch may have been copied mid-update
+ * under a seqlock, so its length is clamped; the caller retries the whole read anyway.
+ */
+static inline void summaryMergeSketch(quantile_summary* summary, const quantile_sketch* sketch, double min, double max) {
+      int n = sketch->n;
+      if (n < 0 || n > SKETCH_CENTROIDS) n = 0;
+      centroidsMerge(summary->c, &summary->n, SKETCH_SUMMARY_CENTROIDS, sketch->c, n);
+      for (int i = 0; i < n; i++) summary->total += sketch->c[i].count;
+      if (min < summary->min) summary->min = min;
+      if (max > summary->max) summary->max = max;
+}
+
+/*
+ * Folds count readings that are only known by their min, max and average into a summary.
+ */
+static inline void summaryAddBucket(quantile_summary* summary, double min, double max, double average, int count) {
+      if (count <= 0) return;
+      centroid parts[3];
+      int n = 0;
+      for (int i = 0; i < 3; i++) parts[i].mixed = false;
+      if (count == 1) {
+            parts[n].mean = (float) average;
+            parts[n++].count = 1;
+      }
+      else {
+            parts[n].mean = (float) min;
+            parts[n++].count = 1;
+            if (count > 2) {
+                  parts[n].mean = (float) average;
+                  parts[n].mixed = min != max;
+                  parts[n++].count = count - 2;
+            }
+            parts[n].mean = (float) max;
+            parts[n++].count = 1;
+      }
+      centroidsMerge(summary->c, &summary->n, SKETCH_SUMMARY_CENTROIDS, parts, n);
+      summary->total += count;
+      if (min < summary->min) summary->min = min;
+      if (max > summary->max) summary->max = max;
+}
+
+/*
+ * Folds one summary into another, e.g. to combine sensors.
+ */
+static inline void summaryMerge(quantile_summary* into, const quantile_summary* from) {
+      centroidsMerge(into->c, &into->n, SKETCH_SUMMARY_CENTROIDS, from->c, from->n);
+      into->total += from->total;
+      if (from->min < into->min) into->min = from->min;
+      if (from->max > into->max) into->max = from->max;
+}
+
+/*
+ * Estimates the q quantile by interpolating between centroid midpoints, and between
+ * the exact min and max at the ends. A rank that falls on a centroid of one repeated
+ * value gets that value, since readings are quantized and mostly ties. Returns
+ * NO_READING if the summary is empty.
+ */
+static inline double summaryQuantile(const quantile_summary* summary, double q) {
+      if (summary->total == 0 || summary->n == 0) return NO_READING;
+      double rank = q * summary->total;
+      double prev_mid = 0;
+      double prev_value = summary->min;
+      double cumulative = 0;
+      for (int i = 0; i < summary->n; i++) {
+            if (!summary->c[i].mixed && rank < cumulative + summary->c[i].count) return summary->c[i].mean;
+            double mid = cumulative + summary->c[i].count / 2.0;
+            if (rank < mid) {
+                  //a single reading is exact, and so is a centroid of one repeated value
+                  if (summary->c[i].count == 1 || mid == prev_mid) return summary->c[i].mean;
+                  return prev_value + (summary->c[i].mean - prev_value) * (rank - prev_mid) / (mid - prev_mid);
+            }
+            cumulative += summary->c[i].count;
+            prev_mid = mid;
+            prev_value = summary->c[i].mean;
+      }
+      if (summary->total == prev_mid) return summary->max;
+      return prev_value + (summary->max - prev_value) * (rank - prev_mid) / (summary->total - prev_mid);
+}
+
+#endif
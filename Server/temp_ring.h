@@ -0,0 +1,257 @@
+/*
+ * temp_ring.h
+ *
+ * The temperature history ring (timestamps, samples and write cursor) kept in a
+ * memory-mapped file so it survives server restarts. Samples are int16 in 1/16
+ * degrees with a validity bitmap beside them (see sample_column.h). The file
+ * starts with a small versioned header; a version 1 file, which held doubles,
+ * is converted in place, and a file with a different magic, version or capacity
+ * is reinitialized to "no reading". Inserts only touch the mapping and are
+ * msync'd asynchronously every RING_SYNC_INTERVAL readings. The ingest thread
+ * is the only writer and advances the cursor atomically after each slot.
+ */
+
+#ifndef TEMP_RING_H
+#define TEMP_RING_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "temp_stats.h"
+#include "sample_column.h"
+
+#define RING_MAGIC 0x474f4457      // "WDOG"
+#define RING_VERSION 2
+#define RING_VALID_WORDS SAMPLE_BITMAP_WORDS(TEMP_HISTORY)
+#define RING_SYNC_INTERVAL 64
+
+typedef struct RingHeader ring_header;
+typedef struct TempRing temp_ring;
+
+struct RingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t next;          // slot the next reading is written to
+  uint64_t inserted;      // readings written over the life of the file
+  uint64_t replicated;    // on an aggregator, the edge's sequence number of the last reading applied
+  uint64_t reserved[4];   // pads the header to 64 bytes
+};
+
+struct TempRing {
+  ring_header* header;
+  int64_t* timestamps;    // wall clock time of each reading, ms since the epoch
+  uint64_t* valid;        // bit i is set if slot i holds a reading
+  int16_t* values;        // in 1/16 degrees
+  void* map;
+  size_t map_size;
+  int file;
+  int unsynced;
+};
+
+/*
+ * Returns the current wall clock time in milliseconds since the epoch.
+ */
+static inline int64_t wallMillis() {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Reads a version 1 ring (doubles, then timestamps) out of the file before it is resized.
+ * Returns the old contents in a malloc'd buffer, or NULL if the file holds no such ring.
+ */
+static inline char* ringReadVersion1(int file, size_t file_size, ring_header* header) {
+      size_t size = sizeof(ring_header) + TEMP_HISTORY * (sizeof(double) + sizeof(int64_t));
+      if (file_size != size || pread(file, header, sizeof(ring_header), 0) != (ssize_t) sizeof(ring_header)
+          || header->magic != RING_MAGIC || header->version != 1 || header->capacity != TEMP_HISTORY
+          || header->next >= TEMP_HISTORY) return NULL;
+      char* old = (char*) malloc(size);
+      if (old == NULL) {
+            printf("\nAn error occurred while allocating memory for your request. Please try again.\n");
+            return NULL;
+      }
+      if (pread(file, old, size, 0) != (ssize_t) size) {
+            free(old);
+            return NULL;
+      }
+      return old;
+}
+
+/*
+ * Maps the ring file at path, creating or reinitializing it when it does not hold
+ * a compatible ring. Returns false if the file cannot be opened or mapped.
+ */
+static inline bool ringOpen(temp_ring* ring, const char* path) {
+      size_t size = sizeof(ring_header) + TEMP_HISTORY * sizeof(int64_t) + RING_VALID_WORDS * sizeof(uint64_t)
+                    + TEMP_HISTORY * sizeof(int16_t);
+      ring->file = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (ring->file == -1) {
+            perror("Ring file");
+            return false;
+      }
+      struct stat info;
+      if (fstat(ring->file, &info) == -1) {
+            perror("Ring file");
+            close(ring->file);
+            return false;
+      }
+      ring_header old_header;
+      char* old = ringReadVersion1(ring->file, info.st_size, &old_header);
+      if (ftruncate(ring->file, size) == -1) {
+            perror("Ring file");
+            free(old);
+            close(ring->file);
+            return false;
+      }
+      ring->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->file, 0);
+      if (ring->map == MAP_FAILED) {
+            perror("Ring mmap");
+            free(old);
+            close(ring->file);
+            return false;
+      }
+      ring->map_size = size;
+      ring->header = (ring_header*) ring->map;
+      ring->timestamps = (int64_t*) ((char*) ring->map + sizeof(ring_header));
+      ring->valid = (uint64_t*) (ring->timestamps + TEMP_HISTORY);
+      ring->values = (int16_t*) (ring->valid + RING_VALID_WORDS);
+      ring->unsynced = 0;
+      ring_header* header = ring->header;
+      bool compatible = (size_t) info.st_size == size && header->magic == RING_MAGIC
+                        && header->version == RING_VERSION && header->capacity == TEMP_HISTORY
+                        && header->next < TEMP_HISTORY;
+      if (!compatible) {
+            memset(header, 0, sizeof(ring_header));
+            memset(ring->valid, 0, RING_VALID_WORDS * sizeof(uint64_t));
+            for (int i = 0; i < TEMP_HISTORY; i++) {
+                  ring->values[i] = 0;
+                  ring->timestamps[i] = 0;
+            }
+            if (old != NULL) {
+                  //carry the readings of a version 1 ring over, rounded to the sensor's resolution
+                  const double* old_values = (const double*) (old + sizeof(ring_header));
+                  const int64_t* old_timestamps = (const int64_t*) (old_values + TEMP_HISTORY);
+                  for (int i = 0; i < TEMP_HISTORY; i++) {
+                        sampleStore(ring->values, ring->valid, i, old_values[i]);
+                        ring->timestamps[i] = old_timestamps[i];
+                  }
+                  header->next = old_header.next;
+                  header->inserted = old_header.inserted;
+            }
+            header->capacity = TEMP_HISTORY;
+            header->version = RING_VERSION;
+            header->magic = RING_MAGIC;
+            msync(ring->map, size, MS_SYNC);
+      }
+      free(old);
+      return true;
+}
+
+/*
+ * Returns the reading in slot, or NO_READING if it holds none.
+ */
+static inline double ringValue(const temp_ring* ring, int slot) {
+      return sampleValue(ring->values, ring->valid, slot);
+}
+
+/*
+ * Returns the slot of the seq-th reading written over the life of the file (counting from 1),
+ * which must be one of the newest TEMP_HISTORY. Only the writing thread may call this.
+ */
+static inline int ringSlot(const temp_ring* ring, uint64_t seq) {
+      uint64_t back = ring->header->inserted - seq;
+      return (ring->header->next + TEMP_HISTORY - 1 - back % TEMP_HISTORY) % TEMP_HISTORY;
+}
+
+/*
+ * Replays the ring oldest-first into stats so the aggregates match the stored window.
+ */
+static inline void ringRebuildStats(const temp_ring* ring, temp_stats* stats) {
+      statsInit(stats);
+      for (int i = 0; i < TEMP_HISTORY; i++) {
+            int slot = (ring->header->next + i) % TEMP_HISTORY;
+            statsInsert(stats, NO_READING, ringValue(ring, slot));
+      }
+}
+
+/*
+ * Writes a reading at the cursor and advances it; valid readings are rounded to 1/16
+ * degrees, so callers should pass them through sampleQuantize first. Schedules a write-back of the
+ * mapping once every RING_SYNC_INTERVAL readings.
+ */
+static inline void ringInsert(temp_ring* ring, double value, int64_t timestamp) {
+      ring_header* header = ring->header;
+      uint32_t slot = header->next;
+      sampleStore(ring->values, ring->valid, slot, value);
+      ring->timestamps[slot] = timestamp;
+      header->inserted++;
+      //publish the slot only after its value and timestamp are written
+      __atomic_store_n(&header->next, (slot + 1) % TEMP_HISTORY, __ATOMIC_RELEASE);
+      if (++ring->unsynced >= RING_SYNC_INTERVAL) {
+            msync(ring->map, ring->map_size, MS_ASYNC);
+            ring->unsynced = 0;
+      }
+}
+
+/*
+ * Returns the first of the newest count slots whose timestamp is at least from, by binary
+ * search, as an offset from the oldest slot in ring order. Timestamps only move forward,
+ * bar a clock step, which can only misplace the edge of the range.
+ */
+static inline int ringSeek(const temp_ring* ring, uint32_t next, int64_t from) {
+      int low = 0, high = TEMP_HISTORY;
+      while (low < high) {
+            int mid = (low + high) / 2;
+            int64_t when = __atomic_load_n(&ring->timestamps[(next + mid) % TEMP_HISTORY], __ATOMIC_RELAXED);
+            if (when < from) low = mid + 1;
+            else high = mid;
+      }
+      return low;
+}
+
+/*
+ * Aggregates the readings taken from `from` ms up to the newest one straight out of the
+ * mapping, in one fused pass per contiguous run of slots. Retries if the ingest thread
+ * wrapped around into the range meanwhile, so it never holds up ingest. agg is in 1/16 degrees.
+ */
+static inline void ringAggregate(const temp_ring* ring, int64_t from, column_aggregate* agg) {
+      while (true) {
+            //read before next, so every insert into the range after next was read is counted
+            uint64_t inserted = __atomic_load_n(&ring->header->inserted, __ATOMIC_ACQUIRE);
+            uint32_t next = __atomic_load_n(&ring->header->next, __ATOMIC_ACQUIRE);
+            //the oldest slot is the next one overwritten, so a scan of the whole ring leaves it out
+            int first = ringSeek(ring, next, from);
+            if (first == 0) first = 1;
+            aggregateInit(agg);
+            //the range is ring order [first, TEMP_HISTORY), which wraps at the end of the arrays
+            int start = (next + first) % TEMP_HISTORY;
+            int len = TEMP_HISTORY - first;
+            int split = start + len > TEMP_HISTORY ? TEMP_HISTORY : start + len;
+            columnAggregate(ring->values, ring->valid, start, split, agg);
+            columnAggregate(ring->values, ring->valid, 0, start + len - split, agg);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            //inserts since (and one still being written) overwrote the oldest slots, which are
+            //only the range's once they reach first
+            if (__atomic_load_n(&ring->header->inserted, __ATOMIC_RELAXED) - inserted + 1 <= (uint64_t) first) return;
+      }
+}
+
+/*
+ * Flushes and unmaps the ring.
+ */
+static inline void ringClose(temp_ring* ring) {
+      if (ring->map == NULL) return;
+      msync(ring->map, ring->map_size, MS_SYNC);
+      munmap(ring->map, ring->map_size);
+      close(ring->file);
+      ring->map = NULL;
+}
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * temp_stats.h
+ *
+ * Running high/low/average over the last TEMP_HISTORY readings, updated in
+ * O(1) amortized time on every insert instead of rescanning the temps array.
+ * The sum and count are adjusted as the ring overwrites old slots and the
+ * sliding-window max and min are kept in monotonic deques. Only the ingest
+ * thread touches temp_stats; after each insert it publishes a constant-size
+ * summary behind a seqlock so request handlers read it without taking a lock.
+ */
+
+#ifndef TEMP_STATS_H
+#define TEMP_STATS_H
+
+#include <math.h>
+#include "seqlock.h"
+
+#define TEMP_HISTORY 3600
+#define NO_READING -274.0
+
+typedef struct StatsEntry stats_entry;
+typedef struct MonotonicDeque monotonic_deque;
+typedef struct TempStats temp_stats;
+typedef struct TempSummary temp_summary;
+typedef struct PublishedStats published_stats;
+
+struct StatsEntry {
+  long long seq;    // insert number of the reading
+  double value;
+};
+
+//ring of entries whose values are kept strictly decreasing (max) or increasing (min)
+struct MonotonicDeque {
+  stats_entry entries[TEMP_HISTORY];
+  int head;
+  int len;
+};
+
+struct TempStats {
+  long long inserted;     // readings inserted so far
+  long long sum;          // sum of valid readings in the window, in 1/10000 degrees
+  int count;              // number of valid readings in the window
+  double latest;
+  monotonic_deque maxq;
+  monotonic_deque minq;
+};
+
+//constant-size copy of the aggregates handed to the request handlers
+struct TempSummary {
+  double latest;
+  double max;
+  double min;
+  double average;
+  int count;
+  long long inserted;     // readings inserted when the summary was taken
+};
+
+//the latest summary, written by the ingest thread and read by any thread
+struct PublishedStats {
+  seqlock lock;
+  temp_summary summary;
+};
+
+/*
+ * Readings outside +-200 are sentinels or garbage and are left out of the aggregates.
+ */
+static inline bool validReading(double value) {
+      return value <= 200.0 && value >= -200.0;
+}
+
+static inline stats_entry* dequeAt(monotonic_deque* q, int i) {
+      return &q->entries[(q->head + i) % TEMP_HISTORY];
+}
+
+/*
+ * Appends a reading to a deque after dropping every entry it dominates.
+ * keep_max selects whether the front of the deque is the window max or min.
+ */
+static inline void dequePush(monotonic_deque* q, long long seq, double value, bool keep_max) {
+      while (q->len > 0) {
+            double back = dequeAt(q, q->len - 1)->value;
+            if (keep_max ? back > value : back < value) break;
+            q->len--;
+      }
+      stats_entry* slot = dequeAt(q, q->len);
+      slot->seq = seq;
+      slot->value = value;
+      q->len++;
+}
+
+/*
+ * Drops entries that have slid out of the window ending at insert number seq.
+ */
+static inline void dequeExpire(monotonic_deque* q, long long seq) {
+      while (q->len > 0 && q->entries[q->head].seq <= seq - TEMP_HISTORY) {
+            q->head = (q->head + 1) % TEMP_HISTORY;
+            q->len--;
+      }
+}
+
+/*
+ * Resets the aggregates to an empty window.
+ */
+static inline void statsInit(temp_stats* stats) {
+      stats->inserted = 0;
+      stats->sum = 0;
+      stats->count = 0;
+      stats->latest = NO_READING;
+      stats->maxq.head = stats->maxq.len = 0;
+      stats->minq.head = stats->minq.len = 0;
+}
+
+/*
+ * Records a reading that overwrites old_value in the ring. old_value is only
+ * evicted once the window is full, so an empty ring's sentinels are ignored.
+ */
+static inline void statsInsert(temp_stats* stats, double old_value, double value) {
+      long long seq = stats->inserted;
+      if (seq >= TEMP_HISTORY && validReading(old_value)) {
+            stats->sum -= llround(old_value * 10000.0);
+            stats->count--;
+      }
+      dequeExpire(&stats->maxq, seq);
+      dequeExpire(&stats->minq, seq);
+      if (validReading(value)) {
+            stats->sum += llround(value * 10000.0);
+            stats->count++;
+            dequePush(&stats->maxq, seq, value, true);
+            dequePush(&stats->minq, seq, value, false);
+      }
+      stats->latest = value;
+      stats->inserted = seq + 1;
+}
+
+/*
+ * Copies the current aggregates into summary in constant time.
+ */
+static inline void statsSummary(const temp_stats* stats, temp_summary* summary) {
+      summary->latest = stats->latest;
+      summary->count = stats->count;
+      summary->inserted = stats->inserted;
+      if (stats->count == 0) {
+            summary->max = summary->min = summary->average = NO_READING;
+            return;
+      }
+      summary->max = stats->maxq.entries[stats->maxq.head].value;
+      summary->min = stats->minq.entries[stats->minq.head].value;
+      summary->average = stats->sum / 10000.0 / stats->count;
+}
+
+/*
+ * Publishes the current aggregates for readers. Called by the ingest thread only.
+ */
+static inline void statsPublish(published_stats* published, const temp_stats* stats) {
+      temp_summary summary;
+      statsSummary(stats, &summary);
+      seqlockWriteBegin(&published->lock);
+      published->summary = summary;
+      seqlockWriteEnd(&published->lock);
+}
+
+/*
+ * Copies the most recently published summary, retrying if the ingest thread
+ * published a new one mid-copy. Never blocks the ingest thread.
+ */
+static inline void statsRead(const published_stats* published, temp_summary* summary) {
+      unsigned seq;
+      do {
+            seq = seqlockReadBegin(&published->lock);
+            *summary = published->summary;
+      } while (seqlockReadRetry(&published->lock, seq));
+}
+
+#endif
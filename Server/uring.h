@@ -0,0 +1,291 @@
+/*
+ * uring.h
+ *
+ * A small io_uring wrapper over the raw system calls, for the optional
+ * completion-based I/O backend (-u 1). Operations are queued as submission
+ * entries and handed to the kernel in one io_uring_enter together with the
+ * wait for their completions, so a loop iteration that reads several serial
+ * devices or sends several replies costs one system call instead of one per
+ * descriptor plus the readiness wait. Each event loop thread owns its own
+ * ring. uringInit fails on kernels (or sandboxes) without io_uring, or
+ * without the operations and features used here, and the caller keeps to
+ * its epoll loop.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "metrics.h"
+
+typedef struct Uring uring;
+
+struct Uring {
+  int fd;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned queued;            // entries filled in since the last io_uring_enter
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  void* ring_map;             // submission and completion rings share one mapping
+  size_t ring_map_size;
+  size_t sqes_size;
+};
+
+/*
+ * Returns true if every operation the backends use is supported by the running kernel.
+ */
+static inline bool uringProbe(int fd) {
+      size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+      struct io_uring_probe* probe = (struct io_uring_probe*) calloc(1, size);
+      if (probe == NULL) return false;
+      bool supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+      const int needed[7] = { IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_RECV, IORING_OP_SEND,
+                              IORING_OP_ACCEPT, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+      for (int i = 0; i < 7 && supported; i++) {
+            supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+      }
+      free(probe);
+      return supported;
+}
+
+/*
+ * Sets up a ring with room for entries submissions at a time. Returns false, leaving
+ * nothing open, if io_uring or anything needed from it is unavailable.
+ */
+static inline bool uringInit(uring* ring, unsigned entries) {
+      struct io_uring_params params;
+      memset(&params, 0, sizeof(params));
+      memset(ring, 0, sizeof(uring));
+      ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+      if (ring->fd == -1) return false;
+      //one mapping for both rings, a timeout on the wait, no completions lost on overflow, and
+      //reads on non-blocking descriptors that wait for data instead of failing with EAGAIN
+      unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+      if ((params.features & needed) != needed || !uringProbe(ring->fd)) {
+            close(ring->fd);
+            return false;
+      }
+      size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+      ring->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+      ring->ring_map = mmap(NULL, ring->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+      if (ring->ring_map == MAP_FAILED) {
+            close(ring->fd);
+            return false;
+      }
+      ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+      ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+      if (ring->sqes == MAP_FAILED) {
+            munmap(ring->ring_map, ring->ring_map_size);
+            close(ring->fd);
+            return false;
+      }
+      char* base = (char*) ring->ring_map;
+      ring->sq_head = (unsigned*) (base + params.sq_off.head);
+      ring->sq_tail = (unsigned*) (base + params.sq_off.tail);
+      ring->sq_mask = *(unsigned*) (base + params.sq_off.ring_mask);
+      ring->sq_entries = params.sq_entries;
+      ring->sq_array = (unsigned*) (base + params.sq_off.array);
+      ring->cq_head = (unsigned*) (base + params.cq_off.head);
+      ring->cq_tail = (unsigned*) (base + params.cq_off.tail);
+      ring->cq_mask = *(unsigned*) (base + params.cq_off.ring_mask);
+      ring->cqes = (struct io_uring_cqe*) (base + params.cq_off.cqes);
+      ring->queued = 0;
+      return true;
+}
+
+/*
+ * Registers buffers for READ_FIXED, so the kernel maps them once instead of on every
+ * read. Returns false if they could not be registered (a low RLIMIT_MEMLOCK, say).
+ */
+static inline bool uringRegisterBuffers(uring* ring, const struct iovec* buffers, int n) {
+      return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, buffers, n) == 0;
+}
+
+/*
+ * Hands every queued entry to the kernel and waits up to timeout_ms for at least
+ * wait completions (0 just submits). Returns false on an error other than an
+ * interrupted or timed-out wait.
+ */
+static inline bool uringSubmit(uring* ring, unsigned wait, int timeout_ms) {
+      struct __kernel_timespec timeout = { timeout_ms / 1000, (long long) (timeout_ms % 1000) * 1000000 };
+      struct io_uring_getevents_arg arg;
+      memset(&arg, 0, sizeof(arg));
+      arg.ts = (uint64_t) (uintptr_t) &timeout;
+      unsigned flags = IORING_ENTER_EXT_ARG | (wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+      while (true) {
+            int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, flags, &arg, sizeof(arg));
+            if (metrics_local != NULL) counterAdd(&metrics_local->ring_enters, 1);
+            if (submitted >= 0) {
+                  ring->queued -= submitted;
+                  //whatever the kernel took is in flight; a short submission is retried next time
+                  if (ring->queued == 0 || wait > 0) return true;
+                  continue;
+            }
+            if (errno == ETIME || errno == EINTR) {
+                  //the entries were consumed before the wait was cut short
+                  ring->queued = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+                  return true;
+            }
+            if (errno == EAGAIN || errno == EBUSY) return true;
+            return false;
+      }
+}
+
+/*
+ * Returns a cleared submission entry to fill in, submitting what is queued first if
+ * the ring is full. Returns NULL if there is still no room.
+ */
+static inline struct io_uring_sqe* uringSqe(uring* ring) {
+      unsigned tail = *ring->sq_tail;
+      if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            uringSubmit(ring, 0, 0);
+            if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) return NULL;
+      }
+      unsigned index = tail & ring->sq_mask;
+      struct io_uring_sqe* sqe = &ring->sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      ring->sq_array[index] = index;
+      //the kernel sees the entry once the tail moves past it, which happens after it is filled in
+      return sqe;
+}
+
+/*
+ * Publishes an entry returned by uringSqe once it is filled in.
+ */
+static inline void uringQueue(uring* ring) {
+      __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+      ring->queued++;
+}
+
+/*
+ * Takes the next completion into cqe. Returns false if there is none.
+ */
+static inline bool uringNext(uring* ring, struct io_uring_cqe* cqe) {
+      unsigned head = *ring->cq_head;
+      if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return false;
+      *cqe = ring->cqes[head & ring->cq_mask];
+      __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+      if (metrics_local != NULL) counterAdd(&metrics_local->ring_completions, 1);
+      return true;
+}
+
+/*
+ * Queues an operation on fd. Returns false if the ring is full.
+ */
+static inline bool uringPrep(uring* ring, int op, int fd, const void* addr, unsigned len, uint64_t user_data) {
+      struct io_uring_sqe* sqe = uringSqe(ring);
+      if (sqe == NULL) return false;
+      sqe->opcode = op;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t) (uintptr_t) addr;
+      sqe->len = len;
+      sqe->user_data = user_data;
+      uringQueue(ring);
+      return true;
+}
+
+static inline bool uringRead(uring* ring, int fd, void* buf, unsigned len, uint64_t user_data) {
+      return uringPrep(ring, IORING_OP_READ, fd, buf, len, user_data);
+}
+
+/*
+ * Reads into registered buffer index, which must hold buf.
+ */
+static inline bool uringReadFixed(uring* ring, int fd, void* buf, unsigned len, int index, uint64_t user_data) {
+      struct io_uring_sqe* sqe = uringSqe(ring);
+      if (sqe == NULL) return false;
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t) (uintptr_t) buf;
+      sqe->len = len;
+      sqe->buf_index = index;
+      sqe->user_data = user_data;
+      uringQueue(ring);
+      return true;
+}
+
+static inline bool uringRecv(uring* ring, int fd, void* buf, unsigned len, uint64_t user_data) {
+      return uringPrep(ring, IORING_OP_RECV, fd, buf, len, user_data);
+}
+
+static inline bool uringSend(uring* ring, int fd, const void* buf, unsigned len, uint64_t user_data) {
+      struct io_uring_sqe* sqe = uringSqe(ring);
+      if (sqe == NULL) return false;
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t) (uintptr_t) buf;
+      sqe->len = len;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      sqe->user_data = user_data;
+      uringQueue(ring);
+      return true;
+}
+
+/*
+ * Accepts one connection on a listening socket, with accept4 flags.
+ */
+static inline bool uringAccept(uring* ring, int fd, int flags, uint64_t user_data) {
+      struct io_uring_sqe* sqe = uringSqe(ring);
+      if (sqe == NULL) return false;
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = fd;
+      sqe->accept_flags = flags;
+      sqe->user_data = user_data;
+      uringQueue(ring);
+      return true;
+}
+
+/*
+ * Completes once fd reports any of the poll events in mask.
+ */
+static inline bool uringPoll(uring* ring, int fd, unsigned mask, uint64_t user_data) {
+      struct io_uring_sqe* sqe = uringSqe(ring);
+      if (sqe == NULL) return false;
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = fd;
+      sqe->poll32_events = mask;
+      sqe->user_data = user_data;
+      uringQueue(ring);
+      return true;
+}
+
+/*
+ * Cancels the operation queued with target as its user data. The cancellation's own
+ * completion carries user data 0.
+ */
+static inline bool uringCancel(uring* ring, uint64_t target) {
+      struct io_uring_sqe* sqe = uringSqe(ring);
+      if (sqe == NULL) return false;
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = target;
+      sqe->user_data = 0;
+      uringQueue(ring);
+      return true;
+}
+
+static inline void uringClose(uring* ring) {
+      munmap(ring->sqes, ring->sqes_size);
+      munmap(ring->ring_map, ring->ring_map_size);
+      close(ring->fd);
+}
+
+#endif